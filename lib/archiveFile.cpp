@@ -0,0 +1,371 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "archiveFile.h"
+
+// ZIP format signatures and structure sizes (see APPNOTE.TXT)
+#define FZ_SIG_LOCAL_HEADER     (0x04034b50)
+#define FZ_SIG_CENTRAL_HEADER   (0x02014b50)
+#define FZ_SIG_EOCD             (0x06054b50)
+#define FZ_SIG_EOCD64_LOCATOR   (0x07064b50)
+#define FZ_SIG_EOCD64           (0x06064b50)
+#define FZ_LOCAL_HEADER_SIZE    (30)
+#define FZ_CENTRAL_HEADER_SIZE  (46)
+#define FZ_EOCD_SIZE            (22)
+#define FZ_EOCD64_LOCATOR_SIZE  (20)
+#define FZ_EOCD64_SIZE          (56)
+#define FZ_EF_ZIP64             (0x0001)
+
+static inline zip_uint16_t getShort(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline zip_uint32_t getLong(const unsigned char *p) {
+    return getShort(p) | ((zip_uint32_t)getShort(p + 2) << 16);
+}
+
+static inline zip_uint64_t getLongLong(const unsigned char *p) {
+    return getLong(p) | ((zip_uint64_t)getLong(p + 4) << 32);
+}
+
+ArchiveFile::ArchiveFile(int fd): m_fd(fd), m_parsed(false), m_map(NULL),
+    m_mapSize(0), m_cd(NULL), m_cdSize(0), m_count(0), m_shift(0) {
+}
+
+ArchiveFile::~ArchiveFile() {
+    unmapCentralDirectory();
+    close(m_fd);
+}
+
+bool ArchiveFile::readAt(void *buf, size_t size, zip_uint64_t offset) const {
+    char *dest = (char *)buf;
+    while (size > 0) {
+        ssize_t nr = pread(m_fd, dest, size, offset);
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            return false;
+        }
+        dest += nr;
+        size -= nr;
+        offset += nr;
+    }
+    return true;
+}
+
+bool ArchiveFile::locate(zip_uint64_t &cdOffset, zip_uint64_t &cdSize,
+        zip_uint64_t &count, zip_int64_t &shift) const {
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || st.st_size < FZ_EOCD_SIZE) {
+        return false;
+    }
+    zip_uint64_t fileSize = st.st_size;
+
+    // search for end of central directory record from the end of file
+    // (it is followed by comment up to 65535 bytes length)
+    size_t tailSize = FZ_EOCD_SIZE + 0xFFFF + FZ_EOCD64_LOCATOR_SIZE;
+    if (tailSize > fileSize) {
+        tailSize = fileSize;
+    }
+    zip_uint64_t tailOffset = fileSize - tailSize;
+    std::vector<unsigned char> tail(tailSize);
+    if (!readAt(&tail[0], tailSize, tailOffset)) {
+        return false;
+    }
+    const unsigned char *eocd = NULL;
+    for (size_t i = tailSize - FZ_EOCD_SIZE + 1; i-- > 0;) {
+        if (getLong(&tail[i]) == FZ_SIG_EOCD) {
+            eocd = &tail[i];
+            break;
+        }
+    }
+    if (eocd == NULL) {
+        return false;
+    }
+    zip_uint64_t eocdOffset = tailOffset + (eocd - &tail[0]);
+    count = getShort(eocd + 10);
+    cdSize = getLong(eocd + 12);
+    cdOffset = getLong(eocd + 16);
+    // Real position of central directory may differ from declared one if
+    // some data is prepended to archive (self-extracting archives)
+
+    if (eocd - &tail[0] >= FZ_EOCD64_LOCATOR_SIZE
+            && getLong(eocd - FZ_EOCD64_LOCATOR_SIZE) == FZ_SIG_EOCD64_LOCATOR) {
+        const unsigned char *locator = eocd - FZ_EOCD64_LOCATOR_SIZE;
+        unsigned char eocd64[FZ_EOCD64_SIZE];
+        zip_uint64_t declared = getLongLong(locator + 8);
+        zip_uint64_t eocd64Offset = declared;
+        if (!readAt(eocd64, FZ_EOCD64_SIZE, eocd64Offset)
+                || getLong(eocd64) != FZ_SIG_EOCD64) {
+            // try record without extensible data just before locator
+            eocd64Offset = eocdOffset - FZ_EOCD64_LOCATOR_SIZE
+                - FZ_EOCD64_SIZE;
+            if (eocdOffset < FZ_EOCD64_LOCATOR_SIZE + FZ_EOCD64_SIZE
+                    || !readAt(eocd64, FZ_EOCD64_SIZE, eocd64Offset)
+                    || getLong(eocd64) != FZ_SIG_EOCD64) {
+                return false;
+            }
+        }
+        shift = eocd64Offset - declared;
+        count = getLongLong(eocd64 + 32);
+        cdSize = getLongLong(eocd64 + 40);
+        cdOffset = getLongLong(eocd64 + 48);
+    } else {
+        shift = eocdOffset - (cdOffset + cdSize);
+    }
+    return cdOffset + shift + cdSize <= fileSize;
+}
+
+bool ArchiveFile::mapCentralDirectory() {
+    if (m_map != NULL) {
+        return true;
+    }
+    zip_uint64_t cdOffset, cdSize, count;
+    zip_int64_t shift;
+    if (!locate(cdOffset, cdSize, count, shift)) {
+        return false;
+    }
+    static const zip_uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    zip_uint64_t start = cdOffset + shift;
+    zip_uint64_t mapStart = start / pageSize * pageSize;
+    zip_uint64_t mapSize = start + cdSize - mapStart;
+    if (mapSize != size_t(mapSize)) {
+        return false;
+    }
+    if (mapSize == 0) {
+        // empty archive
+        mapSize = 1;
+    }
+    void *p = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, m_fd, mapStart);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    // records are read sequentially
+    madvise(p, mapSize, MADV_SEQUENTIAL);
+    m_map = p;
+    m_mapSize = mapSize;
+    m_cd = (const unsigned char *)p + (start - mapStart);
+    m_cdSize = cdSize;
+    m_count = count;
+    m_shift = shift;
+    return true;
+}
+
+void ArchiveFile::unmapCentralDirectory() {
+    if (m_map != NULL) {
+        munmap(m_map, m_mapSize);
+        m_map = NULL;
+        m_cd = NULL;
+    }
+}
+
+bool ArchiveFile::readEntry(zip_uint64_t &pos, Entry &entry,
+        zip_uint64_t &localOffset) const {
+    if (m_cdSize < pos || m_cdSize - pos < FZ_CENTRAL_HEADER_SIZE) {
+        return false;
+    }
+    const unsigned char *p = m_cd + pos, *end = m_cd + m_cdSize;
+    if (getLong(p) != FZ_SIG_CENTRAL_HEADER) {
+        return false;
+    }
+    zip_uint32_t compSize = getLong(p + 20);
+    zip_uint32_t uncompSize = getLong(p + 24);
+    zip_uint16_t nameLen = getShort(p + 28);
+    zip_uint16_t extraLen = getShort(p + 30);
+    zip_uint16_t commentLen = getShort(p + 32);
+    zip_uint64_t offset = getLong(p + 42);
+    const unsigned char *extra = p + FZ_CENTRAL_HEADER_SIZE + nameLen;
+    const unsigned char *next = extra + extraLen + commentLen;
+    if (next > end) {
+        return false;
+    }
+    entry.name = (const char *)p + FZ_CENTRAL_HEADER_SIZE;
+    entry.nameLen = nameLen;
+    entry.size = uncompSize;
+    entry.dosTime = getShort(p + 12);
+    entry.dosDate = getShort(p + 14);
+    entry.opsys = p[5];
+    entry.attributes = getLong(p + 38);
+    entry.extra = extra;
+    entry.extraLen = extraLen;
+    if (offset == 0xFFFFFFFF || uncompSize == 0xFFFFFFFF) {
+        // search for ZIP64 extended information extra field
+        const unsigned char *ef = extra, *efEnd = extra + extraLen;
+        while (efEnd - ef >= 4) {
+            zip_uint16_t type = getShort(ef);
+            zip_uint16_t len = getShort(ef + 2);
+            const unsigned char *data = ef + 4;
+            if (data + len > efEnd) {
+                break;
+            }
+            if (type == FZ_EF_ZIP64) {
+                // fields are present only if corresponding values
+                // in header are set to 0xFFFFFFFF
+                int fpos = 0;
+                if (uncompSize == 0xFFFFFFFF && fpos + 8 <= len) {
+                    entry.size = getLongLong(data + fpos);
+                    fpos += 8;
+                }
+                if (compSize == 0xFFFFFFFF) {
+                    fpos += 8;
+                }
+                if (offset == 0xFFFFFFFF && fpos + 8 <= len) {
+                    offset = getLongLong(data + fpos);
+                }
+                break;
+            }
+            ef = data + len;
+        }
+    }
+    localOffset = offset + m_shift;
+    pos = next - m_cd;
+    return true;
+}
+
+time_t ArchiveFile::dosTime(zip_uint16_t time, zip_uint16_t date,
+        TimeCache &cache) {
+    if (cache.value != -1 && time == cache.time && date == cache.date) {
+        return cache.value;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    // let mktime decide if DST is in effect
+    tm.tm_isdst = -1;
+    tm.tm_year = ((date >> 9) & 127) + 1980 - 1900;
+    tm.tm_mon = ((date >> 5) & 15) - 1;
+    tm.tm_mday = date & 31;
+    tm.tm_hour = (time >> 11) & 31;
+    tm.tm_min = (time >> 5) & 63;
+    tm.tm_sec = (time << 1) & 62;
+    cache.value = mktime(&tm);
+    cache.time = time;
+    cache.date = date;
+    return cache.value;
+}
+
+bool ArchiveFile::parse() {
+    bool res = localHeaderOffsets(m_offsets);
+    m_resolved.resize(m_offsets.size(), false);
+    return res;
+}
+
+bool ArchiveFile::localHeaderOffsets(std::vector<zip_uint64_t> &offsets) {
+    bool mapped = m_map != NULL;
+    if (!mapCentralDirectory()) {
+        return false;
+    }
+    bool res = true;
+    offsets.clear();
+    offsets.reserve(m_count);
+    zip_uint64_t pos = 0;
+    for (zip_uint64_t i = 0; i < m_count; ++i) {
+        Entry entry;
+        zip_uint64_t offset;
+        if (!readEntry(pos, entry, offset)) {
+            res = false;
+            break;
+        }
+        offsets.push_back(offset);
+    }
+    if (!mapped) {
+        unmapCentralDirectory();
+    }
+    return res;
+}
+
+void ArchiveFile::setLocalHeaderOffsets(const zip_uint64_t *offsets,
+        zip_uint64_t count) {
+    m_offsets.assign(offsets, offsets + count);
+    m_resolved.assign(count, false);
+    m_parsed = true;
+}
+
+bool ArchiveFile::centralDirectoryChecksum(zip_uint64_t &size,
+        zip_uint32_t &crc) {
+    bool mapped = m_map != NULL;
+    if (!mapCentralDirectory()) {
+        return false;
+    }
+    size = m_cdSize;
+    uLong res = crc32(0L, Z_NULL, 0);
+    for (zip_uint64_t pos = 0; pos < m_cdSize;) {
+        // zlib accepts uInt length
+        uInt chunk = m_cdSize - pos > 0x40000000 ? 0x40000000
+            : m_cdSize - pos;
+        res = crc32(res, m_cd + pos, chunk);
+        pos += chunk;
+    }
+    crc = res;
+    if (!mapped) {
+        unmapCentralDirectory();
+    }
+    return true;
+}
+
+void ArchiveFile::ensureParsed() {
+    if (!m_parsed) {
+        m_parsed = true;
+        if (!parse()) {
+            syslog(LOG_WARNING, "unable to read central directory, direct access to stored files is disabled");
+            m_offsets.clear();
+            m_resolved.clear();
+        }
+    }
+}
+
+zip_int64_t ArchiveFile::position(zip_uint64_t index) {
+    ensureParsed();
+    if (index >= m_offsets.size()) {
+        return -1;
+    }
+    // data offset (if resolved) keeps order of local header offsets
+    return m_offsets[index];
+}
+
+zip_int64_t ArchiveFile::dataOffset(zip_uint64_t index) {
+    ensureParsed();
+    if (index >= m_offsets.size()) {
+        return -1;
+    }
+    if (!m_resolved[index]) {
+        unsigned char header[FZ_LOCAL_HEADER_SIZE];
+        if (!readAt(header, FZ_LOCAL_HEADER_SIZE, m_offsets[index])
+                || getLong(header) != FZ_SIG_LOCAL_HEADER) {
+            syslog(LOG_WARNING, "bad local header for entry %llu",
+                    (unsigned long long)index);
+            return -1;
+        }
+        m_offsets[index] += FZ_LOCAL_HEADER_SIZE + getShort(header + 26)
+            + getShort(header + 28);
+        m_resolved[index] = true;
+    }
+    return m_offsets[index];
+}
@@ -0,0 +1,216 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef ARCHIVE_FILE_H
+#define ARCHIVE_FILE_H
+
+#include <zip.h>
+#include <ctime>
+
+#include <vector>
+
+/**
+ * Direct access to ZIP archive file on disk.
+ *
+ * Central directory is read on first request to find local headers of
+ * archive entries, so data of uncompressed entries can be read directly
+ * from archive file without libzip.
+ *
+ * Central directory can also be mapped into memory to walk its records
+ * without libzip calls while file tree is built (see readEntry).
+ */
+class ArchiveFile {
+private:
+    // must not be defined
+    ArchiveFile (const ArchiveFile &);
+    ArchiveFile &operator= (const ArchiveFile &);
+
+    int m_fd;
+    bool m_parsed;
+    /**
+     * Offsets of local headers indexed by entry number. After local header
+     * is read value is replaced with data offset and 'm_resolved' flag is
+     * set for entry.
+     */
+    std::vector<zip_uint64_t> m_offsets;
+    std::vector<bool> m_resolved;
+
+    /**
+     * Mapping that covers central directory and end of central directory
+     * records, NULL if not mapped
+     */
+    void *m_map;
+    size_t m_mapSize;
+    /**
+     * Central directory inside m_map
+     */
+    const unsigned char *m_cd;
+    zip_uint64_t m_cdSize;
+    zip_uint64_t m_count;
+    /**
+     * Difference between real and declared offsets in archive (non-zero
+     * if some data is prepended to archive)
+     */
+    zip_int64_t m_shift;
+
+    /**
+     * Read central directory to fill m_offsets.
+     * @return false if archive structure is not recognized
+     */
+    bool parse();
+
+    /**
+     * Find central directory position and number of entries using end of
+     * central directory records.
+     * @return false if archive structure is not recognized
+     */
+    bool locate(zip_uint64_t &cdOffset, zip_uint64_t &cdSize,
+            zip_uint64_t &count, zip_int64_t &shift) const;
+
+    /**
+     * Read central directory if it is not read yet.
+     */
+    void ensureParsed();
+
+    /**
+     * Read exactly 'size' bytes at 'offset'
+     * @return false on error or unexpected end of file
+     */
+    bool readAt(void *buf, size_t size, zip_uint64_t offset) const;
+
+public:
+    /**
+     * Central directory record fields. Pointers refer to mapped central
+     * directory.
+     */
+    struct Entry {
+        // file name (not null-terminated)
+        const char *name;
+        zip_uint16_t nameLen;
+        // uncompressed size
+        zip_uint64_t size;
+        zip_uint16_t dosTime, dosDate;
+        // host system that created entry ("version made by" upper byte)
+        zip_uint8_t opsys;
+        zip_uint32_t attributes;
+        const zip_uint8_t *extra;
+        zip_uint16_t extraLen;
+    };
+
+    /**
+     * Result of the last MS-DOS time conversion. Consecutive entries often
+     * have the same time. Each thread must use its own cache.
+     */
+    struct TimeCache {
+        zip_uint16_t time, date;
+        time_t value;
+
+        TimeCache(): time(0), date(0), value(-1) {
+        }
+    };
+
+    /**
+     * Keep archive file descriptor. It is closed in destructor.
+     */
+    explicit ArchiveFile(int fd);
+    ~ArchiveFile();
+
+    inline int fd() const {
+        return m_fd;
+    }
+
+    /**
+     * Return offset of entry data in archive file.
+     *
+     * @param index     Entry index in ZIP archive as it was opened
+     * @return data offset or -1 if not available
+     */
+    zip_int64_t dataOffset(zip_uint64_t index);
+
+    /**
+     * Return position of entry in archive file. Positions are ordered as
+     * entries are stored in archive, so they can be used to access entries
+     * sequentially.
+     *
+     * @param index     Entry index in ZIP archive as it was opened
+     * @return entry position or -1 if not available
+     */
+    zip_int64_t position(zip_uint64_t index);
+
+    /**
+     * Map central directory into memory.
+     * @return false if archive structure is not recognized or mapping
+     * failed
+     */
+    bool mapCentralDirectory();
+
+    /**
+     * Release central directory mapping. Entries returned by readEntry
+     * become invalid.
+     */
+    void unmapCentralDirectory();
+
+    /**
+     * Return number of entries in mapped central directory.
+     */
+    inline zip_uint64_t entriesCount() const {
+        return m_count;
+    }
+
+    /**
+     * Read record of mapped central directory at 'pos' (byte offset from
+     * central directory start, 0 for the first record) and advance 'pos'
+     * to the next record.
+     *
+     * @param localOffset   (OUT) real offset of local header
+     * @return false if record is broken
+     */
+    bool readEntry(zip_uint64_t &pos, Entry &entry,
+            zip_uint64_t &localOffset) const;
+
+    /**
+     * Read local header offsets of all entries from central directory.
+     * @return false if archive structure is not recognized
+     */
+    bool localHeaderOffsets(std::vector<zip_uint64_t> &offsets);
+
+    /**
+     * Use local header offsets read earlier (e.g. from index cache)
+     * instead of parsing central directory.
+     */
+    void setLocalHeaderOffsets(const zip_uint64_t *offsets,
+            zip_uint64_t count);
+
+    /**
+     * Calculate size and CRC32 of central directory to check that archive
+     * is not changed.
+     * @return false if archive structure is not recognized
+     */
+    bool centralDirectoryChecksum(zip_uint64_t &size, zip_uint32_t &crc);
+
+    /**
+     * Convert MS-DOS date and time to UNIX time as libzip does.
+     */
+    static time_t dosTime(zip_uint16_t time, zip_uint16_t date,
+            TimeCache &cache);
+};
+
+#endif
@@ -19,244 +19,1066 @@
 //  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
 ////////////////////////////////////////////////////////////////////////////
 
+#include <cassert>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <string>
 #include <stdexcept>
 #include <syslog.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 #include "bigBuffer.h"
+#include "mutexLock.h"
 
 /**
- * Class that keep chunk of file data.
+ * Class that keep extent of file data. Memory is allocated on demand from
+ * s_allocator and can be smaller than extent size. Bytes after allocated
+ * space are zeroes.
  */
-class BigBuffer::ChunkWrapper {
+class BigBuffer::Extent {
 private:
     /**
-     * Pointer that keeps data for chunk. Can be NULL.
+     * Pointer that keeps data for extent. Can be NULL.
      */
     char *m_ptr;
+    size_t m_capacity;
 
 public:
     /**
      * By default internal buffer is NULL, so this can be used for creating
      * sparse files.
      */
-    ChunkWrapper(): m_ptr(NULL) {
+    Extent(): m_ptr(NULL), m_capacity(0) {
     }
 
     /**
      * Take ownership on internal pointer from 'other' object.
      */
-    ChunkWrapper(const ChunkWrapper &other) {
+    Extent(const Extent &other) {
         m_ptr = other.m_ptr;
-        const_cast<ChunkWrapper*>(&other)->m_ptr = NULL;
+        m_capacity = other.m_capacity;
+        const_cast<Extent*>(&other)->m_ptr = NULL;
+        const_cast<Extent*>(&other)->m_capacity = 0;
     }
 
     /**
      * Free pointer if allocated.
      */
-    ~ChunkWrapper() {
+    ~Extent() {
         if (m_ptr != NULL) {
-            free(m_ptr);
+            s_allocator.free(m_ptr, m_capacity);
         }
     }
 
     /**
      * Take ownership on internal pointer from 'other' object.
      */
-    ChunkWrapper &operator=(const ChunkWrapper &other) {
+    Extent &operator=(const Extent &other) {
         if (&other != this) {
+            if (m_ptr != NULL) {
+                s_allocator.free(m_ptr, m_capacity);
+            }
             m_ptr = other.m_ptr;
-            const_cast<ChunkWrapper*>(&other)->m_ptr = NULL;
+            m_capacity = other.m_capacity;
+            const_cast<Extent*>(&other)->m_ptr = NULL;
+            const_cast<Extent*>(&other)->m_capacity = 0;
         }
         return *this;
     }
 
     /**
-     * Return pointer to internal storage and initialize it if needed.
+     * Return number of allocated bytes.
+     */
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    /**
+     * Return pointer to internal storage. Can be NULL.
+     */
+    char *ptr() const {
+        return m_ptr;
+    }
+
+    /**
+     * Make at least 'size' bytes available. Allocated space is grown
+     * geometrically, but at least 'hint' bytes and no more than 'maxSize'
+     * bytes are allocated (rounded up to allocator size class). New space
+     * is filled with zeroes.
+     *
+     * @return  Number of newly allocated bytes.
      * @throws
      *      std::bad_alloc  If memory can not be allocated
      */
-    char *ptr(bool init = false) {
-        if (init && m_ptr == NULL) {
-            m_ptr = (char *)malloc(chunkSize);
-            if (m_ptr == NULL) {
-                throw std::bad_alloc();
-            }
+    size_t reserve(size_t size, size_t hint, size_t maxSize) {
+        if (size <= m_capacity) {
+            return 0;
         }
-        return m_ptr;
+        size_t capacity = 2 * m_capacity;
+        if (capacity < hint) {
+            capacity = hint;
+        }
+        if (capacity > maxSize) {
+            capacity = maxSize;
+        }
+        if (capacity < size) {
+            capacity = size;
+        }
+        // maxSize is a size class itself, so it is never exceeded
+        char *p = s_allocator.allocate(capacity);
+        if (m_ptr != NULL) {
+            memcpy(p, m_ptr, m_capacity);
+            s_allocator.free(m_ptr, m_capacity);
+        }
+        size_t res = capacity - m_capacity;
+        m_ptr = p;
+        m_capacity = capacity;
+        return res;
     }
 
     /**
-     * Fill 'dest' with internal buffer content.
-     * If m_ptr is NULL, destination bytes is zeroed.
+     * Fill 'dest' with internal buffer content. Bytes after allocated
+     * space are zeroed.
      *
      * @param dest      Destination buffer.
      * @param offset    Offset in internal buffer to start reading from.
      * @param count     Number of bytes to be read.
-     *
-     * @return  Number of bytes actually read. It can differ with 'count'
-     *      if offset+count>chunkSize.
      */
-    size_t read(char *dest, zip_uint64_t offset, size_t count) const {
-        if (offset + count > chunkSize) {
-            count = chunkSize - offset;
+    void read(char *dest, size_t offset, size_t count) const {
+        size_t avail = 0;
+        if (offset < m_capacity) {
+            avail = m_capacity - offset;
+            if (avail > count) {
+                avail = count;
+            }
+            memcpy(dest, m_ptr + offset, avail);
         }
-        if (m_ptr != NULL) {
-            memcpy(dest, m_ptr + offset, count);
-        } else {
-            memset(dest, 0, count);
+        if (avail < count) {
+            memset(dest + avail, 0, count - avail);
         }
-        return count;
     }
 
     /**
-     * Fill internal buffer with bytes from 'src'.
-     * If m_ptr is NULL, memory for buffer is malloc()-ed and then head of
-     * allocated space is zeroed. After that byte copying is performed.
+     * Free internal buffer making extent a hole.
      *
-     * @param src       Source buffer.
-     * @param offset    Offset in internal buffer to start writting from.
-     * @param count     Number of bytes to be written.
-     *
-     * @return  Number of bytes actually written. It can differ with
-     *      'count' if offset+count>chunkSize.
-     * @throws
-     *      std::bad_alloc  If there are no memory for buffer
+     * @return  Number of released bytes.
      */
-    size_t write(const char *src, zip_uint64_t offset, size_t count) {
-        if (offset + count > chunkSize) {
-            count = chunkSize - offset;
-        }
-        if (m_ptr == NULL) {
-            m_ptr = (char *)malloc(chunkSize);
-            if (m_ptr == NULL) {
-                throw std::bad_alloc();
-            }
-            if (offset > 0) {
-                memset(m_ptr, 0, offset);
-            }
+    size_t release() {
+        size_t res = m_capacity;
+        if (m_ptr != NULL) {
+            s_allocator.free(m_ptr, m_capacity);
         }
-        memcpy(m_ptr + offset, src, count);
-        return count;
+        m_ptr = NULL;
+        m_capacity = 0;
+        return res;
     }
 
     /**
      * Clear tail of internal buffer with zeroes starting from 'offset'.
      */
-    void clearTail(zip_uint64_t offset) {
-        if (m_ptr != NULL && offset < chunkSize) {
-            memset(m_ptr + offset, 0, chunkSize - offset);
+    void clearTail(size_t offset) {
+        if (offset < m_capacity) {
+            memset(m_ptr + offset, 0, m_capacity - offset);
         }
     }
 
 };
 
-BigBuffer::BigBuffer(): len(0) {
-}
-
-BigBuffer::BigBuffer(struct zip *z, zip_uint64_t nodeId, zip_uint64_t length):
-        len(length) {
-    struct zip_file *zf = zip_fopen_index(z, nodeId, 0);
-    if (zf == NULL) {
-        syslog(LOG_WARNING, "%s", zip_strerror(z));
-        throw std::runtime_error(zip_strerror(z));
-    }
-    unsigned int ccount = chunksCount(length);
-    chunks.resize(ccount, ChunkWrapper());
-    unsigned int chunk = 0;
-    int nr;
-    while (length > 0) {
-        zip_uint64_t readSize = chunkSize;
-        if (readSize > length) {
-            readSize = length;
-        }
-        nr = zip_fread(zf, chunks[chunk].ptr(true), readSize);
-        if (nr < 0) {
-            std::string err = zip_file_strerror(zf);
-            syslog(LOG_WARNING, "%s", err.c_str());
-            zip_fclose(zf);
-            throw std::runtime_error(err);
-        }
-        ++chunk;
-        length -= nr;
-        if ((nr == 0 || chunk == ccount) && length != 0) {
-            // Allocated memory are exhausted, but there are unread bytes (or
-            // file is longer that given length). Possibly CRC error.
-            zip_fclose(zf);
-            syslog(LOG_WARNING, "length of file %s differ from data length",
-                    zip_get_name(z, nodeId, ZIP_FL_ENC_RAW));
+SlabAllocator BigBuffer::s_allocator;
+std::string BigBuffer::s_spillDir;
+zip_uint64_t BigBuffer::s_spillBufferLimit = 0;
+zip_uint64_t BigBuffer::s_spillTotalLimit = 0;
+zip_uint64_t BigBuffer::s_heapTotal = 0;
+pthread_mutex_t BigBuffer::s_heapMutex = PTHREAD_MUTEX_INITIALIZER;
+ZipPool *BigBuffer::s_zipPool = NULL;
+DecompressPool *BigBuffer::s_decompressPool = NULL;
+bool BigBuffer::s_mmapMode = false;
+
+BigBuffer::BigBuffer(): m_stream(NULL), m_fd(-1), m_dataOffset(0),
+        m_sourceLen(0), m_spillFd(-1), m_heapUsage(0),
+        m_region(NULL), m_regionSize(0), m_mapped(s_mmapMode),
+        m_loadFailed(false), m_modified(false), m_released(0),
+        m_streamEnd(0), m_loadPaused(false), len(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+BigBuffer::BigBuffer(struct zip *z, zip_uint64_t nodeId, zip_uint64_t length,
+        InflateIndex *index): m_stream(NULL), m_fd(-1), m_dataOffset(0),
+        m_sourceLen(length), m_spillFd(-1), m_heapUsage(0),
+        m_region(NULL), m_regionSize(0), m_mapped(s_mmapMode),
+        m_loadFailed(false), m_modified(false), m_released(0),
+        m_streamEnd(0), m_loadPaused(false), len(length) {
+    m_stream = new ZipStream(z, nodeId, index, s_zipPool);
+    pthread_mutex_init(&m_mutex, NULL);
+    if (!m_mapped) {
+        extents.resize(extentsCount(length), Extent());
+    }
+    if (length == 0) {
+        closeSource(true);
+    }
+}
+
+BigBuffer::BigBuffer(int fd, zip_uint64_t dataOffset, zip_uint64_t length):
+        m_stream(NULL), m_fd(fd), m_dataOffset(dataOffset),
+        m_sourceLen(length), m_spillFd(-1), m_heapUsage(0),
+        m_region(NULL), m_regionSize(0), m_mapped(s_mmapMode),
+        m_loadFailed(false), m_modified(false), m_released(0),
+        m_streamEnd(0), m_loadPaused(false), len(length) {
+    pthread_mutex_init(&m_mutex, NULL);
+    if (!m_mapped) {
+        extents.resize(extentsCount(length), Extent());
+    }
+    if (length == 0) {
+        closeSource(true);
+    }
+}
+
+BigBuffer::~BigBuffer() {
+    stopBackgroundLoad();
+    if (m_stream != NULL) {
+        closeSource(false);
+    }
+    if (m_spillFd != -1) {
+        ::close(m_spillFd);
+    }
+    if (m_region != NULL) {
+        munmap(m_region, m_regionSize);
+    }
+    countHeap(0, m_heapUsage);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void BigBuffer::setSpillOptions(const std::string &dir,
+        zip_uint64_t bufferLimit, zip_uint64_t totalLimit) {
+    s_spillDir = dir;
+    s_spillBufferLimit = bufferLimit;
+    s_spillTotalLimit = totalLimit;
+}
+
+void BigBuffer::setMmapMode(bool enable) {
+    s_mmapMode = enable;
+}
+
+void BigBuffer::setZipPool(ZipPool *pool) {
+    s_zipPool = pool;
+}
+
+void BigBuffer::setDecompressPool(DecompressPool *pool) {
+    s_decompressPool = pool;
+}
+
+void BigBuffer::loadInBackground() {
+    if (s_decompressPool == NULL) {
+        return;
+    }
+    {
+        MutexLock lock(&m_mutex);
+        // data of uncompressed files is read from archive directly
+        if (m_stream == NULL) {
+            return;
+        }
+    }
+    s_decompressPool->schedule(this);
+}
+
+void BigBuffer::stopBackgroundLoad() {
+    if (s_decompressPool != NULL) {
+        s_decompressPool->cancel(this);
+    }
+}
+
+void BigBuffer::countHeap(zip_uint64_t added, zip_uint64_t released) {
+    MutexLock lock(&s_heapMutex);
+    s_heapTotal += added;
+    s_heapTotal -= released;
+}
+
+/**
+ * Check that all 'size' bytes at 'p' are zeroes. Data is compared with
+ * zero block by memcmp that is vectorized by C library.
+ */
+static bool isZero(const char *p, size_t size) {
+    static const char zeroes[4096] = {0};
+    while (size > 0) {
+        size_t n = size < sizeof(zeroes) ? size : sizeof(zeroes);
+        if (memcmp(p, zeroes, n) != 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * Round 'size' up to memory page boundary.
+ */
+static zip_uint64_t pageAlign(zip_uint64_t size) {
+    static const zip_uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+/**
+ * Write 'size' bytes to file descriptor at 'offset'.
+ * @return false on error (errno is set)
+ */
+static bool pwriteAll(int fd, const char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t nw = pwrite(fd, buf, size, offset);
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nw < 0) {
+            return false;
+        }
+        buf += nw;
+        size -= nw;
+        offset += nw;
+    }
+    return true;
+}
+
+int BigBuffer::createSpillFile() {
+    int fd;
+#ifdef O_TMPFILE
+    fd = open(s_spillDir.c_str(), O_TMPFILE | O_RDWR | O_EXCL, 0600);
+    if (fd != -1) {
+        return fd;
+    }
+#endif
+    // O_TMPFILE is not supported by file system
+    std::string templ = s_spillDir + "/.fuse-zip.XXXXXX";
+    std::vector<char> name(templ.begin(), templ.end());
+    name.push_back('\0');
+    fd = mkstemp(&name[0]);
+    if (fd != -1) {
+        unlink(&name[0]);
+    }
+    return fd;
+}
+
+void BigBuffer::spill() {
+    int fd = createSpillFile();
+    if (fd == -1) {
+        syslog(LOG_WARNING, "unable to create temporary file in %s: %s",
+                s_spillDir.c_str(), strerror(errno));
+        // don't try again on every write
+        s_spillDir.clear();
+        return;
+    }
+    bool written = true;
+    if (m_mapped) {
+        // pages after m_heapUsage were never written
+        zip_uint64_t size = m_heapUsage < len ? m_heapUsage : len;
+        written = size == 0 || pwriteAll(fd, m_region, size, 0);
+    }
+    for (unsigned int i = 0; written && i < extents.size(); ++i) {
+        written = extents[i].capacity() == 0 || pwriteAll(fd,
+                extents[i].ptr(), extents[i].capacity(), extentStart(i));
+    }
+    if (!written) {
+        syslog(LOG_WARNING, "unable to write temporary file: %s",
+                strerror(errno));
+        ::close(fd);
+        return;
+    }
+    if (ftruncate(fd, len) != 0) {
+        syslog(LOG_WARNING, "unable to truncate temporary file: %s",
+                strerror(errno));
+        ::close(fd);
+        return;
+    }
+    extents.clear();
+    if (m_region != NULL) {
+        munmap(m_region, m_regionSize);
+        m_region = NULL;
+        m_regionSize = 0;
+    }
+    countHeap(0, m_heapUsage);
+    m_heapUsage = 0;
+    m_spillFd = fd;
+}
+
+void BigBuffer::readData(char *buf, size_t size, zip_uint64_t offset) const {
+    if (m_spillFd != -1) {
+        while (size > 0) {
+            ssize_t nr = pread(m_spillFd, buf, size, offset);
+            if (nr < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nr < 0) {
+                syslog(LOG_WARNING, "unable to read temporary file: %s",
+                        strerror(errno));
+                throw std::runtime_error(strerror(errno));
+            }
+            if (nr == 0) {
+                // hole after the end of data
+                memset(buf, 0, size);
+                break;
+            }
+            buf += nr;
+            size -= nr;
+            offset += nr;
+        }
+        return;
+    }
+    if (m_mapped) {
+        size_t avail = 0;
+        if (offset < m_regionSize) {
+            avail = m_regionSize - offset;
+            if (avail > size) {
+                avail = size;
+            }
+            memcpy(buf, m_region + offset, avail);
+        }
+        if (avail < size) {
+            memset(buf + avail, 0, size - avail);
+        }
+        return;
+    }
+    unsigned int n = extentNumber(offset);
+    size_t pos = offset - extentStart(n);
+    while (size > 0) {
+        size_t r = extentSize(n) - pos;
+        if (r > size) {
+            r = size;
+        }
+        extents[n].read(buf, pos, r);
+
+        size -= r;
+        buf += r;
+        ++n;
+        pos = 0;
+    }
+}
+
+char *BigBuffer::extentData(zip_uint64_t offset, size_t size) {
+    if (m_mapped) {
+        reserveRegion(offset + size);
+        // memory is counted up to the last touched page
+        zip_uint64_t used = pageAlign(offset + size);
+        if (used > m_heapUsage) {
+            countHeap(used - m_heapUsage, 0);
+            m_heapUsage = used;
+        }
+        return m_region + offset;
+    }
+    unsigned int n = extentNumber(offset);
+    zip_uint64_t start = extentStart(n);
+    size_t maxSize = extentSize(n);
+    assert(offset + size <= start + maxSize);
+    // exact size is allocated for known file length
+    size_t hint = maxSize;
+    if (len - start < hint) {
+        hint = len - start;
+    }
+    size_t added = extents[n].reserve(offset - start + size, hint, maxSize);
+    m_heapUsage += added;
+    countHeap(added, 0);
+    return extents[n].ptr() + (offset - start);
+}
+
+void BigBuffer::reserveRegion(zip_uint64_t size) {
+    if (size <= m_regionSize) {
+        return;
+    }
+    zip_uint64_t capacity = 2 * zip_uint64_t(m_regionSize);
+    if (capacity < len) {
+        capacity = len;
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+    capacity = pageAlign(capacity);
+    if (capacity != size_t(capacity)) {
+        throw std::bad_alloc();
+    }
+    void *p;
+    if (m_region == NULL) {
+        p = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    } else {
+#ifdef MREMAP_MAYMOVE
+        p = mremap(m_region, m_regionSize, capacity, MREMAP_MAYMOVE);
+#else
+        p = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            memcpy(p, m_region, m_heapUsage);
+            munmap(m_region, m_regionSize);
+        }
+#endif
+    }
+    if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (capacity >= hugeRegionSize) {
+        // not fatal if transparent huge pages are disabled
+        madvise(p, capacity, MADV_HUGEPAGE);
+    }
+#endif
+    m_region = (char *)p;
+    m_regionSize = capacity;
+}
+
+void BigBuffer::releaseExtent(unsigned int n) {
+    size_t released = extents[n].release();
+    m_heapUsage -= released;
+    countHeap(0, released);
+}
+
+void BigBuffer::releasePages(char *ptr, size_t size) {
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t(ptr) + pageSize - 1) / pageSize * pageSize;
+    uintptr_t end = (uintptr_t(ptr) + size) / pageSize * pageSize;
+    if (start < end) {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+}
+
+void BigBuffer::checkMemoryLimits() {
+    if (s_spillDir.empty()) {
+        return;
+    }
+    zip_uint64_t total;
+    {
+        MutexLock lock(&s_heapMutex);
+        total = s_heapTotal;
+    }
+    if ((s_spillBufferLimit > 0 && m_heapUsage > s_spillBufferLimit)
+            || (s_spillTotalLimit > 0 && total > s_spillTotalLimit)) {
+        spill();
+    }
+}
+
+void BigBuffer::writeData(const char *buf, size_t size,
+        zip_uint64_t offset) {
+    if (m_spillFd != -1) {
+        if (!pwriteAll(m_spillFd, buf, size, offset)) {
+            syslog(LOG_WARNING, "unable to write temporary file: %s",
+                    strerror(errno));
+            throw std::runtime_error(strerror(errno));
+        }
+        return;
+    }
+    if (m_mapped && isZero(buf, size)) {
+        // pages that are never touched are zero-filled
+        size = (offset < m_heapUsage) ? std::min<zip_uint64_t>(size,
+                m_heapUsage - offset) : 0;
+    }
+    if (m_mapped && size > 0) {
+        memcpy(extentData(offset, size), buf, size);
+        size = 0;
+    }
+    while (size > 0) {
+        unsigned int n = extentNumber(offset);
+        size_t w = extentStart(n) + extentSize(n) - offset;
+        if (w > size) {
+            w = size;
+        }
+        if (isZero(buf, w)) {
+            // bytes after allocated space are zeroes already
+            size_t pos = offset - extentStart(n);
+            Extent &e = extents[n];
+            if (pos < e.capacity()) {
+                size_t end = std::min(pos + w, e.capacity());
+                memset(e.ptr() + pos, 0, end - pos);
+                if (end == e.capacity() && isZero(e.ptr(), pos)) {
+                    releaseExtent(n);
+                }
+            }
+        } else {
+            memcpy(extentData(offset, w), buf, w);
+        }
+
+        size -= w;
+        buf += w;
+        offset += w;
+    }
+    checkMemoryLimits();
+}
+
+void BigBuffer::closeSource(bool checkError) {
+    assert(m_stream != NULL || m_fd != -1);
+    ZipStream *s = m_stream;
+    m_stream = NULL;
+    m_fd = -1;
+    m_loaded.clear();
+    if (s == NULL) {
+        return;
+    }
+    if (checkError) {
+        try {
+            s->close();
+        }
+        catch (...) {
+            delete s;
+            throw;
+        }
+    }
+    delete s;
+}
+
+zip_int64_t BigBuffer::readArchive(char *dest, zip_uint64_t size,
+        zip_uint64_t pos) {
+    ssize_t nr;
+    do {
+        nr = pread(m_fd, dest, size, m_dataOffset + pos);
+    } while (nr < 0 && errno == EINTR);
+    if (nr < 0) {
+        syslog(LOG_WARNING, "unable to read archive file: %s",
+                strerror(errno));
+        throw std::runtime_error(strerror(errno));
+    }
+    return nr;
+}
+
+bool BigBuffer::isUnloaded(zip_uint64_t start, zip_uint64_t end) const {
+    if (m_fd == -1 || end > m_sourceLen) {
+        return false;
+    }
+    ranges_t::const_iterator i = m_loaded.upper_bound(start);
+    if (i != m_loaded.end() && i->first < end) {
+        return false;
+    }
+    if (i != m_loaded.begin()) {
+        --i;
+        if (i->second > start) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BigBuffer::markLoaded(zip_uint64_t start, zip_uint64_t end) {
+    ranges_t::iterator i = m_loaded.upper_bound(start);
+    if (i != m_loaded.begin()) {
+        ranges_t::iterator prev = i;
+        --prev;
+        if (prev->second >= start) {
+            start = prev->first;
+            if (end < prev->second) {
+                end = prev->second;
+            }
+            m_loaded.erase(prev);
+        }
+    }
+    while (i != m_loaded.end() && i->first <= end) {
+        if (end < i->second) {
+            end = i->second;
+        }
+        m_loaded.erase(i++);
+    }
+    m_loaded[start] = end;
+}
+
+void BigBuffer::markUnloaded(zip_uint64_t start, zip_uint64_t end) {
+    ranges_t::iterator i = m_loaded.upper_bound(start);
+    if (i != m_loaded.begin()) {
+        ranges_t::iterator prev = i;
+        --prev;
+        if (prev->second > start) {
+            zip_uint64_t prevEnd = prev->second;
+            if (prev->first == start) {
+                m_loaded.erase(prev);
+            } else {
+                prev->second = start;
+            }
+            if (prevEnd > end) {
+                m_loaded[end] = prevEnd;
+                return;
+            }
+        }
+    }
+    while (i != m_loaded.end() && i->first < end) {
+        zip_uint64_t rangeEnd = i->second;
+        m_loaded.erase(i++);
+        if (rangeEnd > end) {
+            m_loaded[end] = rangeEnd;
+            return;
+        }
+    }
+}
+
+void BigBuffer::releaseBefore(zip_uint64_t limit) {
+    if (m_stream == NULL || m_modified || m_spillFd != -1 || m_mapped
+            || limit > m_sourceLen) {
+        return;
+    }
+    while (!m_loaded.empty() && m_loaded.begin()->first < limit) {
+        unsigned int n = extentNumber(m_loaded.begin()->first);
+        zip_uint64_t start = extentStart(n);
+        zip_uint64_t end = start + extentSize(n);
+        if (end > limit) {
+            break;
+        }
+        releaseExtent(n);
+        markUnloaded(start, end);
+        m_released = end;
+    }
+}
+
+void BigBuffer::load(zip_uint64_t start, zip_uint64_t end) {
+    // buffer for data that is not read directly into extents
+    std::vector<char> scratch;
+    zip_uint64_t pos = start;
+    if (m_stream != NULL) {
+        m_stream->seek(start);
+        pos = m_stream->pos();
+    }
+    while (pos < end) {
+        unsigned int n = extentNumber(pos);
+        zip_uint64_t readSize = extentStart(n) + extentSize(n) - pos;
+        if (readSize > end - pos) {
+            readSize = end - pos;
+        }
+        // find out if data at 'pos' is already available
+        bool loaded = false;
+        ranges_t::const_iterator i = m_loaded.upper_bound(pos);
+        if (i != m_loaded.end() && readSize > i->first - pos) {
+            readSize = i->first - pos;
+        }
+        if (i != m_loaded.begin()) {
+            --i;
+            if (i->second > pos) {
+                loaded = true;
+                if (readSize > i->second - pos) {
+                    readSize = i->second - pos;
+                }
+            }
+        }
+        if (loaded && m_stream == NULL) {
+            // archive file is accessed randomly, so there is no need to
+            // read available data again
+            pos += readSize;
+            continue;
+        }
+        char *dest;
+        bool direct = !loaded && m_spillFd == -1;
+        // memory for hole is released if data is zero
+        bool hole = direct && !m_mapped && extents[n].capacity() == 0;
+        if (direct) {
+            dest = extentData(pos, readSize);
+        } else {
+            if (scratch.empty()) {
+                scratch.resize(minExtentSize);
+            }
+            if (readSize > scratch.size()) {
+                readSize = scratch.size();
+            }
+            dest = &scratch[0];
+        }
+        zip_int64_t nr;
+        if (m_stream != NULL) {
+            nr = m_stream->read(dest, readSize);
+        } else {
+            nr = readArchive(dest, readSize, pos);
+        }
+        if (nr == 0 || zip_uint64_t(nr) > readSize) {
+            // There are unread bytes but stream is ended (or file is
+            // longer that given length). Possibly CRC error.
+            if (m_stream != NULL) {
+                syslog(LOG_WARNING,
+                        "length of file %s differ from data length",
+                        m_stream->name());
+            } else {
+                syslog(LOG_WARNING, "unexpected end of archive file");
+            }
             throw std::runtime_error("data length differ");
         }
+        if (!loaded) {
+            if (direct && isZero(dest, nr)) {
+                if (hole) {
+                    releaseExtent(n);
+                } else if (m_mapped) {
+                    releasePages(dest, nr);
+                }
+            } else if (direct) {
+                checkMemoryLimits();
+            } else {
+                writeData(dest, nr, pos);
+            }
+            markLoaded(pos, pos + nr);
+        }
+        pos += nr;
+    }
+}
+
+void BigBuffer::fill(zip_uint64_t offset, zip_uint64_t size) {
+    if (m_loadFailed) {
+        m_loadFailed = false;
+        throw std::runtime_error("background decompression failed");
+    }
+    if ((m_stream == NULL && m_fd == -1) || offset >= m_sourceLen) {
+        return;
+    }
+    zip_uint64_t end = m_sourceLen;
+    if (size < m_sourceLen - offset) {
+        end = offset + size;
+        // round up to minimal extent size
+        if (end % minExtentSize != 0) {
+            end += minExtentSize - end % minExtentSize;
+            if (end > m_sourceLen) {
+                end = m_sourceLen;
+            }
+        }
     }
-    if (zip_fclose(zf)) {
-        syslog(LOG_WARNING, "%s", zip_strerror(z));
-        throw std::runtime_error(zip_strerror(z));
+    // Source is kept opened on error, so subsequent reads of unavailable
+    // data report an error too.
+    zip_uint64_t pos = offset - offset % minExtentSize;
+    while (pos < end) {
+        ranges_t::const_iterator i = m_loaded.upper_bound(pos);
+        zip_uint64_t gapEnd = end;
+        if (i != m_loaded.end() && i->first < end) {
+            gapEnd = i->first;
+        }
+        if (i != m_loaded.begin()) {
+            --i;
+            if (i->second > pos) {
+                pos = i->second;
+                continue;
+            }
+        }
+        load(pos, gapEnd);
+        pos = gapEnd;
+    }
+    if (m_loaded.size() == 1 && m_loaded.begin()->first == 0
+            && m_loaded.begin()->second >= m_sourceLen) {
+        closeSource(true);
     }
 }
 
-BigBuffer::~BigBuffer() {
+bool BigBuffer::loadNext() {
+    MutexLock lock(&m_mutex);
+    zip_uint64_t pos = m_released;
+    ranges_t::const_iterator i = m_loaded.upper_bound(pos);
+    if (i != m_loaded.begin()) {
+        --i;
+        if (i->second > pos) {
+            pos = i->second;
+        }
+    }
+    if (m_stream == NULL || pos >= m_sourceLen) {
+        return false;
+    }
+    if (m_streamEnd > 0 && pos >= m_streamEnd + streamWindow) {
+        // wait for streaming reader to not fill memory ahead of it
+        m_loadPaused = true;
+        return false;
+    }
+    m_loadPaused = false;
+    try {
+        fill(pos, backgroundChunkSize);
+    }
+    catch (const std::exception &) {
+        // some errors (like CRC mismatch) are not repeated by stream, so
+        // the error is reported to reader instead of worker
+        m_loadFailed = true;
+        return false;
+    }
+    return m_stream != NULL;
 }
 
-int BigBuffer::read(char *buf, size_t size, zip_uint64_t offset) const {
+int BigBuffer::read(char *buf, size_t size, zip_uint64_t offset,
+        Cursor *cursor) {
+    MutexLock lock(&m_mutex);
     if (offset > len) {
         return 0;
     }
-    int chunk = chunkNumber(offset);
-    int pos = chunkOffset(offset);
     if (size > unsigned(len - offset)) {
         size = len - offset;
     }
-    int nread = size;
-    while (size > 0) {
-        size_t r = chunks[chunk].read(buf, pos, size);
+    if (cursor != NULL) {
+        if (cursor->buffer == NULL) {
+            m_cursors.push_back(cursor);
+            cursor->buffer = this;
+        }
+        assert(cursor->buffer == this);
+        if (cursor->streaming && (offset + streamWindow < cursor->end
+                    || offset > cursor->end + streamWindow)) {
+            // reader is not sequential, so data is kept from now on
+            cursor->streaming = false;
+            slideWindow();
+        }
+    }
+    if (isUnloaded(offset, offset + size)) {
+        // read unmodified data directly without caching
+        size_t nread = 0;
+        while (nread < size) {
+            zip_int64_t nr = readArchive(buf + nread, size - nread,
+                    offset + nread);
+            if (nr == 0) {
+                syslog(LOG_WARNING, "unexpected end of archive file");
+                throw std::runtime_error("data length differ");
+            }
+            nread += nr;
+        }
+        return nread;
+    }
+    fill(offset, size);
+    readData(buf, size, offset);
+    if (cursor != NULL && cursor->streaming) {
+        if (cursor->end < offset + size) {
+            cursor->end = offset + size;
+        }
+        slideWindow();
+    }
+    return size;
+}
 
-        size -= r;
-        buf += r;
-        ++chunk;
-        pos = 0;
+void BigBuffer::detach(Cursor &cursor) {
+    MutexLock lock(&m_mutex);
+    assert(cursor.buffer == this);
+    m_cursors.erase(std::remove(m_cursors.begin(), m_cursors.end(), &cursor),
+            m_cursors.end());
+    cursor.buffer = NULL;
+}
+
+void BigBuffer::slideWindow() {
+    bool streaming = !m_cursors.empty();
+    zip_uint64_t first = 0, last = 0;
+    for (size_t i = 0; i < m_cursors.size(); ++i) {
+        const Cursor *c = m_cursors[i];
+        streaming = streaming && c->streaming;
+        if (i == 0 || c->end < first) {
+            first = c->end;
+        }
+        if (last < c->end) {
+            last = c->end;
+        }
+    }
+    if (streaming) {
+        m_streamEnd = last;
+        if (first > streamWindow) {
+            releaseBefore(first - streamWindow);
+        }
+    } else {
+        // Data released before is decompressed again on demand and by
+        // background worker.
+        m_released = 0;
+        m_streamEnd = 0;
+    }
+    if (m_loadPaused && s_decompressPool != NULL) {
+        s_decompressPool->schedule(this);
+    }
+}
+
+bool BigBuffer::dataLocation(size_t &size, zip_uint64_t offset, int &fd,
+        zip_uint64_t &pos) const {
+    MutexLock lock(&m_mutex);
+    if (offset > len) {
+        offset = len;
+    }
+    if (size > unsigned(len - offset)) {
+        size = len - offset;
     }
-    return nread;
+    if (!isUnloaded(offset, offset + size)) {
+        return false;
+    }
+    fd = m_fd;
+    pos = m_dataOffset + offset;
+    return true;
 }
 
 int BigBuffer::write(const char *buf, size_t size, zip_uint64_t offset) {
-    int chunk = chunkNumber(offset);
-    int pos = chunkOffset(offset);
-    int nwritten = size;
+    MutexLock lock(&m_mutex);
+    // Data that is not yet read from archive should be read before to
+    // not overwrite new data by old one later.
+    fill(offset, size);
+    m_modified = true;
 
     if (offset > len) {
-        if (len > 0) {
-            chunks[chunkNumber(len)].clearTail(chunkOffset(len));
-        }
+        clearTail();
         len = size + offset;
     } else if (size > unsigned(len - offset)) {
         len = size + offset;
     }
-    chunks.resize(chunksCount(len));
-    while (size > 0) {
-        size_t w = chunks[chunk].write(buf, pos, size);
-
-        size -= w;
-        buf += w;
-        ++ chunk;
-        pos = 0;
+    if (m_spillFd == -1 && !m_mapped) {
+        extents.resize(extentsCount(len));
     }
-    return nwritten;
+    writeData(buf, size, offset);
+    return size;
 }
 
 void BigBuffer::truncate(zip_uint64_t offset) {
-    chunks.resize(chunksCount(offset));
+    MutexLock lock(&m_mutex);
+    if (offset < m_sourceLen) {
+        // the rest of file data is discarded
+        m_sourceLen = offset;
+        ranges_t::iterator i = m_loaded.lower_bound(offset);
+        m_loaded.erase(i, m_loaded.end());
+        if (!m_loaded.empty() && m_loaded.rbegin()->second > offset) {
+            m_loaded.rbegin()->second = offset;
+        }
+        if ((m_stream != NULL || m_fd != -1) && (offset == 0
+                    || (m_loaded.size() == 1 && m_loaded.begin()->first == 0
+                        && m_loaded.begin()->second == offset))) {
+            closeSource(false);
+        }
+    }
+    if (m_spillFd != -1) {
+        // data after file end is not kept, so file is extended with zeroes
+        if (ftruncate(m_spillFd, offset) != 0) {
+            syslog(LOG_WARNING, "unable to truncate temporary file: %s",
+                    strerror(errno));
+            throw std::runtime_error(strerror(errno));
+        }
+        len = offset;
+        return;
+    }
+    if (m_mapped) {
+        zip_uint64_t start = pageAlign(offset);
+        if (start < m_heapUsage) {
+            // pages are zero-filled on next access
+            madvise(m_region + start, m_regionSize - start, MADV_DONTNEED);
+            countHeap(0, m_heapUsage - start);
+            m_heapUsage = start;
+        }
+        if (offset > len) {
+            clearTail();
+        }
+        len = offset;
+        return;
+    }
+    for (unsigned int i = extentsCount(offset); i < extents.size(); ++i) {
+        m_heapUsage -= extents[i].capacity();
+        countHeap(0, extents[i].capacity());
+    }
+    extents.resize(extentsCount(offset));
 
-    if (offset > len && len > 0) {
-        // Fill end of last non-empty chunk with zeroes
-        chunks[chunkNumber(len)].clearTail(chunkOffset(len));
+    if (offset > len) {
+        clearTail();
     }
 
     len = offset;
 }
 
+void BigBuffer::clearTail() {
+    if (m_spillFd != -1) {
+        return;
+    }
+    if (m_mapped) {
+        // pages after the last one were released by truncate
+        zip_uint64_t end = pageAlign(len);
+        if (end > m_regionSize) {
+            end = m_regionSize;
+        }
+        if (len < end) {
+            memset(m_region + len, 0, end - len);
+        }
+        return;
+    }
+    unsigned int n = extentNumber(len);
+    if (n < extents.size() && len > extentStart(n)) {
+        extents[n].clearTail(len - extentStart(n));
+    }
+}
+
 zip_int64_t BigBuffer::zipUserFunctionCallback(void *state, void *data,
         zip_uint64_t len, enum zip_source_cmd cmd) {
     CallBackStruct *b = (CallBackStruct*)state;
@@ -266,7 +1088,13 @@ zip_int64_t BigBuffer::zipUserFunctionCallback(void *state, void *data,
             return 0;
         }
         case ZIP_SOURCE_READ: {
-            int r = b->buf->read((char*)data, len, b->pos);
+            int r;
+            try {
+                r = b->buf->read((char*)data, len, b->pos);
+            }
+            catch (...) {
+                return -1;
+            }
             b->pos += r;
             return r;
         }
@@ -308,6 +1136,17 @@ zip_int64_t BigBuffer::zipUserFunctionCallback(void *state, void *data,
 
 int BigBuffer::saveToZip(time_t mtime, struct zip *z, const char *fname,
         bool newFile, zip_int64_t &index) {
+    stopBackgroundLoad();
+    // Original file data is not available after archive is rewritten
+    try {
+        fill(0, len);
+    }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+    catch (const std::exception &) {
+        return -EIO;
+    }
     struct zip_source *s;
     struct CallBackStruct *cbs = new CallBackStruct();
     cbs->buf = this;
@@ -22,29 +22,316 @@
 #ifndef BIG_BUFFER_H
 #define BIG_BUFFER_H
 
+#include <pthread.h>
 #include <zip.h>
 #include <unistd.h>
 
+#include <map>
+#include <string>
 #include <vector>
 
 #include "types.h"
+#include "decompressPool.h"
+#include "inflateIndex.h"
+#include "zipPool.h"
+#include "zipStream.h"
+#include "slabAllocator.h"
 
 class BigBuffer {
+    friend class DecompressPool;
+public:
+    struct Cursor;
 private:
-    //TODO: use >> and <<
-    static const unsigned int chunkSize = 4*1024; //4 Kilobytes
+    /**
+     * File data is kept in extents of growing size: first megabyte is
+     * divided into 64K extents, next 15 megabytes into 1M extents and the
+     * rest into 8M extents. Memory for extent is allocated on demand, so
+     * small files take exactly as much memory as needed.
+     */
+    static const unsigned int minExtentSize = 64 * 1024;
+    static const unsigned int midExtentSize = 1024 * 1024;
+    static const unsigned int maxExtentSize = 8 * 1024 * 1024;
+    // number of extents of each size
+    static const unsigned int minExtentsCount = 16;
+    static const unsigned int midExtentsCount = 15;
+    /**
+     * Number of bytes decompressed by background worker at once (see
+     * loadNext)
+     */
+    static const unsigned int backgroundChunkSize = 1024 * 1024;
+    /**
+     * Amount of decompressed data kept behind (and decompressed in
+     * background ahead of) sequential reader (see Cursor)
+     */
+    static const zip_uint64_t streamWindow = 16 * 1024 * 1024;
 
-    class ChunkWrapper;
+    class Extent;
 
-    typedef std::vector<ChunkWrapper> chunks_t;
+    typedef std::vector<Extent> extents_t;
 
     struct CallBackStruct {
         size_t pos;
-        const BigBuffer *buf;
+        BigBuffer *buf;
         time_t mtime;
     };
 
-    chunks_t chunks;
+    extents_t extents;
+
+    typedef std::map<zip_uint64_t, zip_uint64_t> ranges_t;
+
+    /**
+     * Stream of file data inside zip archive. It is kept opened until all
+     * data is read (or discarded by truncate) to decompress file content
+     * on demand. NULL if there is nothing to decompress.
+     */
+    ZipStream *m_stream;
+    /**
+     * Descriptor of archive file if file data is stored in archive
+     * without compression and read directly from it, -1 otherwise.
+     * Descriptor is owned by ArchiveFile.
+     */
+    int m_fd;
+    /**
+     * Offset of file data in archive file if m_fd is set.
+     */
+    zip_uint64_t m_dataOffset;
+    /**
+     * Number of bytes at the file beginning whose data should be read
+     * from source (m_stream or m_fd). Data after this offset is not backed
+     * by archive.
+     */
+    zip_uint64_t m_sourceLen;
+    /**
+     * Ranges of data already read from source into extents ([start, end)
+     * pairs). Adjacent ranges are merged.
+     */
+    ranges_t m_loaded;
+
+    /**
+     * Temporary file that keeps file data instead of extents after buffer
+     * is moved out of memory, -1 if data is kept in extents. Data offset in
+     * temporary file is the same as in buffer.
+     */
+    int m_spillFd;
+    /**
+     * Number of bytes allocated for extents
+     */
+    zip_uint64_t m_heapUsage;
+
+    /**
+     * Anonymous memory mapping that keeps whole file data instead of
+     * extents if buffer is created in mmap mode (see setMmapMode). Address
+     * space is reserved without committing memory and grown by mremap,
+     * so pages that are never written take no memory. NULL if nothing is
+     * mapped yet.
+     */
+    char *m_region;
+    /**
+     * Size of m_region mapping
+     */
+    size_t m_regionSize;
+    /**
+     * Is data kept in m_region instead of extents?
+     */
+    bool m_mapped;
+
+    /**
+     * Mode of new buffers (see setMmapMode)
+     */
+    static bool s_mmapMode;
+    /**
+     * Regions of at least this size are backed by transparent huge pages
+     * if possible
+     */
+    static const size_t hugeRegionSize = 2 * 1024 * 1024;
+
+    /**
+     * Allocator of extent memory shared by all buffers
+     */
+    static SlabAllocator s_allocator;
+
+    /**
+     * Directory for temporary files. Empty if data is never moved out of
+     * memory.
+     */
+    static std::string s_spillDir;
+    /**
+     * Buffer data is moved to temporary file when memory used by buffer
+     * exceeds s_spillBufferLimit or memory used by all buffers exceeds
+     * s_spillTotalLimit (0 means no limit).
+     */
+    static zip_uint64_t s_spillBufferLimit, s_spillTotalLimit;
+    /**
+     * Number of bytes allocated for extents by all buffers
+     */
+    static zip_uint64_t s_heapTotal;
+    /**
+     * Protects s_heapTotal
+     */
+    static pthread_mutex_t s_heapMutex;
+    /**
+     * Pool of archive handles for new streams (see setZipPool)
+     */
+    static ZipPool *s_zipPool;
+
+    /**
+     * Worker threads that decompress data of opened files in background
+     * (see setDecompressPool)
+     */
+    static DecompressPool *s_decompressPool;
+
+    /**
+     * Serializes read(), dataLocation(), write() and truncate() calls of
+     * the same buffer and loading of its data in background
+     */
+    mutable pthread_mutex_t m_mutex;
+    /**
+     * Error occurred (for example, CRC mismatch) while data was loaded in
+     * background. The error is reported by the next fill().
+     */
+    bool m_loadFailed;
+    /**
+     * Is data written into buffer? Written data can not be read from
+     * source again, so it is never released by releaseBefore().
+     */
+    bool m_modified;
+    /**
+     * Data before this offset was released after it was read by streaming
+     * reader (0 if nothing is released)
+     */
+    zip_uint64_t m_released;
+    /**
+     * End of data read by streaming readers (0 if there are no such
+     * readers). Background workers do not decompress data further than
+     * streamWindow after it.
+     */
+    zip_uint64_t m_streamEnd;
+    /**
+     * Background worker stopped at streamWindow ahead of reader and should
+     * be scheduled again when reader moves on
+     */
+    bool m_loadPaused;
+    /**
+     * Readers that passed their cursors to read() and are not detached
+     * yet
+     */
+    std::vector<Cursor *> m_cursors;
+
+    /**
+     * Add 'added' and subtract 'released' bytes from s_heapTotal
+     */
+    static void countHeap(zip_uint64_t added, zip_uint64_t released);
+
+    /**
+     * Create anonymous temporary file in s_spillDir.
+     * @return file descriptor or -1 on error
+     */
+    static int createSpillFile();
+
+    /**
+     * Move extents data into temporary file. Data is kept in memory if
+     * temporary file can not be created or written.
+     */
+    void spill();
+
+    /**
+     * Copy data in range [offset, offset + size) from extents or temporary
+     * file into 'buf'. Range should be inside the file.
+     *
+     * @throws
+     *      std::exception  On temporary file read error
+     */
+    void readData(char *buf, size_t size, zip_uint64_t offset) const;
+
+    /**
+     * Copy data from 'buf' into extents or temporary file at 'offset'.
+     * Extents vector should cover the range. Buffer is moved to temporary
+     * file if memory limits are exceeded.
+     * Zeroes are not written into holes, and extent becomes a hole again
+     * when it is zeroed up to the end of allocated memory.
+     *
+     * @throws
+     *      std::exception  On temporary file write error
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void writeData(const char *buf, size_t size, zip_uint64_t offset);
+
+    /**
+     * Read not yet available data in range [offset, offset + size) from
+     * source into extents. Range is expanded to 64K boundaries. Source
+     * is closed when all data is read.
+     *
+     * @throws
+     *      std::exception  On file read error
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void fill(zip_uint64_t offset, zip_uint64_t size);
+
+    /**
+     * Decompress next chunk of data that is not yet available. Called by
+     * background worker of s_decompressPool.
+     *
+     * @return false if there is nothing to load anymore or error occurred
+     */
+    bool loadNext();
+
+    /**
+     * Read data from source into extents until offset 'end'. Data that is
+     * already available is not overwritten.
+     *
+     * @throws
+     *      std::exception  On file read error
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void load(zip_uint64_t start, zip_uint64_t end);
+
+    /**
+     * Read up to 'size' bytes from archive file at data offset 'pos'.
+     *
+     * @return number of bytes read (0 at end of file)
+     * @throws
+     *      std::exception  On file read error
+     */
+    zip_int64_t readArchive(char *dest, zip_uint64_t size, zip_uint64_t pos);
+
+    /**
+     * Add range [start, end) to m_loaded.
+     */
+    void markLoaded(zip_uint64_t start, zip_uint64_t end);
+
+    /**
+     * Remove range [start, end) from m_loaded.
+     */
+    void markUnloaded(zip_uint64_t start, zip_uint64_t end);
+
+    /**
+     * Release extents that lie before offset 'limit' and can be
+     * decompressed from m_stream again. Does nothing if buffer is modified,
+     * kept in temporary file or in memory mapping.
+     */
+    void releaseBefore(zip_uint64_t limit);
+
+    /**
+     * Release data that is streamWindow behind the slowest reader and
+     * limit background decompression to streamWindow ahead of the
+     * fastest one. Data is kept while any reader is not sequential.
+     */
+    void slideWindow();
+
+    /**
+     * Check that source is available and no data in range [start, end) is
+     * loaded into extents.
+     */
+    bool isUnloaded(zip_uint64_t start, zip_uint64_t end) const;
+
+    /**
+     * Close m_stream or forget m_fd.
+     *
+     * @param checkError    throw an exception if zip_fclose fails
+     * @throws
+     *      std::exception  On file read error if checkError is true
+     */
+    void closeSource(bool checkError);
 
     /**
      * Callback for zip_source_function.
@@ -54,27 +341,126 @@ private:
             zip_uint64_t len, enum zip_source_cmd cmd);
 
     /**
-     * Return number of chunks needed to keep 'offset' bytes.
+     * Return number of extents needed to keep 'offset' bytes.
+     */
+    inline static unsigned int extentsCount(zip_uint64_t offset) {
+        return (offset == 0) ? 0 : extentNumber(offset - 1) + 1;
+    }
+
+    /**
+     * Return number of extent where 'offset'-th byte is located.
      */
-    inline static unsigned int chunksCount(zip_uint64_t offset) {
-        return (offset + chunkSize - 1) / chunkSize;
+    inline static unsigned int extentNumber(zip_uint64_t offset) {
+        const zip_uint64_t midStart = zip_uint64_t(minExtentSize) * minExtentsCount;
+        const zip_uint64_t maxStart = midStart + zip_uint64_t(midExtentSize) * midExtentsCount;
+        if (offset < midStart) {
+            return offset / minExtentSize;
+        } else if (offset < maxStart) {
+            return minExtentsCount + (offset - midStart) / midExtentSize;
+        } else {
+            return minExtentsCount + midExtentsCount
+                + (offset - maxStart) / maxExtentSize;
+        }
     }
 
     /**
-     * Return number of chunk where 'offset'-th byte is located.
+     * Return offset of the first byte of extent 'n'.
      */
-    inline static unsigned int chunkNumber(zip_uint64_t offset) {
-        return offset / chunkSize;
+    inline static zip_uint64_t extentStart(unsigned int n) {
+        const zip_uint64_t midStart = zip_uint64_t(minExtentSize) * minExtentsCount;
+        const zip_uint64_t maxStart = midStart + zip_uint64_t(midExtentSize) * midExtentsCount;
+        if (n < minExtentsCount) {
+            return zip_uint64_t(n) * minExtentSize;
+        } else if (n < minExtentsCount + midExtentsCount) {
+            return midStart + zip_uint64_t(n - minExtentsCount) * midExtentSize;
+        } else {
+            return maxStart + zip_uint64_t(n - minExtentsCount
+                    - midExtentsCount) * maxExtentSize;
+        }
     }
 
     /**
-     * Return offset inside chunk to 'offset'-th byte.
+     * Return size of extent 'n'.
      */
-    inline static int chunkOffset(zip_uint64_t offset) {
-        return offset % chunkSize;
+    inline static size_t extentSize(unsigned int n) {
+        if (n < minExtentsCount) {
+            return minExtentSize;
+        } else if (n < minExtentsCount + midExtentsCount) {
+            return midExtentSize;
+        } else {
+            return maxExtentSize;
+        }
     }
 
+    /**
+     * Return pointer to memory for 'size' bytes of data at 'offset'.
+     * Memory is allocated if needed. Range should not cross extent
+     * boundary unless buffer is in mmap mode.
+     *
+     * @throws
+     *      std::bad_alloc  On memory insufficiency
+     */
+    char *extentData(zip_uint64_t offset, size_t size);
+
+    /**
+     * Free memory of extent 'n' making it a hole.
+     */
+    void releaseExtent(unsigned int n);
+
+    /**
+     * Return whole pages inside zero-filled range of m_region to the
+     * system. Pages are zero-filled again on next access.
+     */
+    static void releasePages(char *ptr, size_t size);
+
+    /**
+     * Grow m_region to keep at least 'size' bytes. Mapping is grown
+     * geometrically and covers whole file length at once.
+     *
+     * @throws
+     *      std::bad_alloc  If address space can not be reserved
+     */
+    void reserveRegion(zip_uint64_t size);
+
+    /**
+     * Move buffer to temporary file if memory limits are exceeded.
+     */
+    void checkMemoryLimits();
+
+    /**
+     * Fill space after end of file in the last extent (or in the last page
+     * of m_region) with zeroes.
+     */
+    void clearTail();
+
 public:
+    /**
+     * Access pattern of one reader of buffer (for example, opened file
+     * handle). While all readers move through file sequentially, data that
+     * is left more than streamWindow behind the slowest of them is
+     * released, so file is read in one pass using memory for the window
+     * only. If reader goes back further than that (or jumps forward), it
+     * falls back to keeping all decompressed data, and nothing is released
+     * until it is detached.
+     */
+    struct Cursor {
+        /**
+         * Buffer that tracks this reader (see detach) or NULL
+         */
+        BigBuffer *buffer;
+        /**
+         * End of the furthest range read
+         */
+        zip_uint64_t end;
+        /**
+         * Is reader sequential?
+         */
+        bool streaming;
+
+        Cursor(): buffer(NULL), end(0), streaming(true) {
+        }
+    };
+
     zip_uint64_t len;
 
     /**
@@ -83,42 +469,149 @@ public:
     BigBuffer();
 
     /**
-     * Read file data from file inside zip archive
+     * Open file inside zip archive for reading. File data is decompressed
+     * on demand by read() and other methods, so construction time does not
+     * depend on file length.
      *
      * @param z         Zip file
      * @param nodeId    Node index inside zip file
      * @param length    File length
+     * @param index     Access point index for random access into deflated
+     *                  data or NULL (see ZipStream)
      * @throws 
-     *      std::exception  On file read error
+     *      std::exception  On file open error
      *      std::bad_alloc  On memory insufficiency
      */
-    BigBuffer(struct zip *z, zip_uint64_t nodeId, zip_uint64_t length);
+    BigBuffer(struct zip *z, zip_uint64_t nodeId, zip_uint64_t length,
+            InflateIndex *index);
+
+    /**
+     * Open file stored in archive without compression. Data is read
+     * directly from archive file until it is modified.
+     *
+     * @param fd            Archive file descriptor
+     * @param dataOffset    Offset of file data in archive file
+     * @param length        File length
+     */
+    BigBuffer(int fd, zip_uint64_t dataOffset, zip_uint64_t length);
 
     ~BigBuffer();
 
     /**
-     * Dispatch read requests to chunks of a file and write result to
+     * Dispatch read requests to extents of a file and write result to
      * resulting buffer.
      * Reading after end of file is not allowed, so 'size' is decreased to
      * fit file boundaries.
+     * Data from zip archive is decompressed up to the end of requested
+     * range if it is not yet available. Unmodified data of uncompressed
+     * files is read directly from archive file.
+     * If 'cursor' is given, buffer tracks it until detach() is called and
+     * releases data of unmodified file behind sequential readers (see
+     * Cursor). Released data is decompressed again if it is requested
+     * later.
      *
      * @param buf       destination buffer
      * @param size      requested bytes count
      * @param offset    offset to start reading from
+     * @param cursor    (INOUT) access pattern of reader or NULL
      * @return number of bytes read
+     * @throws
+     *      std::exception  On file read error (including error found while
+     *                      data was decompressed in background)
+     *      std::bad_alloc  On memory insufficiency
+     */
+    int read(char *buf, size_t size, zip_uint64_t offset,
+            Cursor *cursor = NULL);
+
+    /**
+     * Stop tracking reader that passed 'cursor' to read(). Must be called
+     * before cursor is destroyed.
+     */
+    void detach(Cursor &cursor);
+
+    /**
+     * Get location of unmodified file data in archive file to pass it
+     * to the kernel without copying.
+     * Reading after end of file is not allowed, so 'size' is decreased to
+     * fit file boundaries.
+     *
+     * @param size      (INOUT) requested bytes count
+     * @param offset    offset to start reading from
+     * @param fd        (OUT) archive file descriptor
+     * @param pos       (OUT) data position in archive file
+     * @return true if data range is available in archive file
      */
-    int read(char *buf, size_t size, zip_uint64_t offset) const;
+    bool dataLocation(size_t &size, zip_uint64_t offset, int &fd,
+            zip_uint64_t &pos) const;
 
     /**
-     * Dispatch write request to chunks of a file and grow 'chunks' vector if
+     * Return number of bytes of memory used by file data.
+     */
+    inline zip_uint64_t memoryUsage() const {
+        return m_heapUsage;
+    }
+
+    /**
+     * Configure moving of buffer data out of memory for all buffers.
+     *
+     * @param dir           Directory for temporary files (data is never
+     *                      moved out of memory if empty)
+     * @param bufferLimit   Maximum number of bytes kept in memory by one
+     *                      buffer (0 for no limit)
+     * @param totalLimit    Maximum number of bytes kept in memory by all
+     *                      buffers (0 for no limit)
+     */
+    static void setSpillOptions(const std::string &dir,
+            zip_uint64_t bufferLimit, zip_uint64_t totalLimit);
+
+    /**
+     * Keep data of buffers created after this call in single memory
+     * mapping instead of extents. Mapping is contiguous, so data is
+     * copied by one memcpy regardless of request size, and is never
+     * moved when file grows.
+     */
+    static void setMmapMode(bool enable);
+
+    /**
+     * Open streams of buffers created after this call through handles of
+     * 'pool' (NULL to use archive handle passed to constructor). read(),
+     * dataLocation(), write() and truncate() of such buffers can be
+     * called from several threads; saveToZip() must not be called
+     * concurrently.
+     */
+    static void setZipPool(ZipPool *pool);
+
+    /**
+     * Decompress data of buffers scheduled by loadInBackground() by
+     * workers of 'pool' (NULL to decompress data on demand only). Streams
+     * must be opened through pool of archive handles (see setZipPool).
+     */
+    static void setDecompressPool(DecompressPool *pool);
+
+    /**
+     * Start decompression of file data in background if pool is set by
+     * setDecompressPool(). read() waits only until requested range is
+     * available.
+     */
+    void loadInBackground();
+
+    /**
+     * Stop decompression of file data in background. Data that is already
+     * decompressed is kept.
+     */
+    void stopBackgroundLoad();
+
+    /**
+     * Dispatch write request to extents of a file and grow 'extents' vector if
      * necessary.
-     * If 'offset' is after file end, tail of last chunk cleared before growing.
+     * If 'offset' is after file end, tail of last extent cleared before growing.
      *
      * @param buf       Source buffer
      * @param size      Number of bytes to be written
      * @param offset    Offset in file to start writing from
      * @return number of bytes written
      * @throws
+     *      std::exception  On file read error
      *      std::bad_alloc  If there are no memory for buffer
      */
     int write(const char *buf, size_t size, zip_uint64_t offset);
@@ -126,6 +619,7 @@ public:
     /**
      * Create (or replace) file element in zip file. Class instance should
      * not be destroyed until zip_close() is called.
+     * Not yet decompressed data is read from archive before that.
      *
      * @param mtime     File modification time
      * @param z         ZIP archive structure
@@ -136,17 +630,19 @@ public:
      * @return
      *      0       If successfull
      *      -ENOMEM If there are no memory
+     *      -EIO    If file data cannot be read from archive
      */
     int saveToZip(time_t mtime, struct zip *z, const char *fname,
             bool newFile, zip_int64_t &index);
 
     /**
      * Truncate buffer at position offset.
-     * 1. Free chunks after offset
-     * 2. Resize chunks vector to a new size
+     * 1. Free extents (or pages of mapping) after offset
+     * 2. Resize extents vector to a new size
      * 3. Fill data block that made readable by resize with zeroes
      *
      * @throws
+     *      std::exception  On file read error
      *      std::bad_alloc  If insufficient memory available
      */
     void truncate(zip_uint64_t offset);
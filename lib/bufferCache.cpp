@@ -0,0 +1,101 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+
+#include "bufferCache.h"
+#include "mutexLock.h"
+
+BufferCache::BufferCache(zip_uint64_t budget): m_budget(budget), m_used(0),
+    m_hits(0), m_misses(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+BufferCache::~BufferCache() {
+    evict(0);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void BufferCache::evict(zip_uint64_t budget) {
+    while (m_used > budget) {
+        assert(!m_lru.empty());
+        Entry &e = m_lru.back();
+        m_used -= e.size;
+        m_index.erase(e.node);
+        delete e.buffer;
+        m_lru.pop_back();
+    }
+}
+
+BigBuffer *BufferCache::take(const FileNode *node) {
+    MutexLock lock(&m_mutex);
+    index_t::iterator i = m_index.find(node);
+    if (i == m_index.end()) {
+        ++m_misses;
+        return NULL;
+    }
+    ++m_hits;
+    BigBuffer *buffer = i->second->buffer;
+    m_used -= i->second->size;
+    m_lru.erase(i->second);
+    m_index.erase(i);
+    return buffer;
+}
+
+bool BufferCache::contains(const FileNode *node) {
+    MutexLock lock(&m_mutex);
+    return m_index.find(node) != m_index.end();
+}
+
+void BufferCache::put(const FileNode *node, BigBuffer *buffer) {
+    MutexLock lock(&m_mutex);
+    assert(m_index.find(node) == m_index.end());
+    zip_uint64_t size = buffer->memoryUsage();
+    // buffers without data are cheap to create again
+    if (size == 0 || size > m_budget) {
+        delete buffer;
+        return;
+    }
+    evict(m_budget - size);
+    Entry e;
+    e.node = node;
+    e.buffer = buffer;
+    e.size = size;
+    m_lru.push_front(e);
+    m_index[node] = m_lru.begin();
+    m_used += size;
+}
+
+void BufferCache::remove(const FileNode *node) {
+    MutexLock lock(&m_mutex);
+    index_t::iterator i = m_index.find(node);
+    if (i != m_index.end()) {
+        m_used -= i->second->size;
+        delete i->second->buffer;
+        m_lru.erase(i->second);
+        m_index.erase(i);
+    }
+}
+
+void BufferCache::clear() {
+    MutexLock lock(&m_mutex);
+    evict(0);
+}
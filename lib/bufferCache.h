@@ -0,0 +1,115 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <pthread.h>
+#include <zip.h>
+
+#include <list>
+#include <map>
+
+#include "types.h"
+#include "bigBuffer.h"
+
+/**
+ * Cache of unmodified file buffers that are not used by opened files.
+ *
+ * Buffers are kept until total size of their data exceeds budget. Least
+ * recently used buffers are evicted first. Methods may be called from
+ * several threads.
+ */
+class BufferCache {
+private:
+    // must not be defined
+    BufferCache (const BufferCache &);
+    BufferCache &operator= (const BufferCache &);
+
+    struct Entry {
+        const FileNode *node;
+        BigBuffer *buffer;
+        zip_uint64_t size;
+    };
+
+    // most recently used buffers first
+    typedef std::list<Entry> lru_t;
+    typedef std::map<const FileNode *, lru_t::iterator> index_t;
+
+    lru_t m_lru;
+    index_t m_index;
+    zip_uint64_t m_budget, m_used;
+    unsigned long long m_hits, m_misses;
+    pthread_mutex_t m_mutex;
+
+    /**
+     * Delete least recently used buffers until m_used <= budget
+     */
+    void evict(zip_uint64_t budget);
+
+public:
+    /**
+     * @param budget    Maximum total size of cached data in bytes
+     */
+    explicit BufferCache(zip_uint64_t budget);
+    ~BufferCache();
+
+    /**
+     * Take buffer of node from cache. Caller becomes an owner of buffer.
+     * @return buffer or NULL if node buffer is not cached
+     */
+    BigBuffer *take(const FileNode *node);
+
+    /**
+     * Check if buffer of node is cached
+     */
+    bool contains(const FileNode *node);
+
+    /**
+     * Put buffer into cache. Buffer is deleted immediately if it does not
+     * fit into cache.
+     */
+    void put(const FileNode *node, BigBuffer *buffer);
+
+    /**
+     * Delete cached buffer of node (if any)
+     */
+    void remove(const FileNode *node);
+
+    /**
+     * Delete all cached buffers
+     */
+    void clear();
+
+    inline zip_uint64_t used() const {
+        return m_used;
+    }
+
+    inline unsigned long long hits() const {
+        return m_hits;
+    }
+
+    inline unsigned long long misses() const {
+        return m_misses;
+    }
+};
+
+#endif
@@ -0,0 +1,157 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <syslog.h>
+
+#include "bigBuffer.h"
+#include "decompressPool.h"
+#include "mutexLock.h"
+
+DecompressPool::DecompressPool(unsigned int threads): m_stop(false) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_queued, NULL);
+    pthread_cond_init(&m_done, NULL);
+    try {
+        m_workers.reserve(threads);
+        for (unsigned int i = 0; i < threads; ++i) {
+            Worker *w = new Worker;
+            w->pool = this;
+            w->current = NULL;
+            w->cancelled = false;
+            if (pthread_create(&w->id, NULL, run, w) != 0) {
+                delete w;
+                break;
+            }
+            m_workers.push_back(w);
+        }
+    }
+    catch (...) {
+        stopWorkers();
+        throw;
+    }
+    if (m_workers.empty()) {
+        stopWorkers();
+        throw std::runtime_error("unable to start decompression threads");
+    }
+    if (m_workers.size() < threads) {
+        syslog(LOG_WARNING, "only %u of %u decompression threads are started",
+                (unsigned int)m_workers.size(), threads);
+    }
+}
+
+DecompressPool::~DecompressPool() {
+    stopWorkers();
+}
+
+void DecompressPool::stopWorkers() {
+    {
+        MutexLock lock(&m_mutex);
+        m_stop = true;
+        pthread_cond_broadcast(&m_queued);
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        pthread_join(m_workers[i]->id, NULL);
+        delete m_workers[i];
+    }
+    m_workers.clear();
+    pthread_cond_destroy(&m_done);
+    pthread_cond_destroy(&m_queued);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void *DecompressPool::run(void *worker) {
+    Worker *w = (Worker *)worker;
+    DecompressPool *pool = w->pool;
+    while (pool->next(w)) {
+        // buffer is not destroyed while it is current for worker
+        bool more;
+        do {
+            more = w->current->loadNext();
+        } while (pool->proceed(w, more));
+    }
+    return NULL;
+}
+
+bool DecompressPool::next(Worker *w) {
+    MutexLock lock(&m_mutex);
+    while (m_queue.empty() && !m_stop) {
+        pthread_cond_wait(&m_queued, &m_mutex);
+    }
+    if (m_stop) {
+        return false;
+    }
+    w->current = m_queue.front();
+    m_queue.pop_front();
+    return true;
+}
+
+bool DecompressPool::proceed(Worker *w, bool more) {
+    MutexLock lock(&m_mutex);
+    if (more && !w->cancelled && !m_stop) {
+        return true;
+    }
+    w->current = NULL;
+    w->cancelled = false;
+    pthread_cond_broadcast(&m_done);
+    return false;
+}
+
+void DecompressPool::schedule(BigBuffer *buffer) {
+    MutexLock lock(&m_mutex);
+    if (std::find(m_queue.begin(), m_queue.end(), buffer) != m_queue.end()) {
+        return;
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        if (m_workers[i]->current == buffer) {
+            return;
+        }
+    }
+    try {
+        m_queue.push_back(buffer);
+    }
+    catch (const std::bad_alloc &) {
+        // data is decompressed on demand then
+        return;
+    }
+    pthread_cond_signal(&m_queued);
+}
+
+void DecompressPool::cancel(BigBuffer *buffer) {
+    MutexLock lock(&m_mutex);
+    m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), buffer),
+            m_queue.end());
+    for (;;) {
+        Worker *busy = NULL;
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            if (m_workers[i]->current == buffer) {
+                busy = m_workers[i];
+            }
+        }
+        if (busy == NULL) {
+            break;
+        }
+        busy->cancelled = true;
+        pthread_cond_wait(&m_done, &m_mutex);
+    }
+}
@@ -0,0 +1,122 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef DECOMPRESS_POOL_H
+#define DECOMPRESS_POOL_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+class BigBuffer;
+
+/**
+ * Worker threads that decompress data of opened files in background, so
+ * that reads find data already available instead of inflating it.
+ *
+ * Buffer is loaded in chunks (see BigBuffer::loadNext) and buffer lock is
+ * released between them, so reader waits for one chunk at most and then
+ * decompresses data it needs by itself if worker has not reached it yet.
+ */
+class DecompressPool {
+private:
+    // must not be defined
+    DecompressPool (const DecompressPool &);
+    DecompressPool &operator= (const DecompressPool &);
+
+    struct Worker {
+        pthread_t id;
+        DecompressPool *pool;
+        /**
+         * Buffer being loaded or NULL
+         */
+        BigBuffer *current;
+        /**
+         * Stop loading of 'current' after the chunk being loaded
+         */
+        bool cancelled;
+    };
+
+    std::vector<Worker *> m_workers;
+    std::deque<BigBuffer *> m_queue;
+    /**
+     * Protects m_queue, m_stop and state of workers
+     */
+    pthread_mutex_t m_mutex;
+    /**
+     * Signalled when buffer is queued or pool is stopped
+     */
+    pthread_cond_t m_queued;
+    /**
+     * Signalled when worker stops loading of buffer
+     */
+    pthread_cond_t m_done;
+    bool m_stop;
+
+    static void *run(void *worker);
+
+    /**
+     * Wait for buffer in queue and make it current for worker 'w'.
+     * @return false if pool is stopped
+     */
+    bool next(Worker *w);
+
+    /**
+     * Check if 'w' should continue loading of current buffer. Buffer is
+     * released by worker if not.
+     */
+    bool proceed(Worker *w, bool more);
+
+    void stopWorkers();
+
+public:
+    /**
+     * Start 'threads' worker threads.
+     *
+     * @throws
+     *      std::runtime_error  If no thread can be started
+     *      std::bad_alloc      On memory insufficiency
+     */
+    explicit DecompressPool(unsigned int threads);
+    ~DecompressPool();
+
+    /**
+     * Queue 'buffer' to be loaded in background. Nothing is done if it is
+     * already queued or being loaded.
+     */
+    void schedule(BigBuffer *buffer);
+
+    /**
+     * Remove 'buffer' from queue and wait until worker that loads it (if
+     * any) stops. Must be called before buffer is destroyed.
+     */
+    void cancel(BigBuffer *buffer);
+
+    /**
+     * Return number of worker threads
+     */
+    inline size_t size() const {
+        return m_workers.size();
+    }
+};
+
+#endif
@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FILE_HANDLE_H
+#define FILE_HANDLE_H
+
+#include "bigBuffer.h"
+#include "fileNode.h"
+
+/**
+ * File opened by FUSE (kept in fuse_file_info::fh). Several handles can
+ * refer to the same node, and each of them tracks access pattern of its
+ * reader. Handle must be deleted before node is closed.
+ */
+struct FileHandle {
+    FileNode *node;
+    /**
+     * Reads through this handle (see BigBuffer::read)
+     */
+    BigBuffer::Cursor cursor;
+
+    explicit FileHandle(FileNode *n): node(n) {
+    }
+
+    ~FileHandle() {
+        // buffer is alive while node is opened
+        if (cursor.buffer != NULL) {
+            cursor.buffer->detach(cursor);
+        }
+    }
+};
+
+#endif
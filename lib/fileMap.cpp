@@ -0,0 +1,151 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+
+#include "fileMap.h"
+#include "fileNode.h"
+
+static const size_t minCapacity = 16;
+
+FileMap::FileMap(): m_slots(NULL), m_capacity(0), m_size(0) {
+}
+
+FileMap::~FileMap() {
+    delete [] m_slots;
+}
+
+size_t FileMap::hash(const FileNode *parent, const char *name, size_t len) {
+    // FNV-1a over name seeded by parent address
+    unsigned long long h = 14695981039346656037ULL
+        ^ (unsigned long long)(size_t)parent;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return size_t(h ^ (h >> 32));
+}
+
+FileMap::Slot *FileMap::lookup(const FileNode *parent, const char *name,
+        size_t len, size_t h) const {
+    size_t mask = m_capacity - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        Slot *s = m_slots + i;
+        if (s->node == NULL) {
+            return s;
+        }
+        if (s->hash == h && s->node->parent == parent
+                && strncmp(s->node->name, name, len) == 0
+                && s->node->name[len] == '\0') {
+            return s;
+        }
+    }
+}
+
+void FileMap::rehash(size_t capacity) {
+    Slot *slots = new Slot[capacity];
+    memset(slots, 0, capacity * sizeof(Slot));
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < m_capacity; ++i) {
+        const Slot &s = m_slots[i];
+        if (s.node == NULL) {
+            continue;
+        }
+        size_t j = s.hash & mask;
+        while (slots[j].node != NULL) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = s;
+    }
+    delete [] m_slots;
+    m_slots = slots;
+    m_capacity = capacity;
+}
+
+FileNode *FileMap::find(const FileNode *parent, const char *name,
+        size_t len) const {
+    if (m_size == 0) {
+        return NULL;
+    }
+    return lookup(parent, name, len, hash(parent, name, len))->node;
+}
+
+bool FileMap::insert(FileNode *node) {
+    reserve(m_size + 1);
+    size_t len = strlen(node->name);
+    size_t h = hash(node->parent, node->name, len);
+    Slot *s = lookup(node->parent, node->name, len, h);
+    if (s->node != NULL) {
+        return false;
+    }
+    s->hash = h;
+    s->node = node;
+    ++m_size;
+    return true;
+}
+
+bool FileMap::erase(const FileNode *node) {
+    if (m_size == 0) {
+        return false;
+    }
+    size_t len = strlen(node->name);
+    Slot *s = lookup(node->parent, node->name, len,
+            hash(node->parent, node->name, len));
+    if (s->node != node) {
+        return false;
+    }
+    // shift following slots of the same cluster backward instead of
+    // leaving tombstone
+    size_t mask = m_capacity - 1;
+    size_t i = s - m_slots;
+    for (size_t j = (i + 1) & mask; m_slots[j].node != NULL;
+            j = (j + 1) & mask) {
+        size_t home = m_slots[j].hash & mask;
+        // move slot j to hole i if its home position is not in (i, j]
+        bool move = (i <= j) ? (home <= i || home > j)
+            : (home <= i && home > j);
+        if (move) {
+            m_slots[i] = m_slots[j];
+            i = j;
+        }
+    }
+    m_slots[i].node = NULL;
+    --m_size;
+    return true;
+}
+
+void FileMap::reserve(size_t n) {
+    size_t capacity = m_capacity > 0 ? m_capacity : minCapacity;
+    // load factor is kept under 3/4
+    while (n * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+    if (capacity != m_capacity) {
+        rehash(capacity);
+    }
+}
+
+void FileMap::clear() {
+    delete [] m_slots;
+    m_slots = NULL;
+    m_capacity = 0;
+    m_size = 0;
+}
@@ -0,0 +1,160 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <cstddef>
+
+class FileNode;
+
+/**
+ * Index of file tree nodes by parent node and name of path component.
+ *
+ * Open-addressing hash table with linear probing. Path is looked up by
+ * walking its components from root, so names are never compared as whole
+ * paths and descendants of renamed directory keep their keys. Each slot
+ * keeps hash of its key, so node fields are compared only if hashes are
+ * equal, and table is grown without rehashing of names.
+ *
+ * Key of node is taken from its 'parent' and 'name' fields that must not
+ * be changed while node is in map.
+ */
+class FileMap {
+private:
+    // must not be defined
+    FileMap (const FileMap &);
+    FileMap &operator= (const FileMap &);
+
+    struct Slot {
+        size_t hash;
+        // NULL for empty slot
+        FileNode *node;
+    };
+
+    Slot *m_slots;
+    // number of slots (power of 2 or 0)
+    size_t m_capacity;
+    size_t m_size;
+
+    static size_t hash(const FileNode *parent, const char *name,
+            size_t len);
+
+    /**
+     * Return slot of key or empty slot where key should be inserted
+     */
+    Slot *lookup(const FileNode *parent, const char *name, size_t len,
+            size_t h) const;
+
+    /**
+     * Move nodes into table of 'capacity' slots
+     * @throws std::bad_alloc
+     */
+    void rehash(size_t capacity);
+
+public:
+    /**
+     * Iterator over nodes in unspecified order
+     */
+    class const_iterator {
+    private:
+        const Slot *m_pos, *m_end;
+
+        void skipEmpty() {
+            while (m_pos != m_end && m_pos->node == NULL) {
+                ++m_pos;
+            }
+        }
+
+    public:
+        const_iterator(const Slot *pos, const Slot *end):
+            m_pos(pos), m_end(end) {
+            skipEmpty();
+        }
+
+        FileNode *operator* () const {
+            return m_pos->node;
+        }
+
+        const_iterator &operator++ () {
+            ++m_pos;
+            skipEmpty();
+            return *this;
+        }
+
+        bool operator== (const const_iterator &that) const {
+            return m_pos == that.m_pos;
+        }
+
+        bool operator!= (const const_iterator &that) const {
+            return m_pos != that.m_pos;
+        }
+    };
+
+    FileMap();
+    ~FileMap();
+
+    /**
+     * Find child of 'parent' with name of 'len' characters
+     * @return node or NULL if not found
+     */
+    FileNode *find(const FileNode *parent, const char *name,
+            size_t len) const;
+
+    /**
+     * Add node
+     * @return false if map already contains node with the same parent and
+     * name
+     * @throws std::bad_alloc
+     */
+    bool insert(FileNode *node);
+
+    /**
+     * Remove node
+     * @return false if node is not found
+     */
+    bool erase(const FileNode *node);
+
+    /**
+     * Prepare map to contain 'n' nodes without growing
+     * @throws std::bad_alloc
+     */
+    void reserve(size_t n);
+
+    /**
+     * Remove all nodes. Nodes are not deleted.
+     */
+    void clear();
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    inline const_iterator begin() const {
+        return const_iterator(m_slots, m_slots + m_capacity);
+    }
+
+    inline const_iterator end() const {
+        return const_iterator(m_slots + m_capacity, m_slots + m_capacity);
+    }
+};
+
+#endif
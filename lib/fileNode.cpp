@@ -30,25 +30,61 @@
 #include <stdexcept>
 #include <syslog.h>
 #include <cassert>
+#include <fcntl.h>
 
 #include "fileNode.h"
 #include "extraField.h"
+#include "mutexLock.h"
 
 const zip_int64_t FileNode::ROOT_NODE_INDEX = -1;
 const zip_int64_t FileNode::NEW_NODE_INDEX = -2;
+pthread_mutex_t *FileNode::s_zipLock = NULL;
+Readahead *FileNode::s_readahead = NULL;
 
-FileNode::FileNode(struct zip *zip, const char *fname, zip_int64_t _id) {
+FileNode::FileNode(struct zip *zip, zip_int64_t _id) {
     this->zip = zip;
+    m_index = NULL;
+    m_archive = NULL;
+    m_cache = NULL;
+    open_count = 0;
     metadataChanged = false;
-    full_name = fname;
+    m_localMetadataPending = false;
+    m_childsLoaded = true;
+    m_childIndex = 0;
+    name = "";
+    parent = NULL;
     id = _id;
     m_uid = 0;
     m_gid = 0;
 }
 
-FileNode *FileNode::createFile (struct zip *zip, const char *fname, 
-        uid_t owner, gid_t group, mode_t mode) {
-    FileNode *n = new FileNode(zip, fname, NEW_NODE_INDEX);
+void FileNode::setZipLock(pthread_mutex_t *lock) {
+    s_zipLock = lock;
+}
+
+void FileNode::setReadahead(Readahead *readahead) {
+    s_readahead = readahead;
+}
+
+void *FileNode::operator new(size_t size, NodeArena &arena) {
+    (void)size;
+    return arena.allocate();
+}
+
+void FileNode::operator delete(void *p, NodeArena &arena) {
+    arena.release(p);
+}
+
+void FileNode::destroy(NodeArena &arena, FileNode *node) {
+    if (node != NULL) {
+        node->~FileNode();
+        arena.release(node);
+    }
+}
+
+FileNode *FileNode::createFile (NodeArena &arena, struct zip *zip,
+        const char *fname, uid_t owner, gid_t group, mode_t mode) {
+    FileNode *n = new (arena) FileNode(zip, NEW_NODE_INDEX);
     if (n == NULL) {
         return NULL;
     }
@@ -56,13 +92,13 @@ FileNode *FileNode::createFile (struct zip *zip, const char *fname,
     n->is_dir = false;
     n->buffer = new BigBuffer();
     if (!n->buffer) {
-        delete n;
+        destroy(arena, n);
         return NULL;
     }
     n->has_cretime = true;
     n->m_mtime = n->m_atime = n->m_ctime = n->cretime = time(NULL);
 
-    n->parse_name();
+    n->parse_name(arena, fname);
     n->m_mode = mode;
     n->m_uid = owner;
     n->m_gid = group;
@@ -70,8 +106,9 @@ FileNode *FileNode::createFile (struct zip *zip, const char *fname,
     return n;
 }
 
-FileNode *FileNode::createSymlink(struct zip *zip, const char *fname) {
-    FileNode *n = new FileNode(zip, fname, NEW_NODE_INDEX);
+FileNode *FileNode::createSymlink(NodeArena &arena, struct zip *zip,
+        const char *fname) {
+    FileNode *n = new (arena) FileNode(zip, NEW_NODE_INDEX);
     if (n == NULL) {
         return NULL;
     }
@@ -79,13 +116,13 @@ FileNode *FileNode::createSymlink(struct zip *zip, const char *fname) {
     n->is_dir = false;
     n->buffer = new BigBuffer();
     if (!n->buffer) {
-        delete n;
+        destroy(arena, n);
         return NULL;
     }
     n->has_cretime = true;
     n->m_mtime = n->m_atime = n->m_ctime = n->cretime = time(NULL);
 
-    n->parse_name();
+    n->parse_name(arena, fname);
     n->m_mode = S_IFLNK | 0777;
 
     return n;
@@ -94,9 +131,9 @@ FileNode *FileNode::createSymlink(struct zip *zip, const char *fname) {
 /**
  * Create intermediate directory to build full tree
  */
-FileNode *FileNode::createIntermediateDir(struct zip *zip,
-        const char *fname) {
-    FileNode *n = new FileNode(zip, fname, NEW_NODE_INDEX);
+FileNode *FileNode::createIntermediateDir(NodeArena &arena,
+        struct zip *zip, const char *fname) {
+    FileNode *n = new (arena) FileNode(zip, NEW_NODE_INDEX);
     if (n == NULL) {
         return NULL;
     }
@@ -107,14 +144,15 @@ FileNode *FileNode::createIntermediateDir(struct zip *zip,
     n->m_size = 0;
     n->m_mode = S_IFDIR | 0775;
 
-    n->parse_name();
+    n->parse_name(arena, fname);
 
     return n;
 }
 
-FileNode *FileNode::createDir(struct zip *zip, const char *fname,
-        zip_int64_t id, uid_t owner, gid_t group, mode_t mode) {
-    FileNode *n = createNodeForZipEntry(zip, fname, id);
+FileNode *FileNode::createDir(NodeArena &arena, struct zip *zip,
+        const char *fname, zip_int64_t id, uid_t owner, gid_t group,
+        mode_t mode) {
+    FileNode *n = createNodeForZipEntry(arena, zip, fname, id, false);
     if (n == NULL) {
         return NULL;
     }
@@ -129,8 +167,8 @@ FileNode *FileNode::createDir(struct zip *zip, const char *fname,
     return n;
 }
 
-FileNode *FileNode::createRootNode() {
-    FileNode *n = new FileNode(NULL, "", ROOT_NODE_INDEX);
+FileNode *FileNode::createRootNode(NodeArena &arena) {
+    FileNode *n = new (arena) FileNode(NULL, ROOT_NODE_INDEX);
     if (n == NULL) {
         return NULL;
     }
@@ -139,14 +177,14 @@ FileNode *FileNode::createRootNode() {
     n->m_mtime = n->m_atime = n->m_ctime = n->cretime = time(NULL);
     n->has_cretime = true;
     n->m_size = 0;
-    n->name = n->full_name.c_str();
     n->m_mode = S_IFDIR | 0775;
     return n;
 }
 
-FileNode *FileNode::createNodeForZipEntry(struct zip *zip,
-        const char *fname, zip_int64_t id) {
-    FileNode *n = new FileNode(zip, fname, id);
+FileNode *FileNode::createNodeForZipEntry(NodeArena &arena,
+        struct zip *zip, const char *fname, zip_int64_t id,
+        bool centralOnly) {
+    FileNode *n = new (arena) FileNode(zip, id);
     if (n == NULL) {
         return NULL;
     }
@@ -166,10 +204,39 @@ FileNode *FileNode::createNodeForZipEntry(struct zip *zip,
     n->has_cretime = false;
     n->m_size = stat.size;
 
-    n->parse_name();
+    n->parse_name(arena, fname);
 
     n->processExternalAttributes();
-    n->processExtraFields();
+    if (centralOnly) {
+        // local header is read later if central directory is not enough
+        n->m_localMetadataPending = !n->processExtraFields(ZIP_FL_CENTRAL);
+    } else {
+        n->processExtraFields(ZIP_FL_LOCAL);
+    }
+    return n;
+}
+
+FileNode *FileNode::createNodeForCentralEntry(NodeArena &arena,
+        struct zip *zip, const char *fname, zip_int64_t id,
+        const ArchiveFile::Entry &entry, ArchiveFile::TimeCache &timeCache) {
+    FileNode *n = new (arena) FileNode(zip, id);
+    if (n == NULL) {
+        return NULL;
+    }
+    n->is_dir = false;
+    n->open_count = 0;
+    n->state = CLOSED;
+
+    n->m_mtime = n->m_atime = n->m_ctime = ArchiveFile::dosTime(
+            entry.dosTime, entry.dosDate, timeCache);
+    n->has_cretime = false;
+    n->m_size = entry.size;
+
+    n->parse_name(arena, fname);
+
+    n->setExternalAttributes(entry.opsys, entry.attributes);
+    n->m_localMetadataPending = !n->processExtraFields(entry.extra,
+            entry.extraLen);
     return n;
 }
 
@@ -177,35 +244,51 @@ FileNode::~FileNode() {
     if (state == OPENED || state == CHANGED || state == NEW) {
         delete buffer;
     }
+    if (m_cache != NULL) {
+        m_cache->remove(this);
+    }
+    if (s_readahead != NULL) {
+        s_readahead->remove(this);
+    }
+    delete m_index;
 }
 
-/**
- * Get short name of a file. If last char is '/' then node is a directory
- */
-void FileNode::parse_name() {
-    assert(!full_name.empty());
+void FileNode::parse_name(NodeArena &arena, const char *fname) {
+    assert(fname[0] != '\0');
 
-    const char *lsl = full_name.c_str();
-    while (*lsl++) {}
-    lsl--;
-    while (lsl > full_name.c_str() && *lsl != '/') {
-        lsl--;
-    }
+    const char *end = fname + strlen(fname);
     // If the last symbol in file name is '/' then it is a directory
-    if (*lsl == '/' && *(lsl+1) == '\0') {
-        // It will produce two \0s at the end of file name. I think that
-        // it is not a problem
-        full_name[full_name.size() - 1] = 0;
+    if (end[-1] == '/') {
         this->is_dir = true;
-        while (lsl > full_name.c_str() && *lsl != '/') {
-            lsl--;
-        }
+        --end;
+    }
+    const char *start = end;
+    while (start > fname && start[-1] != '/') {
+        --start;
+    }
+    this->name = arena.intern(start, end - start);
+}
+
+std::string FileNode::fullName() const {
+    size_t len = 0;
+    for (const FileNode *n = this; n->parent != NULL; n = n->parent) {
+        len += strlen(n->name) + 1;
+    }
+    if (len == 0) {
+        return "";
     }
-    // Setting short name of node
-    if (*lsl == '/') {
-        lsl++;
+    // components are copied from the end, separators are already in place
+    std::string res(len - 1, '/');
+    size_t pos = res.size();
+    for (const FileNode *n = this; n->parent != NULL; n = n->parent) {
+        size_t l = strlen(n->name);
+        pos -= l;
+        res.replace(pos, l, n->name, l);
+        if (pos > 0) {
+            --pos;
+        }
     }
-    this->name = lsl;
+    return res;
 }
 
 void FileNode::appendChild (FileNode *child) {
@@ -213,30 +296,77 @@ void FileNode::appendChild (FileNode *child) {
 }
 
 void FileNode::detachChild (FileNode *child) {
-    childs.remove (child);
+    childs.erase(child);
 }
 
-void FileNode::rename(const char *new_name) {
-    full_name = new_name;
-    parse_name();
+void FileNode::rename(NodeArena &arena, const char *new_name) {
+    parse_name(arena, new_name);
 }
 
-int FileNode::open() {
-    if (state == NEW) {
+BigBuffer *FileNode::createBuffer() {
+    if (m_archive != NULL) {
+        // data of uncompressed files is read from archive directly
+        MutexLock lock(s_zipLock);
+        struct zip_stat stat;
+        if (zip_stat_index(zip, id, 0, &stat) == 0
+                && (stat.valid & ZIP_STAT_COMP_METHOD)
+                && (stat.valid & ZIP_STAT_ENCRYPTION_METHOD)
+                && stat.comp_method == ZIP_CM_STORE
+                && stat.encryption_method == ZIP_EM_NONE) {
+            zip_int64_t dataOffset = m_archive->dataOffset(id);
+            if (dataOffset >= 0) {
+                return new BigBuffer(m_archive->fd(), dataOffset, m_size);
+            }
+        }
+    }
+    return new BigBuffer(zip, id, m_size, m_index);
+}
+
+int FileNode::open(int flags) {
+    if (open_count == INT_MAX) {
+        return -EMFILE;
+    }
+    if (state == CLOSED && (flags & O_TRUNC)) {
+        // old data is not needed, so archive is not touched at all
+        try {
+            buffer = new BigBuffer();
+        }
+        catch (const std::bad_alloc &) {
+            return -ENOMEM;
+        }
+        if (m_cache != NULL) {
+            m_cache->remove(this);
+        }
+        if (s_readahead != NULL) {
+            s_readahead->remove(this);
+        }
+        loadLocalMetadata();
+        state = CHANGED;
+        m_mtime = time(NULL);
+        metadataChanged = true;
+        ++open_count;
         return 0;
     }
-    if (state == OPENED) {
-        if (open_count == INT_MAX) {
-            return -EMFILE;
-        } else {
-            ++open_count;
+    if ((flags & O_TRUNC) && buffer->len > 0) {
+        int res = truncate(0);
+        if (res != 0) {
+            return -res;
         }
     }
     if (state == CLOSED) {
-        open_count = 1;
         try {
             assert (zip != NULL);
-            buffer = new BigBuffer(zip, id, m_size);
+            buffer = NULL;
+            if (m_cache != NULL) {
+                buffer = m_cache->take(this);
+            }
+            if (buffer == NULL && s_readahead != NULL) {
+                buffer = s_readahead->take(this);
+            }
+            if (buffer == NULL) {
+                buffer = createBuffer();
+            }
+            buffer->loadInBackground();
             state = OPENED;
         }
         catch (std::bad_alloc) {
@@ -246,27 +376,57 @@ int FileNode::open() {
             return -EIO;
         }
     }
+    ++open_count;
     return 0;
 }
 
-int FileNode::read(char *buf, size_t sz, zip_uint64_t offset) {
-    m_atime = time(NULL);
-    return buffer->read(buf, sz, offset);
+int FileNode::read(char *buf, size_t sz, zip_uint64_t offset,
+        BigBuffer::Cursor *cursor) {
+    try {
+        return buffer->read(buf, sz, offset, cursor);
+    }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+    catch (const std::exception &) {
+        return -EIO;
+    }
+}
+
+bool FileNode::dataLocation(size_t &sz, zip_uint64_t offset, int &fd,
+        zip_uint64_t &pos) {
+    return buffer->dataLocation(sz, offset, fd, pos);
 }
 
 int FileNode::write(const char *buf, size_t sz, zip_uint64_t offset) {
+    loadLocalMetadata();
     if (state == OPENED) {
         state = CHANGED;
     }
     m_mtime = time(NULL);
     metadataChanged = true;
-    return buffer->write(buf, sz, offset);
+    try {
+        return buffer->write(buf, sz, offset);
+    }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+    catch (const std::exception &) {
+        return -EIO;
+    }
 }
 
 int FileNode::close() {
+    assert(open_count > 0);
     m_size = buffer->len;
-    if (state == OPENED && --open_count == 0) {
-        delete buffer;
+    if (--open_count == 0 && state == OPENED) {
+        // closed file is not read, so its data is not needed anymore
+        buffer->stopBackgroundLoad();
+        if (m_cache != NULL) {
+            m_cache->put(this, buffer);
+        } else {
+            delete buffer;
+        }
         state = CLOSED;
     }
     return 0;
@@ -276,7 +436,8 @@ int FileNode::save() {
     assert (!is_dir);
     // index is modified if state == NEW
     assert (zip != NULL);
-    return buffer->saveToZip(m_mtime, zip, full_name.c_str(),
+    std::string fname = fullName();
+    return buffer->saveToZip(m_mtime, zip, fname.c_str(),
             state == NEW, id);
 }
 
@@ -287,9 +448,12 @@ int FileNode::saveMetadata() const {
 
 int FileNode::truncate(zip_uint64_t offset) {
     if (state != CLOSED) {
+        loadLocalMetadata();
         if (state != NEW) {
             state = CHANGED;
         }
+        m_mtime = time(NULL);
+        metadataChanged = true;
         try {
             buffer->truncate(offset);
             return 0;
@@ -297,8 +461,9 @@ int FileNode::truncate(zip_uint64_t offset) {
         catch (const std::bad_alloc &) {
             return EIO;
         }
-        m_mtime = time(NULL);
-        metadataChanged = true;
+        catch (const std::exception &) {
+            return EIO;
+        }
     } else {
         return EBADF;
     }
@@ -321,6 +486,10 @@ void FileNode::processExternalAttributes () {
     assert(id >= 0);
     assert (zip != NULL);
     zip_file_get_external_attributes(zip, id, 0, &opsys, &attr);
+    setExternalAttributes(opsys, attr);
+}
+
+void FileNode::setExternalAttributes (zip_uint8_t opsys, zip_uint32_t attr) {
     switch (opsys) {
         case ZIP_OPSYS_UNIX: {
             m_mode = attr >> 16;
@@ -369,67 +538,111 @@ void FileNode::processExternalAttributes () {
  * Get timestamp information from extra fields.
  * Get owner and group information.
  */
-void FileNode::processExtraFields () {
+bool FileNode::processExtraFields (zip_flags_t location) {
     zip_int16_t count;
     // times from timestamp have precedence
     bool mtimeFromTimestamp = false, atimeFromTimestamp = false;
     // UIDs and GIDs from UNIX extra fields with bigger type IDs have
     // precedence
     int lastProcessedUnixField = 0;
+    bool hasTimestamp = false;
 
     assert (id >= 0);
     assert (zip != NULL);
-    count = zip_file_extra_fields_count (zip, id, ZIP_FL_LOCAL);
+    count = zip_file_extra_fields_count (zip, id, location);
     for (zip_int16_t i = 0; i < count; ++i) {
-        bool has_mtime, has_atime, has_cretime;
-        time_t mt, at, cret;
         zip_uint16_t type, len;
         const zip_uint8_t *field = zip_file_extra_field_get (zip,
-                id, i, &type, &len, ZIP_FL_LOCAL);
-
-        switch (type) {
-            case FZ_EF_TIMESTAMP: {
-                if (ExtraField::parseExtTimeStamp (len, field, has_mtime, mt,
-                            has_atime, at, has_cretime, cret)) {
-                    if (has_mtime) {
-                        m_mtime = mt;
-                        mtimeFromTimestamp = true;
-                    }
-                    if (has_atime) {
-                        m_atime = at;
-                        atimeFromTimestamp = true;
-                    }
-                    if (has_cretime) {
-                        cretime = cret;
-                        this->has_cretime = true;
-                    }
+                id, i, &type, &len, location);
+        if (processExtraField(type, len, field, mtimeFromTimestamp,
+                    atimeFromTimestamp, lastProcessedUnixField)) {
+            hasTimestamp = true;
+        }
+    }
+    return hasTimestamp && lastProcessedUnixField != 0;
+}
+
+bool FileNode::processExtraFields (const zip_uint8_t *data,
+        zip_uint16_t len) {
+    bool mtimeFromTimestamp = false, atimeFromTimestamp = false;
+    int lastProcessedUnixField = 0;
+    bool hasTimestamp = false;
+
+    const zip_uint8_t *end = data + len;
+    while (end - data >= 4) {
+        zip_uint16_t type = data[0] | (data[1] << 8);
+        zip_uint16_t fieldLen = data[2] | (data[3] << 8);
+        data += 4;
+        if (end - data < fieldLen) {
+            break;
+        }
+        if (processExtraField(type, fieldLen, data, mtimeFromTimestamp,
+                    atimeFromTimestamp, lastProcessedUnixField)) {
+            hasTimestamp = true;
+        }
+        data += fieldLen;
+    }
+    return hasTimestamp && lastProcessedUnixField != 0;
+}
+
+bool FileNode::processExtraField (zip_uint16_t type, zip_uint16_t len,
+        const zip_uint8_t *field, bool &mtimeFromTimestamp,
+        bool &atimeFromTimestamp, int &lastProcessedUnixField) {
+    bool has_mtime, has_atime, has_cretime;
+    time_t mt, at, cret;
+    switch (type) {
+        case FZ_EF_TIMESTAMP: {
+            if (ExtraField::parseExtTimeStamp (len, field, has_mtime, mt,
+                        has_atime, at, has_cretime, cret)) {
+                if (has_mtime) {
+                    m_mtime = mt;
+                    mtimeFromTimestamp = true;
+                }
+                if (has_atime) {
+                    m_atime = at;
+                    atimeFromTimestamp = true;
                 }
-                break;
+                if (has_cretime) {
+                    cretime = cret;
+                    this->has_cretime = true;
+                }
+                return true;
             }
-            case FZ_EF_PKWARE_UNIX:
-            case FZ_EF_INFOZIP_UNIX1:
-            case FZ_EF_INFOZIP_UNIX2:
-            case FZ_EF_INFOZIP_UNIXN: {
-                uid_t uid;
-                gid_t gid;
-                if (ExtraField::parseSimpleUnixField (type, len, field,
-                            uid, gid, has_mtime, mt, has_atime, at)) {
-                    if (type >= lastProcessedUnixField) {
-                        m_uid = uid;
-                        m_gid = gid;
-                        lastProcessedUnixField = type;
-                    }
-                    if (has_mtime && !mtimeFromTimestamp) {
-                        m_mtime = mt;
-                    }
-                    if (has_atime && !atimeFromTimestamp) {
-                        m_atime = at;
-                    }
+            break;
+        }
+        case FZ_EF_PKWARE_UNIX:
+        case FZ_EF_INFOZIP_UNIX1:
+        case FZ_EF_INFOZIP_UNIX2:
+        case FZ_EF_INFOZIP_UNIXN: {
+            uid_t uid;
+            gid_t gid;
+            if (ExtraField::parseSimpleUnixField (type, len, field,
+                        uid, gid, has_mtime, mt, has_atime, at)) {
+                if (type >= lastProcessedUnixField) {
+                    m_uid = uid;
+                    m_gid = gid;
+                    lastProcessedUnixField = type;
+                }
+                if (has_mtime && !mtimeFromTimestamp) {
+                    m_mtime = mt;
+                }
+                if (has_atime && !atimeFromTimestamp) {
+                    m_atime = at;
                 }
-                break;
             }
+            break;
         }
     }
+    return false;
+}
+
+void FileNode::loadLocalMetadata() {
+    MutexLock lock(s_zipLock);
+    if (!m_localMetadataPending) {
+        return;
+    }
+    m_localMetadataPending = false;
+    processExtraFields(ZIP_FL_LOCAL);
 }
 
 /**
@@ -483,17 +696,20 @@ int FileNode::updateExtraFields () const {
 }
 
 void FileNode::chmod (mode_t mode) {
+    loadLocalMetadata();
     m_mode = (m_mode & S_IFMT) | mode;
     m_ctime = time(NULL);
     metadataChanged = true;
 }
 
 void FileNode::setUid (uid_t uid) {
+    loadLocalMetadata();
     m_uid = uid;
     metadataChanged = true;
 }
 
 void FileNode::setGid (gid_t gid) {
+    loadLocalMetadata();
     m_gid = gid;
     metadataChanged = true;
 }
@@ -528,12 +744,14 @@ int FileNode::updateExternalAttributes() const {
 }
 
 void FileNode::setTimes (time_t atime, time_t mtime) {
+    loadLocalMetadata();
     m_atime = atime;
     m_mtime = mtime;
     metadataChanged = true;
 }
 
 void FileNode::setCTime (time_t ctime) {
+    loadLocalMetadata();
     m_ctime = ctime;
     metadataChanged = true;
 }
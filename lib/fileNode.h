@@ -22,15 +22,24 @@
 #ifndef FILE_NODE_H
 #define FILE_NODE_H
 
+#include <pthread.h>
 #include <string>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "types.h"
 #include "bigBuffer.h"
+#include "inflateIndex.h"
+#include "archiveFile.h"
+#include "bufferCache.h"
+#include "nodeArena.h"
+#include "readahead.h"
 
 class FileNode {
 friend class FuseZipData;
+friend class NodeList;
+friend class FrozenIndex;
 private:
     // must not be defined
     FileNode (const FileNode &);
@@ -45,54 +54,183 @@ private:
     };
 
     BigBuffer *buffer;
+    /**
+     * Access point index for random access into file data. NULL if not
+     * used.
+     */
+    InflateIndex *m_index;
+    /**
+     * Archive file to read uncompressed file data directly from. NULL if
+     * not available. Owned by FuseZipData.
+     */
+    ArchiveFile *m_archive;
+    /**
+     * Cache to keep buffer after file is closed. NULL if not used. Owned
+     * by FuseZipData.
+     */
+    BufferCache *m_cache;
     struct zip *zip;
+    /**
+     * Number of open() calls without close()
+     */
     int open_count;
     nodeState state;
 
     zip_uint64_t m_size;
     bool has_cretime, metadataChanged;
+    /**
+     * Metadata is read from central directory only and local header
+     * should be read to get missing timestamps and owner info
+     */
+    bool m_localMetadataPending;
+    /**
+     * All children of directory are present in 'childs' list (false for
+     * directories of lazy file tree until they are listed)
+     */
+    bool m_childsLoaded;
+    /**
+     * Position in parent's 'childs' list
+     */
+    size_t m_childIndex;
     mode_t m_mode;
     time_t m_mtime, m_atime, m_ctime, cretime;
     uid_t m_uid;
     gid_t m_gid;
 
-    void parse_name();
-    void processExtraFields();
+    /**
+     * Set short name of node to interned last component of 'fname'. If
+     * the last character is '/' then node is a directory.
+     * @throws std::bad_alloc
+     */
+    void parse_name(NodeArena &arena, const char *fname);
+    /**
+     * Read timestamps and owner info from extra fields.
+     *
+     * @param location  ZIP_FL_LOCAL or ZIP_FL_CENTRAL
+     * @return true if both timestamp and UNIX owner fields are found
+     */
+    bool processExtraFields(zip_flags_t location);
+    /**
+     * Read timestamps and owner info from raw extra fields block (see
+     * processExtraFields(zip_flags_t)).
+     */
+    bool processExtraFields(const zip_uint8_t *data, zip_uint16_t len);
+    /**
+     * Process one extra field. Flags and last UNIX field type are used to
+     * resolve conflicts between fields.
+     *
+     * @return true if field is a valid timestamp field
+     */
+    bool processExtraField(zip_uint16_t type, zip_uint16_t len,
+            const zip_uint8_t *field, bool &mtimeFromTimestamp,
+            bool &atimeFromTimestamp, int &lastProcessedUnixField);
     void processExternalAttributes();
+    /**
+     * Set file mode from external attributes.
+     *
+     * @param opsys     Host system that created archive entry
+     * @param attr      External attributes
+     */
+    void setExternalAttributes(zip_uint8_t opsys, zip_uint32_t attr);
     int updateExtraFields() const;
     int updateExternalAttributes() const;
 
+    /**
+     * Create buffer for file data in archive
+     * @throws
+     *      std::exception  On file open error
+     *      std::bad_alloc  On memory insufficiency
+     */
+    BigBuffer *createBuffer();
+
     static const zip_int64_t ROOT_NODE_INDEX, NEW_NODE_INDEX;
-    FileNode(struct zip *zip, const char *fname, zip_int64_t id);
+    FileNode(struct zip *zip, zip_int64_t id);
+
+    /**
+     * Mutex to lock around libzip calls on archive handle or NULL (see
+     * setZipLock)
+     */
+    static pthread_mutex_t *s_zipLock;
+    /**
+     * Area of buffers decompressed before files are opened or NULL (see
+     * setReadahead)
+     */
+    static Readahead *s_readahead;
+
+    /**
+     * Nodes are allocated from arena only and deleted by destroy()
+     */
+    static void *operator new(size_t size, NodeArena &arena);
+    static void operator delete(void *p, NodeArena &arena);
+    // must not be defined
+    static void operator delete(void *p);
 
 protected:
-    static FileNode *createIntermediateDir(struct zip *zip, const char *fname);
+    static FileNode *createIntermediateDir(NodeArena &arena, struct zip *zip,
+            const char *fname);
 
 public:
     /**
-     * Create new regular file
+     * Serialize libzip calls that nodes make on archive handle while file
+     * system is accessed from several threads by 'lock' (NULL to not lock).
+     */
+    static void setZipLock(pthread_mutex_t *lock);
+
+    /**
+     * Take buffers of opened files from 'readahead' if they are prefetched
+     * (NULL to not use readahead). Nodes are removed from it on deletion.
+     */
+    static void setReadahead(Readahead *readahead);
+
+    /**
+     * Create new regular file. Node is allocated from 'arena' and its
+     * short name is taken from the last component of 'fname'. Node is not
+     * attached to parent.
      */
-    static FileNode *createFile(struct zip *zip, const char *fname,
-            uid_t owner, gid_t group, mode_t mode);
+    static FileNode *createFile(NodeArena &arena, struct zip *zip,
+            const char *fname, uid_t owner, gid_t group, mode_t mode);
     /**
      * Create new symbolic link
      */
-    static FileNode *createSymlink(struct zip *zip, const char *fname);
+    static FileNode *createSymlink(NodeArena &arena, struct zip *zip,
+            const char *fname);
     /**
      * Create new directory for ZIP file entry
      */
-    static FileNode *createDir(struct zip *zip, const char *fname,
-            zip_int64_t id, uid_t owner, gid_t group, mode_t mode);
+    static FileNode *createDir(NodeArena &arena, struct zip *zip,
+            const char *fname, zip_int64_t id, uid_t owner, gid_t group,
+            mode_t mode);
     /**
      * Create root pseudo-node for file system
      */
-    static FileNode *createRootNode();
+    static FileNode *createRootNode(NodeArena &arena);
     /**
      * Create node for existing ZIP file entry
+     *
+     * @param centralOnly   Read metadata from central directory only.
+     *                      If it is incomplete, local header is read by
+     *                      loadLocalMetadata().
+     */
+    static FileNode *createNodeForZipEntry(NodeArena &arena,
+            struct zip *zip, const char *fname, zip_int64_t id,
+            bool centralOnly);
+    /**
+     * Create node for existing ZIP file entry from mapped central
+     * directory record without libzip calls. Local header is read by
+     * loadLocalMetadata() if central directory record is not enough.
+     * Nodes can be created concurrently by different threads if each of
+     * them uses its own 'arena' and 'timeCache'.
      */
-    static FileNode *createNodeForZipEntry(struct zip *zip,
-            const char *fname, zip_int64_t id);
+    static FileNode *createNodeForCentralEntry(NodeArena &arena,
+            struct zip *zip, const char *fname, zip_int64_t id,
+            const ArchiveFile::Entry &entry,
+            ArchiveFile::TimeCache &timeCache);
     ~FileNode();
+
+    /**
+     * Delete node allocated from 'arena'
+     */
+    static void destroy(NodeArena &arena, FileNode *node);
     
     /**
      * add child node to list
@@ -105,13 +243,46 @@ public:
     void detachChild (FileNode *child);
 
     /**
-     * Rename file without reparenting
+     * Rename file without reparenting. Short name is taken from the last
+     * component of 'new_name'.
+     * @throws std::bad_alloc
+     */
+    void rename (NodeArena &arena, const char *new_name);
+
+    /**
+     * Open file. Buffer with file data is created when file is opened
+     * first time.
+     *
+     * @param flags     Open flags. If O_TRUNC is set, file content is
+     *                  discarded without reading it from archive.
+     * @return 0 or negative error code
+     */
+    int open(int flags);
+
+    /**
+     * Read file data (see BigBuffer::read). Node should be opened.
+     * Access time is not changed (see accessed()).
+     *
+     * @param cursor    (INOUT) access pattern of file handle or NULL
+     * @return number of bytes read or negative error code
      */
-    void rename (const char *new_name);
+    int read(char *buf, size_t size, zip_uint64_t offset,
+            BigBuffer::Cursor *cursor = NULL);
 
-    int open();
-    int read(char *buf, size_t size, zip_uint64_t offset);
+    /**
+     * Get location of unmodified file data in archive file (see
+     * BigBuffer::dataLocation). Node should be opened. Access time is
+     * not changed (see accessed()).
+     *
+     * @return true if data can be read from 'fd' at 'pos'
+     */
+    bool dataLocation(size_t &size, zip_uint64_t offset, int &fd,
+            zip_uint64_t &pos);
     int write(const char *buf, size_t size, zip_uint64_t offset);
+    /**
+     * Close file opened by open(). Buffer of unchanged file is released
+     * when file is closed last time.
+     */
     int close();
 
     /**
@@ -147,6 +318,16 @@ public:
         return metadataChanged;
     }
 
+    /**
+     * Read metadata from local header if it was not read on node creation.
+     * Called before metadata is changed to not overwrite new values later.
+     */
+    void loadLocalMetadata();
+
+    inline bool isLocalMetadataPending() const {
+        return m_localMetadataPending;
+    }
+
     inline bool isTemporaryDir() const {
         return (state == NEW_DIR) && (id == NEW_NODE_INDEX);
     }
@@ -164,6 +345,15 @@ public:
      */
     void setTimes (time_t atime, time_t mtime);
 
+    /**
+     * Set atime to current time after file data is read. read() and
+     * dataLocation() are called without node lock, so atime is updated
+     * separately under it.
+     */
+    inline void accessed () {
+        m_atime = time(NULL);
+    }
+
     void setCTime (time_t ctime);
 
     inline time_t atime() const {
@@ -177,16 +367,11 @@ public:
     }
 
     /**
-     * Get parent name
+     * Build full name of node from names of its parents (without
+     * trailing slash for directories, "" for root)
+     * @throws std::bad_alloc
      */
-    //TODO: rewrite without memory allocation
-    inline std::string getParentName () const {
-        if (name > full_name.c_str()) {
-            return std::string (full_name, 0, name - full_name.c_str() - 1);
-        } else {
-            return "";
-        }
-    }
+    std::string fullName () const;
 
     /**
      * owner and group
@@ -202,8 +387,10 @@ public:
 
     zip_uint64_t size() const;
 
+    /**
+     * Short name interned in arena
+     */
     const char *name;
-    std::string full_name;
     bool is_dir;
     zip_int64_t id;
     nodelist_t childs;
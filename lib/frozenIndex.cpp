@@ -0,0 +1,132 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <string>
+
+#include "frozenIndex.h"
+#include "fileNode.h"
+
+const size_t FrozenIndex::npos = (size_t)-1;
+
+FrozenIndex::FrozenIndex(const FileNode *root) {
+    m_nodes.push_back(const_cast<FileNode *>(root));
+    Entry e;
+    e.path = 0;
+    e.pathLen = 0;
+    e.name = 0;
+    e.parent = npos;
+    m_entries.push_back(e);
+    m_paths.push_back('\0');
+    // children of each directory are appended after all entries of
+    // previous directories
+    std::string path;
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        const FileNode *node = m_nodes[i];
+        m_entries[i].firstChild = m_nodes.size();
+        path.assign(&m_paths[m_entries[i].path], m_entries[i].pathLen);
+        if (i > 0) {
+            path.push_back('/');
+        }
+        for (nodelist_t::const_iterator j = node->childs.begin();
+                j != node->childs.end(); ++j) {
+            e.path = m_paths.size();
+            e.name = path.size();
+            e.pathLen = path.size() + strlen((*j)->name);
+            e.parent = i;
+            m_paths.insert(m_paths.end(), path.begin(), path.end());
+            m_paths.insert(m_paths.end(), (*j)->name,
+                    (*j)->name + strlen((*j)->name) + 1);
+            m_entries.push_back(e);
+            m_nodes.push_back(*j);
+        }
+        m_entries[i].childsEnd = m_nodes.size();
+    }
+
+    m_attrs.resize(m_nodes.size());
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        update(i);
+    }
+
+    // load factor is kept under 1/2
+    size_t capacity = 16;
+    while (capacity < 2 * m_entries.size()) {
+        capacity *= 2;
+    }
+    Slot empty = {0, npos};
+    m_slots.assign(capacity, empty);
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        size_t h = hash(&m_paths[m_entries[i].path], m_entries[i].pathLen);
+        size_t j = h & mask;
+        while (m_slots[j].entry != npos) {
+            j = (j + 1) & mask;
+        }
+        m_slots[j].hash = h;
+        m_slots[j].entry = i;
+    }
+}
+
+size_t FrozenIndex::hash(const char *path, size_t len) {
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return size_t(h ^ (h >> 32));
+}
+
+size_t FrozenIndex::find(const char *fname) const {
+    size_t len = strlen(fname);
+    // FUSE subdir module appends '/' to the end of new root path
+    while (len > 0 && fname[len - 1] == '/') {
+        --len;
+    }
+    size_t h = hash(fname, len);
+    size_t mask = m_slots.size() - 1;
+    for (size_t j = h & mask; m_slots[j].entry != npos; j = (j + 1) & mask) {
+        const Slot &s = m_slots[j];
+        const Entry &e = m_entries[s.entry];
+        if (s.hash == h && e.pathLen == len
+                && memcmp(&m_paths[e.path], fname, len) == 0) {
+            return s.entry;
+        }
+    }
+    return npos;
+}
+
+void FrozenIndex::update(size_t i) {
+    const FileNode *node = m_nodes[i];
+    Attr &a = m_attrs[i];
+    a.size = node->size();
+    a.id = node->id;
+    a.mtime = node->mtime();
+    a.atime = node->atime();
+    a.ctime = node->ctime();
+    a.mode = node->mode();
+    a.uid = node->uid();
+    a.gid = node->gid();
+    a.nlink = node->is_dir ? 2 + node->childs.size() : 1;
+    a.live = node->isLocalMetadataPending()
+        || (node->state != FileNode::CLOSED
+                && node->state != FileNode::NEW_DIR);
+}
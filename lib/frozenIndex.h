@@ -0,0 +1,146 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef FROZEN_INDEX_H
+#define FROZEN_INDEX_H
+
+#include <cstddef>
+#include <vector>
+#include <sys/types.h>
+#include <zip.h>
+
+class FileNode;
+
+/**
+ * Read-only copy of file tree in flat arrays for archives mounted
+ * read-only.
+ *
+ * Entries are numbered in breadth-first order, so children of each
+ * directory are a contiguous range of entries. Full paths of entries are
+ * kept in one buffer and looked up via open-addressing hash table.
+ * Metadata used by getattr is packed in separate array to be read
+ * without touching nodes.
+ *
+ * Metadata of entry is taken from node while its local header is not read
+ * or file is opened ('live' flag), and copied again by update().
+ */
+class FrozenIndex {
+public:
+    static const size_t npos;
+
+    /**
+     * Hot metadata of entry
+     */
+    struct Attr {
+        zip_uint64_t size;
+        zip_int64_t id;
+        time_t mtime, atime, ctime;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        zip_uint32_t nlink;
+        // metadata must be taken from node
+        bool live;
+    };
+
+private:
+    // must not be defined
+    FrozenIndex (const FrozenIndex &);
+    FrozenIndex &operator= (const FrozenIndex &);
+
+    struct Entry {
+        // offset of full path in m_paths
+        size_t path;
+        // range of children
+        size_t firstChild, childsEnd;
+        size_t parent;
+        zip_uint32_t pathLen;
+        // offset of short name in full path
+        zip_uint32_t name;
+    };
+
+    struct Slot {
+        size_t hash;
+        // npos for empty slot
+        size_t entry;
+    };
+
+    std::vector<Entry> m_entries;
+    std::vector<FileNode *> m_nodes;
+    std::vector<Attr> m_attrs;
+    // full paths separated by '\0'
+    std::vector<char> m_paths;
+    std::vector<Slot> m_slots;
+
+    static size_t hash(const char *path, size_t len);
+
+public:
+    /**
+     * Copy tree with root 'root'. Tree must not be changed while index
+     * exists.
+     * @throws std::bad_alloc
+     */
+    explicit FrozenIndex(const FileNode *root);
+
+    /**
+     * Find entry by path relative to root. Trailing slashes are ignored.
+     * @return entry number or npos
+     */
+    size_t find(const char *fname) const;
+
+    /**
+     * Copy metadata of entry 'i' from its node
+     */
+    void update(size_t i);
+
+    inline size_t size() const {
+        return m_entries.size();
+    }
+
+    inline const Attr &attr(size_t i) const {
+        return m_attrs[i];
+    }
+
+    inline FileNode *node(size_t i) const {
+        return m_nodes[i];
+    }
+
+    inline const char *name(size_t i) const {
+        return &m_paths[m_entries[i].path + m_entries[i].name];
+    }
+
+    /**
+     * Return parent entry of entry 'i' or npos for root
+     */
+    inline size_t parent(size_t i) const {
+        return m_entries[i].parent;
+    }
+
+    inline size_t firstChild(size_t i) const {
+        return m_entries[i].firstChild;
+    }
+
+    inline size_t childsEnd(size_t i) const {
+        return m_entries[i].childsEnd;
+    }
+};
+
+#endif
@@ -31,22 +31,25 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
+#include <fcntl.h>
 
 #include <cerrno>
 #include <cstring>
 #include <cstdlib>
-#include <queue>
+#include <new>
 
 #include "fuse-zip.h"
 #include "types.h"
+#include "fileHandle.h"
 #include "fileNode.h"
 #include "fuseZipData.h"
+#include "mutexLock.h"
 
 using namespace std;
 
 //TODO: Move printf-s out this function
 FuseZipData *initFuseZip(const char *program, const char *fileName,
-        bool readonly) {
+        bool readonly, const FuseZipOptions &options) {
     FuseZipData *data = NULL;
     int err;
     struct zip *zip_file;
@@ -69,13 +72,16 @@ FuseZipData *initFuseZip(const char *program, const char *fileName,
             return data;
         }
 
-        data = new FuseZipData(fileName, zip_file, cwd);
+        data = new FuseZipData(fileName, zip_file, cwd, options);
         free(cwd);
         if (data == NULL) {
             throw std::bad_alloc();
         }
         try {
-            data->build_tree(readonly);
+            if (!data->loadIndexCache(readonly)) {
+                data->build_tree(readonly);
+                data->saveIndexCache(readonly);
+            }
         }
         catch (...) {
             delete data;
@@ -96,7 +102,14 @@ FuseZipData *initFuseZip(const char *program, const char *fileName,
 }
 
 void *fusezip_init(struct fuse_conn_info *conn) {
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+    // pass O_TRUNC to open() to not read file data that is discarded
+    if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC) {
+        conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+    }
+#else
     (void) conn;
+#endif
     FuseZipData *data = (FuseZipData*)fuse_get_context()->private_data;
     syslog(LOG_INFO, "Mounting file system on %s (cwd=%s)", data->m_archiveName, data->m_cwd.c_str());
     return data;
@@ -117,8 +130,88 @@ void fusezip_destroy(void *data) {
     syslog(LOG_INFO, "File system unmounted");
 }
 
-FileNode *get_file_node(const char *fname) {
-    return get_data()->find (fname);
+FileNode *get_file_node(FuseZipData::TreeLock &tree, const char *fname) {
+    return get_data()->lazyLookup (tree, fname);
+}
+
+/**
+ * Read local headers of node and its siblings if metadata of node is not
+ * complete yet. Caller must hold tree lock but not node locks.
+ */
+static void load_local_metadata(FileNode *node) {
+    bool pending;
+    {
+        MutexLock lock(get_data()->nodeLock(node));
+        pending = node->isLocalMetadataPending();
+    }
+    if (pending) {
+        get_data()->loadLocalMetadata(node);
+    }
+}
+
+/**
+ * Copy metadata of file that is opened or closed into frozen index of
+ * read-only archive. Caller must hold node lock.
+ */
+static void update_frozen(const char *fname) {
+    FrozenIndex *frozen = get_data()->frozen();
+    if (frozen == NULL) {
+        return;
+    }
+    size_t i = frozen->find(fname);
+    if (i != FrozenIndex::npos) {
+        frozen->update(i);
+    }
+}
+
+/**
+ * getattr for read-only archive. Metadata is taken from packed array of
+ * frozen index if it is not changed since index was built. Attributes of
+ * entry are protected by lock of its node.
+ */
+static int frozen_getattr(FrozenIndex *frozen, const char *fname,
+        struct stat *stbuf) {
+    size_t i = frozen->find(fname);
+    if (i == FrozenIndex::npos) {
+        return -ENOENT;
+    }
+    FuseZipData *data = get_data();
+    FileNode *node = frozen->node(i);
+    bool live;
+    {
+        MutexLock lock(data->nodeLock(node));
+        live = frozen->attr(i).live;
+    }
+    if (live) {
+        load_local_metadata(node);
+        // local headers of siblings are read too
+        size_t parent = frozen->parent(i);
+        size_t first = (parent == FrozenIndex::npos) ? i :
+            frozen->firstChild(parent);
+        size_t end = (parent == FrozenIndex::npos) ? i + 1 :
+            frozen->childsEnd(parent);
+        for (size_t j = first; j < end; ++j) {
+            MutexLock lock(data->nodeLock(frozen->node(j)));
+            if (frozen->attr(j).live) {
+                frozen->update(j);
+            }
+        }
+    }
+    MutexLock lock(data->nodeLock(node));
+    const FrozenIndex::Attr &attr = frozen->attr(i);
+    stbuf->st_nlink = attr.nlink;
+    stbuf->st_mode = attr.mode;
+    stbuf->st_blksize = STANDARD_BLOCK_SIZE;
+    stbuf->st_ino = attr.id;
+    stbuf->st_blocks = (attr.size + STANDARD_BLOCK_SIZE - 1) / STANDARD_BLOCK_SIZE;
+    stbuf->st_size = attr.size;
+    stbuf->st_atime = attr.atime;
+    stbuf->st_mtime = attr.mtime;
+    stbuf->st_ctime = attr.ctime;
+    stbuf->st_uid = attr.uid;
+    stbuf->st_gid = attr.gid;
+
+    return 0;
 }
 
 int fusezip_getattr(const char *path, struct stat *stbuf) {
@@ -126,12 +219,19 @@ int fusezip_getattr(const char *path, struct stat *stbuf) {
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FrozenIndex *frozen = get_data()->frozen();
+    if (frozen != NULL) {
+        return frozen_getattr(frozen, path + 1, stbuf);
+    }
+    FuseZipData::TreeLock tree(get_data(), false);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
+    load_local_metadata(node);
+    MutexLock lock(get_data()->nodeLock(node));
     if (node->is_dir) {
-        stbuf->st_nlink = 2 + node->childs.size();
+        stbuf->st_nlink = 2 + get_data()->childsCount(node);
     } else {
         stbuf->st_nlink = 1;
     }
@@ -156,10 +256,38 @@ int fusezip_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FrozenIndex *frozen = get_data()->frozen();
+    if (frozen != NULL) {
+        size_t i = frozen->find(path + 1);
+        if (i == FrozenIndex::npos) {
+            return -ENOENT;
+        }
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (size_t j = frozen->firstChild(i); j < frozen->childsEnd(i); ++j) {
+            filler(buf, frozen->name(j), NULL, 0);
+        }
+        return 0;
+    }
+    FuseZipData::TreeLock tree(get_data(), false);
+    FileNode *node = get_file_node(tree, path + 1);
+    if (node != NULL && !get_data()->childsLoaded(node)) {
+        // children are created under exclusive lock
+        tree.exclusive();
+        node = get_file_node(tree, path + 1);
+    }
     if (node == NULL) {
         return -ENOENT;
     }
+    try {
+        get_data()->loadChilds(node);
+    }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+    catch (...) {
+        return -EIO;
+    }
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     for (nodelist_t::const_iterator i = node->childs.begin(); i != node->childs.end(); ++i) {
@@ -187,92 +315,200 @@ int fusezip_statfs(const char *path, struct statvfs *buf) {
     buf->f_ffree = 0;
     buf->f_favail = 0;
 
-    buf->f_files = get_data()->numFiles();
+    {
+        FuseZipData::TreeLock tree(get_data(), false);
+        buf->f_files = get_data()->numFiles();
+    }
     buf->f_namemax = 255;
 
     return 0;
 }
 
 int fusezip_open(const char *path, struct fuse_file_info *fi) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
     if (node->is_dir) {
         return -EISDIR;
     }
-    fi->fh = (uint64_t)node;
-
-    try {
-        return node->open();
-    }
-    catch (std::bad_alloc) {
+    FileHandle *handle = new (std::nothrow) FileHandle(node);
+    if (handle == NULL) {
         return -ENOMEM;
     }
-    catch (std::exception) {
-        return -EIO;
+
+    int res;
+    {
+        MutexLock lock(get_data()->nodeLock(node));
+        try {
+            res = node->open(fi->flags);
+            if (res == 0) {
+                update_frozen(path + 1);
+            }
+        }
+        catch (std::bad_alloc) {
+            res = -ENOMEM;
+        }
+        catch (std::exception) {
+            res = -EIO;
+        }
+    }
+    if (res != 0) {
+        delete handle;
+        return res;
     }
+    fi->fh = (uint64_t)handle;
+    // the next entries are decompressed while this one is read
+    get_data()->readahead(node);
+    return 0;
 }
 
 int fusezip_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -EACCES;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node != NULL) {
         return -EEXIST;
     }
-    node = FileNode::createFile (get_zip(), path + 1,
-            fuse_get_context()->uid, fuse_get_context()->gid, mode);
-    if (node == NULL) {
+    try {
+        node = FileNode::createFile (get_data()->arena(), get_zip(),
+                path + 1, fuse_get_context()->uid, fuse_get_context()->gid,
+                mode);
+        if (node == NULL) {
+            return -ENOMEM;
+        }
+        get_data()->insertNode (node, path + 1);
+    }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+    FileHandle *handle = new (std::nothrow) FileHandle(node);
+    if (handle == NULL) {
         return -ENOMEM;
     }
-    get_data()->insertNode (node);
-    fi->fh = (uint64_t)node;
 
-    return node->open();
+    int res = node->open(fi->flags);
+    if (res != 0) {
+        delete handle;
+        return res;
+    }
+    fi->fh = (uint64_t)handle;
+    return 0;
 }
 
 int fusezip_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    return ((FileNode*)fi->fh)->read(buf, size, offset);
+    // buffer is locked by itself, so files are read in parallel
+    FileHandle *handle = (FileHandle*)fi->fh;
+    int res = handle->node->read(buf, size, offset, &handle->cursor);
+    MutexLock lock(get_data()->nodeLock(handle->node));
+    handle->node->accessed();
+    return res;
 }
 
-int fusezip_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+#if FUSE_VERSION >= 29
+int fusezip_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    return ((FileNode*)fi->fh)->write(buf, size, offset);
+    FileHandle *handle = (FileHandle*)fi->fh;
+    FileNode *node = handle->node;
+    struct fuse_bufvec *bv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    if (bv == NULL) {
+        return -ENOMEM;
+    }
+    memset(bv, 0, sizeof(struct fuse_bufvec));
+    bv->count = 1;
+    int fd;
+    zip_uint64_t pos;
+    if (node->dataLocation(size, offset, fd, pos)) {
+        // let FUSE read (or splice) unmodified data from archive file
+        bv->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bv->buf[0].fd = fd;
+        bv->buf[0].pos = pos;
+        bv->buf[0].size = size;
+    } else {
+        void *mem = malloc(size);
+        if (mem == NULL) {
+            free(bv);
+            return -ENOMEM;
+        }
+        int res = node->read((char *)mem, size, offset,
+                &handle->cursor);
+        if (res < 0) {
+            free(mem);
+            free(bv);
+            return res;
+        }
+        bv->buf[0].mem = mem;
+        bv->buf[0].fd = -1;
+        bv->buf[0].size = res;
+    }
+    {
+        MutexLock lock(get_data()->nodeLock(node));
+        node->accessed();
+    }
+    *bufp = bv;
+    return 0;
 }
+#endif
 
-int fusezip_release (const char *path, struct fuse_file_info *fi) {
+int fusezip_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    return ((FileNode*)fi->fh)->close();
+    FileNode *node = ((FileHandle*)fi->fh)->node;
+    MutexLock lock(get_data()->nodeLock(node));
+    return node->write(buf, size, offset);
+}
+
+int fusezip_release (const char *path, struct fuse_file_info *fi) {
+    FileHandle *handle = (FileHandle*)fi->fh;
+    FileNode *node = handle->node;
+    // reader is detached from buffer before node is closed
+    delete handle;
+    // lazy tree is trimmed under exclusive lock, so nodes are not closed
+    // while it is going on
+    FuseZipData::TreeLock tree(get_data(), false);
+    MutexLock lock(get_data()->nodeLock(node));
+    int res = node->close();
+    if (path != NULL) {
+        update_frozen(path + 1);
+    }
+    // node of file that was unlinked while it was opened
+    get_data()->releaseNode(node);
+    return res;
 }
 
 int fusezip_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    return -((FileNode*)fi->fh)->truncate(offset);
+    FileNode *node = ((FileHandle*)fi->fh)->node;
+    MutexLock lock(get_data()->nodeLock(node));
+    return -node->truncate(offset);
 }
 
 int fusezip_truncate(const char *path, off_t offset) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -EACCES;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
     if (node->is_dir) {
         return -EISDIR;
     }
+    MutexLock lock(get_data()->nodeLock(node));
     int res;
-    if ((res = node->open()) != 0) {
+    // data is not read from archive if it is discarded anyway
+    if ((res = node->open(offset == 0 ? O_TRUNC : 0)) != 0) {
         return res;
     }
     if ((res = node->truncate(offset)) != 0) {
@@ -283,10 +519,11 @@ int fusezip_truncate(const char *path, off_t offset) {
 }
 
 int fusezip_unlink(const char *path) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
@@ -297,10 +534,11 @@ int fusezip_unlink(const char *path) {
 }
 
 int fusezip_rmdir(const char *path) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
@@ -314,34 +552,57 @@ int fusezip_rmdir(const char *path) {
 }
 
 int fusezip_mkdir(const char *path, mode_t mode) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -ENOENT;
     }
-    zip_int64_t idx = zip_dir_add(get_zip(), path + 1, ZIP_FL_ENC_UTF_8);
+    zip_int64_t idx;
+    {
+        MutexLock lock(get_data()->zipLock());
+        idx = zip_dir_add(get_zip(), path + 1, ZIP_FL_ENC_UTF_8);
+    }
+    if (idx < 0) {
+        // name may be still taken by entry of renamed node
+        try {
+            get_data()->applyRenames();
+        }
+        catch (const std::bad_alloc &) {
+            return -ENOMEM;
+        }
+        MutexLock lock(get_data()->zipLock());
+        idx = zip_dir_add(get_zip(), path + 1, ZIP_FL_ENC_UTF_8);
+    }
     if (idx < 0) {
         return -ENOMEM;
     }
-    FileNode *node = FileNode::createDir(get_zip(), path + 1, idx,
-            fuse_get_context()->uid, fuse_get_context()->gid, mode);
-    if (node == NULL) {
+    try {
+        FileNode *node = FileNode::createDir(get_data()->arena(), get_zip(),
+                path + 1, idx, fuse_get_context()->uid,
+                fuse_get_context()->gid, mode);
+        if (node == NULL) {
+            return -ENOMEM;
+        }
+        get_data()->insertNode (node, path + 1);
+    }
+    catch (const std::bad_alloc &) {
         return -ENOMEM;
     }
-    get_data()->insertNode (node);
     return 0;
 }
 
 int fusezip_rename(const char *path, const char *new_path) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
     if (*new_path == '\0') {
         return -EINVAL;
     }
-    FileNode *new_node = get_file_node(new_path + 1);
+    FileNode *new_node = get_file_node(tree, new_path + 1);
     if (new_node != NULL) {
         int res = get_data()->removeNode(new_node);
         if (res !=0) {
@@ -349,71 +610,34 @@ int fusezip_rename(const char *path, const char *new_path) {
         }
     }
 
-    int len = strlen(new_path);
-    int oldLen = strlen(path + 1) + 1;
-    std::string new_name;
-    if (!node->is_dir) {
-        --len;
-        --oldLen;
-    }
-    new_name.reserve(len + ((node->is_dir) ? 1 : 0));
-    new_name.append(new_path + 1);
-    if (node->is_dir) {
-        new_name.push_back('/');
-    }
-
     try {
-        struct zip *z = get_zip();
-        // Renaming directory and its content recursively
+        std::string new_name(new_path + 1);
         if (node->is_dir) {
-            queue<FileNode*> q;
-            q.push(node);
-            while (!q.empty()) {
-                FileNode *n = q.front();
-                q.pop();
-                for (nodelist_t::const_iterator i = n->childs.begin(); i != n->childs.end(); ++i) {
-                    FileNode *nn = *i;
-                    q.push(nn);
-                    char *name = (char*)malloc(len + nn->full_name.size() - oldLen + (nn->is_dir ? 2 : 1));
-                    if (name == NULL) {
-                        //TODO: check that we are have enough memory before entering this loop
-                        return -ENOMEM;
-                    }
-                    strcpy(name, new_name.c_str());
-                    strcpy(name + len, nn->full_name.c_str() + oldLen);
-                    if (nn->is_dir) {
-                        strcat(name, "/");
-                    }
-                    if (nn->id >= 0) {
-                        zip_file_rename(z, nn->id, name, ZIP_FL_ENC_UTF_8);
-                    }
-                    // changing child list may cause loop iterator corruption
-                    get_data()->renameNode (nn, name, false);
-                    
-                    free(name);
-                }
-            }
-        }
-        if (node->id >= 0) {
-            zip_file_rename(z, node->id, new_name.c_str(), ZIP_FL_ENC_UTF_8);
+            new_name.push_back('/');
         }
+        // Archive entries of node and its descendants are renamed on save
         get_data()->renameNode (node, new_name.c_str(), true);
 
         return 0;
     }
+    catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
     catch (...) {
         return -EIO;
     }
 }
 
 int fusezip_utimens(const char *path, const struct timespec tv[2]) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
+    MutexLock lock(get_data()->nodeLock(node));
     node->setTimes (tv[0].tv_sec, tv[1].tv_sec);
     return 0;
 }
@@ -443,25 +667,29 @@ int fusezip_removexattr(const char *, const char *) {
 }
 
 int fusezip_chmod(const char *path, mode_t mode) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
+    MutexLock lock(get_data()->nodeLock(node));
     node->chmod(mode);
     return 0;
 }
 
 int fusezip_chown(const char *path, uid_t uid, gid_t gid) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
+    MutexLock lock(get_data()->nodeLock(node));
     if (uid != (uid_t) -1) {
         node->setUid (uid);
     }
@@ -496,45 +724,57 @@ int fusezip_access(const char *, int) {
 }
 
 int fusezip_readlink(const char *path, char *buf, size_t size) {
+    FuseZipData::TreeLock tree(get_data(), false);
     if (*path == '\0') {
         return -ENOENT;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node == NULL) {
         return -ENOENT;
     }
+    MutexLock lock(get_data()->nodeLock(node));
     if (!S_ISLNK(node->mode())) {
         return -EINVAL;
     }
     int res;
-    if ((res = node->open()) != 0) {
+    if ((res = node->open(0)) != 0) {
         if (res == -EMFILE) {
             res = -ENOMEM;
         }
         return res;
     }
     int count = node->read(buf, size - 1, 0);
-    buf[count] = '\0';
     node->close();
+    if (count < 0) {
+        return count;
+    }
+    buf[count] = '\0';
     return 0;
 }
 
 int fusezip_symlink(const char *dest, const char *path) {
+    FuseZipData::TreeLock tree(get_data(), true);
     if (*path == '\0') {
         return -EACCES;
     }
-    FileNode *node = get_file_node(path + 1);
+    FileNode *node = get_file_node(tree, path + 1);
     if (node != NULL) {
         return -EEXIST;
     }
-    node = FileNode::createSymlink (get_zip(), path + 1);
-    if (node == NULL) {
+    try {
+        node = FileNode::createSymlink (get_data()->arena(), get_zip(),
+                path + 1);
+        if (node == NULL) {
+            return -ENOMEM;
+        }
+        get_data()->insertNode (node, path + 1);
+    }
+    catch (const std::bad_alloc &) {
         return -ENOMEM;
     }
-    get_data()->insertNode (node);
 
     int res;
-    if ((res = node->open()) != 0) {
+    if ((res = node->open(0)) != 0) {
         if (res == -EMFILE) {
             res = -ENOMEM;
         }
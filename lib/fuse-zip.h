@@ -33,10 +33,12 @@ extern "C" {
  *
  * @param program   Program name
  * @param fileName  ZIP file name
+ * @param readonly  Read-only mode flag
+ * @param options   Tuning parameters (see FuseZipOptions)
  * @return NULL if an error occured, otherwise pointer to FuseZipData structure.
  */
 class FuseZipData *initFuseZip(const char *program, const char *fileName,
-        bool readonly);
+        bool readonly, const struct FuseZipOptions &options);
 
 /**
  * Initialize filesystem
@@ -68,6 +70,10 @@ int fusezip_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 
 int fusezip_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
+#if FUSE_VERSION >= 29
+int fusezip_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+#endif
+
 int fusezip_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
 int fusezip_release (const char *path, struct fuse_file_info *fi);
@@ -23,14 +23,70 @@
 #include <syslog.h>
 #include <cerrno>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fuseZipData.h"
+#include "mutexLock.h"
 
-FuseZipData::FuseZipData(const char *archiveName, struct zip *z, const char *cwd): m_zip(z), m_archiveName(archiveName), m_cwd(cwd)  {
+FuseZipData::FuseZipData(const char *archiveName, struct zip *z, const char *cwd,
+        const FuseZipOptions &options):
+    m_arena(sizeof(FileNode)), m_options(options), m_zip(z), m_archiveName(archiveName), m_cwd(cwd) {
+    int fd = open(archiveName, O_RDONLY);
+    m_archive = (fd == -1) ? NULL : new ArchiveFile(fd);
+    m_lazy = NULL;
+    m_trimThreshold = options.lazyNodeLimit;
+    m_frozen = NULL;
+    m_cache = NULL;
+    m_renamesPending = false;
+    m_pool = NULL;
+    m_decompressPool = NULL;
+    m_readahead = NULL;
+    m_threaded = false;
+    pthread_rwlock_init(&m_treeLock, NULL);
+    for (unsigned int i = 0; i < nodeLockCount; ++i) {
+        pthread_mutex_init(&m_nodeLocks[i], NULL);
+    }
+    pthread_mutex_init(&m_zipLock, NULL);
+    if (options.cacheSize > 0) {
+        m_cache = new BufferCache(options.cacheSize);
+    }
+    if (options.spillFileSize > 0 || options.spillTotalSize > 0) {
+        // temporary files are created near archive to not exhaust tmpfs
+        std::string dir = archiveName;
+        std::string::size_type slash = dir.rfind('/');
+        dir = (slash == std::string::npos) ? "." : dir.substr(0, slash + 1);
+        if (dir[0] != '/') {
+            dir = m_cwd + "/" + dir;
+        }
+        BigBuffer::setSpillOptions(dir, options.spillFileSize,
+                options.spillTotalSize);
+    }
+    if (options.mmapBuffers) {
+        BigBuffer::setMmapMode(true);
+    }
 }
 
 FuseZipData::~FuseZipData() {
+    if (m_readahead != NULL) {
+        syslog(LOG_INFO, "readahead: %llu hits, %llu buffers wasted",
+                m_readahead->hits(), m_readahead->wasted());
+        FileNode::setReadahead(NULL);
+        delete m_readahead;
+    }
+    if (m_decompressPool != NULL) {
+        BigBuffer::setDecompressPool(NULL);
+        delete m_decompressPool;
+    }
     if (chdir(m_cwd.c_str()) != 0) {
         syslog(LOG_ERR, "Unable to chdir() to archive directory %s. Trying to save file into /tmp",
                 m_cwd.c_str());
@@ -38,23 +94,167 @@ FuseZipData::~FuseZipData() {
             chdir("/tmp");
         }
     }
+    // cached buffers still own streams of archive entries
+    if (m_cache != NULL) {
+        m_cache->clear();
+    }
     int res = zip_close(m_zip);
     if (res != 0) {
         syslog(LOG_ERR, "Error while closing archive: %s", zip_strerror(m_zip));
     }
-    for (filemap_t::iterator i = files.begin(); i != files.end(); ++i) {
-        delete i->second;
+    // node memory is released by arena at once
+    for (FileMap::const_iterator i = files.begin(); i != files.end(); ++i) {
+        FileNode::destroy(m_arena, *i);
+    }
+    if (m_cache != NULL) {
+        syslog(LOG_INFO, "buffer cache: %llu hits, %llu misses",
+                m_cache->hits(), m_cache->misses());
+        delete m_cache;
+    }
+    delete m_frozen;
+    delete m_lazy;
+    delete m_archive;
+    // streams of buffers are closed before the archive and nodes are gone
+    if (m_threaded) {
+        BigBuffer::setZipPool(NULL);
+        FileNode::setZipLock(NULL);
+    }
+    delete m_pool;
+    pthread_rwlock_destroy(&m_treeLock);
+    for (unsigned int i = 0; i < nodeLockCount; ++i) {
+        pthread_mutex_destroy(&m_nodeLocks[i]);
+    }
+    pthread_mutex_destroy(&m_zipLock);
+}
+
+bool FuseZipData::enableThreads() {
+    assert(!m_threaded);
+    if (zip_get_num_entries(m_zip, ZIP_FL_UNCHANGED) > 0) {
+        unsigned int handles = m_options.zipHandles;
+        if (handles == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            handles = cpus > 0 ? cpus : 1;
+        }
+        // fuse_setup() changes current directory in daemon mode
+        std::string path = m_archiveName;
+        if (path[0] != '/') {
+            path = m_cwd + "/" + path;
+        }
+        try {
+            m_pool = new ZipPool(path.c_str(), handles);
+        }
+        catch (const std::exception &e) {
+            syslog(LOG_WARNING, "unable to open archive handles, "
+                    "using single thread: %s", e.what());
+            return false;
+        }
+        BigBuffer::setZipPool(m_pool);
+        syslog(LOG_INFO, "%u archive handles are opened",
+                (unsigned int)m_pool->size());
+        unsigned int threads = m_options.decompressThreads;
+        if (threads == 0 && m_options.readahead > 0) {
+            // buffers that are read ahead are loaded by workers
+            threads = 1;
+        }
+        if (threads > 0) {
+            try {
+                m_decompressPool = new DecompressPool(threads);
+                BigBuffer::setDecompressPool(m_decompressPool);
+                syslog(LOG_INFO, "%u decompression threads are started",
+                        (unsigned int)m_decompressPool->size());
+            }
+            catch (const std::exception &e) {
+                syslog(LOG_WARNING, "data is decompressed on demand: %s",
+                        e.what());
+            }
+        }
+        // nodes of lazy tree are not known in advance
+        if (m_decompressPool != NULL && m_options.readahead > 0
+                && m_lazy == NULL) {
+            try {
+                m_readahead = new Readahead(m_options.readahead,
+                        readaheadBudget);
+                for (FileMap::const_iterator i = files.begin();
+                        i != files.end(); ++i) {
+                    FileNode *node = *i;
+                    if (node->id >= 0 && !node->is_dir
+                            && !S_ISLNK(node->mode())) {
+                        m_readahead->addNode(node);
+                    }
+                }
+                FileNode::setReadahead(m_readahead);
+            }
+            catch (const std::bad_alloc &) {
+                syslog(LOG_WARNING, "no enough memory to read ahead");
+                delete m_readahead;
+                m_readahead = NULL;
+            }
+        }
     }
+    FileNode::setZipLock(&m_zipLock);
+    m_threaded = true;
+    return true;
 }
 
 void FuseZipData::build_tree(bool readonly) {
-    m_root = FileNode::createRootNode();
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    m_root = FileNode::createRootNode(m_arena);
     if (m_root == NULL) {
         throw std::bad_alloc();
     }
     m_root->parent = NULL;
-    files[m_root->full_name.c_str()] = m_root;
+    files.insert(m_root);
     zip_int64_t n = zip_get_num_entries(m_zip, 0);
+    bool lazy = m_options.lazyTree && readonly;
+    if (m_options.lazyTree && !readonly) {
+        syslog(LOG_WARNING, "lazy file tree is available in read-only mode only");
+    }
+    // central directory is walked without libzip if local headers are not
+    // needed on mount
+    bool native = (m_options.fastMount || lazy) && m_archive != NULL
+        && m_archive->mapCentralDirectory();
+    if (native && m_archive->entriesCount() != zip_uint64_t(n)) {
+        syslog(LOG_WARNING, "number of entries in central directory differs from libzip one");
+        m_archive->unmapCentralDirectory();
+        native = false;
+    }
+    if (lazy && !native) {
+        syslog(LOG_WARNING, "unable to map central directory, building whole file tree");
+        lazy = false;
+    }
+    try {
+        if (lazy) {
+            buildLazyIndex(readonly);
+        } else if (native) {
+            addCentralEntries(readonly);
+        } else {
+            addZipEntries(readonly, n);
+        }
+    }
+    catch (...) {
+        if (native) {
+            m_archive->unmapCentralDirectory();
+        }
+        throw;
+    }
+    if (lazy) {
+        // central directory is kept mapped to create nodes on demand
+        m_root->m_childsLoaded = false;
+    } else if (native) {
+        m_archive->unmapCentralDirectory();
+    }
+    if (readonly && !lazy) {
+        m_frozen = new FrozenIndex(m_root);
+    }
+    gettimeofday(&end, NULL);
+    syslog(LOG_INFO, "%lld entries loaded in %.3f seconds, %llu bytes of "
+            "node memory", (long long)n, (end.tv_sec - start.tv_sec)
+            + (end.tv_usec - start.tv_usec) / 1000000.0,
+            (unsigned long long)m_arena.memoryUsage());
+}
+
+void FuseZipData::addZipEntries(bool readonly, zip_int64_t n) {
     // search for absolute or parent-relative paths
     bool needPrefix = false;
     if (readonly) {
@@ -66,47 +266,698 @@ void FuseZipData::build_tree(bool readonly) {
         }
     }
     // add zip entries into tree
-    for (zip_int64_t i = 0; i < n; ++i) {
-        const char *name = zip_get_name(m_zip, i, ZIP_FL_ENC_RAW);
-        std::string converted;
-        convertFileName(name, readonly, needPrefix, converted);
-        const char *cname = converted.c_str();
-        if (files.find(cname) != files.end()) {
-            syslog(LOG_ERR, "duplicated file name: %s", cname);
+    std::vector<FileNode *> nodes(n, (FileNode *)NULL);
+    std::vector<std::string> names(n);
+    try {
+        for (zip_int64_t i = 0; i < n; ++i) {
+            const char *name = zip_get_name(m_zip, i, ZIP_FL_ENC_RAW);
+            convertFileName(name, readonly, needPrefix, names[i]);
+            nodes[i] = FileNode::createNodeForZipEntry(m_arena, m_zip,
+                    names[i].c_str(), i, m_options.fastMount);
+            if (nodes[i] == NULL) {
+                throw std::bad_alloc();
+            }
+            initNode(nodes[i]);
+        }
+        attachNodes(nodes, names);
+    }
+    catch (...) {
+        for (zip_int64_t i = 0; i < n; ++i) {
+            FileNode::destroy(m_arena, nodes[i]);
+        }
+        throw;
+    }
+}
+
+void FuseZipData::attachNodes(std::vector<FileNode *> &nodes,
+        const std::vector<std::string> &names) {
+    // pairs of path depth and node number
+    std::vector<std::pair<size_t, size_t> > order;
+    order.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const std::string &name = names[i];
+        size_t depth = std::count(name.begin(), name.end(), '/');
+        if (!name.empty() && name[name.size() - 1] == '/') {
+            --depth;
+        }
+        order.push_back(std::make_pair(depth, i));
+    }
+    std::sort(order.begin(), order.end());
+    files.reserve(files.size() + nodes.size());
+    for (size_t j = 0; j < order.size(); ++j) {
+        size_t i = order[j].second;
+        FileNode *node = nodes[i];
+        FileNode *parent = findParent(names[i].c_str(), true);
+        if (files.find(parent, node->name, strlen(node->name)) != NULL) {
+            syslog(LOG_ERR, "duplicated file name: %s", names[i].c_str());
             throw std::runtime_error("duplicate file names");
         }
-        FileNode *node = FileNode::createNodeForZipEntry(m_zip, cname, i);
-        if (node == NULL) {
+        linkNode(parent, node);
+        nodes[i] = NULL;
+    }
+}
+
+void FuseZipData::linkNode(FileNode *parent, FileNode *node) {
+    node->parent = parent;
+    parent->appendChild(node);
+    try {
+        files.insert(node);
+    }
+    catch (...) {
+        parent->detachChild(node);
+        throw;
+    }
+}
+
+/**
+ * Check that central directory entry name is absolute or relative to
+ * parent directory
+ */
+static bool isOutsidePath(const ArchiveFile::Entry &entry) {
+    return (entry.nameLen > 0 && entry.name[0] == '/')
+        || (entry.nameLen >= 3 && strncmp(entry.name, "../", 3) == 0);
+}
+
+/**
+ * Range of central directory entries processed by one thread
+ */
+struct FuseZipData::BuildTask {
+    const FuseZipData *data;
+    const std::vector<zip_uint64_t> *positions;
+    std::vector<FileNode *> *nodes;
+    std::vector<std::string> *names;
+    // arena of nodes created by task
+    NodeArena *arena;
+    zip_uint64_t begin, end;
+    bool readonly, needPrefix;
+    // error description if task failed
+    bool noMemory;
+    std::string error;
+};
+
+void FuseZipData::addCentralEntries(bool readonly) {
+    zip_uint64_t n = m_archive->entriesCount();
+    // find record positions and search for absolute or parent-relative paths
+    std::vector<zip_uint64_t> positions;
+    positions.reserve(n);
+    ArchiveFile::Entry entry;
+    zip_uint64_t pos = 0, offset;
+    bool needPrefix = false;
+    for (zip_uint64_t i = 0; i < n; ++i) {
+        positions.push_back(pos);
+        if (!m_archive->readEntry(pos, entry, offset)) {
+            throw std::runtime_error("broken central directory");
+        }
+        if (readonly && isOutsidePath(entry)) {
+            needPrefix = true;
+        }
+    }
+
+    // create nodes
+    unsigned int threads = buildThreads(n);
+    std::vector<FileNode *> nodes(n, (FileNode *)NULL);
+    std::vector<std::string> names(n);
+    std::vector<BuildTask> tasks(threads);
+    std::vector<pthread_t> ids(threads);
+    std::vector<bool> started(threads, false);
+    // the first range is processed by current thread in main arena
+    std::vector<NodeArena *> arenas(threads, (NodeArena *)NULL);
+    try {
+        for (unsigned int t = 1; t < threads; ++t) {
+            arenas[t] = new NodeArena(sizeof(FileNode));
+        }
+    }
+    catch (...) {
+        for (unsigned int t = 1; t < threads; ++t) {
+            delete arenas[t];
+        }
+        throw;
+    }
+    for (unsigned int t = 0; t < threads; ++t) {
+        BuildTask &task = tasks[t];
+        task.data = this;
+        task.positions = &positions;
+        task.nodes = &nodes;
+        task.names = &names;
+        task.arena = t > 0 ? arenas[t] : &m_arena;
+        task.begin = n * t / threads;
+        task.end = n * (t + 1) / threads;
+        task.readonly = readonly;
+        task.needPrefix = needPrefix;
+        task.noMemory = false;
+    }
+    for (unsigned int t = 1; t < threads; ++t) {
+        started[t] = pthread_create(&ids[t], NULL, buildNodes, &tasks[t]) == 0;
+    }
+    // the first range and ranges of threads that failed to start are
+    // processed by current thread
+    for (unsigned int t = 0; t < threads; ++t) {
+        if (!started[t]) {
+            buildNodes(&tasks[t]);
+        }
+    }
+    for (unsigned int t = 1; t < threads; ++t) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        }
+    }
+    if (threads > 1) {
+        syslog(LOG_INFO, "file tree nodes created by %u threads", threads);
+    }
+
+    for (unsigned int t = 1; t < threads; ++t) {
+        m_arena.merge(*arenas[t]);
+        delete arenas[t];
+    }
+
+    // attach nodes to tree
+    try {
+        for (unsigned int t = 0; t < threads; ++t) {
+            if (tasks[t].noMemory) {
+                throw std::bad_alloc();
+            }
+            if (!tasks[t].error.empty()) {
+                throw std::runtime_error(tasks[t].error);
+            }
+        }
+        attachNodes(nodes, names);
+    }
+    catch (...) {
+        for (zip_uint64_t i = 0; i < n; ++i) {
+            FileNode::destroy(m_arena, nodes[i]);
+        }
+        throw;
+    }
+}
+
+unsigned int FuseZipData::buildThreads(zip_uint64_t n) const {
+    zip_uint64_t threads = n / minEntriesPerThread;
+    zip_uint64_t limit = m_options.treeThreads;
+    if (limit == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        limit = cpus > 0 ? cpus : 1;
+        if (limit > maxBuildThreads) {
+            limit = maxBuildThreads;
+        }
+    }
+    if (threads > limit) {
+        threads = limit;
+    }
+    return threads > 0 ? threads : 1;
+}
+
+void *FuseZipData::buildNodes(void *arg) {
+    BuildTask *task = static_cast<BuildTask *>(arg);
+    const FuseZipData *data = task->data;
+    ArchiveFile::Entry entry;
+    ArchiveFile::TimeCache timeCache;
+    std::string name;
+    try {
+        for (zip_uint64_t i = task->begin; i < task->end; ++i) {
+            // records are checked by caller
+            zip_uint64_t pos = (*task->positions)[i], offset;
+            data->m_archive->readEntry(pos, entry, offset);
+            name.assign(entry.name, entry.nameLen);
+            std::string &converted = (*task->names)[i];
+            convertFileName(name.c_str(), task->readonly, task->needPrefix,
+                    converted);
+            FileNode *node = FileNode::createNodeForCentralEntry(*task->arena,
+                    data->m_zip, converted.c_str(), i, entry, timeCache);
+            if (node == NULL) {
+                throw std::bad_alloc();
+            }
+            (*task->nodes)[i] = node;
+            data->initNode(node);
+        }
+    }
+    catch (const std::bad_alloc &) {
+        task->noMemory = true;
+    }
+    catch (const std::exception &e) {
+        task->error = e.what();
+    }
+    return NULL;
+}
+
+void FuseZipData::initNode(FileNode *node) const {
+    zip_uint64_t interval = m_options.seekIndexInterval;
+    if (interval > 0 && !node->is_dir && node->m_size > interval) {
+        node->m_index = new InflateIndex(interval);
+    }
+    if (!node->is_dir) {
+        node->m_archive = m_archive;
+        node->m_cache = m_cache;
+    }
+}
+
+bool FuseZipData::indexCacheKey(bool readonly, std::string &fileName,
+        IndexCache::Key &key) {
+    // lazy tree is not built at once
+    if (m_options.indexCacheDir.empty() || m_archive == NULL
+            || (m_options.lazyTree && readonly)) {
+        return false;
+    }
+    struct stat st;
+    if (stat(m_archiveName, &st) != 0) {
+        return false;
+    }
+    memset(&key, 0, sizeof(key));
+    if (!m_archive->centralDirectoryChecksum(key.cdSize, key.cdCrc)) {
+        return false;
+    }
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime = st.st_mtime;
+#if ( __APPLE__ )
+    key.mtimeNsec = st.st_mtimespec.tv_nsec;
+#else
+    key.mtimeNsec = st.st_mtim.tv_nsec;
+#endif
+    key.flags = (readonly ? 1 : 0) | (m_options.fastMount ? 2 : 0);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/%llx-%llx.idx",
+            (unsigned long long)key.dev, (unsigned long long)key.ino);
+    fileName = m_options.indexCacheDir + name;
+    return true;
+}
+
+bool FuseZipData::loadIndexCache(bool readonly) {
+    std::string fileName;
+    IndexCache::Key key;
+    if (!indexCacheKey(readonly, fileName, key)) {
+        return false;
+    }
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    IndexCache cache;
+    zip_int64_t n = zip_get_num_entries(m_zip, 0);
+    if (!cache.load(fileName, key) || cache.count() != zip_uint64_t(n)
+            || cache.offsetsCount() != zip_uint64_t(n)) {
+        syslog(LOG_INFO, "index cache %s is not found or stale",
+                fileName.c_str());
+        return false;
+    }
+    std::vector<FileNode *> nodes(n, (FileNode *)NULL);
+    std::vector<std::string> names(n);
+    bool noMemory = false;
+    std::string error;
+    try {
+        m_root = FileNode::createRootNode(m_arena);
+        if (m_root == NULL) {
+            throw std::bad_alloc();
+        }
+        m_root->parent = NULL;
+        files.insert(m_root);
+        for (zip_uint64_t i = 0; i < cache.count(); ++i) {
+            const IndexCache::Record &r = cache.record(i);
+            const char *name = cache.name(r);
+            if (name == NULL || r.nameLen == 0 || r.id < 0 || r.id >= n) {
+                throw std::runtime_error("bad node record");
+            }
+            // name of directory ends with slash
+            names[i].assign(name, r.nameLen);
+            if (strlen(names[i].c_str()) != r.nameLen) {
+                throw std::runtime_error("bad node record");
+            }
+            validateFileName(names[i].c_str());
+            FileNode *node = new (m_arena) FileNode(m_zip, r.id);
+            nodes[i] = node;
+            node->is_dir = false;
+            node->open_count = 0;
+            node->state = FileNode::CLOSED;
+            node->m_size = r.size;
+            node->m_mtime = r.mtime;
+            node->m_atime = r.atime;
+            node->m_ctime = r.ctime;
+            node->cretime = r.cretime;
+            node->has_cretime = r.hasCretime != 0;
+            node->m_mode = r.mode;
+            node->m_uid = r.uid;
+            node->m_gid = r.gid;
+            node->m_localMetadataPending = r.localMetadataPending != 0;
+            node->parse_name(m_arena, names[i].c_str());
+            if (node->is_dir != (r.isDir != 0)) {
+                throw std::runtime_error("bad node record");
+            }
+            initNode(node);
+        }
+        attachNodes(nodes, names);
+    }
+    catch (const std::bad_alloc &) {
+        noMemory = true;
+    }
+    catch (const std::exception &e) {
+        error = e.what();
+    }
+    if (noMemory || !error.empty()) {
+        for (zip_int64_t i = 0; i < n; ++i) {
+            FileNode::destroy(m_arena, nodes[i]);
+        }
+        clearTree();
+        if (noMemory) {
             throw std::bad_alloc();
         }
-        files[node->full_name.c_str()] = node;
+        syslog(LOG_WARNING, "index cache %s is broken: %s",
+                fileName.c_str(), error.c_str());
+        return false;
     }
-    // Connect nodes to tree. Missing intermediate nodes created on demand.
-    for (filemap_t::const_iterator i = files.begin(); i != files.end(); ++i)
-    {
-        FileNode *node = i->second;
-        if (node != m_root) {
-            connectNodeToTree (node);
+    m_archive->setLocalHeaderOffsets(cache.offsets(), cache.offsetsCount());
+    if (readonly) {
+        m_frozen = new FrozenIndex(m_root);
+    }
+    gettimeofday(&end, NULL);
+    syslog(LOG_INFO, "%lld entries loaded from index cache in %.3f seconds",
+            (long long)n, (end.tv_sec - start.tv_sec)
+            + (end.tv_usec - start.tv_usec) / 1000000.0);
+    return true;
+}
+
+void FuseZipData::saveIndexCache(bool readonly) {
+    std::string fileName;
+    IndexCache::Key key;
+    if (!indexCacheKey(readonly, fileName, key)) {
+        return;
+    }
+    std::vector<zip_uint64_t> offsets;
+    if (!m_archive->localHeaderOffsets(offsets)) {
+        return;
+    }
+    try {
+        std::vector<IndexCache::Record> records;
+        std::string names;
+        // intermediate directories are created again on load
+        for (FileMap::const_iterator i = files.begin(); i != files.end();
+                ++i) {
+            const FileNode *node = *i;
+            if (node->id < 0) {
+                continue;
+            }
+            IndexCache::Record r;
+            memset(&r, 0, sizeof(r));
+            r.id = node->id;
+            r.size = node->m_size;
+            r.mtime = node->m_mtime;
+            r.atime = node->m_atime;
+            r.ctime = node->m_ctime;
+            r.cretime = node->cretime;
+            r.nameOffset = names.size();
+            names.append(node->fullName());
+            if (node->is_dir) {
+                names.push_back('/');
+            }
+            r.nameLen = names.size() - r.nameOffset;
+            r.mode = node->m_mode;
+            r.uid = node->m_uid;
+            r.gid = node->m_gid;
+            r.isDir = node->is_dir;
+            r.hasCretime = node->has_cretime;
+            r.localMetadataPending = node->m_localMetadataPending;
+            records.push_back(r);
+        }
+        if (records.size() != offsets.size()) {
+            return;
+        }
+        if (IndexCache::save(fileName, key, records, offsets, names)) {
+            syslog(LOG_INFO, "file tree saved into index cache %s",
+                    fileName.c_str());
+        }
+    }
+    catch (const std::bad_alloc &) {
+        syslog(LOG_WARNING, "no enough memory to save index cache");
+    }
+}
+
+void FuseZipData::clearTree() {
+    for (FileMap::const_iterator i = files.begin(); i != files.end(); ++i) {
+        FileNode::destroy(m_arena, *i);
+    }
+    files.clear();
+    m_root = NULL;
+}
+
+void FuseZipData::buildLazyIndex(bool readonly) {
+    zip_uint64_t n = m_archive->entriesCount();
+    ArchiveFile::Entry entry;
+    zip_uint64_t pos = 0, offset;
+    // search for absolute or parent-relative paths
+    bool needPrefix = false;
+    if (readonly) {
+        for (zip_uint64_t i = 0; i < n; ++i) {
+            if (!m_archive->readEntry(pos, entry, offset)) {
+                throw std::runtime_error("broken central directory");
+            }
+            if (isOutsidePath(entry)) {
+                needPrefix = true;
+            }
         }
     }
+    LazyIndex *index = new LazyIndex();
+    try {
+        std::string name, converted;
+        pos = 0;
+        for (zip_uint64_t i = 0; i < n; ++i) {
+            zip_uint64_t cdPos = pos;
+            if (!m_archive->readEntry(pos, entry, offset)) {
+                throw std::runtime_error("broken central directory");
+            }
+            name.assign(entry.name, entry.nameLen);
+            convertFileName(name.c_str(), readonly, needPrefix, converted);
+            index->add(converted, i, cdPos);
+        }
+        index->sort();
+    }
+    catch (...) {
+        delete index;
+        throw;
+    }
+    m_lazy = index;
+    syslog(LOG_INFO, "lazy file tree index takes %llu bytes",
+            (unsigned long long)m_lazy->memoryUsage());
 }
 
-void FuseZipData::connectNodeToTree (FileNode *node) {
-    FileNode *parent = findParent(node);
+FileNode *FuseZipData::materialize(const char *fname) {
+    // names in lazy index have no trailing slashes
+    size_t len = strlen(fname);
+    while (len > 0 && fname[len - 1] == '/') {
+        --len;
+    }
+    if (len == 0) {
+        return m_root;
+    }
+    zip_uint64_t item = m_lazy->find(fname, len);
+    if (item == LazyIndex::npos && !m_lazy->isDir(fname, len)) {
+        return NULL;
+    }
+    size_t parentLen = len;
+    while (parentLen > 0 && fname[parentLen - 1] != '/') {
+        --parentLen;
+    }
+    std::string parentName(fname, parentLen);
+    FileNode *parent = lookup(parentName.c_str());
     if (parent == NULL) {
-        parent = FileNode::createIntermediateDir (m_zip,
-                node->getParentName().c_str());
-        if (parent == NULL) {
-            throw std::bad_alloc();
+        parent = materialize(parentName.c_str());
+    }
+    if (parent == NULL || !parent->is_dir) {
+        return NULL;
+    }
+    return materializeChild(parent, std::string(fname, len), item);
+}
+
+FileNode *FuseZipData::materializeChild(FileNode *parent,
+        const std::string &fname, zip_uint64_t item) {
+    FileNode *node;
+    if (item == LazyIndex::npos) {
+        node = FileNode::createIntermediateDir(m_arena, m_zip,
+                (fname + "/").c_str());
+    } else {
+        ArchiveFile::Entry entry;
+        zip_uint64_t pos = m_lazy->cdPos(item), offset;
+        if (!m_archive->readEntry(pos, entry, offset)) {
+            throw std::runtime_error("broken central directory");
+        }
+        node = FileNode::createNodeForCentralEntry(m_arena, m_zip,
+                m_lazy->itemIsDir(item) ? (fname + "/").c_str()
+                : fname.c_str(), m_lazy->id(item), entry, m_timeCache);
+        if (node != NULL) {
+            initNode(node);
         }
-        files[parent->full_name.c_str()] = parent;
-        connectNodeToTree (parent);
-    } else if (!parent->is_dir) {
-        throw std::runtime_error ("bad archive structure");
     }
-    // connecting to parent
-    node->parent = parent;
-    parent->appendChild (node);
+    if (node == NULL) {
+        throw std::bad_alloc();
+    }
+    if (node->is_dir) {
+        node->m_childsLoaded = false;
+    }
+    try {
+        linkNode(parent, node);
+    }
+    catch (...) {
+        FileNode::destroy(m_arena, node);
+        throw;
+    }
+    return node;
+}
+
+void FuseZipData::loadChilds(FileNode *node) {
+    if (m_lazy == NULL || node->m_childsLoaded) {
+        return;
+    }
+    trimLazyTree(node);
+    std::string dir = node->fullName();
+    std::vector<LazyIndex::Child> childs;
+    m_lazy->children(dir.data(), dir.size(), childs);
+    std::string name;
+    for (size_t i = 0; i < childs.size(); ++i) {
+        if (files.find(node, childs[i].name, childs[i].nameLen) != NULL) {
+            continue;
+        }
+        name = dir;
+        if (!name.empty()) {
+            name += '/';
+        }
+        name.append(childs[i].name, childs[i].nameLen);
+        materializeChild(node, name, childs[i].item);
+    }
+    node->m_childsLoaded = true;
+}
+
+zip_uint64_t FuseZipData::childsCount(FileNode *node) {
+    if (m_lazy == NULL || node->m_childsLoaded) {
+        return node->childs.size();
+    }
+    std::string dir = node->fullName();
+    return m_lazy->childrenCount(dir.data(), dir.size());
+}
+
+void FuseZipData::trimLazyTree(const FileNode *keep) {
+    if (m_lazy == NULL || files.size() <= m_trimThreshold) {
+        return;
+    }
+    zip_uint64_t target = m_options.lazyNodeLimit - m_options.lazyNodeLimit / 4;
+    // nodes in breadth-first order, so node's children are checked before
+    // node in reverse order
+    std::vector<FileNode *> nodes;
+    nodes.reserve(files.size());
+    nodes.push_back(m_root);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes.insert(nodes.end(), nodes[i]->childs.begin(),
+                nodes[i]->childs.end());
+    }
+    std::set<FileNode *> dropped;
+    for (std::vector<FileNode *>::reverse_iterator i = nodes.rbegin();
+            i != nodes.rend() && files.size() - dropped.size() > target;
+            ++i) {
+        FileNode *node = *i;
+        if (node == m_root || node == keep || (node->state != FileNode::CLOSED
+                    && node->state != FileNode::NEW_DIR)) {
+            continue;
+        }
+        bool used = false;
+        for (nodelist_t::const_iterator j = node->childs.begin();
+                j != node->childs.end() && !used; ++j) {
+            used = dropped.find(*j) == dropped.end();
+        }
+        if (!used) {
+            dropped.insert(node);
+        }
+    }
+    std::set<FileNode *> parents;
+    for (std::set<FileNode *>::const_iterator i = dropped.begin();
+            i != dropped.end(); ++i) {
+        files.erase(*i);
+        if (dropped.find((*i)->parent) == dropped.end()) {
+            parents.insert((*i)->parent);
+        }
+    }
+    for (std::set<FileNode *>::const_iterator i = dropped.begin();
+            i != dropped.end(); ++i) {
+        if (parents.find((*i)->parent) != parents.end()) {
+            (*i)->parent->detachChild(*i);
+        }
+    }
+    for (std::set<FileNode *>::const_iterator i = parents.begin();
+            i != parents.end(); ++i) {
+        (*i)->m_childsLoaded = false;
+    }
+    for (std::set<FileNode *>::const_iterator i = dropped.begin();
+            i != dropped.end(); ++i) {
+        FileNode::destroy(m_arena, *i);
+    }
+    // nodes that are in use are not walked again until their number
+    // grows by one third
+    m_trimThreshold = std::max(m_options.lazyNodeLimit,
+            zip_uint64_t(files.size() + files.size() / 3));
+    syslog(LOG_INFO, "%llu nodes of lazy file tree deleted",
+            (unsigned long long)dropped.size());
+}
+
+void FuseZipData::readahead(const FileNode *node) {
+    if (m_readahead == NULL) {
+        return;
+    }
+    std::vector<FileNode *> next;
+    try {
+        m_readahead->opened(node, next);
+    }
+    catch (const std::bad_alloc &) {
+        return;
+    }
+    for (size_t i = 0; i < next.size(); ++i) {
+        FileNode *n = next[i];
+        // Buffer is published while node is locked, so the node is not
+        // opened with another buffer meanwhile, and it is loaded before
+        // that, so it is not destroyed while it is being scheduled.
+        MutexLock lock(nodeLock(n));
+        // opened, changed and cached files have their buffers already
+        if (n->state != FileNode::CLOSED
+                || (m_cache != NULL && m_cache->contains(n))) {
+            continue;
+        }
+        BigBuffer *buffer;
+        try {
+            buffer = n->createBuffer();
+        }
+        catch (const std::exception &) {
+            // error is reported when file is opened
+            continue;
+        }
+        buffer->loadInBackground();
+        if (!m_readahead->put(n, buffer)) {
+            delete buffer;
+        }
+    }
+}
+
+void FuseZipData::loadLocalMetadata(FileNode *node) {
+    // pairs of archive position and node
+    typedef std::vector<std::pair<zip_int64_t, FileNode *> > batch_t;
+    batch_t batch;
+    {
+        // positions and pending flags are changed under archive lock
+        MutexLock lock(zipLock());
+        if (node->parent == NULL) {
+            batch.push_back(std::make_pair(0, node));
+        } else {
+            for (nodelist_t::const_iterator i = node->parent->childs.begin();
+                    i != node->parent->childs.end(); ++i) {
+                if ((*i)->isLocalMetadataPending()) {
+                    zip_int64_t pos = (*i)->id;
+                    if (m_archive != NULL
+                            && m_archive->position((*i)->id) >= 0) {
+                        pos = m_archive->position((*i)->id);
+                    }
+                    batch.push_back(std::make_pair(pos, *i));
+                }
+            }
+        }
+        std::sort(batch.begin(), batch.end());
+    }
+    for (batch_t::const_iterator i = batch.begin(); i != batch.end(); ++i) {
+        MutexLock lock(nodeLock(i->second));
+        i->second->loadLocalMetadata();
+    }
 }
 
 int FuseZipData::removeNode(FileNode *node) {
@@ -114,17 +965,32 @@ int FuseZipData::removeNode(FileNode *node) {
     assert(node->parent != NULL);
     node->parent->detachChild (node);
     node->parent->setCTime (time(NULL));
-    files.erase(node->full_name.c_str());
+    files.erase(node);
 
     zip_int64_t id = node->id;
-    delete node;
+    {
+        MutexLock lock(nodeLock(node));
+        if (node->open_count > 0) {
+            // handles still point to node, so it is deleted on release
+            node->parent = NULL;
+        } else {
+            FileNode::destroy(m_arena, node);
+        }
+    }
     if (id >= 0) {
+        MutexLock lock(zipLock());
         return (zip_delete (m_zip, id) == 0)? 0 : ENOENT;
     } else {
         return 0;
     }
 }
 
+void FuseZipData::releaseNode(FileNode *node) {
+    if (node != m_root && node->parent == NULL && node->open_count == 0) {
+        FileNode::destroy(m_arena, node);
+    }
+}
+
 void FuseZipData::validateFileName(const char *fname) {
     if (fname[0] == 0) {
         throw std::runtime_error("empty file name");
@@ -194,40 +1060,104 @@ void FuseZipData::convertFileName(const char *fname, bool readonly,
     converted.append(start);
 }
 
-FileNode *FuseZipData::findParent (const FileNode *node) const {
-    std::string name = node->getParentName();
-    return find(name.c_str());
+FileNode *FuseZipData::findParent(const char *fname, bool create) {
+    // parent name is everything before the last component
+    const char *end = fname + strlen(fname);
+    if (end > fname && end[-1] == '/') {
+        --end;
+    }
+    while (end > fname && end[-1] != '/') {
+        --end;
+    }
+    FileNode *node = m_root;
+    for (const char *p = fname; p < end; ) {
+        const char *slash = static_cast<const char *>(
+                memchr(p, '/', end - p));
+        if (slash == p) {
+            ++p;
+            continue;
+        }
+        FileNode *child = files.find(node, p, slash - p);
+        if (child == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            child = FileNode::createIntermediateDir(m_arena, m_zip,
+                    std::string(fname, slash + 1).c_str());
+            if (child == NULL) {
+                throw std::bad_alloc();
+            }
+            try {
+                linkNode(node, child);
+            }
+            catch (...) {
+                FileNode::destroy(m_arena, child);
+                throw;
+            }
+        } else if (!child->is_dir) {
+            if (!create) {
+                return NULL;
+            }
+            throw std::runtime_error ("bad archive structure");
+        }
+        node = child;
+        p = slash + 1;
+    }
+    return node;
+}
+
+FileNode *FuseZipData::lookup(const char *fname) const {
+    FileNode *node = m_root;
+    for (const char *p = fname; *p != '\0' && node != NULL; ) {
+        if (*p == '/') {
+            ++p;
+            continue;
+        }
+        const char *end = p;
+        while (*end != '\0' && *end != '/') {
+            ++end;
+        }
+        node = files.find(node, p, end - p);
+        p = end;
+    }
+    return node;
 }
 
-void FuseZipData::insertNode (FileNode *node) {
-    FileNode *parent = findParent (node);
+void FuseZipData::insertNode (FileNode *node, const char *fname) {
+    FileNode *parent = findParent (fname, false);
     assert (parent != NULL);
-    parent->appendChild (node);
-    node->parent = parent;
+    assert (files.find(parent, node->name, strlen(node->name)) == NULL);
+    linkNode (parent, node);
     parent->setCTime (node->ctime());
-    assert (files.find(node->full_name.c_str()) == files.end());
-    files[node->full_name.c_str()] = node;
 }
 
 void FuseZipData::renameNode (FileNode *node, const char *newName, bool
         reparent) {
     assert(node != NULL);
     assert(newName != NULL);
-    FileNode *parent1 = node->parent, *parent2;
+    FileNode *parent1 = node->parent, *parent2 = parent1;
     assert (parent1 != NULL);
     if (reparent) {
+        parent2 = findParent(newName, false);
+        assert (parent2 != NULL);
         parent1->detachChild (node);
     }
 
-    files.erase(node->full_name.c_str());
-    node->rename(newName);
-    files[node->full_name.c_str()] = node;
+    // descendants keep their keys because they refer to this node
+    files.erase(node);
+    try {
+        node->rename(m_arena, newName);
+    }
+    catch (...) {
+        files.insert(node);
+        throw;
+    }
+    node->parent = parent2;
+    files.insert(node);
+    m_renamesPending = true;
 
     if (reparent) {
-        parent2 = findParent(node);
-        assert (parent2 != NULL);
         parent2->appendChild (node);
-        node->parent = parent2;
     }
 
     if (reparent && parent1 != parent2) {
@@ -237,21 +1167,132 @@ void FuseZipData::renameNode (FileNode *node, const char *newName, bool
     }
 }
 
-FileNode *FuseZipData::find (const char *fname) const {
-    filemap_t::const_iterator i = files.find(fname);
-    if (i == files.end()) {
+FileNode *FuseZipData::find (const char *fname) {
+    if (m_frozen != NULL) {
+        size_t i = m_frozen->find(fname);
+        return i == FrozenIndex::npos ? NULL : m_frozen->node(i);
+    }
+    FileNode *node = lookup(fname);
+    if (node != NULL || m_lazy == NULL) {
+        return node;
+    }
+    try {
+        trimLazyTree(NULL);
+        return materialize(fname);
+    }
+    catch (const std::exception &e) {
+        syslog(LOG_ERR, "unable to create node for %s: %s", fname, e.what());
         return NULL;
-    } else {
-        return i->second;
     }
 }
 
-void FuseZipData::save () {
-    for (filemap_t::const_iterator i = files.begin(); i != files.end(); ++i) {
-        FileNode *node = i->second;
-        if (node == m_root) {
+FileNode *FuseZipData::lazyLookup (TreeLock &tree, const char *fname) {
+    if (m_lazy != NULL && !tree.isExclusive()) {
+        FileNode *node = lookup(fname);
+        if (node != NULL) {
+            return node;
+        }
+        tree.exclusive();
+    }
+    return find(fname);
+}
+
+/**
+ * Archive entry that should be renamed
+ */
+struct EntryRename {
+    zip_int64_t id;
+    std::string name;
+    // entry is moved to temporary name
+    bool moved;
+};
+
+void FuseZipData::applyRenames () {
+    if (!m_renamesPending) {
+        return;
+    }
+    MutexLock lock(zipLock());
+    std::vector<EntryRename> renames;
+    for (FileMap::const_iterator i = files.begin(); i != files.end(); ++i) {
+        const FileNode *node = *i;
+        if (node->id < 0) {
             continue;
         }
+        EntryRename r;
+        r.id = node->id;
+        r.name = node->fullName();
+        if (node->is_dir) {
+            r.name.push_back('/');
+        }
+        r.moved = false;
+        const char *name = zip_get_name(m_zip, node->id, ZIP_FL_ENC_RAW);
+        if (name == NULL || r.name != name) {
+            renames.push_back(r);
+        }
+    }
+    m_renamesPending = false;
+    // Entry can not take name of another entry that is not renamed yet, so
+    // renames are repeated until all names are free. Entries with swapped
+    // names are moved to temporary names first.
+    while (!renames.empty()) {
+        size_t left = 0;
+        for (size_t i = 0; i < renames.size(); ++i) {
+            if (zip_file_rename(m_zip, renames[i].id,
+                        renames[i].name.c_str(), ZIP_FL_ENC_UTF_8) != 0) {
+                renames[left++] = renames[i];
+            }
+        }
+        if (left == renames.size()) {
+            size_t i = 0;
+            while (i < left && renames[i].moved) {
+                ++i;
+            }
+            if (i == left) {
+                for (i = 0; i < left; ++i) {
+                    syslog(LOG_ERR, "Unable to rename %s in ZIP archive: %s",
+                            renames[i].name.c_str(), zip_strerror(m_zip));
+                }
+                left = 0;
+            } else {
+                char suffix[32];
+                sprintf(suffix, ".fuse-zip-rename.%lld",
+                        (long long)renames[i].id);
+                std::string tmp = renames[i].name + suffix;
+                if (zip_file_rename(m_zip, renames[i].id, tmp.c_str(),
+                            ZIP_FL_ENC_UTF_8) == 0) {
+                    renames[i].moved = true;
+                } else {
+                    syslog(LOG_ERR, "Unable to rename %s in ZIP archive: %s",
+                            renames[i].name.c_str(), zip_strerror(m_zip));
+                    renames.erase(renames.begin() + i);
+                    --left;
+                }
+            }
+        }
+        renames.resize(left);
+    }
+}
+
+void FuseZipData::save () {
+    try {
+        applyRenames();
+    }
+    catch (const std::bad_alloc &) {
+        syslog(LOG_ERR, "no enough memory to rename entries in ZIP archive");
+    }
+    // new entries are added into archive in name order
+    typedef std::vector<std::pair<std::string, FileNode *> > names_t;
+    names_t nodes;
+    nodes.reserve(files.size());
+    for (FileMap::const_iterator i = files.begin(); i != files.end(); ++i) {
+        if (*i != m_root) {
+            nodes.push_back(std::make_pair((*i)->fullName(), *i));
+        }
+    }
+    std::sort(nodes.begin(), nodes.end());
+    for (names_t::const_iterator i = nodes.begin(); i != nodes.end(); ++i) {
+        FileNode *node = i->second;
+        const char *fullName = i->first.c_str();
         assert(node != NULL);
         bool saveMetadata = node->isMetadataChanged();
         if (node->isChanged() && !node->is_dir) {
@@ -260,17 +1301,17 @@ void FuseZipData::save () {
             if (res != 0) {
                 saveMetadata = false;
                 syslog(LOG_ERR, "Error while saving file %s in ZIP archive: %d",
-                        node->full_name.c_str(), res);
+                        fullName, res);
             }
         }
         if (saveMetadata) {
             if (node->isTemporaryDir()) {
                 // persist temporary directory
                 zip_int64_t idx = zip_dir_add(m_zip,
-                        node->full_name.c_str(), ZIP_FL_ENC_UTF_8);
+                        fullName, ZIP_FL_ENC_UTF_8);
                 if (idx < 0) {
                     syslog(LOG_ERR, "Unable to save directory %s in ZIP archive",
-                        node->full_name.c_str());
+                        fullName);
                     continue;
                 }
                 node->id = idx;
@@ -278,7 +1319,7 @@ void FuseZipData::save () {
             int res = node->saveMetadata();
             if (res != 0) {
                 syslog(LOG_ERR, "Error while saving metadata for file %s in ZIP archive: %d",
-                        node->full_name.c_str(), res);
+                        fullName, res);
             }
         }
     }
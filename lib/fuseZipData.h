@@ -22,12 +22,101 @@
 #ifndef FUSEZIP_DATA
 #define FUSEZIP_DATA
 
+#include <pthread.h>
+
 #include <string>
+#include <vector>
 
 #include "types.h"
 #include "fileNode.h"
+#include "fileMap.h"
+#include "archiveFile.h"
+#include "bufferCache.h"
+#include "indexCache.h"
+#include "lazyIndex.h"
+#include "frozenIndex.h"
+#include "decompressPool.h"
+#include "readahead.h"
+#include "zipPool.h"
+
+/**
+ * Tuning parameters of mounted archive
+ */
+struct FuseZipOptions {
+    /**
+     * Distance between access points in index for random access into
+     * deflated files in bytes (0 if index is not used)
+     */
+    zip_uint64_t seekIndexInterval;
+    /**
+     * Maximum total size of cached buffers of closed files in bytes (0 if
+     * cache is not used)
+     */
+    zip_uint64_t cacheSize;
+    /**
+     * Maximum size of memory used by one file or by all files in bytes.
+     * Data is moved to temporary file in archive directory if it is
+     * exceeded (0 for no limit).
+     */
+    zip_uint64_t spillFileSize, spillTotalSize;
+    /**
+     * Keep data of each file in single memory mapping instead of extents
+     */
+    bool mmapBuffers;
+    /**
+     * Read file metadata from central directory only on mount. Local
+     * headers are read on first access if central directory has no
+     * timestamp or owner info for file.
+     */
+    bool fastMount;
+    /**
+     * Number of threads that create file tree nodes in fastMount mode (0 to
+     * use all processors)
+     */
+    unsigned int treeThreads;
+    /**
+     * Directory to keep file tree of archive between mounts (empty if
+     * index cache is not used)
+     */
+    std::string indexCacheDir;
+    /**
+     * Create file tree nodes of read-only archive on demand (see
+     * LazyIndex). Metadata is read as in fastMount mode.
+     */
+    bool lazyTree;
+    /**
+     * Number of nodes of lazy file tree after which nodes that are not
+     * used are deleted
+     */
+    zip_uint64_t lazyNodeLimit;
+    /**
+     * Number of archive handles used to decompress files from several
+     * threads (0 to open one handle per processor)
+     */
+    unsigned int zipHandles;
+    /**
+     * Number of threads that decompress data of opened files in
+     * background when file system is accessed from several threads (0 to
+     * decompress data on demand only)
+     */
+    unsigned int decompressThreads;
+    /**
+     * Number of archive entries that are decompressed in background ahead
+     * of sequential scan of archive (0 to not read ahead, see Readahead)
+     */
+    unsigned int readahead;
+
+    FuseZipOptions(): seekIndexInterval(0), cacheSize(0), spillFileSize(0),
+        spillTotalSize(0), mmapBuffers(false), fastMount(false),
+        treeThreads(0), lazyTree(false), lazyNodeLimit(65536),
+        zipHandles(0), decompressThreads(0), readahead(0) {
+    }
+};
 
 class FuseZipData {
+public:
+    class TreeLock;
+    friend class TreeLock;
 private:
     /**
      * Check that file name is non-empty and does not contain duplicate
@@ -52,19 +141,209 @@ private:
             bool needPrefix, std::string &converted);
 
     /**
-     * Find node parent by its name
+     * Find parent of file 'fname' by walking its path components. If
+     * 'create' is set, missing intermediate directories are created.
+     * @return parent node or NULL if it is not found
+     * @throws std::bad_alloc
+     * @throws std::runtime_error - if parent is not directory and 'create'
+     * is set
+     */
+    FileNode *findParent (const char *fname, bool create);
+
+    /**
+     * Find node by name without creating nodes of lazy tree
+     * @return node or NULL
+     */
+    FileNode *lookup (const char *fname) const;
+
+    /**
+     * Attach node to parent and add it into file map
+     * @throws std::bad_alloc
+     */
+    void linkNode (FileNode *parent, FileNode *node);
+
+    /**
+     * Attach nodes created for zip entries with converted names 'names' to
+     * tree. Parents are attached before children, so intermediate
+     * directories are created only for names without own entries.
+     * Attached nodes are replaced by NULL in 'nodes'.
+     * @throws std::bad_alloc
+     * @throws std::runtime_error - if file name is duplicated or parent is
+     * not directory
      */
-    FileNode *findParent (const FileNode *node) const;
+    void attachNodes (std::vector<FileNode *> &nodes,
+            const std::vector<std::string> &names);
 
     /**
-     * Create node parents (if not yet exist) and connect node to
+     * Create nodes for zip entries using libzip.
+     * @param n number of entries
      * @throws std::bad_alloc
-     * @throws std::runtime_error - if parent is not directory
+     * @throws std::runtime_error - if file name is invalid or duplicated
      */
-    void connectNodeToTree (FileNode *node);
+    void addZipEntries(bool readonly, zip_int64_t n);
 
+    /**
+     * Central directory entries processed by one thread while nodes are
+     * created (see addCentralEntries)
+     */
+    struct BuildTask;
+    /**
+     * Minimal number of central directory entries per node creation thread
+     */
+    static const zip_uint64_t minEntriesPerThread = 16384;
+    static const unsigned int maxBuildThreads = 16;
+
+    /**
+     * Create nodes for zip entries from central directory mapped by
+     * m_archive. Metadata is read from central directory only.
+     *
+     * For large archives entries are split between threads that convert
+     * file names and create nodes in their own arenas. Nodes are attached
+     * to tree by calling thread.
+     *
+     * @throws std::bad_alloc
+     * @throws std::runtime_error - if file name is invalid or duplicated
+     * or central directory is broken
+     */
+    void addCentralEntries(bool readonly);
+
+    /**
+     * Return number of threads to create nodes for 'n' entries
+     */
+    unsigned int buildThreads(zip_uint64_t n) const;
+
+    /**
+     * Thread function that creates nodes for BuildTask 'task'. Errors are
+     * stored in task.
+     */
+    static void *buildNodes(void *task);
+
+    /**
+     * Attach archive-wide objects to node created for zip entry
+     * @throws std::bad_alloc
+     */
+    void initNode(FileNode *node) const;
+
+    /**
+     * Get index cache file name and identity of archive
+     * @return false if index cache is disabled or archive can not be
+     * identified
+     */
+    bool indexCacheKey(bool readonly, std::string &fileName,
+            IndexCache::Key &key);
+
+    /**
+     * Delete all nodes
+     */
+    void clearTree();
+
+    /**
+     * Fill lazy index with central directory entries. Nodes are not
+     * created.
+     * @throws std::bad_alloc
+     * @throws std::runtime_error - if file name is invalid or duplicated
+     * or central directory is broken
+     */
+    void buildLazyIndex(bool readonly);
+
+    /**
+     * Create node of lazy tree for 'fname' and its missing parents.
+     * @return NULL if there is no such file
+     * @throws std::bad_alloc
+     */
+    FileNode *materialize(const char *fname);
+
+    /**
+     * Create node of lazy tree for existing entry or directory that has
+     * no own entry ('item' is LazyIndex::npos) and attach it to 'parent'.
+     * @throws std::bad_alloc
+     * @throws std::runtime_error if central directory record is broken
+     */
+    FileNode *materializeChild(FileNode *parent, const std::string &fname,
+            zip_uint64_t item);
+
+    /**
+     * Delete nodes of lazy tree that are not opened and have no children
+     * if number of nodes exceeds m_trimThreshold. Nodes are deleted until
+     * 3/4 of options.lazyNodeLimit are left. Node 'keep' is not deleted.
+     */
+    void trimLazyTree(const FileNode *keep);
+
+    /**
+     * Index to create nodes on demand. NULL if tree is built at once.
+     */
+    LazyIndex *m_lazy;
+    /**
+     * Number of nodes of lazy tree after which it is trimmed. It is
+     * greater than options.lazyNodeLimit if most nodes could not be
+     * deleted last time, so tree is not walked on each lookup.
+     */
+    zip_uint64_t m_trimThreshold;
+    /**
+     * Flat copy of file tree of read-only archive. NULL if archive is
+     * writable or tree is lazy.
+     */
+    FrozenIndex *m_frozen;
+    /**
+     * Time conversion cache for nodes of lazy tree
+     */
+    ArchiveFile::TimeCache m_timeCache;
+
+    /**
+     * Memory of nodes and their names
+     */
+    NodeArena m_arena;
     FileNode *m_root;
-    filemap_t files;
+    FileMap files;
+    FuseZipOptions m_options;
+    /**
+     * Archive file opened for direct reading of uncompressed entries. NULL
+     * if archive file does not exist yet.
+     */
+    ArchiveFile *m_archive;
+    /**
+     * Cache of buffers of closed files. NULL if not used.
+     */
+    BufferCache *m_cache;
+    /**
+     * Nodes are renamed but archive entries are not (see applyRenames)
+     */
+    bool m_renamesPending;
+    /**
+     * Archive handles for file streams. NULL if file system is accessed
+     * from single thread or archive has no entries.
+     */
+    ZipPool *m_pool;
+    /**
+     * Background decompression threads. NULL if not used.
+     */
+    DecompressPool *m_decompressPool;
+    /**
+     * Buffers of entries that are read ahead. NULL if not used.
+     */
+    Readahead *m_readahead;
+    /**
+     * Maximum total length of files that are read ahead
+     */
+    static const zip_uint64_t readaheadBudget = 64 * 1024 * 1024;
+    /**
+     * Is file system accessed from several threads (see enableThreads)?
+     */
+    bool m_threaded;
+    static const unsigned int nodeLockCount = 64;
+    /**
+     * Structure of file tree: nodes, their names and parents
+     */
+    pthread_rwlock_t m_treeLock;
+    /**
+     * State of nodes. Node is protected by one of mutexes chosen by node
+     * address to not keep mutex in each node.
+     */
+    pthread_mutex_t m_nodeLocks[nodeLockCount];
+    /**
+     * libzip calls on m_zip and offsets cached by m_archive
+     */
+    pthread_mutex_t m_zipLock;
 public:
     struct zip *m_zip;
     const char *m_archiveName;
@@ -75,48 +354,278 @@ public:
      *
      * 'cwd' and 'z' free()-ed in destructor.
      * 'archiveName' should be managed externally.
+     *
+     * If options.seekIndexInterval is not 0, then access point index is
+     * built for files that are larger than seekIndexInterval bytes to allow
+     * random access into deflated data (see InflateIndex).
+     *
+     * If options.cacheSize is not 0, then buffers of closed files are
+     * kept in cache (see BufferCache).
+     *
+     * If options.spillFileSize or options.spillTotalSize is not 0, then
+     * file data is moved from memory to temporary files in archive
+     * directory when limit is exceeded (see BigBuffer::setSpillOptions).
+     *
+     * If options.mmapBuffers is set, then file data is kept in memory
+     * mappings (see BigBuffer::setMmapMode).
+     *
+     * If options.fastMount is set, then local headers are not read while
+     * file tree is built (see loadLocalMetadata). Central directory is
+     * mapped and read without libzip in this case (see ArchiveFile).
+     *
+     * If options.indexCacheDir is not empty, then file tree can be saved
+     * into and loaded from cache directory (see IndexCache).
+     *
+     * If options.lazyTree is set and archive is opened read-only, then
+     * nodes are created on lookup or when parent directory is listed and
+     * deleted again if there are more than options.lazyNodeLimit nodes
+     * (see LazyIndex). Central directory stays mapped while archive is
+     * mounted.
+     *
+     * If archive is opened read-only and tree is not lazy, then tree is
+     * copied into FrozenIndex after it is built to look up files and
+     * read their metadata without walking nodes.
+     *
+     * Archive file is opened to read uncompressed entries directly (see
+     * ArchiveFile).
      */
-    FuseZipData(const char *archiveName, struct zip *z, const char *cwd);
+    FuseZipData(const char *archiveName, struct zip *z, const char *cwd,
+            const FuseZipOptions &options);
     ~FuseZipData();
 
     /**
      * Detach node from tree, and delete associated entry in zip file if
-     * present.
+     * present. Node that is opened is deleted by releaseNode() when it is
+     * closed last time.
      *
      * @param node Node to remove
      * @return Error code or 0 is successful
      */
     int removeNode(FileNode *node);
 
+    /**
+     * Delete node that was removed from tree while it was opened if it is
+     * not opened anymore. Caller must hold TreeLock and node lock.
+     */
+    void releaseNode(FileNode *node);
+
     /**
      * Build tree of zip file entries from ZIP file
      */
     void build_tree(bool readonly);
 
     /**
-     * Insert new node into tree by adding it to parent's childs list and
-     * specifying node parent field.
+     * Load file tree from index cache instead of build_tree() if
+     * options.indexCacheDir is set and cache file is created for the same
+     * archive with the same options.
+     *
+     * @return false if cache is disabled, stale or corrupted and tree
+     * must be built by build_tree()
+     * @throws std::bad_alloc
+     */
+    bool loadIndexCache(bool readonly);
+
+    /**
+     * Save file tree built by build_tree() into index cache if
+     * options.indexCacheDir is set. Errors are logged and ignored.
+     */
+    void saveIndexCache(bool readonly);
+
+    /**
+     * Insert new node created for file 'fname' into tree by adding it to
+     * parent's childs list and specifying node parent field.
+     * @throws std::bad_alloc
      */
-    void insertNode (FileNode *node);
+    void insertNode (FileNode *node, const char *fname);
 
     /**
      * Detach node from old parent, rename, attach to new parent.
+     * Descendants are not changed because their paths are built from
+     * parents. Archive entries are renamed later by applyRenames().
      * @param node
      * @param newName new name
      * @param reparent if false, node detaching is not performed
+     * @throws std::bad_alloc
      */
     void renameNode (FileNode *node, const char *newName, bool reparent);
 
+    /**
+     * Rename archive entries whose names differ from paths of their nodes
+     * after renameNode() calls. Does nothing if nothing is renamed since
+     * last call. Errors are logged.
+     * @throws std::bad_alloc
+     */
+    void applyRenames ();
+
+    /**
+     * Read metadata from local headers for node and for its siblings that
+     * are waiting for it too (see FileNode::loadLocalMetadata). Headers are
+     * read in archive order to avoid random seeks when directory is
+     * listed. Each node is locked by nodeLock() while its metadata is
+     * loaded, so caller must hold TreeLock but not node locks.
+     */
+    void loadLocalMetadata (FileNode *node);
+
     /**
      * search for node
      * @return node or NULL
      */
-    FileNode *find (const char *fname) const;
+    FileNode *find (const char *fname);
+
+    /**
+     * Scoped lock of file tree structure. Operations that add, remove or
+     * rename nodes lock tree exclusively, lookups lock it shared. Lookup in
+     * lazy tree creates nodes, so shared lock is upgraded by exclusive()
+     * before nodes are created (see lazyLookup()). Does nothing if file
+     * system is accessed from single thread.
+     */
+    class TreeLock {
+    private:
+        // must not be defined
+        TreeLock (const TreeLock &);
+        TreeLock &operator= (const TreeLock &);
+
+        pthread_rwlock_t *m_lock;
+        bool m_exclusive;
+    public:
+        TreeLock(FuseZipData *data, bool modify):
+            m_lock(data->m_threaded ? &data->m_treeLock : NULL),
+            m_exclusive(modify || m_lock == NULL) {
+            if (m_lock == NULL) {
+                return;
+            }
+            if (modify) {
+                pthread_rwlock_wrlock(m_lock);
+            } else {
+                pthread_rwlock_rdlock(m_lock);
+            }
+        }
+
+        /**
+         * Lock tree exclusively. Shared lock is released before that, so
+         * nodes found under it may be deleted already.
+         */
+        void exclusive() {
+            if (!m_exclusive) {
+                pthread_rwlock_unlock(m_lock);
+                pthread_rwlock_wrlock(m_lock);
+                m_exclusive = true;
+            }
+        }
+
+        inline bool isExclusive() const {
+            return m_exclusive;
+        }
+
+        ~TreeLock() {
+            if (m_lock != NULL) {
+                pthread_rwlock_unlock(m_lock);
+            }
+        }
+    };
+
+    /**
+     * Prepare file system to be accessed from several threads. Unchanged
+     * archive entries are read through options.zipHandles handles of
+     * archive (see ZipPool), so data of different files is decompressed in
+     * parallel. If options.decompressThreads is set, data of opened files
+     * is decompressed in background (see DecompressPool). If
+     * options.readahead is set, entries that follow opened files in
+     * archive are decompressed too (see readahead()).
+     *
+     * Operations take locks in the following order:
+     * 1. TreeLock for anything that looks up or changes nodes by path;
+     * 2. nodeLock() for open state, buffer and metadata of node (and its
+     *    FrozenIndex attributes);
+     * 3. zipLock() around libzip calls on m_zip.
+     * Data of opened file is read under lock of its buffer only (see
+     * BigBuffer::setZipPool).
+     *
+     * @return false if handles can not be opened and file system must be
+     * accessed from single thread
+     */
+    bool enableThreads ();
+
+    /**
+     * Note that 'node' is opened and decompress buffers of the next
+     * archive entries in background if archive is scanned sequentially.
+     * Caller must hold TreeLock but not node locks. Errors are ignored.
+     */
+    void readahead (const FileNode *node);
+
+    /**
+     * Mutex of node state (for MutexLock) or NULL if file system is
+     * accessed from single thread.
+     */
+    inline pthread_mutex_t *nodeLock (const FileNode *node) {
+        if (!m_threaded) {
+            return NULL;
+        }
+        // nodes are allocated from arena, so low bits are the same
+        size_t h = size_t(node) / sizeof(void *);
+        return &m_nodeLocks[(h ^ (h >> 7)) % nodeLockCount];
+    }
+
+    /**
+     * Mutex of archive handle m_zip (for MutexLock) or NULL if file system
+     * is accessed from single thread.
+     */
+    inline pthread_mutex_t *zipLock () {
+        return m_threaded ? &m_zipLock : NULL;
+    }
+
+    /**
+     * Flat index of read-only tree or NULL
+     */
+    inline FrozenIndex *frozen () {
+        return m_frozen;
+    }
+
+    /**
+     * Arena to allocate new nodes from
+     */
+    inline NodeArena &arena () {
+        return m_arena;
+    }
+
+    /**
+     * Find node by name as find() does. Nodes of lazy tree are created
+     * under exclusive lock only, so 'tree' is made exclusive if node is
+     * not created yet.
+     * @return node or NULL
+     */
+    FileNode *lazyLookup (TreeLock &tree, const char *fname);
+
+    /**
+     * Check that all children of directory node are created, so
+     * loadChilds() does nothing
+     */
+    inline bool childsLoaded (const FileNode *node) const {
+        return m_lazy == NULL || node->m_childsLoaded;
+    }
+
+    /**
+     * Create all children of directory node in lazy tree. Does nothing if
+     * tree is built at once. Caller must hold TreeLock exclusively unless
+     * childsLoaded() is true.
+     * @throws std::bad_alloc
+     * @throws std::runtime_error if central directory record is broken
+     */
+    void loadChilds (FileNode *node);
+
+    /**
+     * Return number of children of directory node including children that
+     * are not created yet
+     */
+    zip_uint64_t childsCount (FileNode *node);
 
     /**
      * Return number of files in tree
      */
     int numFiles () const {
+        if (m_lazy != NULL) {
+            return m_lazy->size();
+        }
         return files.size() - 1;
     }
 
@@ -0,0 +1,205 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "indexCache.h"
+
+/**
+ * Cache file header. Tables follow header in the same order as fields
+ * that describe them.
+ */
+struct IndexCache::Header {
+    char magic[8];
+    zip_uint32_t version;
+    zip_uint32_t recordSize;
+    Key key;
+    zip_uint64_t count, offsetsCount, namesSize;
+    // CRC32 of data after header
+    zip_uint32_t crc;
+    zip_uint32_t reserved;
+};
+
+/**
+ * Update CRC32 with data of any size (zlib accepts uInt length)
+ */
+static uLong updateCrc(uLong crc, const void *buf, zip_uint64_t size) {
+    const Bytef *p = (const Bytef *)buf;
+    while (size > 0) {
+        uInt chunk = size > 0x40000000 ? 0x40000000 : size;
+        crc = crc32(crc, p, chunk);
+        p += chunk;
+        size -= chunk;
+    }
+    return crc;
+}
+
+/**
+ * Write whole buffer into file descriptor
+ * @return false on error
+ */
+static bool writeAll(int fd, const void *buf, size_t size) {
+    const char *p = (const char *)buf;
+    while (size > 0) {
+        ssize_t nw = write(fd, p, size);
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nw <= 0) {
+            return false;
+        }
+        p += nw;
+        size -= nw;
+    }
+    return true;
+}
+
+const char IndexCache::magic[8] = {'F', 'Z', 'I', 'N', 'D', 'E', 'X', 0};
+const zip_uint32_t IndexCache::version = 2;
+
+IndexCache::IndexCache(): m_map(NULL), m_mapSize(0), m_records(NULL),
+    m_offsets(NULL), m_names(NULL), m_count(0), m_offsetsCount(0),
+    m_namesSize(0) {
+}
+
+IndexCache::~IndexCache() {
+    if (m_map != NULL) {
+        munmap(m_map, m_mapSize);
+    }
+}
+
+bool IndexCache::load(const std::string &fileName, const Key &key) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || zip_uint64_t(st.st_size) < sizeof(Header)
+            || size_t(st.st_size) != zip_uint64_t(st.st_size)) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    m_map = p;
+    m_mapSize = st.st_size;
+
+    const Header *h = (const Header *)p;
+    if (memcmp(h->magic, magic, sizeof(magic)) != 0
+            || h->version != version || h->recordSize != sizeof(Record)
+            || memcmp(&h->key, &key, sizeof(Key)) != 0) {
+        return false;
+    }
+    // check table sizes without overflow
+    zip_uint64_t rest = m_mapSize - sizeof(Header);
+    if (h->count > rest / sizeof(Record)) {
+        return false;
+    }
+    rest -= h->count * sizeof(Record);
+    if (h->offsetsCount > rest / sizeof(zip_uint64_t)) {
+        return false;
+    }
+    rest -= h->offsetsCount * sizeof(zip_uint64_t);
+    if (h->namesSize != rest) {
+        return false;
+    }
+    const unsigned char *data = (const unsigned char *)(h + 1);
+    if (updateCrc(crc32(0L, Z_NULL, 0), data, m_mapSize - sizeof(Header))
+            != h->crc) {
+        syslog(LOG_WARNING, "index cache %s is corrupted", fileName.c_str());
+        return false;
+    }
+    m_count = h->count;
+    m_offsetsCount = h->offsetsCount;
+    m_namesSize = h->namesSize;
+    m_records = (const Record *)data;
+    m_offsets = (const zip_uint64_t *)(m_records + m_count);
+    m_names = (const char *)(m_offsets + m_offsetsCount);
+    return true;
+}
+
+const char *IndexCache::name(const Record &r) const {
+    if (r.nameOffset > m_namesSize || r.nameLen > m_namesSize - r.nameOffset) {
+        return NULL;
+    }
+    return m_names + r.nameOffset;
+}
+
+bool IndexCache::save(const std::string &fileName, const Key &key,
+        const std::vector<Record> &records,
+        const std::vector<zip_uint64_t> &offsets, const std::string &names) {
+    std::string tmpName = fileName + ".XXXXXX";
+    int fd = mkstemp(&tmpName[0]);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "unable to create index cache %s: %s",
+                fileName.c_str(), strerror(errno));
+        return false;
+    }
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.recordSize = sizeof(Record);
+    h.key = key;
+    h.count = records.size();
+    h.offsetsCount = offsets.size();
+    h.namesSize = names.size();
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (!records.empty()) {
+        crc = updateCrc(crc, &records[0], records.size() * sizeof(Record));
+    }
+    if (!offsets.empty()) {
+        crc = updateCrc(crc, &offsets[0],
+                offsets.size() * sizeof(zip_uint64_t));
+    }
+    h.crc = updateCrc(crc, names.data(), names.size());
+
+    bool res = writeAll(fd, &h, sizeof(h))
+        && (records.empty() || writeAll(fd, &records[0],
+                    records.size() * sizeof(Record)))
+        && (offsets.empty() || writeAll(fd, &offsets[0],
+                    offsets.size() * sizeof(zip_uint64_t)))
+        && writeAll(fd, names.data(), names.size());
+    if (close(fd) != 0) {
+        res = false;
+    }
+    if (res && rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        res = false;
+    }
+    if (!res) {
+        syslog(LOG_WARNING, "unable to write index cache %s: %s",
+                fileName.c_str(), strerror(errno));
+        unlink(tmpName.c_str());
+    }
+    return res;
+}
@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include <zip.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Serialized file tree of archive kept between mounts.
+ *
+ * Cache file consists of header, table of fixed-size node records, table
+ * of local header offsets indexed by entry number and names of nodes. It
+ * is read by single mmap call and is valid only for archive with the same
+ * identity key. Payload is protected by CRC32, so corrupted file is
+ * rejected as well as stale one.
+ */
+class IndexCache {
+public:
+    /**
+     * Archive identity
+     */
+    struct Key {
+        zip_uint64_t dev, ino, size;
+        zip_int64_t mtime, mtimeNsec;
+        zip_uint64_t cdSize;
+        zip_uint32_t cdCrc;
+        // options that affect file tree
+        zip_uint32_t flags;
+    };
+
+    /**
+     * File tree node
+     */
+    struct Record {
+        zip_int64_t id;
+        zip_uint64_t size;
+        zip_int64_t mtime, atime, ctime, cretime;
+        // name position in names block
+        zip_uint64_t nameOffset;
+        zip_uint32_t nameLen;
+        zip_uint32_t mode, uid, gid;
+        zip_uint8_t isDir, hasCretime, localMetadataPending, reserved[5];
+    };
+
+private:
+    // must not be defined
+    IndexCache (const IndexCache &);
+    IndexCache &operator= (const IndexCache &);
+
+    struct Header;
+
+    void *m_map;
+    size_t m_mapSize;
+    const Record *m_records;
+    const zip_uint64_t *m_offsets;
+    const char *m_names;
+    zip_uint64_t m_count, m_offsetsCount, m_namesSize;
+
+    static const char magic[8];
+    static const zip_uint32_t version;
+
+public:
+    IndexCache();
+    ~IndexCache();
+
+    /**
+     * Map cache file and check that it is intact and created for archive
+     * with identity 'key'.
+     * @return false if file does not exist, is corrupted or stale
+     */
+    bool load(const std::string &fileName, const Key &key);
+
+    /**
+     * Number of node records
+     */
+    inline zip_uint64_t count() const {
+        return m_count;
+    }
+
+    inline const Record &record(zip_uint64_t i) const {
+        return m_records[i];
+    }
+
+    /**
+     * Return pointer to name of node (not null-terminated) or NULL if
+     * record refers outside of names block
+     */
+    const char *name(const Record &r) const;
+
+    /**
+     * Local header offsets (see ArchiveFile)
+     */
+    inline const zip_uint64_t *offsets() const {
+        return m_offsets;
+    }
+
+    inline zip_uint64_t offsetsCount() const {
+        return m_offsetsCount;
+    }
+
+    /**
+     * Write cache file atomically (temporary file is renamed to
+     * 'fileName').
+     * @return false on I/O error
+     */
+    static bool save(const std::string &fileName, const Key &key,
+            const std::vector<Record> &records,
+            const std::vector<zip_uint64_t> &offsets,
+            const std::string &names);
+};
+
+#endif
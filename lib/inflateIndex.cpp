@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "inflateIndex.h"
+#include "mutexLock.h"
+
+InflateIndex::InflateIndex(zip_uint64_t interval): m_interval(interval) {
+    assert(interval > 0);
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+InflateIndex::~InflateIndex() {
+    for (points_t::iterator i = m_points.begin(); i != m_points.end(); ++i) {
+        free(i->window);
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool InflateIndex::needPoint(zip_uint64_t out) const {
+    MutexLock lock(&m_mutex);
+    return needPointLocked(out);
+}
+
+size_t InflateIndex::size() const {
+    MutexLock lock(&m_mutex);
+    return m_points.size();
+}
+
+void InflateIndex::addPoint(zip_uint64_t out, zip_uint64_t in, int bits,
+        const unsigned char *window, unsigned int winPos) {
+    assert(winPos < windowSize);
+    Point p;
+    p.out = out;
+    p.in = in;
+    p.bits = bits;
+    p.window = (unsigned char *)malloc(windowSize);
+    if (p.window == NULL) {
+        throw std::bad_alloc();
+    }
+    // store window contents from the oldest byte to the newest one
+    memcpy(p.window, window + winPos, windowSize - winPos);
+    memcpy(p.window + windowSize - winPos, window, winPos);
+    MutexLock lock(&m_mutex);
+    if (!needPointLocked(out)) {
+        free(p.window);
+        return;
+    }
+    try {
+        m_points.push_back(p);
+    }
+    catch (...) {
+        free(p.window);
+        throw;
+    }
+}
+
+bool InflateIndex::find(zip_uint64_t offset, Point &point) const {
+    MutexLock lock(&m_mutex);
+    // binary search for the first point after offset
+    size_t lo = 0, hi = m_points.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (m_points[mid].out <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return false;
+    }
+    point = m_points[lo - 1];
+    return true;
+}
@@ -0,0 +1,136 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef INFLATE_INDEX_H
+#define INFLATE_INDEX_H
+
+#include <pthread.h>
+#include <zip.h>
+
+#include <vector>
+
+/**
+ * List of access points into deflate stream that allows to start
+ * decompression from the middle of file (see examples/zran.c from zlib
+ * distribution).
+ *
+ * Index is shared by streams of the same file that can be read from
+ * several threads, so access points are added and found under lock and
+ * returned by value. Windows of points are not freed until index is
+ * destroyed.
+ */
+class InflateIndex {
+public:
+    /**
+     * Maximum distance of back references in deflate stream
+     */
+    static const unsigned int windowSize = 32768;
+
+    struct Point {
+        /**
+         * Offset in uncompressed data
+         */
+        zip_uint64_t out;
+        /**
+         * Offset of the first full byte in compressed data
+         */
+        zip_uint64_t in;
+        /**
+         * Number of bits (1-7) from the byte at in-1, or 0
+         */
+        int bits;
+        /**
+         * Uncompressed data preceding this point
+         */
+        unsigned char *window;
+    };
+
+private:
+    // must not be defined
+    InflateIndex (const InflateIndex &);
+    InflateIndex &operator= (const InflateIndex &);
+
+    typedef std::vector<Point> points_t;
+
+    zip_uint64_t m_interval;
+    points_t m_points;
+    mutable pthread_mutex_t m_mutex;
+
+    /**
+     * Check that access point should be added at offset 'out'. Caller
+     * must hold m_mutex.
+     */
+    inline bool needPointLocked(zip_uint64_t out) const {
+        zip_uint64_t last = m_points.empty() ? 0 : m_points.back().out;
+        return out >= last + m_interval;
+    }
+
+public:
+    /**
+     * Create empty index.
+     *
+     * @param interval  Minimal distance between access points in
+     *                  uncompressed data
+     */
+    explicit InflateIndex(zip_uint64_t interval);
+    ~InflateIndex();
+
+    inline zip_uint64_t interval() const {
+        return m_interval;
+    }
+
+    /**
+     * Check that access point should be added at offset 'out'.
+     * Points are appended in ascending order only.
+     */
+    bool needPoint(zip_uint64_t out) const;
+
+    /**
+     * Add access point. Does nothing if point is not needed anymore
+     * because it is added by another stream of the same file.
+     *
+     * @param out       Offset in uncompressed data
+     * @param in        Offset in compressed data
+     * @param bits      Number of unused bits in byte at in-1
+     * @param window    Circular buffer with last windowSize bytes of
+     *                  uncompressed data
+     * @param winPos    Position of the oldest byte in window
+     * @throws
+     *      std::bad_alloc  If there are no memory for window copy
+     */
+    void addPoint(zip_uint64_t out, zip_uint64_t in, int bits,
+            const unsigned char *window, unsigned int winPos);
+
+    /**
+     * Find the last access point before or at 'offset'.
+     *
+     * @param point     (OUT) copy of access point
+     * @return false if not found
+     */
+    bool find(zip_uint64_t offset, Point &point) const;
+
+    /**
+     * Return number of access points
+     */
+    size_t size() const;
+};
+
+#endif
@@ -0,0 +1,204 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <syslog.h>
+
+#include "lazyIndex.h"
+#include "mutexLock.h"
+
+const zip_uint64_t LazyIndex::npos = zip_uint64_t(-1);
+
+/**
+ * Order of records by name bytes
+ */
+class LazyIndex::ItemLess {
+private:
+    const char *m_names;
+public:
+    ItemLess(const char *names): m_names(names) {
+    }
+
+    bool operator() (const Item &i1, const Item &i2) const {
+        size_t len = std::min(i1.nameLen, i2.nameLen);
+        int res = memcmp(m_names + i1.nameOffset, m_names + i2.nameOffset,
+                len);
+        return res < 0 || (res == 0 && i1.nameLen < i2.nameLen);
+    }
+};
+
+LazyIndex::LazyIndex() {
+    pthread_mutex_init(&m_countsMutex, NULL);
+}
+
+LazyIndex::~LazyIndex() {
+    pthread_mutex_destroy(&m_countsMutex);
+}
+
+void LazyIndex::add(const std::string &name, zip_uint64_t id,
+        zip_uint64_t cdPos) {
+    Item item;
+    item.nameOffset = m_names.size();
+    item.cdPos = cdPos;
+    item.id = id;
+    item.nameLen = name.size();
+    item.isDir = 0;
+    while (item.nameLen > 0 && name[item.nameLen - 1] == '/') {
+        --item.nameLen;
+        item.isDir = 1;
+    }
+    m_names.append(name, 0, item.nameLen);
+    m_items.push_back(item);
+}
+
+void LazyIndex::sort() {
+    ItemLess less(m_names.data());
+    std::sort(m_items.begin(), m_items.end(), less);
+    for (size_t i = 1; i < m_items.size(); ++i) {
+        if (!less(m_items[i - 1], m_items[i])) {
+            const Item &item = m_items[i];
+            std::string name(m_names, item.nameOffset, item.nameLen);
+            syslog(LOG_ERR, "duplicated file name: %s", name.c_str());
+            throw std::runtime_error("duplicate file names");
+        }
+    }
+}
+
+int LazyIndex::compare(const Item &item, const char *name, size_t len) const {
+    size_t common = std::min(size_t(item.nameLen), len);
+    int res = memcmp(m_names.data() + item.nameOffset, name, common);
+    if (res != 0) {
+        return res;
+    }
+    return item.nameLen < len ? -1 : (item.nameLen > len ? 1 : 0);
+}
+
+zip_uint64_t LazyIndex::lowerBound(const char *name, size_t len) const {
+    zip_uint64_t lo = 0, hi = m_items.size();
+    while (lo < hi) {
+        zip_uint64_t mid = lo + (hi - lo) / 2;
+        if (compare(m_items[mid], name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+zip_uint64_t LazyIndex::find(const char *name, size_t len) const {
+    zip_uint64_t i = lowerBound(name, len);
+    if (i < m_items.size() && compare(m_items[i], name, len) == 0) {
+        return i;
+    }
+    return npos;
+}
+
+bool LazyIndex::isDir(const char *name, size_t len) const {
+    zip_uint64_t i = find(name, len);
+    if (i != npos && m_items[i].isDir) {
+        return true;
+    }
+    // the first record after "name/" is a descendant if name is a directory
+    std::string prefix(name, len);
+    prefix += '/';
+    i = lowerBound(prefix.data(), prefix.size());
+    if (i < m_items.size()) {
+        const Item &item = m_items[i];
+        return item.nameLen > prefix.size()
+            && memcmp(m_names.data() + item.nameOffset, prefix.data(),
+                    prefix.size()) == 0;
+    }
+    return false;
+}
+
+zip_uint64_t LazyIndex::scanChildren(const char *dir, size_t len,
+        std::vector<Child> *result) const {
+    zip_uint64_t count = 0;
+    std::string prefix(dir, len);
+    if (len > 0) {
+        prefix += '/';
+    }
+    zip_uint64_t i = lowerBound(prefix.data(), prefix.size());
+    while (i < m_items.size()) {
+        const Item &item = m_items[i];
+        const char *name = m_names.data() + item.nameOffset;
+        if (item.nameLen <= prefix.size()
+                || memcmp(name, prefix.data(), prefix.size()) != 0) {
+            break;
+        }
+        Child child;
+        child.name = name + prefix.size();
+        const char *slash = (const char *)memchr(child.name, '/',
+                item.nameLen - prefix.size());
+        if (slash == NULL) {
+            child.item = i;
+            child.nameLen = item.nameLen - prefix.size();
+            child.isDir = item.isDir != 0;
+            if (result != NULL) {
+                result->push_back(child);
+            }
+            ++count;
+            ++i;
+            continue;
+        }
+        // descendant of subdirectory
+        child.item = npos;
+        child.nameLen = slash - child.name;
+        child.isDir = true;
+        // explicit directory entry precedes its descendants
+        if (find(name, slash - name) == npos) {
+            if (result != NULL) {
+                result->push_back(child);
+            }
+            ++count;
+        }
+        // skip subdirectory: '0' follows '/' in ASCII
+        std::string next(name, slash - name);
+        next += '0';
+        i = lowerBound(next.data(), next.size());
+    }
+    return count;
+}
+
+void LazyIndex::children(const char *dir, size_t len,
+        std::vector<Child> &result) const {
+    result.clear();
+    scanChildren(dir, len, &result);
+}
+
+zip_uint64_t LazyIndex::childrenCount(const char *dir, size_t len) const {
+    std::string key(dir, len);
+    MutexLock lock(&m_countsMutex);
+    counts_t::const_iterator i = m_childrenCounts.find(key);
+    if (i != m_childrenCounts.end()) {
+        return i->second;
+    }
+    zip_uint64_t count = scanChildren(dir, len, NULL);
+    m_childrenCounts[key] = count;
+    return count;
+}
+
+zip_uint64_t LazyIndex::memoryUsage() const {
+    return m_items.capacity() * sizeof(Item) + m_names.capacity();
+}
@@ -0,0 +1,171 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef LAZY_INDEX_H
+#define LAZY_INDEX_H
+
+#include <pthread.h>
+#include <zip.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Compact sorted index of archive entries used to create file tree nodes
+ * on demand.
+ *
+ * Each entry takes fixed-size record and its converted name without
+ * trailing slash. Records are sorted by name bytes, so all descendants
+ * of a directory form continuous range that starts with "dir/" prefix.
+ */
+class LazyIndex {
+public:
+    static const zip_uint64_t npos;
+
+    /**
+     * Direct child of directory
+     */
+    struct Child {
+        // record number or npos for directory that has no own entry
+        zip_uint64_t item;
+        const char *name;
+        size_t nameLen;
+        bool isDir;
+    };
+
+private:
+    // must not be defined
+    LazyIndex (const LazyIndex &);
+    LazyIndex &operator= (const LazyIndex &);
+
+    struct Item {
+        zip_uint64_t nameOffset;
+        // central directory record position (see ArchiveFile::readEntry)
+        zip_uint64_t cdPos;
+        zip_uint64_t id;
+        zip_uint32_t nameLen;
+        zip_uint32_t isDir;
+    };
+    class ItemLess;
+
+    std::vector<Item> m_items;
+    std::string m_names;
+
+    typedef std::map<std::string, zip_uint64_t> counts_t;
+    /**
+     * Number of direct children of directories whose children were
+     * counted (see childrenCount)
+     */
+    mutable counts_t m_childrenCounts;
+    /**
+     * Lock of m_childrenCounts, so children are counted while index is
+     * read from several threads
+     */
+    mutable pthread_mutex_t m_countsMutex;
+
+    /**
+     * Find direct children of directory 'dir' and append them to 'result'
+     * if it is not NULL.
+     * @return number of children
+     * @throws std::bad_alloc
+     */
+    zip_uint64_t scanChildren(const char *dir, size_t len,
+            std::vector<Child> *result) const;
+
+    /**
+     * Return first record that is not less than 'name'
+     */
+    zip_uint64_t lowerBound(const char *name, size_t len) const;
+
+    /**
+     * Compare name of record with string
+     * @return negative, zero or positive value as memcmp does
+     */
+    int compare(const Item &item, const char *name, size_t len) const;
+
+public:
+    LazyIndex();
+    ~LazyIndex();
+
+    /**
+     * Add entry with converted file name 'name'. Trailing slash means
+     * directory.
+     * @throws std::bad_alloc
+     */
+    void add(const std::string &name, zip_uint64_t id, zip_uint64_t cdPos);
+
+    /**
+     * Sort records after all entries are added.
+     * @throws std::runtime_error if file names are duplicated
+     */
+    void sort();
+
+    inline zip_uint64_t size() const {
+        return m_items.size();
+    }
+
+    /**
+     * Find entry by name without trailing slash
+     * @return record number or npos
+     */
+    zip_uint64_t find(const char *name, size_t len) const;
+
+    /**
+     * Check that 'name' is a directory (explicit or implied by names of
+     * other entries)
+     */
+    bool isDir(const char *name, size_t len) const;
+
+    /**
+     * Get direct children of directory 'dir' ("" for root) in name order.
+     * Child names point into index.
+     * @throws std::bad_alloc
+     */
+    void children(const char *dir, size_t len,
+            std::vector<Child> &result) const;
+
+    /**
+     * Return number of direct children of directory 'dir' ("" for root).
+     * Number is counted once and remembered.
+     * @throws std::bad_alloc
+     */
+    zip_uint64_t childrenCount(const char *dir, size_t len) const;
+
+    inline zip_uint64_t id(zip_uint64_t item) const {
+        return m_items[item].id;
+    }
+
+    inline zip_uint64_t cdPos(zip_uint64_t item) const {
+        return m_items[item].cdPos;
+    }
+
+    inline bool itemIsDir(zip_uint64_t item) const {
+        return m_items[item].isDir != 0;
+    }
+
+    /**
+     * Return memory used by index in bytes
+     */
+    zip_uint64_t memoryUsage() const;
+};
+
+#endif
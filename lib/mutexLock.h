@@ -0,0 +1,52 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MUTEX_LOCK_H
+#define MUTEX_LOCK_H
+
+#include <pthread.h>
+#include <cstddef>
+
+/**
+ * Scoped lock of pthread mutex. Does nothing if mutex is NULL.
+ */
+class MutexLock {
+private:
+    // must not be defined
+    MutexLock (const MutexLock &);
+    MutexLock &operator= (const MutexLock &);
+
+    pthread_mutex_t *m_mutex;
+public:
+    explicit MutexLock(pthread_mutex_t *mutex): m_mutex(mutex) {
+        if (m_mutex != NULL) {
+            pthread_mutex_lock(m_mutex);
+        }
+    }
+
+    ~MutexLock() {
+        if (m_mutex != NULL) {
+            pthread_mutex_unlock(m_mutex);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cstring>
+
+#include "nodeArena.h"
+
+NodeArena::NodeArena(size_t blockSize): m_chunks(NULL), m_chunksSize(0),
+        m_blockPos(NULL),
+        m_blockEnd(NULL), m_free(NULL), m_namePos(NULL), m_nameEnd(NULL),
+        m_namesCount(0) {
+    // blocks keep pointer to the next free block and are aligned as any
+    // node field
+    const size_t align = sizeof(long double);
+    if (blockSize < sizeof(void *)) {
+        blockSize = sizeof(void *);
+    }
+    m_blockSize = (blockSize + align - 1) / align * align;
+}
+
+NodeArena::~NodeArena() {
+    while (m_chunks != NULL) {
+        Chunk *next = m_chunks->next;
+        delete [] reinterpret_cast<char *>(m_chunks);
+        m_chunks = next;
+    }
+}
+
+size_t NodeArena::hash(const char *name, size_t len) {
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return size_t(h ^ (h >> 32));
+}
+
+char *NodeArena::allocateChunk(size_t size) {
+    // data is aligned as blocks are
+    const size_t header = (sizeof(Chunk) + sizeof(long double) - 1)
+        / sizeof(long double) * sizeof(long double);
+    char *mem = new char[header + size];
+    Chunk *chunk = reinterpret_cast<Chunk *>(mem);
+    chunk->next = m_chunks;
+    chunk->size = header + size;
+    m_chunks = chunk;
+    m_chunksSize += chunk->size;
+    return mem + header;
+}
+
+void *NodeArena::allocate() {
+    if (m_free != NULL) {
+        void *block = m_free;
+        m_free = *static_cast<void **>(block);
+        return block;
+    }
+    if (m_blockPos == m_blockEnd) {
+        m_blockPos = allocateChunk(m_blockSize * blocksPerChunk);
+        m_blockEnd = m_blockPos + m_blockSize * blocksPerChunk;
+    }
+    void *block = m_blockPos;
+    m_blockPos += m_blockSize;
+    return block;
+}
+
+void NodeArena::release(void *block) {
+    if (block == NULL) {
+        return;
+    }
+    *static_cast<void **>(block) = m_free;
+    m_free = block;
+}
+
+const char *NodeArena::copyName(const char *name, size_t len) {
+    char *res;
+    if (len + 1 > nameChunkSize / 4) {
+        // long name takes its own chunk to not waste the current one
+        res = allocateChunk(len + 1);
+    } else {
+        if (size_t(m_nameEnd - m_namePos) < len + 1) {
+            m_namePos = allocateChunk(nameChunkSize);
+            m_nameEnd = m_namePos + nameChunkSize;
+        }
+        res = m_namePos;
+        m_namePos += len + 1;
+    }
+    memcpy(res, name, len);
+    res[len] = '\0';
+    return res;
+}
+
+void NodeArena::rehashNames(size_t capacity) {
+    std::vector<const char *> names(capacity, (const char *)NULL);
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < m_names.size(); ++i) {
+        const char *name = m_names[i];
+        if (name == NULL) {
+            continue;
+        }
+        size_t j = hash(name, strlen(name)) & mask;
+        while (names[j] != NULL) {
+            j = (j + 1) & mask;
+        }
+        names[j] = name;
+    }
+    m_names.swap(names);
+}
+
+const char *NodeArena::intern(const char *name, size_t len) {
+    // load factor is kept under 1/2
+    if ((m_namesCount + 1) * 2 > m_names.size()) {
+        rehashNames(m_names.empty() ? 1024 : m_names.size() * 2);
+    }
+    size_t mask = m_names.size() - 1;
+    size_t i = hash(name, len) & mask;
+    for (; m_names[i] != NULL; i = (i + 1) & mask) {
+        const char *s = m_names[i];
+        if (strncmp(s, name, len) == 0 && s[len] == '\0') {
+            return s;
+        }
+    }
+    m_names[i] = copyName(name, len);
+    ++m_namesCount;
+    return m_names[i];
+}
+
+void NodeArena::merge(NodeArena &that) {
+    assert(m_blockSize == that.m_blockSize);
+    // unused blocks of the last chunk are reused as released ones
+    while (that.m_blockPos != that.m_blockEnd) {
+        that.release(that.m_blockPos);
+        that.m_blockPos += that.m_blockSize;
+    }
+    while (that.m_free != NULL) {
+        void *block = that.m_free;
+        that.m_free = *static_cast<void **>(block);
+        release(block);
+    }
+    if (that.m_chunks != NULL) {
+        Chunk *last = that.m_chunks;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->next = m_chunks;
+        m_chunks = that.m_chunks;
+    }
+    m_chunksSize += that.m_chunksSize;
+    that.m_chunks = NULL;
+    that.m_chunksSize = 0;
+    that.m_blockPos = that.m_blockEnd = NULL;
+    that.m_namePos = that.m_nameEnd = NULL;
+    std::vector<const char *>().swap(that.m_names);
+    that.m_namesCount = 0;
+}
+
+size_t NodeArena::memoryUsage() const {
+    return m_chunksSize + m_names.capacity() * sizeof(const char *);
+}
@@ -0,0 +1,126 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Storage of file tree nodes and names of path components.
+ *
+ * Nodes are fixed-size blocks carved from large chunks. Released blocks
+ * are reused by next allocations. Names are interned: equal names of
+ * different nodes ("src", "Makefile", ...) share one copy. All memory is
+ * released at once when arena is destroyed; node destructors are not
+ * called by arena.
+ *
+ * Arena is not thread-safe. Threads that create nodes concurrently use
+ * their own arenas that are merged into the main one afterwards.
+ */
+class NodeArena {
+private:
+    // must not be defined
+    NodeArena (const NodeArena &);
+    NodeArena &operator= (const NodeArena &);
+
+    static const size_t blocksPerChunk = 1024;
+    static const size_t nameChunkSize = 64 * 1024;
+
+    /**
+     * Header of chunk of nodes or names
+     */
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+    };
+
+    size_t m_blockSize;
+    // list of chunks of nodes and names
+    Chunk *m_chunks;
+    size_t m_chunksSize;
+    // unused part of the last chunk of nodes
+    char *m_blockPos, *m_blockEnd;
+    // list of released blocks linked through their first bytes
+    void *m_free;
+    // unused part of the last chunk of names
+    char *m_namePos, *m_nameEnd;
+    // open-addressing table of interned names (NULL for empty slot)
+    std::vector<const char *> m_names;
+    size_t m_namesCount;
+
+    static size_t hash(const char *name, size_t len);
+
+    /**
+     * @throws std::bad_alloc
+     */
+    char *allocateChunk(size_t size);
+
+    /**
+     * Copy name into chunk of names
+     * @throws std::bad_alloc
+     */
+    const char *copyName(const char *name, size_t len);
+
+    /**
+     * @throws std::bad_alloc
+     */
+    void rehashNames(size_t capacity);
+
+public:
+    /**
+     * @param blockSize size of node in bytes
+     */
+    explicit NodeArena(size_t blockSize);
+    ~NodeArena();
+
+    /**
+     * Allocate memory for one node
+     * @throws std::bad_alloc
+     */
+    void *allocate();
+
+    /**
+     * Return node memory into arena
+     */
+    void release(void *block);
+
+    /**
+     * Get null-terminated copy of first 'len' characters of 'name' that
+     * lives while arena exists
+     * @throws std::bad_alloc
+     */
+    const char *intern(const char *name, size_t len);
+
+    /**
+     * Take all memory of other arena. Names of 'that' arena are not
+     * interned again. Arena 'that' becomes empty.
+     */
+    void merge(NodeArena &that);
+
+    /**
+     * Return memory allocated by arena in bytes
+     */
+    size_t memoryUsage() const;
+};
+
+#endif
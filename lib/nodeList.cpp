@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include "nodeList.h"
+#include "fileNode.h"
+
+void NodeList::push_back(FileNode *node) {
+    m_nodes.push_back(node);
+    node->m_childIndex = m_nodes.size() - 1;
+    ++m_size;
+}
+
+void NodeList::erase(FileNode *node) {
+    size_t i = node->m_childIndex;
+    if (i >= m_nodes.size() || m_nodes[i] != node) {
+        return;
+    }
+    m_nodes[i] = NULL;
+    --m_size;
+    if (m_size == 0) {
+        m_nodes.clear();
+    } else if (m_nodes.size() > 2 * m_size + 16) {
+        compact();
+    }
+}
+
+void NodeList::compact() {
+    size_t n = 0;
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes[i] != NULL) {
+            m_nodes[n] = m_nodes[i];
+            m_nodes[n]->m_childIndex = n;
+            ++n;
+        }
+    }
+    m_nodes.resize(n);
+}
@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef NODE_LIST_H
+#define NODE_LIST_H
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+class FileNode;
+
+/**
+ * Children of directory node.
+ *
+ * Each node keeps its position in parent's list, so child is removed in
+ * constant time by clearing its slot. Slots of removed children are
+ * dropped when they outnumber live children. Children are iterated in
+ * insertion order.
+ */
+class NodeList {
+private:
+    // live children and NULL for removed ones
+    std::vector<FileNode *> m_nodes;
+    size_t m_size;
+
+    /**
+     * Remove empty slots and update positions of children
+     */
+    void compact();
+
+public:
+    class const_iterator {
+    friend class NodeList;
+    private:
+        std::vector<FileNode *>::const_iterator m_pos, m_end;
+
+        const_iterator(std::vector<FileNode *>::const_iterator pos,
+                std::vector<FileNode *>::const_iterator end):
+            m_pos(pos), m_end(end) {
+            skip();
+        }
+
+        void skip() {
+            while (m_pos != m_end && *m_pos == NULL) {
+                ++m_pos;
+            }
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef FileNode *value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef FileNode *const *pointer;
+        typedef FileNode *const &reference;
+
+        const_iterator() {
+        }
+
+        reference operator* () const {
+            return *m_pos;
+        }
+
+        const_iterator &operator++ () {
+            ++m_pos;
+            skip();
+            return *this;
+        }
+
+        const_iterator operator++ (int) {
+            const_iterator res = *this;
+            ++*this;
+            return res;
+        }
+
+        bool operator== (const const_iterator &that) const {
+            return m_pos == that.m_pos;
+        }
+
+        bool operator!= (const const_iterator &that) const {
+            return m_pos != that.m_pos;
+        }
+    };
+
+    NodeList(): m_size(0) {
+    }
+
+    /**
+     * Add node to the end of list
+     * @throws std::bad_alloc
+     */
+    void push_back(FileNode *node);
+
+    /**
+     * Remove node from list. Does nothing if node is not in list.
+     */
+    void erase(FileNode *node);
+
+    /**
+     * Return number of children
+     */
+    inline size_t size() const {
+        return m_size;
+    }
+
+    inline bool empty() const {
+        return m_size == 0;
+    }
+
+    inline const_iterator begin() const {
+        return const_iterator(m_nodes.begin(), m_nodes.end());
+    }
+
+    inline const_iterator end() const {
+        return const_iterator(m_nodes.end(), m_nodes.end());
+    }
+};
+
+#endif
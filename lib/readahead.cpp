@@ -0,0 +1,140 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+
+#include "readahead.h"
+#include "fileNode.h"
+#include "bigBuffer.h"
+#include "mutexLock.h"
+
+Readahead::Readahead(unsigned int depth, zip_uint64_t budget):
+        m_depth(depth), m_budget(budget), m_used(0), m_lastId(-1),
+        m_streak(0), m_next(0), m_hits(0), m_wasted(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+Readahead::~Readahead() {
+    while (!m_area.empty()) {
+        discard(m_area.begin());
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void Readahead::discard(area_t::iterator i) {
+    m_used -= i->second.buffer->len;
+    ++m_wasted;
+    delete i->second.buffer;
+    m_area.erase(i);
+}
+
+void Readahead::addNode(FileNode *node) {
+    MutexLock lock(&m_mutex);
+    assert(node->id >= 0 && !node->is_dir);
+    if (zip_uint64_t(node->id) >= m_nodes.size()) {
+        m_nodes.resize(node->id + 1, NULL);
+    }
+    m_nodes[node->id] = node;
+}
+
+void Readahead::opened(const FileNode *node, std::vector<FileNode *> &next) {
+    MutexLock lock(&m_mutex);
+    zip_int64_t id = node->id;
+    if (id < 0 || zip_uint64_t(id) >= m_nodes.size() || m_nodes[id] != node) {
+        return;
+    }
+    // entries skipped by scan are not opened anymore
+    while (!m_area.empty() && m_area.begin()->first < id) {
+        discard(m_area.begin());
+    }
+    if (id > m_lastId && id - m_lastId <= maxGap) {
+        ++m_streak;
+    } else {
+        // new scan is started, so buffers of the previous one are not used
+        while (!m_area.empty()) {
+            discard(m_area.begin());
+        }
+        m_streak = 0;
+        m_next = id + 1;
+    }
+    m_lastId = id;
+    if (m_streak < scanLength) {
+        return;
+    }
+    if (m_next <= id) {
+        m_next = id + 1;
+    }
+    // entries too far from current position are not considered
+    zip_int64_t end = id + 1 + zip_int64_t(m_depth) * maxGap;
+    if (zip_uint64_t(end) > m_nodes.size()) {
+        end = m_nodes.size();
+    }
+    while (m_area.size() + next.size() < m_depth && m_next < end) {
+        FileNode *n = m_nodes[m_next++];
+        if (n != NULL) {
+            next.push_back(n);
+        }
+    }
+}
+
+bool Readahead::put(const FileNode *node, BigBuffer *buffer) {
+    MutexLock lock(&m_mutex);
+    zip_int64_t id = node->id;
+    // node could be removed while buffer was created
+    if (id <= m_lastId || zip_uint64_t(id) >= m_nodes.size()
+            || m_nodes[id] != node || m_area.size() >= m_depth
+            || buffer->len > m_budget - m_used
+            || m_area.find(id) != m_area.end()) {
+        return false;
+    }
+    Entry e;
+    e.node = node;
+    e.buffer = buffer;
+    m_area[id] = e;
+    m_used += buffer->len;
+    return true;
+}
+
+BigBuffer *Readahead::take(const FileNode *node) {
+    MutexLock lock(&m_mutex);
+    area_t::iterator i = m_area.find(node->id);
+    if (i == m_area.end() || i->second.node != node) {
+        return NULL;
+    }
+    ++m_hits;
+    BigBuffer *buffer = i->second.buffer;
+    m_used -= buffer->len;
+    m_area.erase(i);
+    return buffer;
+}
+
+void Readahead::remove(const FileNode *node) {
+    MutexLock lock(&m_mutex);
+    zip_int64_t id = node->id;
+    if (id < 0 || zip_uint64_t(id) >= m_nodes.size() || m_nodes[id] != node) {
+        return;
+    }
+    m_nodes[id] = NULL;
+    area_t::iterator i = m_area.find(id);
+    if (i != m_area.end()) {
+        discard(i);
+    }
+}
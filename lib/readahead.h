@@ -0,0 +1,158 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <pthread.h>
+#include <zip.h>
+
+#include <map>
+#include <vector>
+
+#include "types.h"
+
+class BigBuffer;
+
+/**
+ * Detector of sequential scans of archive and area of buffers that are
+ * decompressed before their files are opened.
+ *
+ * Recursive copy walks file tree in the order that usually matches order
+ * of archive entries. When files are opened in increasing order of their
+ * archive indexes, buffers of the next entries are created and loaded in
+ * background (see DecompressPool), so open() picks up data that is
+ * already decompressed.
+ *
+ * Methods may be called from several threads.
+ */
+class Readahead {
+private:
+    // must not be defined
+    Readahead (const Readahead &);
+    Readahead &operator= (const Readahead &);
+
+    /**
+     * Number of consecutive forward opens after which scan is detected
+     */
+    static const unsigned int scanLength = 3;
+    /**
+     * Maximum distance between indexes of consecutive opens in forward
+     * scan (entries of directories and skipped files are not opened)
+     */
+    static const zip_int64_t maxGap = 8;
+
+    struct Entry {
+        const FileNode *node;
+        BigBuffer *buffer;
+    };
+
+    typedef std::map<zip_int64_t, Entry> area_t;
+
+    /**
+     * Regular file nodes by archive index (NULL for other entries)
+     */
+    std::vector<FileNode *> m_nodes;
+    /**
+     * Prefetched buffers by archive index
+     */
+    area_t m_area;
+    unsigned int m_depth;
+    zip_uint64_t m_budget, m_used;
+    /**
+     * Index of the last opened entry
+     */
+    zip_int64_t m_lastId;
+    /**
+     * Number of consecutive forward opens
+     */
+    unsigned int m_streak;
+    /**
+     * Index of the first entry that is not yet considered for prefetch
+     */
+    zip_int64_t m_next;
+    unsigned long long m_hits, m_wasted;
+    pthread_mutex_t m_mutex;
+
+    /**
+     * Delete buffer of area entry 'i' that is not used
+     */
+    void discard(area_t::iterator i);
+
+public:
+    /**
+     * @param depth     Maximum number of prefetched buffers
+     * @param budget    Maximum total length of prefetched files in bytes
+     */
+    Readahead(unsigned int depth, zip_uint64_t budget);
+    ~Readahead();
+
+    /**
+     * Register regular file node with archive index. Should be called for
+     * all nodes of unchanged archive entries before other methods.
+     *
+     * @throws
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void addNode(FileNode *node);
+
+    /**
+     * Note that 'node' is opened. If forward scan is detected, nodes whose
+     * buffers should be prefetched are appended to 'next'. Prefetched
+     * buffers of entries before 'node' are discarded, and all of them are
+     * discarded if 'node' does not continue the scan.
+     *
+     * @throws
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void opened(const FileNode *node, std::vector<FileNode *> &next);
+
+    /**
+     * Keep prefetched 'buffer' of 'node' until the node is opened.
+     *
+     * @return false if area is full (caller keeps ownership of buffer)
+     */
+    bool put(const FileNode *node, BigBuffer *buffer);
+
+    /**
+     * Take prefetched buffer of node. Caller becomes an owner of buffer.
+     * @return buffer or NULL if node buffer is not prefetched
+     */
+    BigBuffer *take(const FileNode *node);
+
+    /**
+     * Forget node that is going to be deleted
+     */
+    void remove(const FileNode *node);
+
+    inline unsigned long long hits() const {
+        return m_hits;
+    }
+
+    /**
+     * Number of prefetched buffers that were discarded without use
+     */
+    inline unsigned long long wasted() const {
+        return m_wasted;
+    }
+};
+
+#endif
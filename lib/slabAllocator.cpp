@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mutexLock.h"
+#include "slabAllocator.h"
+
+SlabAllocator::SlabAllocator(): m_pageSize(sysconf(_SC_PAGESIZE)),
+    m_mapped(0), m_mapCalls(0) {
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+SlabAllocator::~SlabAllocator() {
+    for (slabs_t::iterator i = m_slabs.begin(); i != m_slabs.end(); ++i) {
+        munmap(i->second->base, i->second->size);
+        delete i->second;
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+unsigned int SlabAllocator::sizeClass(size_t size) {
+    if (size <= minClassSize) {
+        return 0;
+    }
+    // find k: 2^k < size <= 2^(k+1)
+    unsigned int k = 0;
+    while ((size_t(1) << (k + 1)) < size) {
+        ++k;
+    }
+    // classes between 2^k and 2^(k+1) have step 2^(k-2)
+    size_t step = size_t(1) << (k - 2);
+    size_t steps = (size + step - 1) / step;
+    return 1 + (k - 8) * 4 + (steps - 5);
+}
+
+size_t SlabAllocator::classSize(unsigned int cls) {
+    if (cls == 0) {
+        return minClassSize;
+    }
+    unsigned int k = 8 + (cls - 1) / 4;
+    return (5 + (cls - 1) % 4) * (size_t(1) << (k - 2));
+}
+
+SlabAllocator::Slab *SlabAllocator::createSlab(unsigned int cls) {
+    size_t blockSize = classSize(cls);
+    unsigned int capacity = 1;
+    if (blockSize < slabSize) {
+        capacity = slabSize / blockSize;
+    }
+    size_t size = capacity * blockSize;
+    size = (size + m_pageSize - 1) / m_pageSize * m_pageSize;
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ++m_mapCalls;
+    if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    Slab *slab = new Slab();
+    slab->base = (char *)p;
+    slab->size = size;
+    slab->capacity = capacity;
+    slab->used = 0;
+    slab->fresh = 0;
+    m_slabs[slab->base] = slab;
+    m_mapped += size;
+    return slab;
+}
+
+void SlabAllocator::releaseSlab(Slab *slab, SizeClass &sc) {
+    if (sc.spare == NULL) {
+        // pages are zero-filled on next access
+        madvise(slab->base, slab->size, MADV_DONTNEED);
+        slab->fresh = 0;
+        slab->freeList.clear();
+        sc.spare = slab;
+    } else {
+        munmap(slab->base, slab->size);
+        m_mapped -= slab->size;
+        m_slabs.erase(slab->base);
+        delete slab;
+    }
+}
+
+char *SlabAllocator::allocate(size_t &size) {
+    MutexLock lock(&m_mutex);
+    unsigned int cls = sizeClass(size);
+    size = classSize(cls);
+    if (cls >= m_classes.size()) {
+        m_classes.resize(cls + 1);
+    }
+    SizeClass &sc = m_classes[cls];
+    Slab *slab;
+    if (!sc.partial.empty()) {
+        slab = m_slabs[*sc.partial.begin()];
+    } else {
+        if (sc.spare != NULL) {
+            slab = sc.spare;
+            sc.spare = NULL;
+        } else {
+            slab = createSlab(cls);
+        }
+        sc.partial.insert(slab->base);
+    }
+    char *res;
+    // reuse freed blocks first to keep touched memory compact
+    if (!slab->freeList.empty()) {
+        res = slab->base + slab->freeList.back() * size;
+        slab->freeList.pop_back();
+        if (size % m_pageSize != 0) {
+            // block was not released by free()
+            memset(res, 0, size);
+        }
+    } else {
+        assert(slab->fresh < slab->capacity);
+        res = slab->base + slab->fresh * size;
+        ++slab->fresh;
+    }
+    if (++slab->used == slab->capacity) {
+        sc.partial.erase(slab->base);
+    }
+    return res;
+}
+
+void SlabAllocator::free(char *ptr, size_t size) {
+    MutexLock lock(&m_mutex);
+    unsigned int cls = sizeClass(size);
+    assert(cls < m_classes.size() && classSize(cls) == size);
+    SizeClass &sc = m_classes[cls];
+    slabs_t::iterator i = m_slabs.upper_bound(ptr);
+    assert(i != m_slabs.begin());
+    Slab *slab = (--i)->second;
+    assert(ptr < slab->base + slab->size);
+
+    if (size % m_pageSize == 0) {
+        // block is page-aligned because slab is
+        madvise(ptr, size, MADV_DONTNEED);
+    }
+    if (slab->used-- == slab->capacity) {
+        sc.partial.insert(slab->base);
+    }
+    slab->freeList.push_back((ptr - slab->base) / size);
+    if (slab->used == 0) {
+        sc.partial.erase(slab->base);
+        releaseSlab(slab, sc);
+    }
+}
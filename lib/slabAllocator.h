@@ -0,0 +1,156 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <vector>
+
+/**
+ * Allocator of memory blocks for file data.
+ *
+ * Block sizes are rounded up to size classes (four classes per power of
+ * two starting from 256 bytes). Blocks of the same class are cut from
+ * slabs: anonymous memory mappings of at least 1M. Memory of freed blocks
+ * that occupy whole pages and memory of empty slabs is returned to the
+ * system immediately by madvise, so freed memory does not stay in process
+ * heap as it does with malloc. One empty slab per class is kept for reuse;
+ * other empty slabs are unmapped.
+ *
+ * All returned blocks are filled with zeroes. allocate() and free() may be
+ * called from several threads.
+ */
+class SlabAllocator {
+private:
+    // must not be defined
+    SlabAllocator (const SlabAllocator &);
+    SlabAllocator &operator= (const SlabAllocator &);
+
+    static const size_t minClassSize = 256;
+    static const size_t slabSize = 1024 * 1024;
+
+    struct Slab {
+        char *base;
+        // mapping size
+        size_t size;
+        // number of blocks in slab
+        unsigned int capacity;
+        // number of allocated blocks
+        unsigned int used;
+        // blocks starting from this one were never used
+        unsigned int fresh;
+        // indices of freed blocks
+        std::vector<unsigned int> freeList;
+    };
+
+    struct SizeClass {
+        // slabs with free blocks (ordered by address to keep allocated
+        // blocks together)
+        std::set<char *> partial;
+        // empty slab kept for reuse, NULL if none
+        Slab *spare;
+
+        SizeClass(): spare(NULL) {
+        }
+    };
+
+    typedef std::map<char *, Slab *> slabs_t;
+
+    slabs_t m_slabs;
+    std::vector<SizeClass> m_classes;
+    size_t m_pageSize;
+    size_t m_mapped;
+    unsigned long long m_mapCalls;
+    pthread_mutex_t m_mutex;
+
+    /**
+     * Return size class number for block of 'size' bytes.
+     */
+    static unsigned int sizeClass(size_t size);
+
+    /**
+     * Return block size of size class 'cls'.
+     */
+    static size_t classSize(unsigned int cls);
+
+    /**
+     * Map new slab for blocks of class 'cls'.
+     *
+     * @throws
+     *      std::bad_alloc  If memory can not be mapped
+     */
+    Slab *createSlab(unsigned int cls);
+
+    /**
+     * Keep empty slab as spare or unmap it.
+     */
+    void releaseSlab(Slab *slab, SizeClass &sc);
+
+public:
+    SlabAllocator();
+    ~SlabAllocator();
+
+    /**
+     * Allocate zero-filled block for at least 'size' bytes.
+     *
+     * @param size  (INOUT) requested size, set to actual block size
+     * @return pointer to block
+     * @throws
+     *      std::bad_alloc  If memory can not be mapped
+     */
+    char *allocate(size_t &size);
+
+    /**
+     * Return block to allocator.
+     *
+     * @param ptr   Block pointer returned by allocate()
+     * @param size  Block size returned by allocate()
+     */
+    void free(char *ptr, size_t size);
+
+    /**
+     * Return actual block size for request of 'size' bytes.
+     */
+    inline static size_t roundUp(size_t size) {
+        return classSize(sizeClass(size));
+    }
+
+    /**
+     * Return number of bytes of address space mapped for slabs.
+     */
+    inline size_t mapped() const {
+        return m_mapped;
+    }
+
+    /**
+     * Return number of mmap calls made.
+     */
+    inline unsigned long long mapCalls() const {
+        return m_mapCalls;
+    }
+};
+
+#endif
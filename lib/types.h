@@ -26,8 +26,10 @@
 
 #include <cstring>
 #include <cstdlib>
-#include <list>
 #include <map>
+#include <vector>
+
+#include "nodeList.h"
 
 class FileNode;
 class FuseZipData;
@@ -51,8 +53,7 @@ struct ltstr {
     }
 };
 
-typedef std::list <FileNode*> nodelist_t;
-typedef std::map <const char*, FileNode*, ltstr> filemap_t;
+typedef NodeList nodelist_t;
 
 #endif
 
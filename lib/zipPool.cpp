@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <syslog.h>
+
+#include "mutexLock.h"
+#include "zipPool.h"
+
+ZipPool::ZipPool(const char *fileName, unsigned int count) {
+    if (count == 0) {
+        count = 1;
+    }
+    pthread_mutex_init(&m_mutex, NULL);
+    try {
+        m_handles.reserve(count);
+        for (unsigned int i = 0; i < count; ++i) {
+            int err;
+            struct zip *z = zip_open(fileName, ZIP_RDONLY, &err);
+            if (z == NULL) {
+                char buf[256];
+                zip_error_to_str(buf, sizeof(buf), err, errno);
+                syslog(LOG_ERR, "cannot open zip archive %s: %s", fileName,
+                        buf);
+                throw std::runtime_error(buf);
+            }
+            Handle *h = new (std::nothrow) Handle;
+            if (h == NULL) {
+                zip_discard(z);
+                throw std::bad_alloc();
+            }
+            h->zip = z;
+            h->users = 0;
+            pthread_mutex_init(&h->mutex, NULL);
+            m_handles.push_back(h);
+        }
+    }
+    catch (...) {
+        closeHandles();
+        pthread_mutex_destroy(&m_mutex);
+        throw;
+    }
+}
+
+ZipPool::~ZipPool() {
+    closeHandles();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void ZipPool::closeHandles() {
+    for (size_t i = 0; i < m_handles.size(); ++i) {
+        Handle *h = m_handles[i];
+        assert(h->users == 0);
+        // archive is not modified through these handles
+        zip_discard(h->zip);
+        pthread_mutex_destroy(&h->mutex);
+        delete h;
+    }
+    m_handles.clear();
+}
+
+ZipPool::Handle *ZipPool::acquire() {
+    MutexLock lock(&m_mutex);
+    Handle *res = m_handles[0];
+    for (size_t i = 1; i < m_handles.size(); ++i) {
+        if (m_handles[i]->users < res->users) {
+            res = m_handles[i];
+        }
+    }
+    ++res->users;
+    return res;
+}
+
+void ZipPool::release(Handle *handle) {
+    MutexLock lock(&m_mutex);
+    assert(handle->users > 0);
+    --handle->users;
+}
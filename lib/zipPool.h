@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef ZIP_POOL_H
+#define ZIP_POOL_H
+
+#include <pthread.h>
+#include <zip.h>
+
+#include <vector>
+
+/**
+ * Set of independent libzip handles of the same read-only archive.
+ *
+ * libzip handle and its open files must not be used from several threads
+ * at once, so file streams are distributed between handles and each
+ * handle is protected by its own mutex. Streams that use different
+ * handles are read and decompressed in parallel.
+ */
+class ZipPool {
+public:
+    struct Handle {
+        struct zip *zip;
+        pthread_mutex_t mutex;
+        /**
+         * Number of streams that use this handle
+         */
+        unsigned int users;
+    };
+
+private:
+    // must not be defined
+    ZipPool (const ZipPool &);
+    ZipPool &operator= (const ZipPool &);
+
+    std::vector<Handle *> m_handles;
+    /**
+     * Protects 'users' counters
+     */
+    pthread_mutex_t m_mutex;
+
+    void closeHandles();
+
+public:
+    /**
+     * Open 'count' handles of archive 'fileName' in read-only mode.
+     *
+     * @param fileName  Absolute path to archive
+     * @param count     Number of handles (at least one is opened)
+     * @throws
+     *      std::runtime_error  If archive can not be opened
+     *      std::bad_alloc      On memory insufficiency
+     */
+    ZipPool(const char *fileName, unsigned int count);
+    ~ZipPool();
+
+    /**
+     * Return the least used handle and count new user of it.
+     */
+    Handle *acquire();
+
+    /**
+     * Return handle obtained by acquire() to pool.
+     */
+    void release(Handle *handle);
+
+    /**
+     * Return mutex of handle or NULL if handle is NULL (for MutexLock)
+     */
+    inline static pthread_mutex_t *mutex(Handle *handle) {
+        return handle != NULL ? &handle->mutex : NULL;
+    }
+
+    /**
+     * Return number of handles
+     */
+    inline size_t size() const {
+        return m_handles.size();
+    }
+};
+
+#endif
@@ -0,0 +1,298 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <syslog.h>
+
+#include "mutexLock.h"
+#include "zipStream.h"
+
+ZipStream::ZipStream(struct zip *z, zip_uint64_t nodeId,
+        InflateIndex *index, ZipPool *pool): m_zip(z), m_pool(pool),
+        m_handle(NULL), m_nodeId(nodeId), m_index(NULL), m_zf(NULL),
+        m_pos(0), m_seekable(true), m_input(NULL), m_window(NULL) {
+    if (m_pool != NULL) {
+        m_handle = m_pool->acquire();
+        m_zip = m_handle->zip;
+    }
+    try {
+        if (index != NULL) {
+            struct zip_stat st;
+            int res;
+            {
+                MutexLock lock(ZipPool::mutex(m_handle));
+                res = zip_stat_index(m_zip, nodeId, 0, &st);
+            }
+            // only unencrypted deflated data can be decompressed by zlib
+            if (res == 0
+                    && (st.valid & ZIP_STAT_COMP_METHOD)
+                    && st.comp_method == ZIP_CM_DEFLATE
+                    && (st.valid & ZIP_STAT_ENCRYPTION_METHOD)
+                    && st.encryption_method == ZIP_EM_NONE
+                    && (st.valid & ZIP_STAT_CRC)
+                    && (st.valid & ZIP_STAT_SIZE)) {
+                m_index = index;
+                m_expectedCrc = st.crc;
+                m_size = st.size;
+            }
+        }
+        if (m_index != NULL) {
+            memset(&m_strm, 0, sizeof(m_strm));
+            if (inflateInit2(&m_strm, -MAX_WBITS) != Z_OK) {
+                m_index = NULL;
+                throw std::bad_alloc();
+            }
+            m_input = (unsigned char *)malloc(inputSize);
+            m_window = (unsigned char *)malloc(InflateIndex::windowSize);
+            if (m_input == NULL || m_window == NULL) {
+                throw std::bad_alloc();
+            }
+        }
+        open();
+    }
+    catch (...) {
+        release();
+        throw;
+    }
+}
+
+ZipStream::~ZipStream() {
+    if (m_zf != NULL) {
+        MutexLock lock(ZipPool::mutex(m_handle));
+        zip_fclose(m_zf);
+    }
+    release();
+}
+
+void ZipStream::release() {
+    if (m_index != NULL) {
+        free(m_input);
+        free(m_window);
+        inflateEnd(&m_strm);
+    }
+    if (m_handle != NULL) {
+        m_pool->release(m_handle);
+    }
+}
+
+void ZipStream::open() {
+    assert(m_zf == NULL);
+    {
+        MutexLock lock(ZipPool::mutex(m_handle));
+        m_zf = zip_fopen_index(m_zip, m_nodeId,
+                (m_index != NULL) ? ZIP_FL_COMPRESSED : 0);
+        if (m_zf == NULL) {
+            std::string err = zip_strerror(m_zip);
+            syslog(LOG_WARNING, "%s", err.c_str());
+            throw std::runtime_error(err);
+        }
+    }
+    m_pos = 0;
+    if (m_index != NULL) {
+        inflateReset(&m_strm);
+        m_strm.avail_in = 0;
+        m_compRead = 0;
+        memset(m_window, 0, InflateIndex::windowSize);
+        m_winFill = 0;
+        m_outStart = m_outAvail = 0;
+        m_eof = false;
+        m_checkCrc = true;
+        m_crc = crc32(0L, Z_NULL, 0);
+    }
+}
+
+void ZipStream::close() {
+    assert(m_zf != NULL);
+    MutexLock lock(ZipPool::mutex(m_handle));
+    int res = zip_fclose(m_zf);
+    m_zf = NULL;
+    if (res != 0) {
+        std::string err = zip_strerror(m_zip);
+        syslog(LOG_WARNING, "%s", err.c_str());
+        throw std::runtime_error(err);
+    }
+}
+
+const char *ZipStream::name() const {
+    // Handle is not locked, as error() is called under its lock. Handles
+    // of pool are opened read-only even if archive is writable, so their
+    // names are not changed by renames, and without pool the stream is
+    // used from single thread.
+    return zip_get_name(m_zip, m_nodeId, ZIP_FL_ENC_RAW);
+}
+
+void ZipStream::error(const char *msg) const {
+    syslog(LOG_WARNING, "%s: %s", name(), msg);
+    throw std::runtime_error(msg);
+}
+
+bool ZipStream::jump(const InflateIndex::Point &point) {
+    assert(m_index != NULL);
+    zip_uint64_t in = point.in - (point.bits ? 1 : 0);
+    unsigned char c = 0;
+    {
+        MutexLock lock(ZipPool::mutex(m_handle));
+        if (zip_fseek(m_zf, in, SEEK_SET) != 0) {
+            return false;
+        }
+        if (point.bits && zip_fread(m_zf, &c, 1) != 1) {
+            error(zip_file_strerror(m_zf));
+        }
+    }
+    inflateReset(&m_strm);
+    m_strm.avail_in = 0;
+    m_compRead = in;
+    if (point.bits) {
+        ++m_compRead;
+        inflatePrime(&m_strm, point.bits, c >> (8 - point.bits));
+    }
+    inflateSetDictionary(&m_strm, point.window, InflateIndex::windowSize);
+    memcpy(m_window, point.window, InflateIndex::windowSize);
+    m_winFill = InflateIndex::windowSize;
+    m_outStart = m_outAvail = 0;
+    m_eof = false;
+    m_checkCrc = false;
+    m_pos = point.out;
+    return true;
+}
+
+void ZipStream::seek(zip_uint64_t offset) {
+    InflateIndex::Point point;
+    bool found = m_index != NULL && m_seekable
+        && m_index->find(offset, point);
+    if (m_pos <= offset && (!found || point.out <= m_pos)) {
+        // continue from current position
+        return;
+    }
+    if (found) {
+        if (jump(point)) {
+            return;
+        }
+        syslog(LOG_INFO, "%s: random access is not supported by libzip",
+                name());
+        m_seekable = false;
+    }
+    // restart from the beginning
+    {
+        MutexLock lock(ZipPool::mutex(m_handle));
+        zip_fclose(m_zf);
+        m_zf = NULL;
+    }
+    open();
+}
+
+void ZipStream::inflateNext() {
+    if (m_winFill == InflateIndex::windowSize) {
+        m_winFill = 0;
+    }
+    if (m_strm.avail_in == 0) {
+        // data is inflated outside of handle lock
+        MutexLock lock(ZipPool::mutex(m_handle));
+        zip_int64_t nr = zip_fread(m_zf, m_input, inputSize);
+        if (nr < 0) {
+            error(zip_file_strerror(m_zf));
+        }
+        m_compRead += nr;
+        m_strm.next_in = m_input;
+        m_strm.avail_in = nr;
+    }
+    m_strm.next_out = m_window + m_winFill;
+    m_strm.avail_out = InflateIndex::windowSize - m_winFill;
+    int ret = inflate(&m_strm, Z_BLOCK);
+    if (ret == Z_MEM_ERROR) {
+        throw std::bad_alloc();
+    }
+    if (ret == Z_BUF_ERROR) {
+        // no progress is possible without more input data
+        error("unexpected end of compressed data");
+    }
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+        error((ret != Z_NEED_DICT && m_strm.msg != NULL) ? m_strm.msg :
+                "invalid compressed data");
+    }
+    unsigned int produced = InflateIndex::windowSize - m_winFill -
+        m_strm.avail_out;
+    if (m_checkCrc) {
+        m_crc = crc32(m_crc, m_window + m_winFill, produced);
+    }
+    m_outStart = m_winFill;
+    m_outAvail = produced;
+    m_winFill += produced;
+    if (ret == Z_STREAM_END) {
+        m_eof = true;
+        if (m_checkCrc && m_crc != m_expectedCrc) {
+            error("CRC error");
+        }
+        return;
+    }
+    // Access points are added on block boundaries except the last block.
+    // See zran.c for details.
+    zip_uint64_t out = m_pos + produced;
+    if ((m_strm.data_type & 128) && !(m_strm.data_type & 64)
+            && m_index->needPoint(out)) {
+        m_index->addPoint(out, m_compRead - m_strm.avail_in,
+                m_strm.data_type & 7, m_window,
+                (m_winFill == InflateIndex::windowSize) ? 0 : m_winFill);
+    }
+}
+
+zip_int64_t ZipStream::read(char *buf, zip_uint64_t size) {
+    assert(m_zf != NULL);
+    if (m_index == NULL) {
+        MutexLock lock(ZipPool::mutex(m_handle));
+        zip_int64_t nr = zip_fread(m_zf, buf, size);
+        if (nr < 0) {
+            std::string err = zip_file_strerror(m_zf);
+            syslog(LOG_WARNING, "%s", err.c_str());
+            throw std::runtime_error(err);
+        }
+        m_pos += nr;
+        return nr;
+    }
+    zip_uint64_t done = 0;
+    while (done < size) {
+        if (m_outAvail > 0) {
+            zip_uint64_t n = m_outAvail;
+            if (n > size - done) {
+                n = size - done;
+            }
+            memcpy(buf + done, m_window + m_outStart, n);
+            m_outStart += n;
+            m_outAvail -= n;
+            m_pos += n;
+            done += n;
+        } else if (m_eof) {
+            break;
+        } else {
+            inflateNext();
+        }
+    }
+    if (m_pos == m_size && m_outAvail == 0 && !m_eof) {
+        // process the end of deflate stream to check CRC
+        inflateNext();
+    }
+    return done;
+}
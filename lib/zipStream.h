@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2016 by Alexander Galanin                               //
+//  al@galanin.nnov.ru                                                    //
+//  http://galanin.nnov.ru/~al                                            //
+//                                                                        //
+//  This program is free software; you can redistribute it and/or modify  //
+//  it under the terms of the GNU Lesser General Public License as        //
+//  published by the Free Software Foundation; either version 3 of the    //
+//  License, or (at your option) any later version.                       //
+//                                                                        //
+//  This program is distributed in the hope that it will be useful,       //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+//  GNU General Public License for more details.                          //
+//                                                                        //
+//  You should have received a copy of the GNU Lesser General Public      //
+//  License along with this program; if not, write to the                 //
+//  Free Software Foundation, Inc.,                                       //
+//  51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA               //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef ZIP_STREAM_H
+#define ZIP_STREAM_H
+
+#include <zip.h>
+#include <zlib.h>
+
+#include "inflateIndex.h"
+#include "zipPool.h"
+
+/**
+ * Sequential reader of file data inside zip archive.
+ *
+ * If access point index is given and file is deflated, data is
+ * decompressed by zlib instead of libzip. In this mode access points are
+ * added into index on the fly and used to start decompression from the
+ * middle of file.
+ *
+ * If handle pool is given, file is opened through the least used handle of
+ * pool and libzip calls are made under handle mutex, so streams of
+ * different handles can be read from different threads.
+ */
+class ZipStream {
+private:
+    // must not be defined
+    ZipStream (const ZipStream &);
+    ZipStream &operator= (const ZipStream &);
+
+    static const unsigned int inputSize = 16*1024; // 16 Kilobytes
+
+    struct zip *m_zip;
+    /**
+     * Pool that m_handle is taken from or NULL
+     */
+    ZipPool *m_pool;
+    /**
+     * Pool handle that m_zip belongs to or NULL
+     */
+    ZipPool::Handle *m_handle;
+    zip_uint64_t m_nodeId;
+    /**
+     * Access point index. NULL if data is decompressed by libzip.
+     */
+    InflateIndex *m_index;
+    struct zip_file *m_zf;
+    /**
+     * Offset in uncompressed data of the next byte to be read
+     */
+    zip_uint64_t m_pos;
+    /**
+     * False if zip_fseek() is not supported for this file
+     */
+    bool m_seekable;
+
+    // Fields used for raw deflate stream decompression
+    z_stream m_strm;
+    unsigned char *m_input;
+    /**
+     * Circular buffer with last InflateIndex::windowSize bytes of output
+     */
+    unsigned char *m_window;
+    /**
+     * Position in m_window to write next decompressed data
+     */
+    unsigned int m_winFill;
+    /**
+     * Decompressed but not yet returned data in m_window
+     */
+    unsigned int m_outStart, m_outAvail;
+    /**
+     * Offset in compressed data of the byte after m_input end
+     */
+    zip_uint64_t m_compRead;
+    bool m_eof;
+    /**
+     * CRC is checked only if whole file is read from the beginning
+     */
+    bool m_checkCrc;
+    uLong m_crc;
+    zip_uint32_t m_expectedCrc;
+    zip_uint64_t m_size;
+
+    /**
+     * Open file stream and set position to the file beginning
+     * @throws
+     *      std::exception  On file open error
+     */
+    void open();
+
+    /**
+     * Start decompression from access point.
+     * @return false if compressed stream cannot be positioned
+     * @throws
+     *      std::exception  On file read error
+     */
+    bool jump(const InflateIndex::Point &point);
+
+    /**
+     * Decompress next portion of data into m_window.
+     * @throws
+     *      std::exception  On file read error or corrupted data
+     *      std::bad_alloc  On memory insufficiency
+     */
+    void inflateNext();
+
+    /**
+     * Log error message and throw an exception
+     */
+    void error(const char *msg) const;
+
+    /**
+     * Free zlib state and return handle to pool
+     */
+    void release();
+
+public:
+    /**
+     * Open file inside zip archive for reading.
+     *
+     * @param z         Zip file
+     * @param nodeId    Node index inside zip file
+     * @param index     Access point index or NULL
+     * @param pool      Pool of handles to open file through instead of 'z'
+     *                  or NULL
+     * @throws
+     *      std::exception  On file open error
+     *      std::bad_alloc  On memory insufficiency
+     */
+    ZipStream(struct zip *z, zip_uint64_t nodeId, InflateIndex *index,
+            ZipPool *pool = NULL);
+    ~ZipStream();
+
+    /**
+     * Return offset in uncompressed data of the next byte to be read
+     */
+    inline zip_uint64_t pos() const {
+        return m_pos;
+    }
+
+    /**
+     * Move stream position to the nearest point before or at 'offset'
+     * from which data can be read: current position, access point or
+     * file beginning.
+     *
+     * @throws
+     *      std::exception  On file read error
+     */
+    void seek(zip_uint64_t offset);
+
+    /**
+     * Read up to 'size' bytes from current position.
+     *
+     * @return number of bytes read, 0 at the end of data
+     * @throws
+     *      std::exception  On file read error or corrupted data
+     *      std::bad_alloc  On memory insufficiency
+     */
+    zip_int64_t read(char *buf, zip_uint64_t size);
+
+    /**
+     * Close file stream and check for errors.
+     *
+     * @throws
+     *      std::exception  If libzip reports an error
+     */
+    void close();
+
+    /**
+     * Return file name inside archive
+     */
+    const char *name() const;
+};
+
+#endif
@@ -31,6 +31,7 @@
 #include <syslog.h>
 
 #include <cerrno>
+#include <cstddef>
 
 #include "fuse-zip.h"
 #include "fuseZipData.h"
@@ -46,6 +47,33 @@ void print_usage() {
             "    -h   --help            print help\n"
             "    -V   --version         print version\n"
             "    -r   -o ro             open archive in read-only mode\n"
+            "    -o seek_index=N        build index for random access into\n"
+            "                           deflated files every N megabytes\n"
+            "    -o cache_size=N        keep up to N megabytes of data of\n"
+            "                           closed files in memory\n"
+            "    -o spill_size=N        move data of file larger than N\n"
+            "                           megabytes from memory to disk\n"
+            "    -o spill_total=N       move file data from memory to disk\n"
+            "                           if all files take N megabytes\n"
+            "    -o mmap_buffers        keep data of each file in single\n"
+            "                           memory mapping\n"
+            "    -o fast_mount          read file metadata from central\n"
+            "                           directory only on mount\n"
+            "    -o tree_threads=N      create file tree in N threads in\n"
+            "                           fast_mount mode\n"
+            "    -o index_cache=DIR     keep file tree of archive in DIR\n"
+            "                           between mounts\n"
+            "    -o lazy_tree           create file tree nodes on demand\n"
+            "                           (read-only mode)\n"
+            "    -o lazy_nodes=N        keep up to N nodes of lazy tree\n"
+            "    -o zip_handles=N       decompress files in N threads\n"
+            "    -o rw_threads          serve read-write archive from\n"
+            "                           several threads\n"
+            "    -o decompress_threads=N\n"
+            "                           decompress opened files in N\n"
+            "                           background threads\n"
+            "    -o readahead=N         decompress N archive entries ahead\n"
+            "                           of sequential scan\n"
             "    -f                     don't detach from terminal\n"
             "    -d                     turn on debugging, also implies -f\n"
             "\n");
@@ -72,6 +100,32 @@ struct fusezip_param {
     const char *fileName;
     // read-only flag
     bool readonly;
+    // distance between seek index access points in megabytes
+    unsigned int seekIndex;
+    // buffer cache size in megabytes
+    unsigned int cacheSize;
+    // memory limits for file data in megabytes
+    unsigned int spillSize;
+    unsigned int spillTotal;
+    // keep file data in memory mappings (int is required by fuse_opt)
+    int mmapBuffers;
+    // don't read local headers on mount
+    int fastMount;
+    // number of threads to build file tree
+    unsigned int treeThreads;
+    // directory of file tree cache (allocated by fuse_opt_parse)
+    char *indexCache;
+    // create nodes on demand
+    int lazyTree;
+    unsigned int lazyNodes;
+    // number of archive handles in multithreaded mode
+    unsigned int zipHandles;
+    // use several threads in read-write mode
+    int rwThreads;
+    // number of background decompression threads
+    unsigned int decompressThreads;
+    // number of entries to read ahead
+    unsigned int readahead;
 };
 
 /**
@@ -143,6 +197,20 @@ static const struct fuse_opt fusezip_opts[] = {
     FUSE_OPT_KEY("--version",   KEY_VERSION),
     FUSE_OPT_KEY("-r",          KEY_RO),
     FUSE_OPT_KEY("ro",          KEY_RO),
+    {"seek_index=%u", offsetof(struct fusezip_param, seekIndex), 0},
+    {"cache_size=%u", offsetof(struct fusezip_param, cacheSize), 0},
+    {"spill_size=%u", offsetof(struct fusezip_param, spillSize), 0},
+    {"spill_total=%u", offsetof(struct fusezip_param, spillTotal), 0},
+    {"mmap_buffers", offsetof(struct fusezip_param, mmapBuffers), 1},
+    {"fast_mount", offsetof(struct fusezip_param, fastMount), 1},
+    {"tree_threads=%u", offsetof(struct fusezip_param, treeThreads), 0},
+    {"index_cache=%s", offsetof(struct fusezip_param, indexCache), 0},
+    {"lazy_tree", offsetof(struct fusezip_param, lazyTree), 1},
+    {"lazy_nodes=%u", offsetof(struct fusezip_param, lazyNodes), 0},
+    {"zip_handles=%u", offsetof(struct fusezip_param, zipHandles), 0},
+    {"rw_threads", offsetof(struct fusezip_param, rwThreads), 1},
+    {"decompress_threads=%u", offsetof(struct fusezip_param, decompressThreads), 0},
+    {"readahead=%u", offsetof(struct fusezip_param, readahead), 0},
     {NULL, 0, 0}
 };
 
@@ -157,6 +225,20 @@ int main(int argc, char *argv[]) {
     param.help = false;
     param.version = false;
     param.readonly = false;
+    param.seekIndex = 0;
+    param.cacheSize = 0;
+    param.spillSize = 0;
+    param.spillTotal = 0;
+    param.mmapBuffers = 0;
+    param.fastMount = 0;
+    param.treeThreads = 0;
+    param.indexCache = NULL;
+    param.lazyTree = 0;
+    param.lazyNodes = 0;
+    param.zipHandles = 0;
+    param.rwThreads = 0;
+    param.decompressThreads = 0;
+    param.readahead = 0;
     param.strArgCount = 0;
     param.fileName = NULL;
 
@@ -181,8 +263,27 @@ int main(int argc, char *argv[]) {
         }
 
         openlog(PROGRAM, LOG_PID, LOG_USER);
-        if ((data = initFuseZip(PROGRAM, param.fileName, param.readonly))
-                == NULL) {
+        FuseZipOptions options;
+        options.seekIndexInterval = param.seekIndex * 1024ULL * 1024ULL;
+        options.cacheSize = param.cacheSize * 1024ULL * 1024ULL;
+        options.spillFileSize = param.spillSize * 1024ULL * 1024ULL;
+        options.spillTotalSize = param.spillTotal * 1024ULL * 1024ULL;
+        options.mmapBuffers = param.mmapBuffers != 0;
+        options.fastMount = param.fastMount != 0;
+        options.treeThreads = param.treeThreads;
+        if (param.indexCache != NULL) {
+            options.indexCacheDir = param.indexCache;
+            free(param.indexCache);
+        }
+        options.lazyTree = param.lazyTree != 0;
+        if (param.lazyNodes > 0) {
+            options.lazyNodeLimit = param.lazyNodes;
+        }
+        options.zipHandles = param.zipHandles;
+        options.decompressThreads = param.decompressThreads;
+        options.readahead = param.readahead;
+        if ((data = initFuseZip(PROGRAM, param.fileName, param.readonly,
+                        options)) == NULL) {
             fuse_opt_free_args(&args);
             return EXIT_FAILURE;
         }
@@ -196,6 +297,9 @@ int main(int argc, char *argv[]) {
     fusezip_oper.statfs     =   fusezip_statfs;
     fusezip_oper.open       =   fusezip_open;
     fusezip_oper.read       =   fusezip_read;
+#if FUSE_VERSION >= 29
+    fusezip_oper.read_buf   =   fusezip_read_buf;
+#endif
     fusezip_oper.write      =   fusezip_write;
     fusezip_oper.release    =   fusezip_release;
     fusezip_oper.unlink     =   fusezip_unlink;
@@ -228,7 +332,9 @@ int main(int argc, char *argv[]) {
 
     struct fuse *fuse;
     char *mountpoint;
-    // this flag ignored because libzip does not supports multithreading
+    // libzip does not support multithreading, so several threads are used
+    // only if archive handles are opened for them. Read-write archive is
+    // served from several threads on request only.
     int multithreaded;
     int res;
 
@@ -238,7 +344,12 @@ int main(int argc, char *argv[]) {
         delete data;
         return EXIT_FAILURE;
     }
-    res = fuse_loop(fuse);
+    if (multithreaded && (param.readonly || param.rwThreads)
+            && data->enableThreads()) {
+        res = fuse_loop_mt(fuse);
+    } else {
+        res = fuse_loop(fuse);
+    }
     fuse_teardown(fuse, mountpoint);
     return (res == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
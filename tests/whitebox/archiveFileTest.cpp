@@ -0,0 +1,446 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "archiveFile.h"
+#include "bigBuffer.h"
+#include "common.h"
+
+// libzip stub structures
+struct zip {
+};
+struct zip_file {
+};
+struct zip_source {
+};
+
+// only stubs
+
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t,
+        struct zip_stat *) {
+    assert(false);
+    return -1;
+}
+
+struct zip_file *zip_fopen_index(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
+    assert(false);
+    return -1;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return -1;
+}
+
+int zip_fclose(struct zip_file *) {
+    assert(false);
+    return 0;
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_strerror(struct zip *) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+void putShort(std::string &s, unsigned int v) {
+    s += char(v & 0xFF);
+    s += char((v >> 8) & 0xFF);
+}
+
+void putLong(std::string &s, zip_uint32_t v) {
+    putShort(s, v & 0xFFFF);
+    putShort(s, v >> 16);
+}
+
+void putLongLong(std::string &s, zip_uint64_t v) {
+    putLong(s, v & 0xFFFFFFFF);
+    putLong(s, v >> 32);
+}
+
+/**
+ * Build archive with uncompressed entries.
+ * @param prefix    data prepended to archive
+ * @param zip64     use ZIP64 extensions for local header offsets
+ * @param offsets   (OUT) expected data offsets
+ */
+std::string buildArchive(const std::string &prefix, bool zip64,
+        const char **names, const char **contents, int count,
+        zip_uint64_t *offsets) {
+    std::string res = prefix, cd;
+    for (int i = 0; i < count; ++i) {
+        zip_uint64_t local = res.size() - prefix.size();
+        size_t len = strlen(contents[i]);
+        putLong(res, 0x04034b50);
+        putShort(res, 10);      // version needed
+        putShort(res, 0);       // flags
+        putShort(res, 0);       // method
+        putLong(res, 0);        // time & date
+        putLong(res, 0);        // CRC
+        putLong(res, len);
+        putLong(res, len);
+        putShort(res, strlen(names[i]));
+        // extra field length differs from central directory one
+        putShort(res, 4);
+        res += names[i];
+        putShort(res, 0xCAFE);
+        putShort(res, 0);
+        offsets[i] = res.size();
+        res += contents[i];
+
+        std::string extra;
+        if (zip64) {
+            putShort(extra, 0x0001);
+            putShort(extra, 8);
+            putLongLong(extra, local);
+        }
+        putLong(cd, 0x02014b50);
+        putShort(cd, 0x031E);   // version made by
+        putShort(cd, zip64 ? 45 : 10);
+        putShort(cd, 0);
+        putShort(cd, 0);
+        putLong(cd, 0);
+        putLong(cd, 0);
+        putLong(cd, len);
+        putLong(cd, len);
+        putShort(cd, strlen(names[i]));
+        putShort(cd, extra.size());
+        putShort(cd, 0);        // comment length
+        putShort(cd, 0);        // disk number
+        putShort(cd, 0);        // internal attributes
+        putLong(cd, 0);         // external attributes
+        putLong(cd, zip64 ? 0xFFFFFFFF : local);
+        cd += names[i];
+        cd += extra;
+    }
+    zip_uint64_t cdOffset = res.size() - prefix.size();
+    res += cd;
+    if (zip64) {
+        zip_uint64_t eocd64Offset = res.size() - prefix.size();
+        putLong(res, 0x06064b50);
+        putLongLong(res, 44);
+        putShort(res, 45);
+        putShort(res, 45);
+        putLong(res, 0);
+        putLong(res, 0);
+        putLongLong(res, count);
+        putLongLong(res, count);
+        putLongLong(res, cd.size());
+        putLongLong(res, cdOffset);
+
+        putLong(res, 0x07064b50);
+        putLong(res, 0);
+        putLongLong(res, eocd64Offset);
+        putLong(res, 1);
+    }
+    putLong(res, 0x06054b50);
+    putShort(res, 0);
+    putShort(res, 0);
+    putShort(res, zip64 ? 0xFFFF : count);
+    putShort(res, zip64 ? 0xFFFF : count);
+    putLong(res, zip64 ? 0xFFFFFFFF : cd.size());
+    putLong(res, zip64 ? 0xFFFFFFFF : cdOffset);
+    putShort(res, 7);
+    res += "comment";
+    return res;
+}
+
+/**
+ * Write data into temporary file and return its descriptor
+ */
+int tempFile(const std::string &data) {
+    char name[] = "/tmp/fuse-zip-test.XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    unlink(name);
+    assert(write(fd, data.data(), data.size()) == ssize_t(data.size()));
+    return fd;
+}
+
+std::string readAt(int fd, zip_int64_t offset, size_t size) {
+    assert(offset >= 0);
+    std::string res(size, '\0');
+    assert(pread(fd, &res[0], size, offset) == ssize_t(size));
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+const char *names[] = {"a.txt", "dir/", "dir/long name.txt"};
+const char *contents[] = {"first", "", "Lorem ipsum dolor sit amet"};
+
+void checkArchive(const std::string &prefix, bool zip64) {
+    zip_uint64_t offsets[3];
+    int fd = tempFile(buildArchive(prefix, zip64, names, contents, 3,
+                offsets));
+    ArchiveFile af(fd);
+    // entries are read in arbitrary order
+    for (int i = 2; i >= 0; --i) {
+        assert(af.dataOffset(i) == zip_int64_t(offsets[i]));
+        assert(readAt(fd, af.dataOffset(i), strlen(contents[i]))
+                == contents[i]);
+    }
+    assert(af.dataOffset(3) == -1);
+}
+
+void simpleArchive() {
+    checkArchive("", false);
+}
+
+void prefixedArchive() {
+    checkArchive("#!/bin/sh\nexit 0\n", false);
+}
+
+void zip64Archive() {
+    checkArchive("", true);
+    checkArchive("self-extracting stub", true);
+}
+
+void checkMappedArchive(const std::string &prefix, bool zip64) {
+    zip_uint64_t offsets[3];
+    int fd = tempFile(buildArchive(prefix, zip64, names, contents, 3,
+                offsets));
+    ArchiveFile af(fd);
+    assert(af.mapCentralDirectory());
+    assert(af.entriesCount() == 3);
+    zip_uint64_t pos = 0;
+    for (int i = 0; i < 3; ++i) {
+        ArchiveFile::Entry entry;
+        zip_uint64_t local;
+        assert(af.readEntry(pos, entry, local));
+        assert(std::string(entry.name, entry.nameLen) == names[i]);
+        assert(entry.size == strlen(contents[i]));
+        assert(entry.opsys == 3);
+        assert(entry.extraLen == (zip64 ? 12 : 0));
+        // data follows local header with 4-byte extra field
+        assert(local + 30 + strlen(names[i]) + 4 == offsets[i]);
+    }
+    // no more records
+    ArchiveFile::Entry entry;
+    zip_uint64_t local;
+    assert(!af.readEntry(pos, entry, local));
+    // mapping is reused by parser
+    assert(af.dataOffset(1) == zip_int64_t(offsets[1]));
+    assert(af.m_map != NULL);
+    af.unmapCentralDirectory();
+    assert(af.m_map == NULL);
+}
+
+void mappedCentralDirectory() {
+    checkMappedArchive("", false);
+    checkMappedArchive("#!/bin/sh\nexit 0\n", false);
+    checkMappedArchive("self-extracting stub", true);
+    {
+        ArchiveFile af(tempFile("not a zip archive"));
+        assert(!af.mapCentralDirectory());
+    }
+    {
+        zip_uint64_t offsets[2];
+        std::string data = buildArchive("", false, names, contents, 2,
+                offsets);
+        // break signature of the second central directory record
+        size_t cd = data.find("PK\x01\x02");
+        cd = data.find("PK\x01\x02", cd + 1);
+        assert(cd != std::string::npos);
+        data[cd] = 'X';
+        ArchiveFile af(tempFile(data));
+        assert(af.mapCentralDirectory());
+        zip_uint64_t pos = 0, local;
+        ArchiveFile::Entry entry;
+        assert(af.readEntry(pos, entry, local));
+        assert(!af.readEntry(pos, entry, local));
+    }
+}
+
+void dosTime() {
+    // 2020-01-15 12:34:56
+    zip_uint16_t date = (40 << 9) | (1 << 5) | 15;
+    zip_uint16_t time = (12 << 11) | (34 << 5) | (56 >> 1);
+    ArchiveFile::TimeCache cache;
+    for (int i = 0; i < 2; ++i) {
+        time_t t = ArchiveFile::dosTime(time, date, cache);
+        struct tm tm;
+        assert(localtime_r(&t, &tm) != NULL);
+        assert(tm.tm_year == 120 && tm.tm_mon == 0 && tm.tm_mday == 15);
+        assert(tm.tm_hour == 12 && tm.tm_min == 34 && tm.tm_sec == 56);
+    }
+    time_t t = ArchiveFile::dosTime(time, date + 1, cache);
+    assert(t - ArchiveFile::dosTime(time, date, cache) == 24 * 60 * 60);
+}
+
+void badArchive() {
+    {
+        ArchiveFile af(tempFile("not a zip archive"));
+        assert(af.dataOffset(0) == -1);
+    }
+    {
+        zip_uint64_t offsets[1];
+        std::string data = buildArchive("", false, names, contents, 1,
+                offsets);
+        // break local header signature
+        data[0] = 'X';
+        ArchiveFile af(tempFile(data));
+        assert(af.dataOffset(0) == -1);
+    }
+}
+
+void bigBufferDirect() {
+    const size_t U = BigBuffer::minExtentSize;
+    std::string content;
+    for (size_t i = 0; i < 4 * U; ++i) {
+        content += char('a' + i % 26);
+    }
+    std::string data = "header" + content + "trailer";
+    int fd = tempFile(data);
+    static char buf[8 * BigBuffer::minExtentSize];
+
+    BigBuffer bb(fd, 6, content.size());
+    assert(bb.m_stream == NULL);
+    assert(bb.read(buf, sizeof(buf), 3 * U + 100) == int(U - 100));
+    assert(memcmp(buf, content.data() + 3 * U + 100, U - 100) == 0);
+    // nothing is kept in memory
+    assert(bb.m_loaded.empty());
+    assert(bb.memoryUsage() == 0);
+
+    size_t size = 100;
+    int dfd;
+    zip_uint64_t pos;
+    assert(bb.dataLocation(size, 2 * U, dfd, pos));
+    assert(dfd == fd && pos == 2 * U + 6 && size == 100);
+    size = sizeof(buf);
+    assert(bb.dataLocation(size, 2 * U, dfd, pos));
+    assert(size == 2 * U);
+
+    // modification loads data around written range only
+    assert(bb.write("XYZ", 3, 100) == 3);
+    assert(!bb.dataLocation(size = 10, 95, dfd, pos));
+    assert(bb.dataLocation(size = 10, 2 * U, dfd, pos));
+    assert(bb.read(buf, 10, 95) == 10);
+    assert(memcmp(buf, content.data() + 95, 5) == 0);
+    assert(memcmp(buf + 5, "XYZ", 3) == 0);
+    assert(memcmp(buf + 8, content.data() + 103, 2) == 0);
+    // mixed range
+    assert(bb.read(buf, 2 * U, 0) == int(2 * U));
+    assert(memcmp(buf + 200, content.data() + 200, 2 * U - 200) == 0);
+    assert(bb.dataLocation(size = 10, 2 * U, dfd, pos));
+
+    // archive file is not needed after all data is loaded
+    assert(bb.read(buf, sizeof(buf), 0) == int(4 * U));
+    assert(memcmp(buf + 200, content.data() + 200, 4 * U - 200) == 0);
+    assert(bb.m_fd == -1);
+    assert(bb.write("!", 1, content.size()) == 1);
+    assert(!bb.dataLocation(size = 10, 2 * U, dfd, pos));
+    assert(bb.read(buf, 10, 4 * U - 5) == 6);
+    assert(memcmp(buf, content.data() + 4 * U - 5, 5) == 0);
+    assert(buf[5] == '!');
+
+    close(fd);
+}
+
+void bigBufferDirectTruncate() {
+    int fd = tempFile("0123456789");
+    char buf[10];
+    {
+        BigBuffer bb(fd, 0, 10);
+        bb.truncate(0);
+        assert(bb.m_fd == -1);
+        assert(bb.read(buf, 10, 0) == 0);
+    }
+    {
+        BigBuffer bb(fd, 0, 10);
+        bb.truncate(5);
+        bb.truncate(8);
+        assert(bb.read(buf, 10, 0) == 8);
+        assert(memcmp(buf, "01234\0\0\0", 8) == 0);
+    }
+    {
+        // archive file is shorter than expected
+        BigBuffer bb(fd, 5, 10);
+        bool thrown = false;
+        try {
+            bb.read(buf, 10, 0);
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    close(fd);
+}
+
+int main(int, char **) {
+    initTest();
+
+    simpleArchive();
+    prefixedArchive();
+    zip64Archive();
+    badArchive();
+    mappedCentralDirectory();
+    dosTime();
+    bigBufferDirect();
+    bigBufferDirectTruncate();
+
+    return EXIT_SUCCESS;
+}
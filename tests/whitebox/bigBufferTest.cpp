@@ -27,10 +27,14 @@ struct zip {
     bool fail_zip_source_function;
     bool fail_zip_add;
     bool fail_zip_replace;
+    // number of bytes returned by zip_fread
+    zip_uint64_t bytes_read;
+    // byte returned by zip_fread
+    char fill;
 
     struct zip_source *source;
 
-    zip(): zip_fread_custom_return(false) {}
+    zip(): zip_fread_custom_return(false), bytes_read(0), fill('X') {}
 };
 struct zip_file {
     struct zip *zip;
@@ -69,10 +73,12 @@ zip_int64_t zip_fread(struct zip_file *zf, void *dest, zip_uint64_t size) {
     if (zf->zip->fail_zip_fread) {
         return -1;
     } else {
+        memset(dest, zf->zip->fill, size);
         if (zf->zip->zip_fread_custom_return) {
+            // bytes after requested size are not really written
             size = zf->zip->zip_fread_custom_return_length;
         }
-        memset(dest, 'X', size);
+        zf->zip->bytes_read += size;
         return size;
     }
 }
@@ -127,6 +133,10 @@ int zip_error_to_str(char *, zip_uint64_t, int, int) {
     return 0;
 }
 
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
 zip_int64_t zip_dir_add(struct zip *, const char *, zip_flags_t) {
     assert(false);
     return 0;
@@ -152,7 +162,12 @@ int zip_rename(struct zip *, int, const char *) {
     return 0;
 }
 
-int zip_stat_index(struct zip *, int, int, struct zip_stat *) {
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t, struct zip_stat *) {
+    assert(false);
+    return 0;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
     assert(false);
     return 0;
 }
@@ -161,28 +176,42 @@ int zip_stat_index(struct zip *, int, int, struct zip_stat *) {
 // TESTS
 ////////////////////////////////////////////////////////////////////////////
 
-void chunkLocators() {
+void extentLocators() {
     // static functions test
-    assert(BigBuffer::chunksCount(0) == 0);
-    assert(BigBuffer::chunksCount(1) == 1);
-    assert(BigBuffer::chunksCount(BigBuffer::chunkSize) == 1);
-    assert(BigBuffer::chunksCount(BigBuffer::chunkSize - 1) == 1);
-    assert(BigBuffer::chunksCount(BigBuffer::chunkSize + 1) == 2);
-    assert(BigBuffer::chunksCount(BigBuffer::chunkSize * 2 - 1) == 2);
-
-    assert(BigBuffer::chunkNumber(0) == 0);
-    assert(BigBuffer::chunkNumber(1) == 0);
-    assert(BigBuffer::chunkNumber(BigBuffer::chunkSize) == 1);
-    assert(BigBuffer::chunkNumber(BigBuffer::chunkSize - 1) == 0);
-    assert(BigBuffer::chunkNumber(BigBuffer::chunkSize + 1) == 1);
-    assert(BigBuffer::chunkNumber(BigBuffer::chunkSize * 2 - 1) == 1);
-
-    assert(BigBuffer::chunkOffset(0) == 0);
-    assert(BigBuffer::chunkOffset(1) == 1);
-    assert(BigBuffer::chunkOffset(BigBuffer::chunkSize) == 0);
-    assert(BigBuffer::chunkOffset(BigBuffer::chunkSize - 1) == BigBuffer::chunkSize - 1);
-    assert(BigBuffer::chunkOffset(BigBuffer::chunkSize + 1) == 1);
-    assert(BigBuffer::chunkOffset(BigBuffer::chunkSize * 2 - 1) == BigBuffer::chunkSize - 1);
+    const zip_uint64_t K = 1024, M = 1024 * 1024;
+
+    assert(BigBuffer::extentsCount(0) == 0);
+    assert(BigBuffer::extentsCount(1) == 1);
+    assert(BigBuffer::extentsCount(64 * K) == 1);
+    assert(BigBuffer::extentsCount(64 * K + 1) == 2);
+    assert(BigBuffer::extentsCount(M) == 16);
+    assert(BigBuffer::extentsCount(M + 1) == 17);
+    assert(BigBuffer::extentsCount(16 * M) == 31);
+    assert(BigBuffer::extentsCount(16 * M + 1) == 32);
+    assert(BigBuffer::extentsCount(1024 * M) == 31 + 126);
+
+    assert(BigBuffer::extentNumber(0) == 0);
+    assert(BigBuffer::extentNumber(64 * K - 1) == 0);
+    assert(BigBuffer::extentNumber(64 * K) == 1);
+    assert(BigBuffer::extentNumber(M - 1) == 15);
+    assert(BigBuffer::extentNumber(M) == 16);
+    assert(BigBuffer::extentNumber(2 * M) == 17);
+    assert(BigBuffer::extentNumber(16 * M - 1) == 30);
+    assert(BigBuffer::extentNumber(16 * M) == 31);
+    assert(BigBuffer::extentNumber(24 * M - 1) == 31);
+    assert(BigBuffer::extentNumber(24 * M) == 32);
+    assert(BigBuffer::extentNumber(8192 * M) == 31 + 1022);
+
+    for (unsigned int n = 0; n < 100; ++n) {
+        zip_uint64_t start = BigBuffer::extentStart(n);
+        size_t size = BigBuffer::extentSize(n);
+        assert(BigBuffer::extentNumber(start) == n);
+        assert(BigBuffer::extentNumber(start + size - 1) == n);
+        assert(BigBuffer::extentStart(n + 1) == start + size);
+    }
+    assert(BigBuffer::extentSize(0) == 64 * K);
+    assert(BigBuffer::extentSize(16) == M);
+    assert(BigBuffer::extentSize(31) == 8 * M);
 }
 
 void createDelete() {
@@ -199,11 +228,11 @@ void truncate() {
     bb.truncate(2);
     assert(bb.len == 2);
 
-    bb.truncate(BigBuffer::chunkSize);
-    assert(bb.len == BigBuffer::chunkSize);
+    bb.truncate(BigBuffer::minExtentSize);
+    assert(bb.len == BigBuffer::minExtentSize);
 
-    bb.truncate(BigBuffer::chunkSize + 1);
-    assert(bb.len == BigBuffer::chunkSize + 1);
+    bb.truncate(BigBuffer::minExtentSize + 1);
+    assert(bb.len == BigBuffer::minExtentSize + 1);
 
     bb.truncate(0);
     assert(bb.len == 0);
@@ -227,15 +256,15 @@ void readFile() {
     assert(nr == 10);
     assert(memcmp(buf, empty, nr) == 0);
 
-    bb.truncate(BigBuffer::chunkSize);
-    nr = bb.read(buf, 10, BigBuffer::chunkSize - 5);
+    bb.truncate(BigBuffer::minExtentSize);
+    nr = bb.read(buf, 10, BigBuffer::minExtentSize - 5);
     assert(nr == 5);
     assert(memcmp(buf, empty, nr) == 0);
 }
 
-// read (size > chunkSize)
+// read (size > minExtentSize)
 void readFileOverChunkSize() {
-    int n = BigBuffer::chunkSize * 3 + 15;
+    int n = BigBuffer::minExtentSize * 3 + 15;
     char buf[n];
     char empty[n];
     memset(empty, 0, n);
@@ -253,17 +282,17 @@ void readFileOverChunkSize() {
     assert(nr == 10);
     assert(memcmp(buf, empty, nr) == 0);
 
-    bb.truncate(BigBuffer::chunkSize);
-    nr = bb.read(buf, n, BigBuffer::chunkSize - 5);
+    bb.truncate(BigBuffer::minExtentSize);
+    nr = bb.read(buf, n, BigBuffer::minExtentSize - 5);
     assert(nr == 5);
     assert(memcmp(buf, empty, nr) == 0);
 
-    bb.truncate(BigBuffer::chunkSize * 2 - 12);
+    bb.truncate(BigBuffer::minExtentSize * 2 - 12);
     nr = bb.read(buf, n, 1);
-    assert(nr == BigBuffer::chunkSize * 2 - 12 - 1);
+    assert(nr == BigBuffer::minExtentSize * 2 - 12 - 1);
     assert(memcmp(buf, empty, nr) == 0);
 
-    bb.truncate(BigBuffer::chunkSize * 10);
+    bb.truncate(BigBuffer::minExtentSize * 10);
     nr = bb.read(buf, n, 1);
     assert(nr == n);
     assert(memcmp(buf, empty, nr) == 0);
@@ -271,15 +300,15 @@ void readFileOverChunkSize() {
 
 // read data created by truncate
 void truncateRead() {
-    char buf[BigBuffer::chunkSize];
-    char empty[BigBuffer::chunkSize];
-    memset(empty, 0, BigBuffer::chunkSize);
+    char buf[BigBuffer::minExtentSize];
+    char empty[BigBuffer::minExtentSize];
+    memset(empty, 0, BigBuffer::minExtentSize);
     BigBuffer b;
-    b.truncate(BigBuffer::chunkSize);
-    assert(b.len == BigBuffer::chunkSize);
-    int nr = b.read(buf, BigBuffer::chunkSize, 0);
-    assert((unsigned)nr == BigBuffer::chunkSize);
-    assert(memcmp(buf, empty, BigBuffer::chunkSize) == 0);
+    b.truncate(BigBuffer::minExtentSize);
+    assert(b.len == BigBuffer::minExtentSize);
+    int nr = b.read(buf, BigBuffer::minExtentSize, 0);
+    assert((unsigned)nr == BigBuffer::minExtentSize);
+    assert(memcmp(buf, empty, BigBuffer::minExtentSize) == 0);
 }
 
 // writing to file
@@ -313,7 +342,7 @@ void writeFile() {
 
 // read data from file expanded by write
 void readExpanded() {
-    int n = BigBuffer::chunkSize * 2;
+    int n = BigBuffer::minExtentSize * 2;
     char buf[n];
     char expected[n];
     memset(expected, 0, n);
@@ -325,12 +354,12 @@ void readExpanded() {
     assert(b.len == 10);
 
     memset(buf, 'z', 10);
-    memset(expected + BigBuffer::chunkSize + 10, 'z', 10);
-    b.write(buf, 10, BigBuffer::chunkSize + 10);
-    assert(b.len == BigBuffer::chunkSize + 20);
+    memset(expected + BigBuffer::minExtentSize + 10, 'z', 10);
+    b.write(buf, 10, BigBuffer::minExtentSize + 10);
+    assert(b.len == BigBuffer::minExtentSize + 20);
 
     int nr = b.read(buf, n, 0);
-    assert((unsigned)nr == BigBuffer::chunkSize + 20);
+    assert((unsigned)nr == BigBuffer::minExtentSize + 20);
     assert(memcmp(buf, expected, nr) == 0);
 }
 
@@ -360,7 +389,7 @@ void zipUserFunctionCallBackEmpty() {
 
 // Test zip user function callback with non-empty file
 void zipUserFunctionCallBackNonEmpty() {
-    zip_uint64_t n = BigBuffer::chunkSize*2;
+    zip_uint64_t n = BigBuffer::minExtentSize*2;
     char buf[n];
     memset(buf, 'f', n);
 
@@ -379,11 +408,11 @@ void zipUserFunctionCallBackNonEmpty() {
 
     assert(BigBuffer::zipUserFunctionCallback(cbs, NULL, 0, ZIP_SOURCE_OPEN)
             == 0);
-    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::chunkSize,
-                ZIP_SOURCE_READ) == BigBuffer::chunkSize);
-    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::chunkSize,
-                ZIP_SOURCE_READ) == BigBuffer::chunkSize);
-    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::chunkSize,
+    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::minExtentSize,
+                ZIP_SOURCE_READ) == BigBuffer::minExtentSize);
+    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::minExtentSize,
+                ZIP_SOURCE_READ) == BigBuffer::minExtentSize);
+    assert(BigBuffer::zipUserFunctionCallback(cbs, buf, BigBuffer::minExtentSize,
                 ZIP_SOURCE_READ) == 0);
     assert(BigBuffer::zipUserFunctionCallback(cbs, NULL, 0, ZIP_SOURCE_CLOSE)
             == 0);
@@ -395,12 +424,13 @@ void zipUserFunctionCallBackNonEmpty() {
 void readZip() {
     int size = 100;
     struct zip z;
+    z.fail_zip_fclose = false;
     z.fail_zip_fopen_index = true;
     // invalid file
     {
         bool thrown = false;
         try {
-            BigBuffer bb(&z, 1, size);
+            BigBuffer bb(&z, 1, size, NULL);
         }
         catch (const std::exception &e) {
             thrown = true;
@@ -411,9 +441,11 @@ void readZip() {
     z.fail_zip_fread = true;
     // read error
     {
+        BigBuffer bb(&z, 2, size, NULL);
+        char buf[1];
         bool thrown = false;
         try {
-            BigBuffer bb(&z, 2, size);
+            bb.read(buf, 1, 0);
         }
         catch (const std::exception &e) {
             thrown = true;
@@ -424,19 +456,22 @@ void readZip() {
     z.fail_zip_fclose = true;
     // close error
     {
+        BigBuffer bb(&z, 3, size, NULL);
+        char *buf = (char *)malloc(size);
         bool thrown = false;
         try {
-            BigBuffer bb(&z, 3, size);
+            bb.read(buf, size, 0);
         }
         catch (const std::exception &e) {
             thrown = true;
         }
         assert(thrown);
+        free(buf);
     }
     z.fail_zip_fclose = false;
     // normal case
     {
-        BigBuffer bb(&z, 0, size);
+        BigBuffer bb(&z, 0, size, NULL);
         char *buf = (char *)malloc(size);
         assert(bb.read(buf, size, 0) == size);
         for (int i = 0; i < size; ++i) {
@@ -446,6 +481,46 @@ void readZip() {
     }
 }
 
+// Data should be decompressed only up to the end of requested range
+void readZipLazy() {
+    zip_uint64_t size = BigBuffer::minExtentSize * 10;
+    struct zip z;
+    z.fail_zip_fopen_index = false;
+    z.fail_zip_fread = false;
+    z.fail_zip_fclose = false;
+    char buf[BigBuffer::minExtentSize * 2];
+
+    BigBuffer bb(&z, 0, size, NULL);
+    assert(z.bytes_read == 0);
+    assert(bb.m_stream != NULL);
+
+    assert(bb.read(buf, 10, 0) == 10);
+    assert(z.bytes_read == BigBuffer::minExtentSize);
+    assert(buf[0] == 'X' && buf[9] == 'X');
+
+    // already decompressed data
+    assert(bb.read(buf, 10, 100) == 10);
+    assert(z.bytes_read == BigBuffer::minExtentSize);
+
+    assert(bb.read(buf, 10, BigBuffer::minExtentSize * 3 + 1) == 10);
+    assert(z.bytes_read == BigBuffer::minExtentSize * 4);
+
+    // write into not yet decompressed area
+    memset(buf, 'w', 10);
+    assert(bb.write(buf, 10, BigBuffer::minExtentSize * 5) == 10);
+    assert(bb.read(buf, 12, BigBuffer::minExtentSize * 5 - 1) == 12);
+    assert(buf[0] == 'X' && buf[1] == 'w' && buf[10] == 'w' && buf[11] == 'X');
+
+    // truncate discards the rest of stream
+    bb.truncate(BigBuffer::minExtentSize * 7);
+    assert(bb.m_stream != NULL);
+    assert(z.bytes_read == BigBuffer::minExtentSize * 6);
+    assert(bb.read(buf, 1, BigBuffer::minExtentSize * 7 - 1) == 1);
+    assert(buf[0] == 'X');
+    assert(z.bytes_read == BigBuffer::minExtentSize * 7);
+    assert(bb.m_stream == NULL);
+}
+
 // Save file to zip
 // Check that saveToZip correctly working
 void writeZip() {
@@ -475,10 +550,11 @@ void writeZip() {
         int size = 11111;
         zip_int64_t id = 11;
         struct zip z;
+        z.fail_zip_add = false;
         z.fail_zip_fopen_index = false;
         z.fail_zip_fread = false;
         z.fail_zip_fclose = false;
-        BigBuffer bb(&z, 0, size);
+        BigBuffer bb(&z, 0, size, NULL);
 
         z.fail_zip_source_function = true;
         assert(bb.saveToZip(time(NULL), &z, "bebebe.txt", false, id) == -ENOMEM);
@@ -499,17 +575,19 @@ void writeZip() {
 }
 
 void zipFReadLengthFailure() {
-    BigBuffer bb;
     struct zip z;
     z.fail_zip_fopen_index = false;
     z.fail_zip_fread = false;
+    z.fail_zip_fclose = false;
     z.zip_fread_custom_return = true;
     z.zip_fread_custom_return_length = 22;
     // data is longer that specified in header
     {
+        BigBuffer bb(&z, 2, 10, NULL);
+        char buf[10];
         bool thrown = false;
         try {
-            BigBuffer bb(&z, 2, 10);
+            bb.read(buf, 10, 0);
         }
         catch (const std::exception &e) {
             thrown = true;
@@ -519,9 +597,11 @@ void zipFReadLengthFailure() {
     // zero read length
     z.zip_fread_custom_return_length = 0;
     {
+        BigBuffer bb(&z, 2, 10, NULL);
+        char buf[10];
         bool thrown = false;
         try {
-            BigBuffer bb(&z, 2, 10);
+            bb.read(buf, 10, 0);
         }
         catch (const std::exception &e) {
             thrown = true;
@@ -530,10 +610,260 @@ void zipFReadLengthFailure() {
     }
 }
 
+// Memory is allocated by extents
+void extentAllocation() {
+    char buf[300];
+    memset(buf, 'a', sizeof(buf));
+    {
+        // appending data grows extent geometrically
+        BigBuffer bb;
+        // (allocated size is rounded up to allocator size class)
+        bb.write(buf, 100, 0);
+        size_t first = SlabAllocator::roundUp(100);
+        assert(bb.memoryUsage() == first);
+        bb.write(buf, first - 100, 100);
+        assert(bb.memoryUsage() == first);
+        bb.write(buf, 1, first);
+        assert(bb.memoryUsage() == 2 * first);
+        assert(bb.read(buf, sizeof(buf), 0) == int(first + 1));
+        assert(buf[first] == 'a');
+        // space after the end of file is zeroed
+        bb.truncate(150);
+        bb.truncate(300);
+        assert(bb.read(buf, sizeof(buf), 0) == 300);
+        assert(buf[149] == 'a' && buf[150] == 0 && buf[299] == 0);
+    }
+    {
+        // holes take no memory
+        BigBuffer bb;
+        bb.write(buf, 1, 20 * 1024 * 1024);
+        // only extent [16M, 24M) is allocated up to the end of file
+        assert(bb.memoryUsage() == SlabAllocator::roundUp(4 * 1024 * 1024 + 1));
+        assert(bb.read(buf, 10, 20 * 1024 * 1024 - 5) == 6);
+        assert(buf[0] == 0 && buf[4] == 0 && buf[5] == 'a');
+        bb.truncate(10);
+        assert(bb.memoryUsage() == 0);
+    }
+    {
+        // file with known length takes only as much memory as needed
+        zip_uint64_t size = BigBuffer::minExtentSize + 1000;
+        struct zip z;
+        z.fail_zip_fopen_index = false;
+        z.fail_zip_fread = false;
+        z.fail_zip_fclose = false;
+        BigBuffer bb(&z, 0, size, NULL);
+        assert(bb.read(buf, 1, 0) == 1);
+        assert(bb.memoryUsage() == BigBuffer::minExtentSize);
+        assert(bb.read(buf, 1, size - 1) == 1);
+        assert(bb.memoryUsage() == BigBuffer::minExtentSize
+                + SlabAllocator::roundUp(1000));
+    }
+}
+
+void spillLimits() {
+    const unsigned int cs = BigBuffer::minExtentSize;
+    char buf[cs * 6];
+    char data[cs * 6];
+    for (unsigned int i = 0; i < sizeof(data); ++i) {
+        data[i] = char(i % 251);
+    }
+    BigBuffer::setSpillOptions("/tmp", 3 * cs, 0);
+    {
+        BigBuffer bb;
+        assert(bb.write(data, 3 * cs, 0) == int(3 * cs));
+        assert(bb.m_spillFd == -1);
+        assert(bb.memoryUsage() == 3 * cs);
+        assert(BigBuffer::s_heapTotal == 3 * cs);
+
+        // limit exceeded
+        assert(bb.write(data + 3 * cs, 10, 3 * cs) == 10);
+        assert(bb.m_spillFd != -1);
+        assert(bb.memoryUsage() == 0);
+        assert(BigBuffer::s_heapTotal == 0);
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs + 10));
+        assert(memcmp(buf, data, 3 * cs + 10) == 0);
+
+        // write after end of file
+        assert(bb.write(data + 5 * cs, 10, 5 * cs) == 10);
+        assert(bb.len == 5 * cs + 10);
+        assert(bb.read(buf, sizeof(buf), 0) == int(5 * cs + 10));
+        assert(memcmp(buf, data, 3 * cs + 10) == 0);
+        for (unsigned int i = 3 * cs + 10; i < 5 * cs; ++i) {
+            assert(buf[i] == 0);
+        }
+        assert(memcmp(buf + 5 * cs, data + 5 * cs, 10) == 0);
+
+        // shrink and grow
+        bb.truncate(5);
+        bb.truncate(20);
+        assert(bb.read(buf, sizeof(buf), 0) == 20);
+        assert(memcmp(buf, data, 5) == 0);
+        for (unsigned int i = 5; i < 20; ++i) {
+            assert(buf[i] == 0);
+        }
+    }
+
+    BigBuffer::setSpillOptions("/tmp", 0, 4 * cs);
+    {
+        BigBuffer b1, b2;
+        assert(b1.write(data, 3 * cs, 0) == int(3 * cs));
+        assert(b2.write(data, cs, 0) == int(cs));
+        assert(BigBuffer::s_heapTotal == 4 * cs);
+        // total limit exceeded by growing buffer
+        assert(b2.write(data, 10, cs) == 10);
+        assert(b1.m_spillFd == -1);
+        assert(b2.m_spillFd != -1);
+        assert(BigBuffer::s_heapTotal == 3 * cs);
+        b1.truncate(cs);
+        assert(BigBuffer::s_heapTotal == cs);
+    }
+    assert(BigBuffer::s_heapTotal == 0);
+
+    // unable to create temporary file: data is kept in memory
+    BigBuffer::setSpillOptions("/nonexistent", cs, 0);
+    {
+        BigBuffer bb;
+        assert(bb.write(data, 2 * cs, 0) == int(2 * cs));
+        assert(bb.m_spillFd == -1);
+        assert(bb.read(buf, sizeof(buf), 0) == int(2 * cs));
+        assert(memcmp(buf, data, 2 * cs) == 0);
+    }
+    assert(BigBuffer::s_spillDir.empty());
+    BigBuffer::setSpillOptions("", 0, 0);
+}
+
+void mmapBuffers() {
+    const unsigned int cs = BigBuffer::minExtentSize;
+    char buf[cs * 6];
+    char data[cs * 6];
+    for (unsigned int i = 0; i < sizeof(data); ++i) {
+        data[i] = char(i % 251);
+    }
+    BigBuffer::setMmapMode(true);
+    {
+        BigBuffer bb;
+        assert(bb.m_mapped);
+        assert(bb.m_region == NULL);
+        assert(bb.write(data, 10, 0) == 10);
+        assert(bb.m_region != NULL);
+        size_t regionSize = bb.m_regionSize;
+        assert(regionSize >= 10);
+        assert(bb.extents.empty());
+
+        // region is grown and data is kept
+        assert(bb.write(data + 10, 3 * cs - 10, 10) == int(3 * cs - 10));
+        assert(bb.m_regionSize >= 3 * cs);
+        assert(bb.memoryUsage() == 3 * cs);
+        assert(BigBuffer::s_heapTotal == 3 * cs);
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs));
+        assert(memcmp(buf, data, 3 * cs) == 0);
+
+        // pages after end of file are released
+        bb.truncate(cs + 5);
+        assert(bb.memoryUsage() == cs + size_t(sysconf(_SC_PAGESIZE)));
+        assert(bb.write(data, 10, 4 * cs) == 10);
+        assert(bb.read(buf, sizeof(buf), 0) == int(4 * cs + 10));
+        assert(memcmp(buf, data, cs + 5) == 0);
+        for (unsigned int i = cs + 5; i < 4 * cs; ++i) {
+            assert(buf[i] == 0);
+        }
+        assert(memcmp(buf + 4 * cs, data, 10) == 0);
+
+        // file is extended by truncate beyond mapping
+        bb.truncate(5);
+        bb.truncate(bb.m_regionSize + cs);
+        assert(bb.read(buf, cs, bb.len - cs) == int(cs));
+        for (unsigned int i = 0; i < cs; ++i) {
+            assert(buf[i] == 0);
+        }
+        assert(bb.read(buf, 10, 0) == 10);
+        assert(memcmp(buf, data, 5) == 0);
+        for (unsigned int i = 5; i < 10; ++i) {
+            assert(buf[i] == 0);
+        }
+    }
+    assert(BigBuffer::s_heapTotal == 0);
+
+    // mapped data is moved to temporary file
+    BigBuffer::setSpillOptions("/tmp", 2 * cs, 0);
+    {
+        BigBuffer bb;
+        assert(bb.write(data, 2 * cs, 0) == int(2 * cs));
+        assert(bb.m_spillFd == -1);
+        assert(bb.write(data + 2 * cs, cs, 2 * cs) == int(cs));
+        assert(bb.m_spillFd != -1);
+        assert(bb.m_region == NULL);
+        assert(bb.memoryUsage() == 0);
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs));
+        assert(memcmp(buf, data, 3 * cs) == 0);
+    }
+    assert(BigBuffer::s_heapTotal == 0);
+    BigBuffer::setSpillOptions("", 0, 0);
+    BigBuffer::setMmapMode(false);
+}
+
+void zeroExtents() {
+    const unsigned int cs = BigBuffer::minExtentSize;
+    static char buf[cs * 40];
+    static char zeroes[cs * 40];
+    {
+        // zeroes are not written into holes
+        BigBuffer bb;
+        assert(bb.write(zeroes, 3 * cs, 0) == int(3 * cs));
+        assert(bb.len == 3 * cs);
+        assert(bb.memoryUsage() == 0);
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs));
+        assert(memcmp(buf, zeroes, 3 * cs) == 0);
+
+        // extent zeroed up to the end becomes hole again
+        assert(bb.write("abc", 3, cs + 10) == 3);
+        assert(bb.write("d", 1, 2 * cs + 10) == 1);
+        assert(bb.memoryUsage() == 2 * cs);
+        assert(bb.write(zeroes, 5, cs + 8) == 5);
+        assert(bb.memoryUsage() == 2 * cs);
+        assert(bb.write(zeroes, cs - 13, cs + 13) == int(cs - 13));
+        assert(bb.memoryUsage() == cs);
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs));
+        assert(memcmp(buf, zeroes, 2 * cs + 10) == 0);
+        assert(buf[2 * cs + 10] == 'd');
+    }
+    assert(BigBuffer::s_heapTotal == 0);
+    {
+        // zero data decompressed from archive takes no memory
+        zip_uint64_t size = 20 * 1024 * 1024;
+        struct zip z;
+        z.fail_zip_fopen_index = false;
+        z.fail_zip_fread = false;
+        z.fail_zip_fclose = false;
+        z.fill = 0;
+        BigBuffer bb(&z, 0, size, NULL);
+        for (zip_uint64_t pos = 0; pos < size; pos += sizeof(buf)) {
+            assert(bb.read(buf, sizeof(buf), pos) > 0);
+        }
+        assert(z.bytes_read == size);
+        assert(bb.m_stream == NULL);
+        assert(bb.memoryUsage() == 0);
+        assert(bb.read(buf, 10, size - 10) == 10);
+        assert(memcmp(buf, zeroes, 10) == 0);
+    }
+    BigBuffer::setMmapMode(true);
+    {
+        // untouched pages of mapping are not written
+        BigBuffer bb;
+        assert(bb.write(zeroes, 3 * cs, 0) == int(3 * cs));
+        assert(bb.memoryUsage() == 0);
+        assert(bb.write("abc", 3, cs) == 3);
+        assert(bb.write(zeroes, 3 * cs, 0) == int(3 * cs));
+        assert(bb.read(buf, sizeof(buf), 0) == int(3 * cs));
+        assert(memcmp(buf, zeroes, 3 * cs) == 0);
+    }
+    BigBuffer::setMmapMode(false);
+}
+
 int main(int, char **) {
     initTest();
 
-    chunkLocators();
+    extentLocators();
     createDelete();
     truncate();
     readFile();
@@ -543,9 +873,14 @@ int main(int, char **) {
     readExpanded();
     zipUserFunctionCallBackEmpty();
     zipUserFunctionCallBackNonEmpty();
+    spillLimits();
+    mmapBuffers();
 
     use_zip = true;
     readZip();
+    readZipLazy();
+    extentAllocation();
+    zeroExtents();
     writeZip();
 
     zipFReadLengthFailure();
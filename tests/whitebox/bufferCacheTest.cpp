@@ -0,0 +1,190 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <cstring>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "bufferCache.h"
+#include "common.h"
+
+// libzip stub structures
+struct zip {
+};
+struct zip_file {
+};
+struct zip_source {
+};
+
+// only stubs
+
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t,
+        struct zip_stat *) {
+    assert(false);
+    return -1;
+}
+
+struct zip_file *zip_fopen_index(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
+    assert(false);
+    return -1;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return -1;
+}
+
+int zip_fclose(struct zip_file *) {
+    assert(false);
+    return 0;
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_strerror(struct zip *) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+// nodes are used as keys only
+const FileNode *node(long n) {
+    return reinterpret_cast<const FileNode *>(n);
+}
+
+/**
+ * Create buffer that uses 'extents' extents of memory
+ */
+BigBuffer *buffer(int extents) {
+    // zero data takes no memory
+    static char data[BigBuffer::minExtentSize];
+    memset(data, 'x', sizeof(data));
+    BigBuffer *b = new BigBuffer();
+    for (int i = 0; i < extents; ++i) {
+        b->write(data, sizeof(data), i * sizeof(data));
+    }
+    assert(b->memoryUsage() == extents * sizeof(data));
+    return b;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void hitAndMiss() {
+    BufferCache cache(10 * BigBuffer::minExtentSize);
+    assert(cache.take(node(1)) == NULL);
+    BigBuffer *b = buffer(2);
+    cache.put(node(1), b);
+    assert(cache.contains(node(1)) && !cache.contains(node(2)));
+    assert(cache.used() == 2 * BigBuffer::minExtentSize);
+    assert(cache.take(node(1)) == b);
+    assert(cache.used() == 0);
+    // buffer is owned by caller after take()
+    assert(cache.take(node(1)) == NULL);
+    assert(cache.hits() == 1);
+    assert(cache.misses() == 2);
+    delete b;
+}
+
+void lruEviction() {
+    BufferCache cache(10 * BigBuffer::minExtentSize);
+    cache.put(node(1), buffer(4));
+    cache.put(node(2), buffer(4));
+    // make node 1 most recently used
+    cache.put(node(1), cache.take(node(1)));
+    cache.put(node(3), buffer(4));
+    assert(cache.used() == 8 * BigBuffer::minExtentSize);
+    assert(cache.take(node(2)) == NULL);
+    cache.remove(node(1));
+    assert(cache.used() == 4 * BigBuffer::minExtentSize);
+    assert(cache.take(node(1)) == NULL);
+    // removal of absent node is ignored
+    cache.remove(node(1));
+    // buffers are deleted by cache destructor
+}
+
+void notCached() {
+    BufferCache cache(2 * BigBuffer::minExtentSize);
+    // too large
+    cache.put(node(1), buffer(3));
+    // empty
+    cache.put(node(2), buffer(0));
+    assert(cache.used() == 0);
+    assert(cache.take(node(1)) == NULL);
+    assert(cache.take(node(2)) == NULL);
+}
+
+void clear() {
+    BufferCache cache(10 * BigBuffer::minExtentSize);
+    cache.put(node(1), buffer(2));
+    cache.put(node(2), buffer(2));
+    cache.clear();
+    assert(cache.used() == 0);
+    assert(!cache.contains(node(1)) && !cache.contains(node(2)));
+    // nodes may be removed after cache is cleared
+    cache.remove(node(1));
+}
+
+int main(int, char **) {
+    initTest();
+
+    hitAndMiss();
+    lruEviction();
+    notCached();
+    clear();
+
+    return EXIT_SUCCESS;
+}
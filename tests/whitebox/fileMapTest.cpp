@@ -0,0 +1,271 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+#define protected public
+
+#include "fileMap.h"
+#include "fileNode.h"
+#include "types.h"
+#include "common.h"
+
+// libzip stubs
+
+struct zip {
+};
+struct zip_file {
+};
+struct zip_source {
+};
+
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t, struct zip_stat *) {
+    assert(false);
+    return 0;
+}
+
+struct zip_file *zip_fopen_index(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
+    assert(false);
+    return 0;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return 0;
+}
+
+int zip_fclose(struct zip_file *) {
+    assert(false);
+    return 0;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_strerror(struct zip *) {
+    assert(false);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create directory node with short name 'name' attached to 'parent'
+ */
+FileNode *node(NodeArena &arena, FileNode *parent, const char *name) {
+    FileNode *n = FileNode::createIntermediateDir(arena, NULL,
+            (std::string(name) + "/").c_str());
+    n->parent = parent;
+    return n;
+}
+
+/**
+ * Find node by path as FuseZipData::lookup does
+ */
+FileNode *walk(const FileMap &m, FileNode *root, const char *path) {
+    FileNode *n = root;
+    for (const char *p = path; *p != '\0' && n != NULL; ) {
+        if (*p == '/') {
+            ++p;
+            continue;
+        }
+        const char *end = p;
+        while (*end != '\0' && *end != '/') {
+            ++end;
+        }
+        n = m.find(n, p, end - p);
+        p = end;
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void keys() {
+    NodeArena arena(sizeof(FileNode));
+    FileMap m;
+    FileNode *root = FileNode::createRootNode(arena);
+    assert(m.find(NULL, "", 0) == NULL);
+    assert(!m.erase(root));
+
+    FileNode *a = node(arena, root, "a");
+    FileNode *ab = node(arena, root, "ab");
+    FileNode *a_b = node(arena, a, "b");
+    FileNode *ab_b = node(arena, ab, "b");
+    assert(m.insert(root));
+    assert(m.insert(a));
+    assert(m.insert(ab));
+    assert(m.insert(a_b));
+    assert(m.insert(ab_b));
+    assert(m.size() == 5);
+
+    assert(m.find(NULL, "", 0) == root);
+    assert(m.find(root, "a", 1) == a);
+    assert(m.find(root, "ab", 2) == ab);
+    assert(m.find(root, "ab/", 2) == ab);
+    assert(m.find(root, "abc", 3) == NULL);
+    assert(m.find(a, "b", 1) == a_b);
+    assert(m.find(ab, "b", 1) == ab_b);
+    assert(m.find(root, "b", 1) == NULL);
+
+    // path walk skips repeated and trailing slashes
+    assert(walk(m, root, "") == root);
+    assert(walk(m, root, "ab////") == ab);
+    assert(walk(m, root, "a/b/") == a_b);
+    assert(walk(m, root, "a/b/c") == NULL);
+
+    // another node with the same key
+    FileNode *dup = node(arena, root, "a");
+    assert(!m.insert(dup));
+    assert(!m.erase(dup));
+    assert(m.size() == 5);
+
+    assert(m.erase(a));
+    assert(m.find(root, "a", 1) == NULL);
+    assert(m.find(a, "b", 1) == a_b);
+    assert(m.insert(dup));
+    assert(m.size() == 5);
+
+    FileNode *nodes[] = {root, a, ab, a_b, ab_b, dup};
+    for (size_t i = 0; i < sizeof(nodes) / sizeof(nodes[0]); ++i) {
+        FileNode::destroy(arena, nodes[i]);
+    }
+}
+
+void eraseInCluster() {
+    NodeArena arena(sizeof(FileNode));
+    FileMap m;
+    FileNode *root = FileNode::createRootNode(arena);
+    std::vector<FileNode *> nodes;
+    for (int i = 0; i < 12; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "file%d", i);
+        nodes.push_back(node(arena, root, name));
+        assert(m.insert(nodes.back()));
+    }
+    assert(m.m_capacity == 16);
+    // every removal keeps other nodes reachable
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        assert(m.erase(nodes[i]));
+        assert(!m.erase(nodes[i]));
+        for (size_t j = 0; j < nodes.size(); ++j) {
+            const char *name = nodes[j]->name;
+            assert(m.find(root, name, strlen(name)) ==
+                    (j > i ? nodes[j] : NULL));
+        }
+    }
+    assert(m.size() == 0);
+    // all slots are free again
+    for (size_t i = 0; i < m.m_capacity; ++i) {
+        assert(m.m_slots[i].node == NULL);
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        FileNode::destroy(arena, nodes[i]);
+    }
+    FileNode::destroy(arena, root);
+}
+
+void growAndIterate() {
+    NodeArena arena(sizeof(FileNode));
+    FileMap m;
+    FileNode *root = FileNode::createRootNode(arena);
+    std::vector<FileNode *> nodes;
+    for (int i = 0; i < 10000; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", i);
+        // two levels of nodes
+        nodes.push_back(node(arena, i < 100 ? root : nodes[i % 100], name));
+        assert(m.insert(nodes.back()));
+    }
+    assert(m.size() == nodes.size());
+    assert(m.m_capacity == 16384);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const char *name = nodes[i]->name;
+        assert(m.find(nodes[i]->parent, name, strlen(name)) == nodes[i]);
+    }
+    std::map<FileNode *, int> seen;
+    for (FileMap::const_iterator i = m.begin(); i != m.end(); ++i) {
+        assert(++seen[*i] == 1);
+    }
+    assert(seen.size() == nodes.size());
+    // half of nodes removed
+    for (size_t i = 0; i < nodes.size(); i += 2) {
+        assert(m.erase(nodes[i]));
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const char *name = nodes[i]->name;
+        assert(m.find(nodes[i]->parent, name, strlen(name)) ==
+                (i % 2 ? nodes[i] : NULL));
+    }
+    m.clear();
+    assert(m.size() == 0);
+    assert(m.begin() == m.end());
+    assert(m.find(root, "1", 1) == NULL);
+}
+
+int main(int, char **) {
+    initTest();
+
+    keys();
+    eraseInCluster();
+    growAndIterate();
+
+    return EXIT_SUCCESS;
+}
@@ -5,7 +5,8 @@
 #include <stdlib.h>
 #include <cstring>
 #include <cerrno>
-#include <memory>
+#include <fcntl.h>
+#include <vector>
 
 // Public Morozoff design pattern :)
 #define private public
@@ -25,6 +26,20 @@ struct zip_file {
 struct zip_source {
 };
 
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
 int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t, struct zip_stat *) {
     assert(false);
     return 0;
@@ -40,6 +55,11 @@ zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
     return 0;
 }
 
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return 0;
+}
+
 int zip_fclose(struct zip_file *) {
     assert(false);
     return 0;
@@ -85,60 +105,200 @@ const char *zip_strerror(struct zip *) {
  * Test parse_name()
  */
 void parseNameTest () {
-    auto_ptr<FileNode> n (FileNode::createRootNode());
+    NodeArena arena(sizeof(FileNode));
+    FileNode *n = FileNode::createRootNode(arena);
 
-    n->full_name = "test";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str());
+    n->parse_name (arena, "test");
+    assert (strcmp(n->name, "test") == 0);
 
-    n->full_name = "dir/test";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str() + strlen("dir/"));
+    n->parse_name (arena, "dir/test");
+    assert (strcmp(n->name, "test") == 0);
 
-    n->full_name = "dir/dir2/dir3/test";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str() + strlen("dir/dir2/dir3/"));
+    n->parse_name (arena, "dir/dir2/dir3/test");
+    assert (strcmp(n->name, "test") == 0);
 
-    n->full_name = "subdir/";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str());
+    n->is_dir = false;
+    n->parse_name (arena, "subdir/");
+    assert (strcmp(n->name, "subdir") == 0);
+    assert (n->is_dir);
 
-    n->full_name = "dir/subdir/";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str() + strlen("dir/"));
+    n->parse_name (arena, "dir/subdir/");
+    assert (strcmp(n->name, "subdir") == 0);
 
-    n->full_name = "dir/dir2/dir3/subdir/";
-    n->parse_name ();
-    assert (n->name == n->full_name.c_str() + strlen("dir/dir2/dir3/"));
+    n->parse_name (arena, "dir/dir2/dir3/subdir/");
+    assert (strcmp(n->name, "subdir") == 0);
+
+    // names are interned
+    const char *name = n->name;
+    n->parse_name (arena, "subdir/");
+    assert (n->name == name);
+
+    FileNode::destroy(arena, n);
 }
 
 /**
- * Test getParentName()
+ * Test fullName()
  */
-void parentNameTest () {
-    // files
+void fullNameTest () {
+    NodeArena arena(sizeof(FileNode));
+    FileNode *root = FileNode::createRootNode(arena);
+    assert (root->fullName() == "");
+
+    FileNode *dir = FileNode::createIntermediateDir(arena, NULL, "dir/");
+    dir->parent = root;
+    assert (dir->fullName() == "dir");
+
+    FileNode *dir2 = FileNode::createIntermediateDir(arena, NULL, "dir/dir2/");
+    dir2->parent = dir;
+    assert (dir2->fullName() == "dir/dir2");
+
+    FileNode *file = FileNode::createFile(arena, NULL, "dir/dir2/file", 0, 0, 0666);
+    file->parent = dir2;
+    assert (file->fullName() == "dir/dir2/file");
+
+    // descendants follow renamed directory
+    dir->rename(arena, "other/");
+    assert (file->fullName() == "other/dir2/file");
+
+    FileNode::destroy(arena, file);
+    FileNode::destroy(arena, dir2);
+    FileNode::destroy(arena, dir);
+    FileNode::destroy(arena, root);
+}
+
+/**
+ * Test that open with O_TRUNC does not read file data from archive
+ */
+void openTruncateTest () {
+    struct zip z;
+    NodeArena arena(sizeof(FileNode));
     {
-        auto_ptr<FileNode> n (FileNode::createFile(NULL, "test", 0, 0, 0666));
-        assert (n->getParentName() == "");
+        // closed file from archive (zip_fopen_index must not be called)
+        FileNode *n = FileNode::createFile(arena, &z, "test", 0, 0, 0666);
+        delete n->buffer;
+        n->buffer = NULL;
+        n->id = 0;
+        n->m_size = 100;
+        n->state = FileNode::CLOSED;
+
+        assert (n->open(O_WRONLY | O_TRUNC) == 0);
+        assert (n->state == FileNode::CHANGED);
+        assert (n->isChanged());
+        assert (n->size() == 0);
+        assert (n->write("abc", 3, 0) == 3);
+        assert (n->close() == 0);
+        assert (n->size() == 3);
+        FileNode::destroy(arena, n);
     }
     {
-        auto_ptr<FileNode> n (FileNode::createFile(NULL, "dir/file", 0, 0, 0666));
-        assert (n->getParentName() == "dir");
+        // opened file is truncated
+        FileNode *n = FileNode::createFile(arena, &z, "test", 0, 0, 0666);
+        assert (n->open(O_WRONLY) == 0);
+        assert (n->write("abc", 3, 0) == 3);
+        n->m_mtime = 0;
+        n->metadataChanged = false;
+        assert (n->open(O_WRONLY | O_TRUNC) == 0);
+        assert (n->size() == 0);
+        assert (n->state == FileNode::NEW);
+        assert (n->m_mtime != 0);
+        assert (n->metadataChanged);
+        // truncate() updates modification time too
+        n->m_mtime = 0;
+        assert (n->truncate(2) == 0);
+        assert (n->size() == 2);
+        assert (n->m_mtime != 0);
+        FileNode::destroy(arena, n);
     }
-    {
-        auto_ptr<FileNode> n (FileNode::createFile(NULL, "dir/dir2/file", 0, 0, 0666));
-        assert (n->getParentName() == "dir/dir2");
+}
+
+/**
+ * Test appendChild() and detachChild()
+ */
+void childsTest () {
+    NodeArena arena(sizeof(FileNode));
+    FileNode *root = FileNode::createRootNode(arena);
+    std::vector<FileNode *> nodes;
+    for (int i = 0; i < 100; ++i) {
+        nodes.push_back(FileNode::createFile(arena, NULL, "file", 0, 0, 0666));
+        root->appendChild(nodes.back());
     }
-    // directories
-    {
-        auto_ptr<FileNode> n (FileNode::createIntermediateDir(NULL, "dir/subdir/"));
-        assert (n->getParentName() == "dir");
+    assert (root->childs.size() == 100);
+
+    // order is kept after removal
+    for (size_t i = 0; i < nodes.size(); i += 3) {
+        root->detachChild(nodes[i]);
+        // second removal does nothing
+        root->detachChild(nodes[i]);
+    }
+    assert (root->childs.size() == 66);
+    size_t expected = 1;
+    for (nodelist_t::const_iterator i = root->childs.begin();
+            i != root->childs.end(); ++i) {
+        assert (*i == nodes[expected]);
+        expected += expected % 3 == 1 ? 1 : 2;
+    }
+    assert (expected == 100);
+
+    // empty slots are dropped
+    for (size_t i = 1; i < nodes.size(); i += 3) {
+        root->detachChild(nodes[i]);
+    }
+    assert (root->childs.size() == 33);
+    assert (root->childs.m_nodes.size() < 100);
+    FileNode *n = FileNode::createFile(arena, NULL, "file", 0, 0, 0666);
+    root->appendChild(n);
+    for (size_t i = 2; i < nodes.size(); i += 3) {
+        root->detachChild(nodes[i]);
+    }
+    assert (root->childs.size() == 1);
+    assert (*root->childs.begin() == n);
+    root->detachChild(n);
+    assert (root->childs.empty());
+    assert (root->childs.begin() == root->childs.end());
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        FileNode::destroy(arena, nodes[i]);
+    }
+    FileNode::destroy(arena, n);
+    FileNode::destroy(arena, root);
+}
+
+/**
+ * Test that slots of children removed in listing order are dropped, so
+ * storage of list stays proportional to number of live children
+ */
+void detachInOrderTest () {
+    const size_t count = 1000;
+    NodeArena arena(sizeof(FileNode));
+    FileNode *root = FileNode::createRootNode(arena);
+    std::vector<FileNode *> nodes;
+    for (size_t i = 0; i < count; ++i) {
+        nodes.push_back(FileNode::createFile(arena, NULL, "file", 0, 0, 0666));
+        root->appendChild(nodes.back());
+    }
+    // the same order as readdir returns
+    for (size_t i = 0; i < count; ++i) {
+        root->detachChild(nodes[i]);
+        size_t left = count - i - 1;
+        assert (root->childs.size() == left);
+        assert (root->childs.m_nodes.size() <= 2 * left + 16);
+        if (left > 0) {
+            assert (*root->childs.begin() == nodes[i + 1]);
+        }
+    }
+    assert (root->childs.m_nodes.empty());
+    for (size_t i = 0; i < count; ++i) {
+        FileNode::destroy(arena, nodes[i]);
     }
+    FileNode::destroy(arena, root);
 }
 
 int main(int, char **) {
     parseNameTest ();
-    parentNameTest ();
+    fullNameTest ();
+    openTruncateTest ();
+    childsTest ();
+    detachInOrderTest ();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,236 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+#define protected public
+
+#include "frozenIndex.h"
+#include "fileMap.h"
+#include "fileNode.h"
+#include "common.h"
+
+// libzip stubs
+
+struct zip {
+};
+struct zip_file {
+};
+struct zip_source {
+};
+
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t, struct zip_stat *) {
+    assert(false);
+    return 0;
+}
+
+struct zip_file *zip_fopen_index(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
+    assert(false);
+    return 0;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return 0;
+}
+
+int zip_fclose(struct zip_file *) {
+    assert(false);
+    return 0;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_strerror(struct zip *) {
+    assert(false);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create node with short name 'name' and attach it to 'parent'
+ */
+FileNode *node(NodeArena &arena, FileNode *parent, const char *name,
+        bool dir) {
+    FileNode *n;
+    if (dir) {
+        n = FileNode::createIntermediateDir(arena, NULL,
+                (std::string(name) + "/").c_str());
+    } else {
+        // closed file from archive
+        n = FileNode::createFile(arena, NULL, name, 1000, 100,
+                S_IFREG | 0640);
+        delete n->buffer;
+        n->buffer = NULL;
+        n->state = FileNode::CLOSED;
+        n->m_size = 0;
+    }
+    n->parent = parent;
+    parent->appendChild(n);
+    return n;
+}
+
+/**
+ * Delete all nodes of tree
+ */
+void destroyTree(NodeArena &arena, FileNode *root) {
+    std::vector<FileNode *> nodes(1, root);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes.insert(nodes.end(), nodes[i]->childs.begin(),
+                nodes[i]->childs.end());
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        FileNode::destroy(arena, nodes[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void structure() {
+    NodeArena arena(sizeof(FileNode));
+    FileNode *root = FileNode::createRootNode(arena);
+    FileNode *a = node(arena, root, "a", true);
+    FileNode *file = node(arena, root, "file", false);
+    FileNode *b = node(arena, a, "b", true);
+    FileNode *c = node(arena, b, "c", false);
+    FileNode *d = node(arena, b, "d", false);
+    FileNode *empty = node(arena, a, "empty", true);
+
+    FrozenIndex index(root);
+    assert(index.size() == 7);
+    // breadth-first order
+    assert(index.node(0) == root);
+    assert(index.node(1) == a && index.node(2) == file);
+    assert(index.node(3) == b && index.node(4) == empty);
+    assert(index.node(5) == c && index.node(6) == d);
+
+    assert(index.find("") == 0);
+    assert(index.find("/") == 0);
+    assert(index.find("a") == 1);
+    assert(index.find("file") == 2);
+    assert(index.find("a/b") == 3);
+    assert(index.find("a/b/") == 3);
+    assert(index.find("a/b//") == 3);
+    assert(index.find("a/b/c") == 5);
+    assert(index.find("a/b/d") == 6);
+    assert(index.find("a/empty") == 4);
+    assert(index.find("b") == FrozenIndex::npos);
+    assert(index.find("a/b/c/d") == FrozenIndex::npos);
+    assert(index.find("a/bc") == FrozenIndex::npos);
+    assert(index.find("a/b/e") == FrozenIndex::npos);
+
+    // child ranges
+    assert(index.firstChild(0) == 1 && index.childsEnd(0) == 3);
+    assert(index.firstChild(1) == 3 && index.childsEnd(1) == 5);
+    assert(index.firstChild(2) == index.childsEnd(2));
+    assert(index.firstChild(3) == 5 && index.childsEnd(3) == 7);
+    assert(index.firstChild(4) == index.childsEnd(4));
+    assert(strcmp(index.name(0), "") == 0);
+    assert(strcmp(index.name(1), "a") == 0);
+    assert(strcmp(index.name(3), "b") == 0);
+    assert(strcmp(index.name(6), "d") == 0);
+
+    // metadata
+    const FrozenIndex::Attr &attr = index.attr(5);
+    assert(attr.mode == (S_IFREG | 0640));
+    assert(attr.uid == 1000 && attr.gid == 100);
+    assert(attr.nlink == 1);
+    assert(attr.size == 0);
+    assert(attr.id == FileNode::NEW_NODE_INDEX);
+    assert(attr.mtime == c->mtime());
+    assert(index.attr(0).nlink == 4);
+    assert(index.attr(1).nlink == 4);
+    assert(index.attr(4).nlink == 2);
+    assert(index.attr(4).mode == (S_IFDIR | 0775));
+
+    // metadata of opened or not loaded nodes is taken from node
+    assert(!index.attr(5).live);
+    c->buffer = new BigBuffer();
+    c->state = FileNode::OPENED;
+    c->open_count = 1;
+    index.update(5);
+    assert(index.attr(5).live);
+    c->close();
+    c->m_size = 10;
+    index.update(5);
+    assert(!index.attr(5).live);
+    assert(index.attr(5).size == 10);
+    d->m_localMetadataPending = true;
+    index.update(6);
+    assert(index.attr(6).live);
+    d->m_localMetadataPending = false;
+    d->m_mtime = 12345;
+    index.update(6);
+    assert(!index.attr(6).live);
+    assert(index.attr(6).mtime == 12345);
+    index.update(0);
+    assert(!index.attr(0).live);
+
+    destroyTree(arena, root);
+}
+
+int main(int, char **) {
+    initTest();
+
+    structure();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+#include "../config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "indexCache.h"
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+IndexCache::Key key() {
+    IndexCache::Key k;
+    memset(&k, 0, sizeof(k));
+    k.dev = 1;
+    k.ino = 2;
+    k.size = 3;
+    k.mtime = 4;
+    k.cdCrc = 5;
+    return k;
+}
+
+std::string tempName() {
+    char name[] = "/tmp/fuse-zip-test.XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    close(fd);
+    return name;
+}
+
+std::string save(const char **names, int count) {
+    std::vector<IndexCache::Record> records;
+    std::vector<zip_uint64_t> offsets;
+    std::string blob;
+    for (int i = 0; i < count; ++i) {
+        IndexCache::Record r;
+        memset(&r, 0, sizeof(r));
+        r.id = i;
+        r.size = 100 * i;
+        r.mtime = 1000 + i;
+        r.mode = 0100644;
+        r.nameOffset = blob.size();
+        r.nameLen = strlen(names[i]);
+        blob += names[i];
+        records.push_back(r);
+        offsets.push_back(10 * i);
+    }
+    std::string fileName = tempName();
+    assert(IndexCache::save(fileName, key(), records, offsets, blob));
+    return fileName;
+}
+
+std::string readFile(const std::string &fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    assert(fd != -1);
+    std::string res;
+    char buf[4096];
+    ssize_t nr;
+    while ((nr = read(fd, buf, sizeof(buf))) > 0) {
+        res.append(buf, nr);
+    }
+    close(fd);
+    return res;
+}
+
+void writeFile(const std::string &fileName, const std::string &data) {
+    int fd = open(fileName.c_str(), O_WRONLY | O_TRUNC);
+    assert(fd != -1);
+    assert(write(fd, data.data(), data.size()) == ssize_t(data.size()));
+    close(fd);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+const char *names[] = {"a", "b/", "b/c"};
+
+void saveAndLoad() {
+    std::string fileName = save(names, 3);
+    IndexCache cache;
+    assert(cache.load(fileName, key()));
+    assert(cache.count() == 3);
+    assert(cache.offsetsCount() == 3);
+    for (int i = 0; i < 3; ++i) {
+        const IndexCache::Record &r = cache.record(i);
+        assert(r.id == i);
+        assert(r.size == zip_uint64_t(100 * i));
+        assert(r.mtime == 1000 + i);
+        assert(std::string(cache.name(r), r.nameLen) == names[i]);
+        assert(cache.offsets()[i] == zip_uint64_t(10 * i));
+    }
+    // name outside of names block
+    IndexCache::Record r = cache.record(2);
+    r.nameLen = 100;
+    assert(cache.name(r) == NULL);
+    unlink(fileName.c_str());
+}
+
+void staleCache() {
+    std::string fileName = save(names, 3);
+    IndexCache::Key k = key();
+    k.mtime++;
+    IndexCache c1;
+    assert(!c1.load(fileName, k));
+    k = key();
+    k.cdCrc++;
+    IndexCache c2;
+    assert(!c2.load(fileName, k));
+    unlink(fileName.c_str());
+    IndexCache c3;
+    assert(!c3.load(fileName, key()));
+}
+
+void corruptedCache() {
+    std::string fileName = save(names, 3);
+    std::string data = readFile(fileName);
+    // broken name
+    std::string broken = data;
+    broken[broken.size() - 1] = 'X';
+    writeFile(fileName, broken);
+    IndexCache c1;
+    assert(!c1.load(fileName, key()));
+    // truncated file
+    writeFile(fileName, data.substr(0, data.size() - 1));
+    IndexCache c2;
+    assert(!c2.load(fileName, key()));
+    writeFile(fileName, data.substr(0, 10));
+    IndexCache c3;
+    assert(!c3.load(fileName, key()));
+    // intact file
+    writeFile(fileName, data);
+    IndexCache c4;
+    assert(c4.load(fileName, key()));
+    unlink(fileName.c_str());
+}
+
+int main(int, char **) {
+    saveAndLoad();
+    staleCache();
+    corruptedCache();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+#include "../config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "lazyIndex.h"
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+std::string childs(const LazyIndex &index, const char *dir) {
+    std::vector<LazyIndex::Child> res;
+    index.children(dir, strlen(dir), res);
+    std::string s;
+    for (size_t i = 0; i < res.size(); ++i) {
+        if (!s.empty()) {
+            s += ' ';
+        }
+        s.append(res[i].name, res[i].nameLen);
+        if (res[i].isDir) {
+            s += '/';
+        }
+        if (res[i].item == LazyIndex::npos) {
+            s += '*';
+        }
+    }
+    return s;
+}
+
+bool contains(const LazyIndex &index, const char *name) {
+    return index.find(name, strlen(name)) != LazyIndex::npos;
+}
+
+bool isDir(const LazyIndex &index, const char *name) {
+    return index.isDir(name, strlen(name));
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void lookup() {
+    LazyIndex index;
+    const char *names[] = {"b/x/y", "a", "b/", "b.txt", "b/c", "c/d/e/f",
+        "b/x.txt", "c/d/"};
+    for (int i = 0; i < 8; ++i) {
+        index.add(names[i], i, 100 * i);
+    }
+    index.sort();
+    assert(index.size() == 8);
+
+    zip_uint64_t i = index.find("b", 1);
+    assert(i != LazyIndex::npos);
+    assert(index.id(i) == 2 && index.cdPos(i) == 200 && index.itemIsDir(i));
+    i = index.find("b/x/y", 5);
+    assert(i != LazyIndex::npos && index.id(i) == 0 && !index.itemIsDir(i));
+    assert(!contains(index, "b/x"));
+    assert(!contains(index, "b/"));
+    assert(!contains(index, "c/d/e"));
+    assert(!contains(index, "z"));
+
+    assert(isDir(index, "b"));
+    assert(isDir(index, "b/x"));
+    assert(isDir(index, "c"));
+    assert(isDir(index, "c/d/e"));
+    assert(!isDir(index, "a"));
+    assert(!isDir(index, "b/x/y"));
+    assert(!isDir(index, "c/d/e/f"));
+    assert(!isDir(index, "b/xx"));
+
+    assert(childs(index, "") == "a b/ b.txt c/*");
+    assert(childs(index, "b") == "c x.txt x/*");
+    assert(childs(index, "b/x") == "y");
+    assert(childs(index, "c") == "d/");
+    assert(childs(index, "c/d") == "e/*");
+    assert(childs(index, "a") == "");
+    assert(childs(index, "z") == "");
+
+    // children are counted once
+    assert(index.childrenCount("", 0) == 4);
+    assert(index.childrenCount("b", 1) == 3);
+    assert(index.childrenCount("c/d", 3) == 1);
+    assert(index.childrenCount("a", 1) == 0);
+    assert(index.m_childrenCounts.size() == 4);
+    assert(index.childrenCount("b", 1) == 3);
+    assert(index.m_childrenCounts.size() == 4);
+}
+
+void duplicates() {
+    LazyIndex index;
+    index.add("a/b", 0, 0);
+    index.add("a/", 1, 0);
+    index.add("a/b/", 2, 0);
+    bool thrown = false;
+    try {
+        index.sort();
+    }
+    catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void manyEntries() {
+    LazyIndex index;
+    const int n = 10000;
+    char name[32];
+    for (int i = 0; i < n; ++i) {
+        sprintf(name, "d%d/f%d", i % 10, i);
+        index.add(name, i, 0);
+    }
+    index.sort();
+    std::vector<LazyIndex::Child> res;
+    index.children("", 0, res);
+    assert(res.size() == 10);
+    index.children("d3", 2, res);
+    assert(res.size() == n / 10);
+    for (size_t i = 0; i < res.size(); ++i) {
+        assert(!res[i].isDir && res[i].item != LazyIndex::npos);
+        assert(index.id(res[i].item) % 10 == 3);
+    }
+    // fixed-size records and names without trailing slashes
+    assert(index.memoryUsage() >= n * sizeof(LazyIndex::Item));
+    assert(index.m_names.size() == strlen("d0/f0") * 10
+            + strlen("d0/f00") * 90 + strlen("d0/f000") * 900
+            + strlen("d0/f0000") * 9000);
+}
+
+int main(int, char **) {
+    lookup();
+    duplicates();
+    manyEntries();
+
+    return EXIT_SUCCESS;
+}
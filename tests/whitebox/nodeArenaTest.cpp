@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <set>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "nodeArena.h"
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void blocks() {
+    NodeArena a(20);
+    assert(a.m_blockSize % sizeof(long double) == 0);
+    assert(a.m_blockSize >= 20);
+    assert(a.memoryUsage() == 0);
+
+    std::set<char *> seen;
+    std::vector<char *> v;
+    for (size_t i = 0; i < 2 * NodeArena::blocksPerChunk + 1; ++i) {
+        char *p = static_cast<char *>(a.allocate());
+        assert((size_t)p % sizeof(long double) == 0);
+        assert(seen.insert(p).second);
+        memset(p, int(i), 20);
+        v.push_back(p);
+    }
+    // blocks do not overlap
+    for (size_t i = 0; i < v.size(); ++i) {
+        assert(v[i][19] == char(i));
+    }
+    size_t used = a.memoryUsage();
+    assert(used >= 3 * NodeArena::blocksPerChunk * a.m_blockSize);
+
+    // released blocks are reused before new chunk is allocated
+    a.release(v[5]);
+    a.release(v[7]);
+    a.release(NULL);
+    assert(a.allocate() == v[7]);
+    assert(a.allocate() == v[5]);
+    assert(a.memoryUsage() == used);
+}
+
+void intern() {
+    NodeArena a(8);
+    const char *src = "src/main.cpp";
+    const char *s1 = a.intern(src, 3);
+    assert(strcmp(s1, "src") == 0);
+    assert(s1 != src);
+    // equal names share one copy
+    assert(a.intern("src", 3) == s1);
+    assert(a.intern("src/", 3) == s1);
+    assert(a.intern("sr", 2) != s1);
+    assert(strcmp(a.intern("", 0), "") == 0);
+
+    // table is grown without losing names
+    std::vector<const char *> names;
+    for (int i = 0; i < 5000; ++i) {
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "file%d", i);
+        names.push_back(a.intern(buf, len));
+    }
+    assert(a.m_namesCount == 5003);
+    assert(a.m_names.size() >= 2 * a.m_namesCount);
+    for (int i = 0; i < 5000; ++i) {
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "file%d", i);
+        assert(a.intern(buf, len) == names[i]);
+        assert(strcmp(names[i], buf) == 0);
+    }
+    assert(a.intern("src", 3) == s1);
+
+    // long name
+    std::string longName(NodeArena::nameChunkSize, 'x');
+    const char *l = a.intern(longName.c_str(), longName.size());
+    assert(l == longName);
+    assert(a.intern(longName.c_str(), longName.size()) == l);
+}
+
+void merge() {
+    NodeArena a(32), b(32);
+    void *pa = a.allocate();
+    const char *na = a.intern("a", 1);
+    void *pb = b.allocate();
+    const char *nb = b.intern("b", 1);
+    size_t usage = a.memoryUsage() + b.m_chunksSize;
+
+    a.merge(b);
+    assert(b.memoryUsage() == 0);
+    assert(b.m_chunks == NULL);
+    assert(a.m_chunksSize + a.m_names.capacity() * sizeof(const char *)
+            == usage);
+    // memory of 'b' lives in 'a'
+    assert(strcmp(nb, "b") == 0);
+    assert(a.intern("a", 1) == na);
+    memset(pb, 0, 32);
+
+    // unused blocks of 'b' are reused by 'a'
+    std::set<void *> seen;
+    seen.insert(pa);
+    seen.insert(pb);
+    for (size_t i = 0; i < 2 * NodeArena::blocksPerChunk - 2; ++i) {
+        assert(seen.insert(a.allocate()).second);
+    }
+    assert(a.memoryUsage() == usage);
+
+    // arena is usable after merge
+    void *p = b.allocate();
+    assert(p != NULL);
+    assert(strcmp(b.intern("b", 1), "b") == 0);
+    a.merge(b);
+}
+
+int main(int, char **) {
+    blocks();
+    intern();
+    merge();
+
+    return EXIT_SUCCESS;
+}
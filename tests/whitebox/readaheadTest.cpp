@@ -0,0 +1,241 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "readahead.h"
+#include "fileNode.h"
+#include "common.h"
+
+// libzip stub structures
+struct zip {
+};
+struct zip_file {
+};
+struct zip_source {
+};
+
+// only stubs
+
+struct zip *zip_open(const char *, int, int *) {
+    assert(false);
+    return NULL;
+}
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
+int zip_stat_index(struct zip *, zip_uint64_t, zip_flags_t,
+        struct zip_stat *) {
+    assert(false);
+    return -1;
+}
+
+struct zip_file *zip_fopen_index(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
+    assert(false);
+    return -1;
+}
+
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
+    assert(false);
+    return -1;
+}
+
+int zip_fclose(struct zip_file *) {
+    assert(false);
+    return 0;
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_strerror(struct zip *) {
+    assert(false);
+    return NULL;
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    assert(false);
+    return NULL;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create 'count' file nodes with archive indexes 0, 1, ... and register
+ * them in 'ra'. Every fourth entry is not registered as if it were a
+ * directory.
+ */
+std::vector<FileNode *> createNodes(NodeArena &arena, Readahead &ra,
+        int count) {
+    std::vector<FileNode *> nodes;
+    for (int i = 0; i < count; ++i) {
+        char name[32];
+        sprintf(name, "entry%d", i);
+        FileNode *n = FileNode::createFile(arena, NULL, name, 0, 0, 0644);
+        assert(n != NULL);
+        n->id = i;
+        if (i % 4 != 3) {
+            ra.addNode(n);
+        }
+        nodes.push_back(n);
+    }
+    return nodes;
+}
+
+void destroyNodes(NodeArena &arena, const std::vector<FileNode *> &nodes) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        FileNode::destroy(arena, nodes[i]);
+    }
+}
+
+/**
+ * Create buffer of 'size' bytes without data
+ */
+BigBuffer *buffer(zip_uint64_t size) {
+    BigBuffer *b = new BigBuffer();
+    b->truncate(size);
+    return b;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void forwardScan() {
+    NodeArena arena(sizeof(FileNode));
+    Readahead ra(3, 1000);
+    std::vector<FileNode *> nodes = createNodes(arena, ra, 40);
+    std::vector<FileNode *> next;
+    // scan is detected after several forward opens
+    ra.opened(nodes[0], next);
+    ra.opened(nodes[1], next);
+    assert(next.empty());
+    ra.opened(nodes[2], next);
+    // directory entry is skipped
+    assert(next.size() == 3);
+    assert(next[0] == nodes[4] && next[1] == nodes[5] && next[2] == nodes[6]);
+
+    BigBuffer *b5 = buffer(100);
+    BigBuffer *b6 = buffer(100);
+    assert(ra.put(nodes[5], b5));
+    assert(ra.put(nodes[6], b6));
+    assert(!ra.put(nodes[6], b6));
+    assert(ra.m_used == 200);
+    next.clear();
+    ra.opened(nodes[4], next);
+    // area is almost full
+    assert(next.size() == 1 && next[0] == nodes[8]);
+    // prefetched buffers are taken on open
+    assert(ra.take(nodes[5]) == b5);
+    assert(ra.take(nodes[5]) == NULL);
+    delete b5;
+
+    // entries skipped by scan are discarded
+    next.clear();
+    ra.opened(nodes[8], next);
+    assert(ra.take(nodes[6]) == NULL);
+    assert(ra.m_used == 0);
+    assert(ra.hits() == 1 && ra.wasted() == 1);
+    assert(next.size() == 3);
+    assert(next[0] == nodes[9] && next[1] == nodes[10] && next[2] == nodes[12]);
+
+    // budget is limited
+    assert(ra.put(nodes[9], buffer(600)));
+    BigBuffer *big = buffer(600);
+    assert(!ra.put(nodes[10], big));
+    delete big;
+    // buffers of entries behind scan position are not kept
+    BigBuffer *old = buffer(1);
+    assert(!ra.put(nodes[0], old));
+    delete old;
+
+    // backward jump restarts detection and drops buffers of old scan
+    next.clear();
+    ra.opened(nodes[1], next);
+    assert(ra.m_area.empty() && ra.m_used == 0);
+    assert(ra.wasted() == 2);
+    ra.opened(nodes[2], next);
+    assert(next.empty());
+    // remaining buffers are deleted by destructor
+    assert(ra.put(nodes[4], buffer(1)));
+    destroyNodes(arena, nodes);
+}
+
+void removal() {
+    NodeArena arena(sizeof(FileNode));
+    Readahead ra(4, 1000);
+    std::vector<FileNode *> nodes = createNodes(arena, ra, 20);
+    std::vector<FileNode *> next;
+    ra.opened(nodes[0], next);
+    ra.opened(nodes[1], next);
+    ra.remove(nodes[5]);
+    ra.opened(nodes[2], next);
+    // removed node is not prefetched
+    assert(next.size() == 4);
+    assert(next[0] == nodes[4] && next[1] == nodes[6]);
+    BigBuffer *b = buffer(1);
+    assert(!ra.put(nodes[5], b));
+    assert(ra.put(nodes[6], b));
+    // buffer of removed node is deleted
+    ra.remove(nodes[6]);
+    assert(ra.take(nodes[6]) == NULL);
+    assert(ra.m_area.empty());
+    // opens of removed nodes and directories are ignored
+    next.clear();
+    ra.opened(nodes[6], next);
+    ra.opened(nodes[7], next);
+    assert(next.empty() && ra.m_lastId == 2);
+    assert(ra.put(nodes[8], buffer(1)));
+    destroyNodes(arena, nodes);
+}
+
+int main(int, char **) {
+    initTest();
+
+    forwardScan();
+    removal();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include <cstring>
+#include <vector>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "slabAllocator.h"
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+bool isZero(const char *p, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void sizeClasses() {
+    assert(SlabAllocator::roundUp(1) == 256);
+    assert(SlabAllocator::roundUp(256) == 256);
+    assert(SlabAllocator::roundUp(257) == 320);
+    assert(SlabAllocator::roundUp(1000) == 1024);
+    assert(SlabAllocator::roundUp(1025) == 1280);
+    assert(SlabAllocator::roundUp(64 * 1024) == 64 * 1024);
+    assert(SlabAllocator::roundUp(64 * 1024 + 1) == 80 * 1024);
+    assert(SlabAllocator::roundUp(8 * 1024 * 1024) == 8 * 1024 * 1024);
+    // classes are ordered and each size maps to the smallest fitting one
+    for (unsigned int c = 1; c < 64; ++c) {
+        size_t prev = SlabAllocator::classSize(c - 1);
+        size_t cur = SlabAllocator::classSize(c);
+        assert(prev < cur);
+        assert(SlabAllocator::sizeClass(cur) == c);
+        assert(SlabAllocator::sizeClass(prev + 1) == c);
+    }
+}
+
+void allocateAndFree() {
+    SlabAllocator a;
+    size_t s1 = 100, s2 = 100;
+    char *p1 = a.allocate(s1);
+    char *p2 = a.allocate(s2);
+    assert(s1 == 256 && s2 == 256);
+    assert(p1 != p2);
+    assert(isZero(p1, s1) && isZero(p2, s2));
+    // blocks of the same class share slab
+    assert(a.mapCalls() == 1);
+    memset(p1, 'x', s1);
+    memset(p2, 'y', s2);
+
+    // freed block is reused and zeroed
+    a.free(p1, s1);
+    size_t s3 = 200;
+    char *p3 = a.allocate(s3);
+    assert(p3 == p1);
+    assert(isZero(p3, s3));
+    assert(p2[0] == 'y');
+
+    // page-sized blocks are released by free
+    size_t s4 = 64 * 1024;
+    char *p4 = a.allocate(s4);
+    memset(p4, 'z', s4);
+    a.free(p4, s4);
+    size_t s5 = s4;
+    char *p5 = a.allocate(s5);
+    assert(isZero(p5, s5));
+    a.free(p5, s5);
+
+    // empty slab is kept as spare
+    size_t mapped = a.mapped();
+    a.free(p2, s2);
+    a.free(p3, s3);
+    assert(a.mapped() == mapped);
+    p1 = a.allocate(s1);
+    assert(isZero(p1, s1));
+    assert(a.mapCalls() == 2);
+    a.free(p1, s1);
+}
+
+void manySlabs() {
+    SlabAllocator a;
+    std::vector<char *> blocks;
+    size_t size = 300 * 1024;
+    // 3 blocks per slab
+    for (int i = 0; i < 30; ++i) {
+        size_t s = size;
+        blocks.push_back(a.allocate(s));
+        assert(s == 320 * 1024);
+        blocks.back()[s - 1] = 1;
+    }
+    assert(a.mapCalls() == 10);
+    // blocks are not moved
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        assert(blocks[i][320 * 1024 - 1] == 1);
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        a.free(blocks[i], 320 * 1024);
+    }
+    // only one spare slab is kept
+    assert(a.m_slabs.size() == 1);
+    assert(a.mapped() == 960 * 1024);
+}
+
+int main(int, char **) {
+    sizeClasses();
+    allocateAndFree();
+    manySlabs();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,544 @@
+#include "../config.h"
+
+#include <fuse.h>
+#include <zip.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "fuse-zip.h"
+#include "fuseZipData.h"
+#include "fileNode.h"
+#include "bigBuffer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////
+// ARCHIVE CONTENT
+////////////////////////////////////////////////////////////////////////////
+
+const unsigned int dirs = 4;
+const unsigned int filesPerDir = 8;
+const unsigned int threads = 8;
+const unsigned int iterations = 200;
+
+std::string entryName(zip_uint64_t index) {
+    char name[32];
+    sprintf(name, "dir%u/file%u", unsigned(index % dirs), unsigned(index));
+    return name;
+}
+
+zip_uint64_t entrySize(zip_uint64_t index) {
+    return 1000 + index * 7919 % 150000;
+}
+
+char entryByte(zip_uint64_t index, zip_uint64_t pos) {
+    return char((index * 131 + pos * 7 + (pos >> 9)) & 0xFF);
+}
+
+char newFileByte(unsigned int thread, unsigned int k, size_t pos) {
+    return char((thread * 17 + k * 5 + pos) & 0xFF);
+}
+
+// FUSE stub functions
+
+struct fuse_context context;
+
+struct fuse_context *fuse_get_context(void) {
+    return &context;
+}
+
+// libzip stub structures
+struct zip {
+    zip_int64_t count;
+    std::vector<std::string> names;
+    // locked while handle is used to detect concurrent access
+    pthread_mutex_t busy;
+
+    zip(zip_int64_t n): count(n) {
+        for (zip_int64_t i = 0; i < n; ++i) {
+            names.push_back(entryName(i));
+        }
+        pthread_mutex_init(&busy, NULL);
+    }
+    ~zip() {
+        pthread_mutex_destroy(&busy);
+    }
+};
+struct zip_file {
+    struct zip *z;
+    zip_uint64_t index;
+    zip_uint64_t pos;
+};
+struct zip_source {};
+
+/**
+ * Mark archive handle as used by current thread. Fails if the handle is
+ * already used by another thread.
+ */
+class Busy {
+public:
+    explicit Busy(struct zip *z): m_zip(z) {
+        assert(pthread_mutex_trylock(&m_zip->busy) == 0);
+    }
+    ~Busy() {
+        pthread_mutex_unlock(&m_zip->busy);
+    }
+private:
+    struct zip *m_zip;
+};
+
+// libzip stub functions
+
+struct zip *zip_open(const char *, int, int *) {
+    return new struct zip(dirs * filesPerDir);
+}
+
+int zip_error_to_str(char *buf, zip_uint64_t len, int, int) {
+    return strncpy(buf, "Unexpected error", len) - buf;
+}
+
+void zip_discard(struct zip *z) {
+    delete z;
+}
+
+int zip_close(struct zip *) {
+    return 0;
+}
+
+zip_int64_t zip_get_num_entries(struct zip *z, zip_flags_t) {
+    Busy busy(z);
+    return z->count;
+}
+
+const char *zip_get_name(struct zip *z, zip_uint64_t index, zip_flags_t) {
+    Busy busy(z);
+    assert(index < z->names.size());
+    return z->names[index].c_str();
+}
+
+int zip_stat_index(struct zip *z, zip_uint64_t index, zip_flags_t,
+        struct zip_stat *zs) {
+    Busy busy(z);
+    assert(index < z->names.size());
+    zs->valid = ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE |
+        ZIP_STAT_COMP_SIZE | ZIP_STAT_MTIME | ZIP_STAT_CRC |
+        ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD | ZIP_STAT_FLAGS;
+    zs->name = z->names[index].c_str();
+    zs->index = index;
+    zs->size = entrySize(index);
+    zs->comp_size = zs->size;
+    zs->mtime = 0;
+    zs->crc = 0;
+    zs->comp_method = ZIP_CM_DEFLATE;
+    zs->encryption_method = ZIP_EM_NONE;
+    zs->flags = 0;
+    return 0;
+}
+
+struct zip_file *zip_fopen_index(struct zip *z, zip_uint64_t index,
+        zip_flags_t) {
+    Busy busy(z);
+    assert(index < zip_uint64_t(dirs * filesPerDir));
+    struct zip_file *f = new struct zip_file;
+    f->z = z;
+    f->index = index;
+    f->pos = 0;
+    return f;
+}
+
+zip_int64_t zip_fread(struct zip_file *f, void *buf, zip_uint64_t size) {
+    Busy busy(f->z);
+    zip_uint64_t total = entrySize(f->index);
+    zip_uint64_t n = 0;
+    for (; n < size && f->pos < total; ++n, ++f->pos) {
+        ((char *)buf)[n] = entryByte(f->index, f->pos);
+    }
+    return n;
+}
+
+zip_int8_t zip_fseek(struct zip_file *f, zip_int64_t offset, int whence) {
+    Busy busy(f->z);
+    assert(whence == SEEK_SET);
+    f->pos = offset;
+    return 0;
+}
+
+int zip_fclose(struct zip_file *f) {
+    {
+        Busy busy(f->z);
+    }
+    delete f;
+    return 0;
+}
+
+zip_int64_t zip_dir_add(struct zip *z, const char *name, zip_flags_t) {
+    Busy busy(z);
+    z->names.push_back(name);
+    return z->count++;
+}
+
+int zip_delete(struct zip *z, zip_uint64_t index) {
+    Busy busy(z);
+    // original entries are never deleted by the test
+    assert(index >= zip_uint64_t(dirs * filesPerDir));
+    assert(index < z->names.size());
+    return 0;
+}
+
+int zip_file_rename(struct zip *z, zip_uint64_t index, const char *name,
+        zip_flags_t) {
+    Busy busy(z);
+    assert(index < z->names.size());
+    z->names[index] = name;
+    return 0;
+}
+
+const char *zip_strerror(struct zip *) {
+    return "Unexpected error";
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    return "Unexpected error";
+}
+
+// only stubs
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+int countEntries(void *buf, const char *, const struct stat *, off_t) {
+    ++*(size_t *)buf;
+    return 0;
+}
+
+/**
+ * Return number of directory entries (including . and ..) listed by
+ * readdir() or -1 on error
+ */
+ssize_t listDir(const char *path) {
+    size_t count = 0;
+    if (fusezip_readdir(path, &count, countEntries, 0, NULL) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Open original archive entry, read and check random ranges, close it.
+ */
+void readEntry(zip_uint64_t index, unsigned int &seed) {
+    std::string path = "/" + entryName(index);
+    struct stat st;
+    assert(fusezip_getattr(path.c_str(), &st) == 0);
+    assert(zip_uint64_t(st.st_size) == entrySize(index));
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    assert(fusezip_open(path.c_str(), &fi) == 0);
+    char buf[4096];
+    for (int i = 0; i < 4; ++i) {
+        off_t offset = rand_r(&seed) % entrySize(index);
+        int res = fusezip_read(path.c_str(), buf, sizeof(buf), offset, &fi);
+        assert(res > 0);
+        for (int j = 0; j < res; ++j) {
+            assert(buf[j] == entryByte(index, offset + j));
+        }
+    }
+    assert(fusezip_release(path.c_str(), &fi) == 0);
+}
+
+/**
+ * Create new file, fill it with thread-specific content and check it.
+ */
+void writeFile(const char *path, unsigned int thread, unsigned int k,
+        size_t size) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY | O_CREAT;
+    assert(fusezip_create(path, 0644, &fi) == 0);
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = newFileByte(thread, k, i);
+    }
+    for (size_t pos = 0; pos < size; pos += 1000) {
+        size_t n = size - pos < 1000 ? size - pos : 1000;
+        assert(fusezip_write(path, &data[pos], n, pos, &fi) == int(n));
+    }
+    assert(fusezip_release(path, &fi) == 0);
+}
+
+void checkFile(const char *path, unsigned int thread, unsigned int k,
+        size_t size) {
+    struct stat st;
+    assert(fusezip_getattr(path, &st) == 0);
+    assert(size_t(st.st_size) == size);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    assert(fusezip_open(path, &fi) == 0);
+    std::vector<char> data(size + 1);
+    assert(fusezip_read(path, &data[0], size + 1, 0, &fi) == int(size));
+    for (size_t i = 0; i < size; ++i) {
+        assert(data[i] == newFileByte(thread, k, i));
+    }
+    assert(fusezip_release(path, &fi) == 0);
+}
+
+struct Worker {
+    unsigned int thread;
+    bool readonly;
+    // names of new files left after the test
+    std::vector<std::string> kept;
+};
+
+std::string newName(const char *prefix, unsigned int thread, unsigned int k) {
+    char name[64];
+    sprintf(name, "/new/%s%u_%u", prefix, thread, k);
+    return name;
+}
+
+/**
+ * Run random mix of operations. Original entries are only read, new files
+ * and directories are private for each thread.
+ */
+void *work(void *arg) {
+    Worker *w = (Worker *)arg;
+    unsigned int seed = w->thread;
+    for (unsigned int k = 0; k < iterations; ++k) {
+        unsigned int op = rand_r(&seed) % (w->readonly ? 2 : 6);
+        switch (op) {
+            case 0:
+                readEntry(rand_r(&seed) % (dirs * filesPerDir), seed);
+                break;
+            case 1: {
+                char path[16];
+                unsigned int d = rand_r(&seed) % dirs;
+                sprintf(path, "/dir%u", d);
+                assert(listDir(path) == ssize_t(filesPerDir + 2));
+                assert(listDir("/") >= ssize_t(dirs + 2));
+                break;
+            }
+            case 2: {
+                // new file is checked, renamed and sometimes deleted
+                std::string path = newName("f", w->thread, k);
+                size_t size = rand_r(&seed) % 20000;
+                writeFile(path.c_str(), w->thread, k, size);
+                checkFile(path.c_str(), w->thread, k, size);
+                std::string renamed = newName("r", w->thread, k);
+                assert(fusezip_rename(path.c_str(), renamed.c_str()) == 0);
+                struct stat st;
+                assert(fusezip_getattr(path.c_str(), &st) == -ENOENT);
+                if (rand_r(&seed) % 2 == 0) {
+                    assert(fusezip_unlink(renamed.c_str()) == 0);
+                } else {
+                    checkFile(renamed.c_str(), w->thread, k, size);
+                    w->kept.push_back(renamed);
+                }
+                break;
+            }
+            case 3: {
+                std::string path = newName("d", w->thread, k);
+                assert(fusezip_mkdir(path.c_str(), 0755) == 0);
+                assert(listDir(path.c_str()) == 2);
+                assert(fusezip_rmdir(path.c_str()) == 0);
+                break;
+            }
+            case 4: {
+                // truncate file which is not open
+                std::string path = newName("t", w->thread, k);
+                writeFile(path.c_str(), w->thread, k, 5000);
+                assert(fusezip_truncate(path.c_str(), 3000) == 0);
+                checkFile(path.c_str(), w->thread, k, 3000);
+                assert(fusezip_unlink(path.c_str()) == 0);
+                break;
+            }
+            case 5: {
+                // metadata of original entries
+                std::string path = "/" + entryName(rand_r(&seed) %
+                        (dirs * filesPerDir));
+                struct timespec tv[2] = {{1, 0}, {2, 0}};
+                assert(fusezip_utimens(path.c_str(), tv) == 0);
+                struct stat st;
+                assert(fusezip_getattr(path.c_str(), &st) == 0);
+                assert(st.st_mtime == 2);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+void runWorkers(bool readonly, std::vector<Worker> &workers) {
+    workers.resize(threads);
+    std::vector<pthread_t> ids(threads);
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers[i].thread = i;
+        workers[i].readonly = readonly;
+        assert(pthread_create(&ids[i], NULL, work, &workers[i]) == 0);
+    }
+    for (unsigned int i = 0; i < threads; ++i) {
+        assert(pthread_join(ids[i], NULL) == 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+void readWriteStress() {
+    struct zip z(dirs * filesPerDir);
+    FuseZipOptions options;
+    options.zipHandles = 3;
+    options.decompressThreads = 2;
+    FuseZipData data("/nonexistent/stress.zip", &z, "/tmp", options);
+    context.private_data = &data;
+    data.build_tree(false);
+    assert(data.enableThreads());
+    assert(data.m_pool->size() == 3);
+    assert(data.m_decompressPool->size() == 2);
+    assert(fusezip_mkdir("/new", 0755) == 0);
+
+    std::vector<Worker> workers;
+    runWorkers(false, workers);
+
+    // tree is consistent after all threads are finished
+    size_t kept = 0;
+    for (unsigned int i = 0; i < threads; ++i) {
+        for (size_t j = 0; j < workers[i].kept.size(); ++j) {
+            const std::string &path = workers[i].kept[j];
+            unsigned int thread, k;
+            assert(sscanf(path.c_str(), "/new/r%u_%u", &thread, &k) == 2);
+            assert(thread == i);
+            struct stat st;
+            assert(fusezip_getattr(path.c_str(), &st) == 0);
+            checkFile(path.c_str(), thread, k, st.st_size);
+        }
+        kept += workers[i].kept.size();
+    }
+    assert(listDir("/new") == ssize_t(kept + 2));
+    assert(data.files.size() == 1 + 1 + dirs + dirs * filesPerDir + kept);
+    for (zip_uint64_t i = 0; i < dirs * filesPerDir; ++i) {
+        FileNode *node = data.find(entryName(i).c_str());
+        assert(node != NULL);
+        assert(node->open_count == 0);
+    }
+    context.private_data = NULL;
+}
+
+void readOnlyStress() {
+    struct zip z(dirs * filesPerDir);
+    FuseZipOptions options;
+    options.zipHandles = 2;
+    options.readahead = 4;
+    FuseZipData data("/nonexistent/stress.zip", &z, "/tmp", options);
+    context.private_data = &data;
+    data.build_tree(true);
+    assert(data.frozen() != NULL);
+    assert(data.enableThreads());
+
+    std::vector<Worker> workers;
+    runWorkers(true, workers);
+
+    // entries are read ahead during sequential scan
+    unsigned int seed = 0;
+    for (zip_uint64_t i = 0; i < dirs * filesPerDir; ++i) {
+        readEntry(i, seed);
+    }
+    assert(data.m_readahead != NULL);
+    assert(data.m_readahead->hits() > dirs * filesPerDir / 2);
+
+    for (zip_uint64_t i = 0; i < dirs * filesPerDir; ++i) {
+        FileNode *node = data.find(entryName(i).c_str());
+        assert(node != NULL);
+        assert(node->open_count == 0);
+    }
+    context.private_data = NULL;
+}
+
+/**
+ * Files that are unlinked or replaced while they are opened are still
+ * read and written through their handles until they are released.
+ */
+void removeOpened() {
+    struct zip z(dirs * filesPerDir);
+    FuseZipOptions options;
+    FuseZipData data("/nonexistent/stress.zip", &z, "/tmp", options);
+    context.private_data = &data;
+    data.build_tree(false);
+    assert(data.enableThreads());
+    assert(fusezip_mkdir("/new", 0755) == 0);
+    size_t files = data.files.size();
+
+    writeFile("/new/a", 0, 0, 3000);
+    writeFile("/new/b", 0, 1, 2000);
+    struct fuse_file_info fi1, fi2;
+    memset(&fi1, 0, sizeof(fi1));
+    fi1.flags = O_RDWR;
+    fi2 = fi1;
+    assert(fusezip_open("/new/a", &fi1) == 0);
+    assert(fusezip_open("/new/a", &fi2) == 0);
+    assert(fusezip_unlink("/new/a") == 0);
+    struct stat st;
+    assert(fusezip_getattr("/new/a", &st) == -ENOENT);
+    assert(data.files.size() == files + 1);
+
+    char buf[100];
+    assert(fusezip_write("/new/a", "xyz", 3, 10, &fi1) == 3);
+    assert(fusezip_release("/new/a", &fi1) == 0);
+    assert(fusezip_read("/new/a", buf, sizeof(buf), 0, &fi2) == sizeof(buf));
+    assert(memcmp(buf + 10, "xyz", 3) == 0);
+    assert(buf[0] == newFileByte(0, 0, 0));
+    assert(fusezip_release("/new/a", &fi2) == 0);
+
+    // file is replaced by rename
+    assert(fusezip_open("/new/b", &fi1) == 0);
+    writeFile("/new/c", 0, 2, 1000);
+    assert(fusezip_rename("/new/c", "/new/b") == 0);
+    assert(fusezip_read("/new/b", buf, sizeof(buf), 0, &fi1) == sizeof(buf));
+    assert(buf[99] == newFileByte(0, 1, 99));
+    assert(fusezip_release("/new/b", &fi1) == 0);
+    checkFile("/new/b", 0, 2, 1000);
+    assert(data.files.size() == files + 1);
+
+    context.private_data = NULL;
+}
+
+int main(int, char **) {
+    initTest();
+    readWriteStress();
+    readOnlyStress();
+    removeOpened();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,733 @@
+#include "../config.h"
+
+#include <zip.h>
+#include <zlib.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <pthread.h>
+#include <unistd.h>
+
+// Public Morozoff design pattern :)
+#define private public
+
+#include "zipStream.h"
+#include "bigBuffer.h"
+#include "decompressPool.h"
+#include "mutexLock.h"
+#include "common.h"
+
+// libzip stub structures
+struct zip {
+    // uncompressed data
+    unsigned char *data;
+    zip_uint64_t size;
+    // raw deflate stream
+    unsigned char *comp;
+    zip_uint64_t comp_size;
+    zip_uint32_t crc;
+    zip_uint16_t comp_method;
+    bool fail_zip_fseek;
+    // number of compressed bytes returned by zip_fread
+    zip_uint64_t comp_read;
+    int open_count;
+};
+struct zip_file {
+    struct zip *zip;
+    bool raw;
+    zip_uint64_t pos;
+};
+struct zip_source {
+};
+
+// libzip stub functions
+
+// archive that is copied by zip_open (see ZipPool)
+struct zip *archive = NULL;
+
+struct zip *zip_open(const char *, int flags, int *) {
+    assert(flags == ZIP_RDONLY);
+    assert(archive != NULL);
+    struct zip *z = (struct zip *)malloc(sizeof(struct zip));
+    // data is shared with original archive
+    *z = *archive;
+    z->comp_read = 0;
+    z->open_count = 0;
+    return z;
+}
+
+void zip_discard(struct zip *z) {
+    free(z);
+}
+
+int zip_stat_index(struct zip *z, zip_uint64_t, zip_flags_t,
+        struct zip_stat *st) {
+    st->valid = ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE | ZIP_STAT_CRC |
+        ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD;
+    st->size = z->size;
+    st->comp_size = z->comp_size;
+    st->crc = z->crc;
+    st->comp_method = z->comp_method;
+    st->encryption_method = ZIP_EM_NONE;
+    return 0;
+}
+
+struct zip_file *zip_fopen_index(struct zip *z, zip_uint64_t, zip_flags_t flags) {
+    struct zip_file *zf = (struct zip_file *)malloc(sizeof(struct zip_file));
+    zf->zip = z;
+    zf->raw = (flags & ZIP_FL_COMPRESSED) != 0;
+    zf->pos = 0;
+    ++z->open_count;
+    return zf;
+}
+
+zip_int64_t zip_fread(struct zip_file *zf, void *dest, zip_uint64_t size) {
+    const unsigned char *src = zf->raw ? zf->zip->comp : zf->zip->data;
+    zip_uint64_t len = zf->raw ? zf->zip->comp_size : zf->zip->size;
+    if (size > len - zf->pos) {
+        size = len - zf->pos;
+    }
+    memcpy(dest, src + zf->pos, size);
+    zf->pos += size;
+    if (zf->raw) {
+        zf->zip->comp_read += size;
+    }
+    return size;
+}
+
+zip_int8_t zip_fseek(struct zip_file *zf, zip_int64_t offset, int whence) {
+    assert(whence == SEEK_SET);
+    assert(zf->raw);
+    if (zf->zip->fail_zip_fseek) {
+        return -1;
+    }
+    zf->pos = offset;
+    return 0;
+}
+
+int zip_fclose(struct zip_file *zf) {
+    free(zf);
+    return 0;
+}
+
+const char *zip_get_name(struct zip *, zip_uint64_t, zip_flags_t) {
+    return "file.name";
+}
+
+const char *zip_strerror(struct zip *) {
+    return "human-readable error (global)";
+}
+
+const char *zip_file_strerror(struct zip_file *) {
+    return "human-readable error (file-specific)";
+}
+
+// only stubs
+
+int zip_error_to_str(char *, zip_uint64_t, int, int) {
+    assert(false);
+    return 0;
+}
+
+zip_int64_t zip_file_add(struct zip *, const char *, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+int zip_file_replace(struct zip *, zip_uint64_t, struct zip_source *, zip_flags_t) {
+    assert(false);
+    return 0;
+}
+
+struct zip_source *zip_source_function(struct zip *, zip_source_callback, void *) {
+    assert(false);
+    return NULL;
+}
+
+void zip_source_free(struct zip_source *) {
+    assert(false);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HELPERS
+////////////////////////////////////////////////////////////////////////////
+
+const zip_uint64_t dataSize = 1024 * 1024;
+const zip_uint64_t interval = 64 * 1024;
+
+/**
+ * Fill zip stub with 'size' bytes of pseudo-random text and its raw
+ * deflate stream
+ */
+void initZip(struct zip &z, zip_uint64_t size = dataSize) {
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet",
+        "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+        "\n", "0123456789", "incididunt"};
+    z.size = size;
+    z.data = (unsigned char *)malloc(z.size);
+    unsigned int seed = 12345;
+    for (zip_uint64_t i = 0; i < z.size;) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        for (; *w && i < z.size; ++w, ++i) {
+            z.data[i] = *w ^ ((seed >> 8) & 1);
+        }
+    }
+    z.crc = crc32(crc32(0L, Z_NULL, 0), z.data, z.size);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    assert(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                8, Z_DEFAULT_STRATEGY) == Z_OK);
+    z.comp = (unsigned char *)malloc(deflateBound(&strm, z.size));
+    strm.next_in = z.data;
+    strm.avail_in = z.size;
+    strm.next_out = z.comp;
+    strm.avail_out = deflateBound(&strm, z.size);
+    assert(deflate(&strm, Z_FINISH) == Z_STREAM_END);
+    z.comp_size = strm.total_out;
+    deflateEnd(&strm);
+
+    z.comp_method = ZIP_CM_DEFLATE;
+    z.fail_zip_fseek = false;
+    z.comp_read = 0;
+    z.open_count = 0;
+}
+
+void freeZip(struct zip &z) {
+    free(z.data);
+    free(z.comp);
+}
+
+/**
+ * Read 'size' bytes from stream and compare with original data
+ */
+void readAndCheck(ZipStream &s, struct zip &z, zip_uint64_t size) {
+    char *buf = (char *)malloc(size);
+    zip_uint64_t pos = s.pos();
+    zip_uint64_t done = 0;
+    while (done < size) {
+        zip_int64_t nr = s.read(buf + done, size - done);
+        assert(nr > 0);
+        done += nr;
+    }
+    assert(s.pos() == pos + size);
+    assert(memcmp(buf, z.data + pos, size) == 0);
+    free(buf);
+}
+
+/**
+ * Skip data up to 'offset' and check data after it
+ */
+void seekAndCheck(ZipStream &s, struct zip &z, zip_uint64_t offset,
+        zip_uint64_t size) {
+    s.seek(offset);
+    assert(s.pos() <= offset);
+    if (s.pos() < offset) {
+        readAndCheck(s, z, offset - s.pos());
+    }
+    readAndCheck(s, z, size);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// TESTS
+////////////////////////////////////////////////////////////////////////////
+
+// Data decompressed by libzip if there is no index
+void readWithoutIndex() {
+    struct zip z;
+    initZip(z);
+    ZipStream s(&z, 0, NULL);
+    assert(s.m_index == NULL);
+    readAndCheck(s, z, dataSize);
+    char c;
+    assert(s.read(&c, 1) == 0);
+    assert(z.comp_read == 0);
+
+    // seek backward restarts from the beginning
+    s.seek(100);
+    assert(s.pos() == 0);
+    assert(z.open_count == 2);
+    s.close();
+    freeZip(z);
+}
+
+// Index is not used for stored files
+void storedFile() {
+    struct zip z;
+    initZip(z);
+    z.comp_method = ZIP_CM_STORE;
+    InflateIndex index(interval);
+    ZipStream s(&z, 0, &index);
+    assert(s.m_index == NULL);
+    readAndCheck(s, z, 1000);
+    freeZip(z);
+}
+
+// Access points are added during sequential read and used for seeking
+void buildAndUseIndex() {
+    struct zip z;
+    initZip(z);
+    InflateIndex index(interval);
+    {
+        ZipStream s(&z, 0, &index);
+        assert(s.m_index == &index);
+        readAndCheck(s, z, dataSize);
+        char c;
+        assert(s.read(&c, 1) == 0);
+        s.close();
+    }
+    assert(index.size() > 4);
+    for (size_t i = 1; i < index.size(); ++i) {
+        assert(index.m_points[i].out >= index.m_points[i - 1].out + interval);
+    }
+
+    // random access using index
+    {
+        ZipStream s(&z, 0, &index);
+        zip_uint64_t offset = dataSize - 1000;
+        z.comp_read = 0;
+        s.seek(offset);
+        InflateIndex::Point p;
+        assert(index.find(offset, p));
+        assert(s.pos() == p.out);
+        seekAndCheck(s, z, offset, 1000);
+        // only a small part of compressed data was read
+        assert(z.comp_read < z.comp_size / 2);
+        assert(z.open_count == 2);
+
+        // seek backward to the file beginning
+        seekAndCheck(s, z, 10, 100);
+        assert(z.open_count == 3);
+        seekAndCheck(s, z, dataSize / 2 + 1, 5000);
+        seekAndCheck(s, z, dataSize / 2 + 10000, 5000);
+        // skip data by reading
+        seekAndCheck(s, z, dataSize / 2 + 10000 + 5000 + 10, 10);
+        assert(z.open_count == 3);
+    }
+    freeZip(z);
+}
+
+// Stream is restarted if zip_fseek is not supported
+void seekFailure() {
+    struct zip z;
+    initZip(z);
+    InflateIndex index(interval);
+    {
+        ZipStream s(&z, 0, &index);
+        readAndCheck(s, z, dataSize);
+    }
+    z.fail_zip_fseek = true;
+    {
+        ZipStream s(&z, 0, &index);
+        readAndCheck(s, z, 10);
+        seekAndCheck(s, z, dataSize - 100, 100);
+        assert(!s.m_seekable);
+        assert(z.open_count == 3);
+    }
+    freeZip(z);
+}
+
+// CRC is checked after sequential read
+void crcError() {
+    struct zip z;
+    initZip(z);
+    z.crc ^= 1;
+    InflateIndex index(interval);
+    ZipStream s(&z, 0, &index);
+    char *buf = (char *)malloc(dataSize);
+    bool thrown = false;
+    try {
+        zip_uint64_t done = 0;
+        while (done < dataSize) {
+            done += s.read(buf + done, dataSize - done);
+        }
+    }
+    catch (const std::runtime_error &e) {
+        thrown = true;
+    }
+    assert(thrown);
+    free(buf);
+    freeZip(z);
+}
+
+// Random access to BigBuffer
+void bigBufferRandomAccess() {
+    struct zip z;
+    initZip(z);
+    InflateIndex index(interval);
+    char buf[1000];
+    {
+        BigBuffer bb(&z, 0, dataSize, &index);
+        // index is built while file is read sequentially
+        for (zip_uint64_t pos = 0; pos < dataSize; pos += sizeof(buf)) {
+            int nr = bb.read(buf, sizeof(buf), pos);
+            assert(memcmp(buf, z.data + pos, nr) == 0);
+        }
+        assert(bb.m_stream == NULL);
+    }
+    {
+        z.comp_read = 0;
+        BigBuffer bb(&z, 0, dataSize, &index);
+        zip_uint64_t offset = dataSize - 2 * interval;
+        assert(bb.read(buf, sizeof(buf), offset) == sizeof(buf));
+        assert(memcmp(buf, z.data + offset, sizeof(buf)) == 0);
+        assert(z.comp_read < z.comp_size / 2);
+        // read data before the loaded range
+        offset = 3 * interval + 17;
+        assert(bb.read(buf, sizeof(buf), offset) == sizeof(buf));
+        assert(memcmp(buf, z.data + offset, sizeof(buf)) == 0);
+        assert(bb.m_loaded.size() == 2);
+        // write into not yet loaded range
+        memset(buf, '*', 10);
+        offset = 5 * interval + 3;
+        assert(bb.write(buf, 10, offset) == 10);
+        assert(bb.read(buf, 12, offset - 1) == 12);
+        assert(buf[0] == z.data[offset - 1]);
+        assert(buf[1] == '*' && buf[10] == '*');
+        assert(buf[11] == z.data[offset + 10]);
+        // read the rest of data
+        for (zip_uint64_t pos = 0; pos < dataSize; pos += sizeof(buf)) {
+            int nr = bb.read(buf, sizeof(buf), pos);
+            if (pos + nr <= offset || pos >= offset + 10) {
+                assert(memcmp(buf, z.data + pos, nr) == 0);
+            }
+        }
+        assert(bb.m_stream == NULL);
+    }
+    freeZip(z);
+}
+
+/**
+ * Read whole buffer by small chunks and compare with original data
+ */
+void *readBuffer(void *param) {
+    BigBuffer *bb = (BigBuffer *)param;
+    char buf[4096];
+    for (zip_uint64_t pos = 0; pos < dataSize; pos += sizeof(buf)) {
+        int nr = bb->read(buf, sizeof(buf), pos);
+        assert(nr == int(sizeof(buf)));
+        assert(memcmp(buf, archive->data + pos, nr) == 0);
+    }
+    return NULL;
+}
+
+// Streams are distributed between handles of pool
+void pooledStreams() {
+    struct zip z;
+    initZip(z);
+    archive = &z;
+    {
+        ZipPool pool("/archive.zip", 2);
+        assert(pool.size() == 2);
+        InflateIndex index(interval);
+        ZipStream s1(&z, 0, &index, &pool);
+        ZipStream s2(&z, 0, NULL, &pool);
+        ZipStream s3(&z, 0, &index, &pool);
+        // archive handle passed to stream is not used
+        assert(s1.m_zip != &z && s2.m_zip != &z && s3.m_zip != &z);
+        assert(s1.m_handle != s2.m_handle);
+        assert(s3.m_handle == s1.m_handle);
+        assert(s1.m_handle->users == 2 && s2.m_handle->users == 1);
+        assert(s1.m_zip->open_count == 2 && z.open_count == 0);
+        readAndCheck(s2, z, dataSize / 2);
+        readAndCheck(s1, z, dataSize / 3);
+        seekAndCheck(s3, z, 1000, 1000);
+        s2.close();
+    }
+    {
+        ZipPool pool("/archive.zip", 3);
+        {
+            ZipStream s(&z, 0, NULL, &pool);
+            assert(s.m_handle->users == 1);
+        }
+        for (size_t i = 0; i < pool.size(); ++i) {
+            assert(pool.m_handles[i]->users == 0);
+        }
+    }
+    archive = NULL;
+    freeZip(z);
+}
+
+// Buffers opened through pool are read from several threads
+void parallelRead() {
+    const int threads = 4;
+    struct zip z;
+    initZip(z);
+    archive = &z;
+    {
+        ZipPool pool("/archive.zip", 2);
+        BigBuffer::setZipPool(&pool);
+        // buffers of the same file share index
+        InflateIndex index(interval);
+        BigBuffer *buffers[threads];
+        pthread_t ids[threads];
+        for (int i = 0; i < threads; ++i) {
+            buffers[i] = new BigBuffer(&z, 0, dataSize,
+                    (i % 2 == 0) ? &index : NULL);
+        }
+        // the first buffer is read by two threads at once
+        for (int i = 0; i < threads; ++i) {
+            BigBuffer *bb = (i == threads - 1) ? buffers[0] : buffers[i];
+            assert(pthread_create(&ids[i], NULL, readBuffer, bb) == 0);
+        }
+        for (int i = 0; i < threads; ++i) {
+            assert(pthread_join(ids[i], NULL) == 0);
+        }
+        for (int i = 0; i < threads; ++i) {
+            delete buffers[i];
+        }
+        for (size_t i = 1; i < index.size(); ++i) {
+            assert(index.m_points[i].out >= index.m_points[i - 1].out
+                    + interval);
+        }
+        BigBuffer::setZipPool(NULL);
+        assert(BigBuffer::s_heapTotal == 0);
+    }
+    archive = NULL;
+    freeZip(z);
+}
+
+/**
+ * Wait until workers of pool have nothing to do
+ */
+void waitIdle(DecompressPool &pool) {
+    for (;;) {
+        {
+            MutexLock lock(&pool.m_mutex);
+            bool idle = pool.m_queue.empty();
+            for (size_t i = 0; i < pool.m_workers.size(); ++i) {
+                idle = idle && pool.m_workers[i]->current == NULL;
+            }
+            if (idle) {
+                return;
+            }
+        }
+        usleep(1000);
+    }
+}
+
+// Data of opened buffers is decompressed by worker threads
+void backgroundDecompression() {
+    struct zip z;
+    initZip(z);
+    archive = &z;
+    {
+        ZipPool pool("/archive.zip", 2);
+        BigBuffer::setZipPool(&pool);
+        DecompressPool decompressPool(2);
+        assert(decompressPool.size() == 2);
+        BigBuffer::setDecompressPool(&decompressPool);
+        char buf[1000];
+        {
+            // nothing is read before data is decompressed
+            BigBuffer bb(&z, 0, dataSize, NULL);
+            bb.loadInBackground();
+            waitIdle(decompressPool);
+            assert(bb.m_stream == NULL && bb.m_loaded.empty());
+            assert(bb.m_heapUsage >= dataSize);
+            readBuffer(&bb);
+        }
+        {
+            // reader does not wait for the whole file
+            BigBuffer bb(&z, 0, dataSize, NULL);
+            bb.loadInBackground();
+            bb.loadInBackground();
+            zip_uint64_t offset = dataSize / 2 + 7;
+            assert(bb.read(buf, sizeof(buf), offset) == sizeof(buf));
+            assert(memcmp(buf, z.data + offset, sizeof(buf)) == 0);
+            readBuffer(&bb);
+        }
+        {
+            // loading is stopped and data that is loaded is kept
+            BigBuffer bb(&z, 0, dataSize, NULL);
+            bb.loadInBackground();
+            bb.stopBackgroundLoad();
+            assert(decompressPool.m_queue.empty());
+            readBuffer(&bb);
+            assert(bb.m_stream == NULL);
+        }
+        for (int i = 0; i < 10; ++i) {
+            // buffer is destroyed while it is loaded
+            BigBuffer *bb = new BigBuffer(&z, 0, dataSize, NULL);
+            bb->loadInBackground();
+            usleep(i * 100);
+            delete bb;
+        }
+
+        // CRC error is reported by the next read
+        struct zip bad = z;
+        bad.crc ^= 1;
+        archive = &bad;
+        {
+            // handles of pool are copies of archive
+            ZipPool badPool("/archive.zip", 1);
+            BigBuffer::setZipPool(&badPool);
+            InflateIndex index(interval);
+            BigBuffer bb(&bad, 0, dataSize, &index);
+            bb.loadInBackground();
+            waitIdle(decompressPool);
+            bool thrown = false;
+            try {
+                bb.read(buf, sizeof(buf), 0);
+            }
+            catch (const std::runtime_error &) {
+                thrown = true;
+            }
+            assert(thrown);
+            assert(bb.read(buf, sizeof(buf), 0) == sizeof(buf));
+        }
+        archive = &z;
+
+        BigBuffer::setDecompressPool(NULL);
+        BigBuffer::setZipPool(NULL);
+        assert(BigBuffer::s_heapTotal == 0);
+    }
+    archive = NULL;
+    freeZip(z);
+}
+
+/**
+ * Read 'size' bytes of buffer from 'offset' through 'cursor' by 64K chunks
+ * and compare with original data.
+ * @return maximal memory usage of buffer
+ */
+zip_uint64_t readStreaming(BigBuffer &bb, BigBuffer::Cursor &cursor,
+        zip_uint64_t offset, zip_uint64_t size) {
+    static char buf[64 * 1024];
+    zip_uint64_t maxUsage = 0;
+    for (zip_uint64_t pos = offset; pos < offset + size; pos += sizeof(buf)) {
+        int nr = bb.read(buf, sizeof(buf), pos, &cursor);
+        assert(nr > 0);
+        assert(memcmp(buf, archive->data + pos, nr) == 0);
+        // extents are allocated by background worker too
+        MutexLock lock(&bb.m_mutex);
+        if (maxUsage < bb.memoryUsage()) {
+            maxUsage = bb.memoryUsage();
+        }
+    }
+    return maxUsage;
+}
+
+// Sequential reader keeps only window of decompressed data
+void streamingRead() {
+    const zip_uint64_t size = 48 * 1024 * 1024;
+    const zip_uint64_t window = BigBuffer::streamWindow
+        + BigBuffer::maxExtentSize;
+    struct zip z;
+    initZip(z, size);
+    archive = &z;
+    {
+        BigBuffer bb(&z, 0, size, NULL);
+        BigBuffer::Cursor cursor;
+        assert(readStreaming(bb, cursor, 0, size) <= window);
+        assert(cursor.streaming && cursor.end == size);
+        assert(bb.m_released >= size - window);
+        // stream is kept to read released data again
+        assert(bb.m_stream != NULL);
+
+        // reader that seeks backward falls back to buffering
+        assert(readStreaming(bb, cursor, 100, 1) > 0);
+        assert(!cursor.streaming);
+        assert(readStreaming(bb, cursor, 0, size) >= size);
+        assert(bb.m_stream == NULL);
+
+        // another reader does not release data that can not be read again
+        BigBuffer::Cursor cursor2;
+        readStreaming(bb, cursor2, 0, size);
+        assert(cursor2.streaming);
+        assert(bb.memoryUsage() >= size);
+    }
+    {
+        // data is released behind the slowest of sequential readers
+        z.open_count = 0;
+        BigBuffer bb(&z, 0, size, NULL);
+        BigBuffer::Cursor fast, slow;
+        for (zip_uint64_t pos = 0; pos < size; pos += 128 * 1024) {
+            readStreaming(bb, fast, pos, 128 * 1024);
+            readStreaming(bb, slow, pos / 2, 64 * 1024);
+        }
+        assert(fast.streaming && slow.streaming);
+        assert(bb.m_released > 0);
+        assert(bb.m_released + BigBuffer::streamWindow <= slow.end);
+        // data is never decompressed again
+        assert(z.open_count == 1);
+
+        // nothing is released while one of readers is not sequential
+        zip_uint64_t released = bb.m_released;
+        BigBuffer::Cursor random;
+        readStreaming(bb, random, 0, 1);
+        readStreaming(bb, random, size / 2, 1);
+        assert(!random.streaming);
+        readStreaming(bb, slow, slow.end, size - slow.end);
+        assert(bb.m_released == 0 && bb.memoryUsage() >= size - released);
+        bb.detach(random);
+        bb.detach(fast);
+        readStreaming(bb, slow, size - 1, 1);
+        assert(bb.m_released >= size - window);
+        bb.detach(slow);
+        assert(bb.m_cursors.empty() && slow.buffer == NULL);
+    }
+    {
+        // reader that jumps forward is not sequential
+        BigBuffer bb(&z, 0, size, NULL);
+        BigBuffer::Cursor cursor;
+        readStreaming(bb, cursor, 0, 1);
+        readStreaming(bb, cursor, size / 2, size / 2);
+        assert(!cursor.streaming);
+        assert(bb.m_released == 0 && bb.memoryUsage() >= size / 2);
+    }
+    {
+        // data of modified buffer is kept
+        BigBuffer bb(&z, 0, size, NULL);
+        BigBuffer::Cursor cursor;
+        assert(bb.write((const char *)z.data, 1, 0) == 1);
+        readStreaming(bb, cursor, 0, size);
+        assert(bb.m_released == 0 && bb.memoryUsage() >= size);
+    }
+    {
+        // background worker does not decompress data far ahead of reader
+        ZipPool pool("/archive.zip", 1);
+        BigBuffer::setZipPool(&pool);
+        DecompressPool decompressPool(1);
+        BigBuffer::setDecompressPool(&decompressPool);
+        {
+            BigBuffer bb(&z, 0, size, NULL);
+            BigBuffer::Cursor cursor;
+            readStreaming(bb, cursor, 0, 1);
+            bb.loadInBackground();
+            waitIdle(decompressPool);
+            assert(bb.m_loadPaused);
+            assert(bb.memoryUsage() <= window + BigBuffer::backgroundChunkSize);
+            // window is kept both behind and ahead of reader
+            assert(readStreaming(bb, cursor, 0, size) <= window
+                    + BigBuffer::streamWindow
+                    + BigBuffer::backgroundChunkSize);
+            assert(cursor.streaming);
+        }
+        BigBuffer::setDecompressPool(NULL);
+        BigBuffer::setZipPool(NULL);
+    }
+    assert(BigBuffer::s_heapTotal == 0);
+    archive = NULL;
+    freeZip(z);
+}
+
+int main(int, char **) {
+    initTest();
+
+    readWithoutIndex();
+    storedFile();
+    buildAndUseIndex();
+    seekFailure();
+    crcError();
+    bigBufferRandomAccess();
+    pooledStreams();
+    parallelRead();
+    backgroundDecompression();
+    streamingRead();
+
+    return EXIT_SUCCESS;
+}
@@ -4,11 +4,18 @@
 #include <zip.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <cstdio>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
+// Public Morozoff design pattern :)
+#define private public
+
 #include "fuse-zip.h"
 #include "fuseZipData.h"
+#include "fileNode.h"
 #include "common.h"
 
 // FUSE stub functions
@@ -21,6 +28,12 @@ struct fuse_context *fuse_get_context(void) {
 struct zip {
     std::string filename;
     zip_int64_t count;
+    // names of entries if they differ
+    std::vector<std::string> names;
+    int renames;
+
+    zip(): count(0), renames(0) {
+    }
 };
 struct zip_file {};
 struct zip_source {};
@@ -36,14 +49,34 @@ int zip_error_to_str(char *buf, zip_uint64_t len, int, int) {
     return strncpy(buf, "Expected error", len) - buf;
 }
 
+void zip_discard(struct zip *) {
+    assert(false);
+}
+
 zip_int64_t zip_get_num_entries(struct zip *z, zip_flags_t) {
     return z->count;
 }
 
-const char *zip_get_name(struct zip *z, zip_uint64_t, zip_flags_t) {
+const char *zip_get_name(struct zip *z, zip_uint64_t index, zip_flags_t) {
+    if (!z->names.empty()) {
+        return z->names[index].c_str();
+    }
     return z->filename.c_str();
 }
 
+int zip_file_rename(struct zip *z, zip_uint64_t index, const char *name,
+        zip_flags_t) {
+    assert(index < z->names.size());
+    for (size_t i = 0; i < z->names.size(); ++i) {
+        if (z->names[i] == name) {
+            return -1;
+        }
+    }
+    z->names[index] = name;
+    ++z->renames;
+    return 0;
+}
+
 int zip_stat_index(struct zip *z, zip_uint64_t index, zip_flags_t,
         struct zip_stat *zs) {
     zs->valid = ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE |
@@ -98,7 +131,7 @@ zip_int64_t zip_fread(struct zip_file *, void *, zip_uint64_t) {
     return 0;
 }
 
-int zip_file_rename(struct zip *, zip_uint64_t, const char *, zip_flags_t) {
+zip_int8_t zip_fseek(struct zip_file *, zip_int64_t, int) {
     assert(false);
     return 0;
 }
@@ -132,7 +165,7 @@ void duplicateFileNames() {
     struct zip z;
     z.filename = "same_file.name";
     z.count = 2;
-    FuseZipData zd("test.zip", &z, "/tmp");
+    FuseZipData zd("test.zip", &z, "/tmp", FuseZipOptions());
     bool thrown = false;
     try {
         zd.build_tree(false);
@@ -148,7 +181,7 @@ void relativePathsReadWrite() {
     struct zip z;
     z.filename = "../file.name";
     z.count = 1;
-    FuseZipData zd("test.zip", &z, "/tmp");
+    FuseZipData zd("test.zip", &z, "/tmp", FuseZipOptions());
     bool thrown = false;
     try {
         zd.build_tree(false);
@@ -164,7 +197,7 @@ void absolutePathsReadWrite() {
     struct zip z;
     z.filename = "/file.name";
     z.count = 1;
-    FuseZipData zd("test.zip", &z, "/tmp");
+    FuseZipData zd("test.zip", &z, "/tmp", FuseZipOptions());
     bool thrown = false;
     try {
         zd.build_tree(false);
@@ -180,7 +213,7 @@ void relativePathsReadOnly() {
     struct zip z;
     z.filename = "../file.name";
     z.count = 1;
-    FuseZipData zd("test.zip", &z, "/tmp");
+    FuseZipData zd("test.zip", &z, "/tmp", FuseZipOptions());
     zd.build_tree(true);
 }
 
@@ -188,8 +221,398 @@ void absolutePathsReadOnly() {
     struct zip z;
     z.filename = "/file.name";
     z.count = 1;
-    FuseZipData zd("test.zip", &z, "/tmp");
+    FuseZipData zd("test.zip", &z, "/tmp", FuseZipOptions());
+    zd.build_tree(true);
+}
+
+void fastMount() {
+    struct zip z;
+    z.filename = "dir/file.name";
+    z.count = 1;
+    FuseZipOptions options;
+    options.fastMount = true;
+    FuseZipData zd("test.zip", &z, "/tmp", options);
+    zd.build_tree(false);
+    FileNode *node = zd.find("dir/file.name");
+    assert(node != NULL);
+    // there are no extra fields in central directory
+    assert(node->isLocalMetadataPending());
+    zd.loadLocalMetadata(node);
+    assert(!node->isLocalMetadataPending());
+}
+
+void putShort(std::string &s, unsigned int v) {
+    s += char(v & 0xFF);
+    s += char((v >> 8) & 0xFF);
+}
+
+void putLong(std::string &s, zip_uint32_t v) {
+    putShort(s, v & 0xFFFF);
+    putShort(s, v >> 16);
+}
+
+/**
+ * Write archive that contains central directory only into temporary file
+ * and return its name
+ */
+std::string centralDirectoryArchive(const std::vector<std::string> &names) {
+    std::string cd;
+    for (size_t i = 0; i < names.size(); ++i) {
+        putLong(cd, 0x02014b50);
+        putShort(cd, 0x031E);
+        putShort(cd, 10);
+        for (int j = 0; j < 4; ++j) {
+            putShort(cd, 0);
+        }
+        putLong(cd, 0);
+        putLong(cd, 0);
+        putLong(cd, 0);
+        putShort(cd, names[i].size());
+        for (int j = 0; j < 4; ++j) {
+            putShort(cd, 0);
+        }
+        putLong(cd, 0100644 << 16);
+        putLong(cd, 0);
+        cd += names[i];
+    }
+    std::string data = cd;
+    putLong(data, 0x06054b50);
+    putShort(data, 0);
+    putShort(data, 0);
+    putShort(data, names.size());
+    putShort(data, names.size());
+    putLong(data, cd.size());
+    putLong(data, 0);
+    putShort(data, 0);
+
+    char name[] = "/tmp/fuse-zip-test.XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    assert(write(fd, data.data(), data.size()) == ssize_t(data.size()));
+    close(fd);
+    return name;
+}
+
+/**
+ * Build tree for archive with 'names' in fast mount mode.
+ * @return false if exception is thrown
+ */
+bool buildCentralTree(const std::vector<std::string> &names, size_t &nodes) {
+    std::string archive = centralDirectoryArchive(names);
+    struct zip z;
+    z.count = names.size();
+    FuseZipOptions options;
+    options.fastMount = true;
+    options.treeThreads = 4;
+    bool res = true;
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        try {
+            zd.build_tree(false);
+            nodes = zd.files.size();
+            for (size_t i = 0; i < names.size(); ++i) {
+                FileNode *node = zd.find(names[i].c_str());
+                assert(node != NULL);
+                assert(node->id == zip_int64_t(i));
+                assert(node->parent != NULL);
+                std::string name = names[i];
+                if (name[name.size() - 1] == '/') {
+                    name.resize(name.size() - 1);
+                }
+                assert(node->fullName() == name);
+            }
+        }
+        catch (const std::runtime_error &) {
+            res = false;
+        }
+    }
+    unlink(archive.c_str());
+    return res;
+}
+
+void parallelTreeBuild() {
+    // enough entries to split work between threads
+    size_t n = 3 * FuseZipData::minEntriesPerThread + 5;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < n; ++i) {
+        char name[32];
+        sprintf(name, "dir%u/file%u", unsigned(i % 100), unsigned(i));
+        names.push_back(name);
+    }
+    size_t nodes = 0;
+    assert(buildCentralTree(names, nodes));
+    // files, intermediate directories and root
+    assert(nodes == n + 100 + 1);
+
+    // duplicates in different ranges
+    names.back() = names.front();
+    assert(!buildCentralTree(names, nodes));
+    // explicit directory entry follows its children
+    names.back() = "dir0/";
+    assert(buildCentralTree(names, nodes));
+    assert(nodes == n + 100);
+
+    // bad name
+    names[n / 2] = "dir/../file";
+    assert(!buildCentralTree(names, nodes));
+}
+
+void frozenTree() {
+    std::vector<std::string> names;
+    names.push_back("a/b/c.txt");
+    names.push_back("a/");
+    names.push_back("d.txt");
+    names.push_back("a/b/e.txt");
+    std::string archive = centralDirectoryArchive(names);
+    struct zip z;
+    z.count = names.size();
+    FuseZipOptions options;
+    options.fastMount = true;
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        zd.build_tree(false);
+        assert(zd.m_frozen == NULL);
+    }
+    FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+    zd.build_tree(true);
+    FrozenIndex *frozen = zd.frozen();
+    assert(frozen != NULL);
+    assert(frozen->size() == 6);
+
+    // nodes are found via frozen index
+    size_t i = frozen->find("a/b/c.txt");
+    assert(i != FrozenIndex::npos);
+    assert(zd.find("a/b/c.txt") == frozen->node(i));
+    assert(zd.find("a/b/c.txt")->id == 0);
+    assert(zd.find("a/b/") == zd.lookup("a/b"));
+    assert(zd.find("a/b/x") == NULL);
+
+    // listing in tree order
+    size_t a = frozen->find("a");
+    assert(frozen->attr(a).id == 1 && frozen->attr(a).nlink == 3);
+    size_t root = frozen->find("");
+    assert(frozen->childsEnd(root) - frozen->firstChild(root) == 2);
+    assert(strcmp(frozen->name(frozen->firstChild(root)), "a") == 0);
+    size_t b = frozen->find("a/b");
+    assert(frozen->childsEnd(b) - frozen->firstChild(b) == 2);
+    assert(frozen->firstChild(b) == i);
+    assert(strcmp(frozen->name(i + 1), "e.txt") == 0);
+
+    // local headers are read for all siblings at once
+    assert(frozen->attr(i).live && frozen->attr(i + 1).live);
+    zd.loadLocalMetadata(frozen->node(i));
+    frozen->update(i);
+    frozen->update(i + 1);
+    assert(!frozen->attr(i).live && !frozen->attr(i + 1).live);
+    assert(frozen->attr(i).mode == (S_IFREG | 0644));
+
+    unlink(archive.c_str());
+}
+
+void batchedRename() {
+    std::vector<std::string> names;
+    names.push_back("a/");
+    names.push_back("a/x");
+    names.push_back("a/y/");
+    names.push_back("a/y/z");
+    names.push_back("b");
+    names.push_back("c");
+    std::string archive = centralDirectoryArchive(names);
+    struct zip z;
+    z.count = names.size();
+    z.names = names;
+    FuseZipOptions options;
+    options.fastMount = true;
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        zd.build_tree(false);
+        // nothing is renamed
+        zd.save();
+        assert(z.renames == 0);
+
+        // directory rename does not touch descendants and archive
+        FileNode *a = zd.find("a");
+        FileNode *z1 = zd.find("a/y/z");
+        zd.renameNode(a, "d/", true);
+        assert(z.renames == 0);
+        assert(zd.find("a") == NULL);
+        assert(zd.find("d/y/z") == z1);
+        assert(z1->fullName() == "d/y/z");
+
+        // swapped names
+        FileNode *b = zd.find("b");
+        FileNode *c = zd.find("c");
+        zd.renameNode(b, "tmp", true);
+        zd.renameNode(c, "b", true);
+        zd.renameNode(b, "c", true);
+        assert(zd.find("c") == b && zd.find("b") == c);
+
+        zd.save();
+        assert(z.names[0] == "d/");
+        assert(z.names[1] == "d/x");
+        assert(z.names[2] == "d/y/");
+        assert(z.names[3] == "d/y/z");
+        assert(z.names[4] == "c");
+        assert(z.names[5] == "b");
+        int renames = z.renames;
+        zd.applyRenames();
+        assert(z.renames == renames);
+    }
+    unlink(archive.c_str());
+}
+
+void indexCache() {
+    std::vector<std::string> names;
+    names.push_back("a/b/c.txt");
+    names.push_back("a/");
+    names.push_back("d.txt");
+    std::string archive = centralDirectoryArchive(names);
+    char dir[] = "/tmp/fuse-zip-test.XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    struct zip z;
+    z.count = names.size();
+    FuseZipOptions options;
+    options.fastMount = true;
+    options.indexCacheDir = dir;
+    std::string cacheName;
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        assert(!zd.loadIndexCache(true));
+        zd.build_tree(true);
+        zd.saveIndexCache(true);
+        IndexCache::Key key;
+        assert(zd.indexCacheKey(true, cacheName, key));
+    }
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        // tree of read-write mount is not cached yet
+        assert(!zd.loadIndexCache(false));
+        assert(zd.loadIndexCache(true));
+        assert(zd.m_frozen != NULL);
+        assert(zd.numFiles() == 4);
+        FileNode *node = zd.find("a/b/c.txt");
+        assert(node != NULL && node->id == 0);
+        assert(strcmp(node->name, "c.txt") == 0);
+        assert(node->mode() == (S_IFREG | 0644));
+        assert(node->isLocalMetadataPending());
+        // intermediate directory
+        assert(zd.find("a/b") != NULL && zd.find("a/b")->id < 0);
+        node = zd.find("a");
+        assert(node != NULL && node->id == 1 && node->is_dir);
+        assert(strcmp(node->name, "a") == 0);
+        assert(zd.m_root->childs.size() == 2);
+        // local header offsets are taken from cache
+        assert(zd.m_archive->m_parsed);
+        assert(zd.m_archive->m_offsets.size() == 3);
+    }
+    // stale cache is ignored
+    names[2] = "e.txt";
+    std::string changed = centralDirectoryArchive(names);
+    assert(rename(changed.c_str(), archive.c_str()) == 0);
+    {
+        FuseZipData zd(archive.c_str(), &z, "/tmp", options);
+        assert(!zd.loadIndexCache(true));
+    }
+    unlink(cacheName.c_str());
+    rmdir(dir);
+    unlink(archive.c_str());
+}
+
+void lazyTree() {
+    std::vector<std::string> names;
+    for (int i = 0; i < 50; ++i) {
+        char name[32];
+        sprintf(name, "dir%d/sub/file%d", i % 5, i);
+        names.push_back(name);
+    }
+    names.push_back("dir0/");
+    names.push_back("top.txt");
+    std::string archive = centralDirectoryArchive(names);
+    struct zip z;
+    z.count = names.size();
+    FuseZipOptions options;
+    options.lazyTree = true;
+    options.lazyNodeLimit = 10;
+    {
+        // lazy tree is not used in read-write mode
+        FuseZipOptions rwOptions = options;
+        rwOptions.fastMount = true;
+        FuseZipData zd(archive.c_str(), &z, "/tmp", rwOptions);
+        zd.build_tree(false);
+        assert(zd.m_lazy == NULL);
+        assert(zd.files.size() == 50 + 2 + 9 + 1);
+    }
+    FuseZipData zd(archive.c_str(), &z, "/tmp", options);
     zd.build_tree(true);
+    assert(zd.m_lazy != NULL);
+    assert(zd.m_frozen == NULL);
+    assert(zd.files.size() == 1);
+    assert(zd.numFiles() == 52);
+
+    // lookup creates node and its parents
+    FileNode *node = zd.find("dir3/sub/file13");
+    assert(node != NULL && node->id == 13 && !node->is_dir);
+    assert(zd.files.size() == 4);
+    FileNode *sub = node->parent;
+    assert(sub->fullName() == "dir3/sub");
+    assert(sub->is_dir && sub->id < 0);
+    assert(sub->parent->is_dir && sub->parent->parent == zd.m_root);
+    assert(zd.find("dir3/sub/") == sub);
+    assert(zd.find("dir3/sub/file14") == NULL);
+    assert(zd.find("dir3/sub/file1") == NULL);
+    assert(zd.find("top.txt/x") == NULL);
+
+    // explicit directory entry
+    FileNode *dir0 = zd.find("dir0");
+    assert(dir0 != NULL && dir0->is_dir && dir0->id == 50);
+    assert(strcmp(dir0->name, "dir0") == 0);
+
+    // listing
+    assert(zd.childsCount(zd.m_root) == 6);
+    zd.loadChilds(zd.m_root);
+    assert(zd.m_root->childs.size() == 6);
+    assert(zd.m_root->m_childsLoaded);
+    assert(zd.childsCount(sub) == 10);
+    zd.loadChilds(sub);
+    assert(sub->childs.size() == 10);
+    assert(zd.files.size() == 1 + 6 + 1 + 10);
+
+    // opened file survives trimming, tree is trimmed to 3/4 of limit
+    node->state = FileNode::OPENED;
+    node->open_count = 1;
+    assert(zd.find("dir1/sub/file1") != NULL);
+    assert(zd.files.size() == 8 + 2);
+    assert(zd.find("dir3/sub/file13") == node);
+    assert(node->parent == sub && sub->childs.size() == 1);
+    assert(!sub->m_childsLoaded && !zd.m_root->m_childsLoaded);
+    assert(zd.m_trimThreshold == 10);
+    // dropped nodes are created again
+    assert(zd.find("top.txt") != NULL);
+    assert(zd.files.size() == 11);
+    zd.loadChilds(zd.m_root);
+    assert(zd.m_root->childs.size() == 6);
+    assert(zd.files.size() == 8 + 1);
+
+    // tree is not walked on each lookup while most nodes are in use
+    zd.loadChilds(sub);
+    for (nodelist_t::const_iterator i = sub->childs.begin();
+            i != sub->childs.end(); ++i) {
+        (*i)->state = FileNode::OPENED;
+        (*i)->open_count = 1;
+    }
+    assert(zd.files.size() == 18);
+    assert(zd.find("dir2/sub/file2") != NULL);
+    assert(zd.files.size() == 13 + 3);
+    assert(zd.m_trimThreshold == 13 + 13 / 3);
+    assert(zd.find("dir4/sub/file4") != NULL);
+    assert(zd.files.size() == 16 + 3);
+    for (nodelist_t::const_iterator i = sub->childs.begin();
+            i != sub->childs.end(); ++i) {
+        (*i)->state = FileNode::CLOSED;
+        (*i)->open_count = 0;
+    }
+
+    unlink(archive.c_str());
 }
 
 int main(int, char **) {
@@ -200,6 +623,12 @@ int main(int, char **) {
     absolutePathsReadOnly();
     relativePathsReadWrite();
     absolutePathsReadWrite();
+    fastMount();
+    parallelTreeBuild();
+    frozenTree();
+    batchedRename();
+    indexCache();
+    lazyTree();
 
     return EXIT_SUCCESS;
 }